@@ -17,6 +17,8 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include "types.h"
+
 typedef enum {
 	CMD_SCAN = 0x80,
 	CMD_RW_AVR_FUSES,
@@ -28,7 +30,288 @@ typedef enum {
 	CMD_RSVD3,
 	CMD_PLAY_XSVF,
 	CMD_STATUS,
-	CMD_SET_IRLENS
+	CMD_SET_IRLENS,
+	CMD_SAMPLE_BSCAN,
+	CMD_CFG_SPARTAN3,
+	CMD_PROG_XCF,
+	CMD_SET_AVR_GEOMETRY,
+	CMD_SCAN_CHAIN,
+	CMD_CANCEL,
+	CMD_SET_DUAL_CHAIN,
+	CMD_CAPTURE,
+	CMD_EXTEST,
+	CMD_RD_AVR_EEPROM,
+	CMD_WR_AVR_EEPROM,
+	CMD_RD_AVR_SRAM
 } CommandByte;
 
+// The framed protocol runs entirely over the bulk endpoints. Each request is
+// a FrameHeader sent as a packet of its own, followed by "length" bytes of
+// payload. The firmware answers every request in-band on the IN endpoint
+// with a FrameResponse followed by "length" bytes of payload. Requests may
+// be pipelined; responses come back in order, tagged with the request's seq.
+//
+typedef struct {
+	uint8 opcode;     // a CommandByte
+	uint8 seq;        // echoed in the response
+	uint8 flags;      // FRAME_WRITE selects the write form of CMD_RW_AVR_FUSES;
+	                  // FRAME_XSVF_TARGET pads CMD_PLAY_XSVF's scans for one device
+	uint8 reserved;
+	uint32 param;     // fuses for CMD_RW_AVR_FUSES, byte count for CMD_RD_AVR_FLASH,
+	                  // start offset (a page boundary) for CMD_WR_AVR_FLASH,
+	                  // snapshot count for CMD_SAMPLE_BSCAN, chain position for
+	                  // CMD_CFG_SPARTAN3, CMD_PROG_XCF and a targeted CMD_PLAY_XSVF
+	uint32 length;    // payload bytes following the header
+} FrameHeader;
+
+typedef struct {
+	uint8 opcode;
+	uint8 seq;
+	uint8 status;     // FRAME_SUCCESS, a ParseStatus for CMD_PLAY_XSVF, or an error below
+	uint8 reserved;
+	uint32 failures;  // XSVF vectors or PROM rows which failed to verify
+	uint32 length;    // payload bytes following the response
+} FrameResponse;
+
+// CMD_SCAN_CHAIN walks the chain from Test-Logic-Reset, where each device has
+// either IDCODE (32 bits, LSB set) or BYPASS (one zero bit) selected, so it
+// finds devices without an IDCODE register too. The response payload is the
+// total IR length of the chain as a uint32, then one uint32 per device,
+// nearest TDO first: its IDCODE, or zero for a BYPASS-only device. The host
+// cannot know that length in advance, so it may ask for the longest and read
+// the length from the header: the response always ends with a short packet,
+// a zero-length one if need be. A chain with more than MAX_SCAN_DEVICES devices (or a TDO stuck low) fails with
+// FRAME_CHAIN_BROKEN. The firmware holds at most MAX_CHAIN_DEVICES IR lengths,
+// so devices can only be addressed in chains no longer than that. Every scan
+// clears the IR lengths set by CMD_SET_IRLENS, and until a scan has found a
+// device the AVR commands and targeted CMD_PLAY_XSVF get FRAME_BAD_PARAM (or
+// a stall, as control requests).
+//
+#define MAX_SCAN_DEVICES  1024
+#define MAX_CHAIN_DEVICES 64
+
+// Payload of CMD_SAMPLE_BSCAN. The response payload is "param" snapshots of
+// the boundary-scan register, each (bsrLen+7)/8 bytes with the cell nearest
+// TDO in bit 0 of the first byte. param must be at least one. The snapshots
+// are taken by a job, a packet's worth at a time, so a cancel stops the
+// capture; the rest of them then come back as 0xFF bytes.
+//
+typedef struct {
+	uint8 device;     // chain position, nearest TDI first
+	uint8 sample;     // that device's SAMPLE/PRELOAD instruction
+	uint16 bsrLen;    // boundary-scan register length in bits
+} SampleRequest;
+
+// Payload of CMD_PROG_XCF: the PROM is erased, then each record's row is
+// programmed and verified on-board. Rows the image leaves blank are simply
+// not sent.
+//
+#define XCF_ROW_BYTES 256
+#define XCF_NUM_ROWS  1024  // XCF02S
+typedef struct {
+	uint16 row;
+	uint8 data[XCF_ROW_BYTES];
+} XcfRecord;
+
+// Payload of CMD_SET_AVR_GEOMETRY, sent at the start of a session when the
+// first device is an AVR. The page size must be a multiple of 64 bytes; parts
+// with more than 128 KiB of flash get the extended address byte loaded too.
+// The EEPROM page size must divide 256. Until it is sent, the firmware assumes
+// an ATmega162 (128 flash pages of 128, 128 EEPROM pages of 4, OCDR at 0x04,
+// UDR1, UDR0 and SPDR at 0x23, 0x2C and 0x2F).
+//
+// A memory dump does not read the I/O registers whose reads have side effects
+// (a UART or SPI data register pops its receive buffer, say); they come back
+// as 0xFF. Their data-space addresses are listed in "unreadable", the unused
+// entries zero.
+//
+#define AVR_MAX_UNREADABLE 6
+typedef struct {
+	uint16 pageSize;  // bytes
+	uint16 numPages;
+	uint16 eepromPageSize;
+	uint16 eepromPages;
+	uint16 ocdr;      // I/O address of the on-chip debug register
+	uint16 unreadable[AVR_MAX_UNREADABLE];
+} AvrGeometry;
+
+// CMD_RD_AVR_EEPROM and CMD_WR_AVR_EEPROM are framed only, and move whole
+// EEPROM pages. A read's param is the number of bytes to read from address
+// zero; the response comes first, and the data follows on the IN endpoint as
+// for CMD_RD_AVR_FLASH. A write's param is the address of its first page, and
+// its payload is streamed into the EEPROM a page at a time; it responds when
+// the last page is written.
+
+// CMD_RD_AVR_SRAM (framed only) dumps the AVR's data space through its
+// on-chip debug interface: param bytes from address zero, so the registers,
+// then the I/O registers, then SRAM. The core is stopped with FORCE_BREAK
+// rather than reset, so it must have the OCDEN fuse programmed; r16 and X
+// are used for the dump and put back, and the core is left running. As for
+// CMD_RD_AVR_FLASH, the response comes first and the data follows.
+
+// Firmware built with DEBUG sends a binary trace on the USART (500000 baud,
+// 8N1). Each record is four bytes: the event, then a 24-bit little-endian
+// value. Events marked (2) are only sent when DEBUG > 1.
+//
+typedef enum {
+	DBG_SYNC = 0xD0,    // DBG_SYNC_VALUE, sent at start-up to align a capture
+	DBG_OVERFLOW,       // number of events dropped because the ring was full
+	DBG_XSVF_BEGIN,     // XSVF bytes to play
+	DBG_XSIR,           // length | first instruction byte << 8
+	DBG_XSDRTDO,        // length in bits | first TDI byte << 16
+	DBG_ATTEMPT,        // (2) attempt number, from zero
+	DBG_TDO_BYTE,       // (2) received | expected << 8 | mask << 16
+	DBG_VECTOR_FAILED,  // (2) failures so far
+	DBG_VECTOR_OK       // (2)
+} DebugEvent;
+#define DBG_SYNC_VALUE  0x5AA55AUL
+#define DBG_RECORD_SIZE 4
+
+// Flash read/write, erase and XSVF playback run as jobs in the firmware's main
+// loop, so the control endpoint stays live while they do. CMD_STATUS on the
+// control endpoint returns a JobStatus at any time (hosts which ask for only
+// the first eight bytes get the original status and failure count), and
+// CMD_CANCEL, a control request with no data, stops the job's JTAG work. A
+// cancelled job still consumes or produces the rest of its data, so the
+// host's transfers complete, and then finishes with FRAME_CANCELLED.
+//
+typedef struct {
+	uint32 status;    // FRAME_BUSY while a job runs, else the last job's result
+	uint32 failures;
+	uint32 done;      // bytes of the current (or last) job processed so far
+	uint32 total;
+	uint8 seq;        // the last framed request the firmware has taken up
+	uint8 reserved[3];
+	uint32 failuresB; // XSVF vectors which failed on chain B, in dual-chain mode
+	uint32 checkpoint; // where the job could be resumed from, as below
+} JobStatus;
+
+// CMD_STATUS with wValue STATUS_XSVF_FAILURES returns an XsvfFailures instead:
+// the first XSVF_MAX_FAILURES vectors of the last (or current) playback which
+// failed every retry. Each keeps the TDO captured in a window of up to
+// XSVF_FAIL_BYTES bytes of its last attempt, in the order they were shifted
+// (the TDO end of the vector first), starting at the first byte which did not
+// match. The expected value and mask are in the host's copy of the file, so
+// they are not kept. Only the failures held are sent, so a clean playback
+// returns just the count.
+//
+#define STATUS_XSVF_FAILURES 0x0001
+#define XSVF_MAX_FAILURES    2
+#define XSVF_FAIL_BYTES      4
+typedef struct {
+	uint32 vector;    // XSDRTDO records played before this one
+	uint16 offset;    // bytes shifted before the window
+	uint8 chain;      // 0, or 1 if only chain B failed, in dual-chain mode
+	uint8 numBytes;   // in the window
+	uint8 actual[XSVF_FAIL_BYTES];  // TDO as captured
+} XsvfFailure;
+typedef struct {
+	uint8 count;      // failures held
+	uint8 reserved[3];
+	XsvfFailure failures[XSVF_MAX_FAILURES];
+} XsvfFailures;
+#define XSVF_FAILURES_HEADER 4
+
+// A job cut short (by a cancel, or by losing the host) can be resumed from
+// JobStatus.checkpoint. For a flash write it is the byte offset of the next
+// page to program, which a new CMD_WR_AVR_FLASH can start from. For XSVF
+// playback it is the number of XSIR records begun; the host replays the
+// program from the start of the last of them, after the XSDRSIZE, XTDOMASK,
+// XRUNTEST, XREPEAT, XENDIR and XENDDR records which were in force there.
+//
+
+// Firmware built with CAPTURE records the TMS, TDI and TDO levels of every TCK
+// cycle, packed two cycles to a byte, while capture is on. CMD_CAPTURE on the
+// control endpoint, which is serviced even while a job runs, switches it on
+// (wValue nonzero) or off; read, it returns the CaptureBlock so far (up to the
+// last byte of data used) and starts a new one. Cycles which come when the
+// block is full are dropped and counted, so the host can lay out a timeline
+// with the gaps marked. The block is kept small for the sake of SRAM: drained
+// between polls, it holds the first cycles after each, not a full trace.
+//
+#define CAPTURE_BYTES 64
+#define CAPTURE_TMS   0x04  // in each nibble of CaptureBlock.data, the first
+#define CAPTURE_TDO   0x02  // cycle in the low nibble: PINB's top four bits
+#define CAPTURE_TDI   0x01
+typedef struct {
+	uint16 cycles;    // held in data
+	uint8 tapState;   // the TAP state (as in XSTATE) before the first of them
+	uint8 reserved;
+	uint32 dropped;   // cycles lost after them because the block was full
+	uint8 data[CAPTURE_BYTES];
+} CaptureBlock;
+#define CAPTURE_HEADER 8
+
+// Firmware built with EXTEST drives the pins of one device through its
+// boundary register, so that a memory wired to them can be programmed. The
+// payload of CMD_EXTEST is an ExtestRequest, then a vector of (bsrLen+7)/8
+// bytes (cell nearest TDO in bit 0 of the first byte), then a record for each
+// further scan: a byte giving the number of cells the scan toggles (at most
+// 127), plus EXTEST_CAPTURE to have its read cells returned, followed by
+// those cells' numbers as uint16s. Each scan applies its vector to the pins
+// at Update-DR, and captures them as the scan before it left them.
+//
+// The first vector is preloaded with SAMPLE/PRELOAD before EXTEST is
+// selected, unless the device is still in EXTEST from the last request; then
+// it is just scanned, so a bus cycle may span requests. EXTEST_RELEASE ends
+// the request in Test-Logic-Reset, which gives the pins back (as does any
+// other request). The request's param gives the number of capturing scans,
+// so the response can go before them: its payload holds the read cells of
+// each in turn, packed LSB first, at most EXTEST_MAX_RESULT bytes. They are
+// streamed as they are scanned, and with the response header fit in one IN
+// packet, which the host reads only once it has sent the whole request. The
+// request runs as a job; if a record turns out to be malformed the rest of
+// the result is zero, and CMD_STATUS reports FRAME_BAD_LENGTH.
+// Firmware built without EXTEST answers FRAME_UNKNOWN_OPCODE.
+//
+#define EXTEST_MAX_BYTES  64    // of a boundary register
+#define EXTEST_MAX_READS  16
+#define EXTEST_MAX_RESULT 32    // with the response header, no more than a packet
+#define EXTEST_MAX_CELLS  127   // toggled by one scan
+#define EXTEST_CAPTURE    0x80
+#define EXTEST_RELEASE    0x01
+typedef struct {
+	uint8 device;     // chain position, nearest TDI first
+	uint8 sample;     // that device's SAMPLE/PRELOAD instruction
+	uint8 extest;     // and its EXTEST instruction
+	uint8 flags;      // EXTEST_RELEASE
+	uint16 bsrLen;    // boundary-scan register length in bits
+	uint16 numReads;  // cells returned by each capturing scan
+	uint16 readCells[EXTEST_MAX_READS];
+} ExtestRequest;
+
+// Firmware built with DUAL_CHAIN drives a second chain, wired to PB3..PB0 as
+// the first is to PB7..PB4, in lockstep with the first: both get the same TMS
+// and TDI, so identical boards take identical flash writes, erases, fuse
+// writes and XSVF playback at once. CMD_SET_DUAL_CHAIN with a nonzero param
+// switches the mode on, after a scan of the first chain, if the second chain
+// shifts out the same IDCODE/BYPASS bits (else FRAME_CHAIN_MISMATCH); zero
+// switches it off. AVR polls wait for both devices; XSVF vectors are compared
+// on both chains, chain B's failures being reported in JobStatus.failuresB.
+// Everything read back (fuses, flash, samples) comes from the first chain.
+// Firmware built without DUAL_CHAIN answers FRAME_UNKNOWN_OPCODE.
+//
+
+#define FRAME_WRITE 0x01
+
+// An XSVF file is written for a chain holding just its target device. With
+// FRAME_XSVF_TARGET, CMD_PLAY_XSVF plays it to the device at chain position
+// "param" (nearest TDI first, as set by CMD_SET_IRLENS): every XSIR is padded
+// with ones to put the other devices in BYPASS, and every XSDRTDO with a bit
+// for each of their bypass registers, whose TDO is not compared. Nothing
+// extra crosses the USB. A position beyond the chain gets FRAME_BAD_PARAM.
+//
+#define FRAME_XSVF_TARGET 0x02
+
+#define FRAME_SUCCESS        0x00
+#define FRAME_CHAIN_MISMATCH 0xF7
+#define FRAME_BUSY           0xF8
+#define FRAME_CANCELLED      0xF9
+#define FRAME_CHAIN_BROKEN   0xFA
+#define FRAME_CFG_NOT_DONE   0xFB
+#define FRAME_CFG_NO_INIT    0xFC
+#define FRAME_BAD_PARAM      0xFD
+#define FRAME_BAD_LENGTH     0xFE
+#define FRAME_UNKNOWN_OPCODE 0xFF
+
 #endif
@@ -0,0 +1,48 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <avr/interrupt.h>
+#include "debug.h"
+#include "../commands.h"
+
+#ifdef DEBUG
+
+uint8 debugRing[DEBUG_RING_SIZE];
+volatile uint8 debugHead = 0;
+volatile uint8 debugTail = 0;
+uint8 debugDropped = 0;
+
+// Transmit-only, 8N1, double speed
+//
+void debugInit(void) {
+	UBRR1 = (F_CPU / 8 / DEBUG_BAUD) - 1;
+	UCSR1A = (1 << U2X1);
+	UCSR1C = (1 << UCSZ11) | (1 << UCSZ10);
+	UCSR1B = (1 << TXEN1);
+	debugEvent(DBG_SYNC, DBG_SYNC_VALUE);
+}
+
+ISR(USART1_UDRE_vect) {
+	const uint8 tail = debugTail;
+	if ( tail == debugHead ) {
+		UCSR1B &= ~(1 << UDRIE1);
+		return;
+	}
+	UDR1 = debugRing[tail & (DEBUG_RING_SIZE - 1)];
+	debugTail = tail + 1;
+}
+
+#endif
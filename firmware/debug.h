@@ -0,0 +1,75 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "types.h"
+#include "../commands.h"
+
+// Binary debug trace (see DebugEvent in commands.h). debugEvent() only
+// copies a record into an SRAM ring, so it costs a few cycles; the USART
+// data-register-empty interrupt drains the ring in the background. If the
+// ring is full the event is dropped and counted, and a DBG_OVERFLOW record
+// reports the count once there is room again.
+//
+#ifdef DEBUG
+	#include <avr/io.h>
+
+	#define DEBUG_RING_SIZE 32  // bytes; a power of two
+	#define DEBUG_BAUD      500000UL
+
+	extern uint8 debugRing[DEBUG_RING_SIZE];
+	extern volatile uint8 debugHead;
+	extern volatile uint8 debugTail;
+	extern uint8 debugDropped;
+
+	void debugInit(void);
+
+	static inline void debugPut(uint8 head, uint8 event, uint32 value) {
+		debugRing[head & (DEBUG_RING_SIZE - 1)] = event;
+		debugRing[(head + 1) & (DEBUG_RING_SIZE - 1)] = (uint8)value;
+		debugRing[(head + 2) & (DEBUG_RING_SIZE - 1)] = (uint8)(value >> 8);
+		debugRing[(head + 3) & (DEBUG_RING_SIZE - 1)] = (uint8)(value >> 16);
+	}
+
+	static inline void debugEvent(uint8 event, uint32 value) {
+		uint8 head = debugHead;
+		uint8 space = DEBUG_RING_SIZE - (uint8)(head - debugTail);
+		if ( debugDropped ) {
+			if ( space < 2 * DBG_RECORD_SIZE ) {
+				if ( debugDropped < 0xFF ) {
+					debugDropped++;
+				}
+				return;
+			}
+			debugPut(head, DBG_OVERFLOW, debugDropped);
+			head += DBG_RECORD_SIZE;
+			debugDropped = 0;
+		} else if ( space < DBG_RECORD_SIZE ) {
+			debugDropped = 1;
+			return;
+		}
+		debugPut(head, event, value);
+		debugHead = head + DBG_RECORD_SIZE;
+		UCSR1B |= (1 << UDRIE1);  // the interrupt disables itself when the ring is empty
+	}
+#else
+	#define debugInit()
+	#define debugEvent(event, value)
+#endif
+
+#endif
@@ -17,18 +17,24 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/power.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include <string.h>
 #include <LUFA/Version.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include "desc.h"
 #include "usart.h"
+#include "debug.h"
 #include "parse.h"
 #include "types.h"
 #include "../commands.h"
+#ifdef SIM
+	#include "sim.h"
+#endif
 
-//#define DEBUG 1
 #define RETRIES 3
 #define CHUNK_SIZE 64
+#define IR_BITS_PER_DEVICE 32  // most IR bits CMD_SCAN_CHAIN allows each device
 
 static uint32 m_status = 0x00000000;
 static uint32 m_idleCycles;
@@ -36,8 +42,63 @@ static uint32 m_idleCycles;
 	static uint8  m_repeats;
 #endif
 static uint32 m_failures;
-static uint8 m_irLens[16];
+static uint8 m_irLens[MAX_CHAIN_DEVICES];
 static uint8 m_numDevices;
+static uint16 m_irBits;              // total IR length of the chain
+static uint16 m_irPadding;           // IR bits of the devices after the first
+static uint16 m_pageSize = 128;     // AVR flash geometry, from CMD_SET_AVR_GEOMETRY
+static uint16 m_numPages = 128;
+static uint8 m_extendedAddress = 0;
+static uint16 m_eepromPageSize = 4;  // AVR EEPROM geometry, likewise
+static uint16 m_eepromPages = 128;
+static uint8 m_ocdr = 0x04;          // I/O address of the AVR's OCDR, likewise
+static uint8 m_ocdIns;               // the AVR's instruction, during a memory dump
+static uint8 m_ocdSaved[3];          // r16, r26 & r27, restored after a dump
+static uint8 m_ocdClobbered;         // nonzero once the dump has used them
+static uint16 m_ocdNext;             // the address X holds, during a dump
+static uint16 m_ocdUnreadable[AVR_MAX_UNREADABLE] = {0x23, 0x2C, 0x2F};  // left out of a dump
+static uint8 m_tapState = TAPSTATE_TEST_LOGIC_RESET;  // a TAPState, as the chain sees it
+static uint8 m_endIR = TAPSTATE_RUN_TEST_IDLE;        // XSVF end states, from XENDIR
+static uint8 m_endDR = TAPSTATE_RUN_TEST_IDLE;        // and XENDDR
+static uint16 m_xsvfIrAfter;         // targeted XSVF: IR bits between the target and TDO
+static uint16 m_xsvfIrBefore;        // and between TDI and the target
+static uint8 m_xsvfDrAfter;          // bypass bits between the target and TDO
+static uint8 m_xsvfDrBefore;         // and between TDI and the target
+static uint32 m_checkpoint;          // where the current job could be resumed from
+static uint32 m_xsvfVectors;         // XSDRTDO records played so far
+static XsvfFailures m_xsvfFailures;  // the first of them which failed
+static SampleRequest m_sample;       // the device a CMD_SAMPLE_BSCAN job captures
+static uint16 m_xcfRow;              // the PROM row a CMD_PROG_XCF job is loading
+static uint16 m_xcfCrc;              // and the CRC of its data so far
+#ifdef DUAL_CHAIN
+	static uint8 m_dualChain = 0;    // drive chain B in lockstep with chain A
+	static uint16 m_tdoB;            // chain B's last 16 TDO bits, newest in bit 15
+	static uint16 m_responseB;       // chain B's answer to the last AVR command
+	static uint32 m_failuresB;       // XSVF vectors which failed on chain B
+	#define CHAIN_B_BYTE(shift) ((uint8)(m_tdoB >> (shift)))
+#else
+	#define CHAIN_B_BYTE(shift) 0x00
+#endif
+#ifdef CAPTURE
+	static uint8 m_captureOn = 0;    // record each TCK cycle into m_capture
+	static CaptureBlock m_capture;
+#endif
+#ifdef EXTEST
+	#define NO_EXTEST 0xFF
+	static uint8 m_extestDevice = NO_EXTEST;        // the device in EXTEST, if any
+	static uint8 m_extestVector[EXTEST_MAX_BYTES];  // as the last scan left it
+	static struct {
+		ExtestRequest request;  // of the CMD_EXTEST job
+		uint16 resultBytes;     // promised in its response
+		uint8 pending;          // read cells not yet sent, short of a byte
+		uint8 record;           // the record being read
+		uint8 cellBytes;        // and how many bytes of its cells are to come
+		uint16 cell;            // the low byte of a cell, until the high one comes
+	} m_extest;
+#endif
+
+void frameTask(void);
+uint8 jobTask(void);
 
 int main(void) {
 	REGCR |= (1 << REGDIS);
@@ -46,13 +107,20 @@ int main(void) {
 	clock_prescale_set(clock_div_1);
 	PORTB = 0x00;
 	DDRB = 0x00;
-	usartInit(38400);
-	usartSendFlashString(PSTR("NanduinoJTAG...\r"));
+	#ifdef DEBUG
+		debugInit();
+	#else
+		usartInit(38400);
+		usartSendFlashString(PSTR("NanduinoJTAG...\r"));
+	#endif
 	sei();
 	USB_Init();
 	
 	for ( ; ; ) {
 		USB_USBTask();
+		if ( !jobTask() ) {
+			frameTask();  // the next request waits until the job is done
+		}
 	}
 }
 
@@ -90,17 +158,70 @@ void EVENT_USB_Device_ConfigurationChanged(void) {
 #define TDO 0x20
 #define TDI 0x10
 
+// Firmware built with DUAL_CHAIN can drive a second chain, B, on PB3..PB0,
+// wired like chain A four bits lower, so one PORTB write clocks both
+#define CHAIN_B_SHIFT 4
+#define TCK_B (TCK >> CHAIN_B_SHIFT)
+#define TMS_B (TMS >> CHAIN_B_SHIFT)
+#define TDO_B (TDO >> CHAIN_B_SHIFT)
+#define TDI_B (TDI >> CHAIN_B_SHIFT)
+
 // JTAG instructions
 #define INS_PROG_ENABLE   0x04
 #define INS_PROG_COMMANDS 0x05
 #define INS_PROG_PAGELOAD 0x06
 #define INS_PROG_PAGEREAD 0x07
+#define INS_FORCE_BREAK   0x08
+#define INS_RUN           0x09
+#define INS_EX_INST       0x0A
+#define INS_OCD_ACCESS    0x0B
 #define INS_AVR_RESET     0x0C
 #define INS_BYPASS        0x0F
 
+// The AVR's on-chip debug registers, reached through the 21-bit OCD_ACCESS
+// register: 16 bits of data, a 4-bit register number, then a write flag. A
+// read captures the register selected by the scan before.
+#define OCD_REG_OCDR      0x0C
+#define OCD_REG_SHIFT     16
+
+// Instructions fed to the stopped core through EX_INST
+#define AVR_LD_R16_XPLUS  0x910D    // LD r16, X+
+#define AVR_LDI(reg, k)   (0xE000 | (((k) & 0xF0) << 4) | (((reg) - 16) << 4) | ((k) & 0x0F))
+#define AVR_OUT(a, reg)   (0xB800 | (((a) & 0x30) << 5) | ((reg) << 4) | ((a) & 0x0F))
+
+// Spartan-3 configuration instructions, and the status bits in the value it
+// captures into its instruction register
+#define INS_S3_CFG_IN     0x05
+#define INS_S3_JPROGRAM   0x0B
+#define INS_S3_JSTART     0x0C
+#define INS_S3_BYPASS     0x3F
+#define S3_IR_INIT        0x10
+#define S3_IR_DONE        0x20
+#define S3_INIT_POLLS     100
+#define S3_STARTUP_CLOCKS 16
+
+// XCF0xS PROM in-system programming instructions and timings, as used by
+// the vendor's XSVF programming algorithm
+#define INS_XCF_ISC_ENABLE   0xE8
+#define INS_XCF_ISC_PROGRAM  0xEA
+#define INS_XCF_ISC_ADDRESS  0xEB
+#define INS_XCF_ISC_ERASE    0xEC
+#define INS_XCF_ISC_DATA     0xED
+#define INS_XCF_XSC_READ     0xEF
+#define INS_XCF_ISC_DISABLE  0xF0
+#define INS_XCF_BYPASS       0xFF
+#define XCF_ENABLE_KEY       0x34
+#define XCF_ERASE_ALL        0x0001
+#define XCF_ERASE_US         15000000UL
+#define XCF_ERASE_SLICE_US   10000UL  // the erase wait per job step
+#define XCF_PROGRAM_US       14000UL
+#define XCF_READ_US          50
+#define XCF_TOGGLE_US        110
+
 // AVR Commands
 #define CMD_LOAD_DATA_HIGH_BYTE    0x1700
 #define CMD_LOAD_DATA_LOW_BYTE     0x1300
+#define CMD_LOAD_ADDRESS_EXT_BYTE  0x0B00
 #define CMD_LOAD_ADDRESS_HIGH_BYTE 0x0700
 #define CMD_LOAD_ADDRESS_LOW_BYTE  0x0300
 
@@ -112,6 +233,13 @@ void EVENT_USB_Device_ConfigurationChanged(void) {
 #define CMD_2A_ENTER_FLASH_WRITE 0x2310
 #define CMD_2G_WRITE_FLASH_PAGE  0x3700
 #define CMD_2H_POLL_FLASH_PAGE   0x3700
+#define CMD_4A_ENTER_EEPROM_WRITE 0x2311
+#define CMD_4E_LATCH_DATA        0x3700
+#define CMD_4F_WRITE_EEPROM_PAGE 0x3300
+#define CMD_4G_POLL_EEPROM_PAGE  0x3300
+#define CMD_5A_ENTER_EEPROM_READ 0x2303
+#define CMD_5C_READ_EEPROM_1     0x3300
+#define CMD_5C_READ_EEPROM_2     0x3200
 
 #define CMD_6A_ENTER_FUSE_WRITE  0x2340
 #define CMD_6C_WRITE_EXT_BYTE    0x3B00
@@ -130,33 +258,131 @@ void EVENT_USB_Device_ConfigurationChanged(void) {
 #define CMD_8F_READ_LOW_BYTE     0x3600
 #define CMD_8F_READ_LOCK_BITS    0x3700
 
-// Execute one TCK cycle of the JTAG TAP state machine
+// In a CAPTURE build, record the TMS, TDO and TDI levels of a cycle, which
+// are the top nibble of PINB as jtagClock() reads it
+//
+#ifdef CAPTURE
+static inline void captureCycle(uint8 pins) {
+	uint16 cycles;
+	if ( !m_captureOn ) {
+		return;
+	}
+	cycles = m_capture.cycles;
+	if ( cycles == 2 * CAPTURE_BYTES ) {
+		m_capture.dropped++;
+		return;
+	}
+	if ( cycles & 1 ) {
+		m_capture.data[cycles >> 1] |= pins & 0xF0;
+	} else {
+		m_capture.data[cycles >> 1] = pins >> 4;
+	}
+	m_capture.cycles = cycles + 1;
+}
+
+// Start a new block; its cycles begin in the current TAP state
+//
+static void captureRestart(void) {
+	m_capture.cycles = 0;
+	m_capture.dropped = 0;
+	m_capture.tapState = m_tapState;
+}
+#else
+	#define captureCycle(pins)
+#endif
+
+// Execute one TCK cycle of the JTAG TAP state machine. In a DUAL_CHAIN build
+// chain B gets the same TMS and TDI, and its TDO is kept in m_tdoB.
 //
+#ifdef DUAL_CHAIN
+static inline uint8 jtagClock(uint8 input) {
+	uint8 value = PORTB;
+	uint8 pins;
+	value &= ~(TCK|TMS|TDI|TCK_B|TMS_B|TDI_B);
+	input &= (TMS|TDI);
+	value |= input | (input >> CHAIN_B_SHIFT);
+	PORTB = value;
+	PORTB = value | TCK | TCK_B;
+	PORTB = value;
+	pins = PINB;
+	captureCycle(pins);
+	m_tdoB >>= 1;
+	if ( pins & TDO_B ) {
+		m_tdoB |= 0x8000;
+	}
+	return pins & TDO;
+}
+#else
 static inline uint8 jtagClock(uint8 input) {
 	uint8 value = PORTB;
+	uint8 pins;
 	value &= ~(TCK|TMS|TDI);
 	input &= (TMS|TDI);
 	value |= input;
 	PORTB = value;
 	PORTB = value | TCK;
 	PORTB = value;
-	return PINB & TDO;
+	pins = PINB;
+	captureCycle(pins);
+	return pins & TDO;
 }
+#endif
+
+// Take control of the JTAG lines: chain A's, and chain B's in dual-chain mode
+//
+static inline void jtagDrive(void) {
+	#ifdef DUAL_CHAIN
+		if ( m_dualChain ) {
+			DDRB = TCK | TMS | TDI | TCK_B | TMS_B | TDI_B;
+			return;
+		}
+	#endif
+	DDRB = TCK | TMS | TDI;
+}
+
+// The TAP state machine, indexed by TAPState: the high nibble is the next
+// state with TMS high, the low nibble the next state with TMS low
+//
+static const uint8 PROGMEM m_tapNext[16] = {
+	0x01, 0x21, 0x93, 0x54, 0x54, 0x86, 0x76, 0x84,
+	0x21, 0x0A, 0xCB, 0xCB, 0xFD, 0xED, 0xFB, 0x21
+};
 
-// Shortcut function to navigate quickly to Shift-DR (from Run-Test/Idle) and
-// Shift-IR (from Select-DR Scan).
+// Shortest paths between TAP states: bit n of row s is the TMS value of the
+// first step of the shortest path from state s to state n. Following the
+// table a step at a time reaches any state in at most eight clocks.
 //
-static inline void jtagGotoShiftState(void) {
-	jtagClock(TMS);  // Now in Select-xR Scan
-	jtagClock(0);    // Now in Capture-xR
-	jtagClock(0);    // Now in Shift-xR
+static const uint16 PROGMEM m_tapPath[16] = {
+	0x0000, 0xFFFD, 0xFE03, 0xFFE7, 0xFFEF, 0xFF0F, 0xFFBF, 0xFF0F,
+	0xFEFD, 0x01FF, 0xF3FF, 0xF7FF, 0x87FF, 0xDFFF, 0x87FF, 0x7FFD
+};
+
+// Move the TAP from wherever it is to the given state by the shortest path.
+// Scans finish in Update-xR rather than Run-Test/Idle, so back-to-back scans
+// go straight round through Select-DR Scan; callers which need Run-Test/Idle
+// (to wait there, or to clock it) ask for it explicitly.
+//
+static void jtagGotoState(uint8 state) {
+	uint8 next;
+	while ( m_tapState != state ) {
+		next = pgm_read_byte(&m_tapNext[m_tapState]);
+		if ( pgm_read_word(&m_tapPath[m_tapState]) & ((uint16)1 << state) ) {
+			jtagClock(TMS);
+			m_tapState = next >> 4;
+		} else {
+			jtagClock(0);
+			m_tapState = next & 0x0F;
+		}
+	}
 }
 
-// After writing data or instruction
+// The exchange functions clock their last bit with TMS high, taking the TAP
+// from Shift-xR to Exit1-xR behind the tracker's back: catch up, then carry
+// on to the given state
 //
-static inline void jtagGotoIdleState(void) {
-	jtagClock(TMS);      // Now in Update-DR
-	jtagClock(0);        // Now in Run-Test/Idle
+static inline void jtagEndScan(uint8 state) {
+	m_tapState++;  // Exit1-xR follows Shift-xR in TAPState
+	jtagGotoState(state);
 }
 
 // Write a byte and read back a byte; stay in Shift-DR
@@ -216,6 +442,21 @@ uint8 jtagExchangeData8(uint8 data, uint8 numBits) {
 	return result;
 }
 
+// Write numBits bits from the supplied uint8 and read back numBits bits; stay
+// in Shift-xR
+//
+uint8 jtagShiftData8(uint8 data, uint8 numBits) {
+	uint8 result = 0x00;
+	uint8 i;
+	for ( i = 0; i < numBits; i++ ) {
+		if ( jtagClock(data&0x01 ? TDI : 0) ) {
+			result |= 1 << i;
+		}
+		data >>= 1;
+	}
+	return result;
+}
+
 // Write numBits bits from the supplied uint16 and read back numBits bits
 //
 uint16 jtagExchangeData16(uint16 data, uint8 numBits) {
@@ -263,37 +504,96 @@ uint32 jtagExchangeData32(uint32 data, uint8 numBits) {
 //       the chain, and also that the device has fewer than 256 instructions.
 //
 void jtagWriteInstruction(uint8 cmd, uint8 len) {
-	uint8 i, j, irLen;
-	jtagClock(TMS);                         // Now in Select-DR Scan
-	jtagGotoShiftState();                   // Now in Shift-IR
-	for ( i = 1; i < m_numDevices; i++ ) {  // Put remaining devices (if any) in BYPASS
-		irLen = m_irLens[i];
-		for ( j = 0; j < irLen; j++ ) {
-			jtagClock(TDI);
-		}
+	uint16 padding = m_irPadding;
+	jtagGotoState(TAPSTATE_SHIFT_IR);
+	while ( padding ) {                     // Put remaining devices (if any) in BYPASS
+		jtagClock(TDI);
+		padding--;
 	}
 	jtagExchangeData8(cmd, len);            // Now in Exit1-IR
-	jtagGotoIdleState();                    // Now in Run-Test/Idle
+	jtagEndScan(TAPSTATE_UPDATE_IR);
 }
 
-// Reset the JTAG TAP state machine and return the IDENT register
+// Write an instruction to one device in the chain (numbered from TDI, as the
+// host sees them), putting all the others in BYPASS. Returns the first eight
+// bits that device captured into its instruction register.
 //
-uint8 jtagScanForDevices(uint32 *idCodes, uint8 bufferSpace) {
+uint8 jtagWriteInstructionTo(uint8 device, uint8 cmd) {
+	const uint8 irLen = m_irLens[device];
+	uint16 after = 0;                       // IR bits between the device and TDO
+	uint16 before;                          // IR bits between TDI and the device
+	uint8 i, input;
+	uint8 captured = 0x00;
+	for ( i = device + 1; i < m_numDevices; i++ ) {
+		after += m_irLens[i];
+	}
+	before = m_irBits - after - irLen;
+	jtagGotoState(TAPSTATE_SHIFT_IR);
+	while ( after ) {                       // The devices nearest TDO go first
+		jtagClock(TDI);
+		after--;
+	}
+	for ( i = 0; i < irLen; i++ ) {
+		input = (i < 8 && (cmd >> i) & 0x01) ? TDI : 0;
+		if ( !before && i == irLen - 1 ) {
+			input |= TMS;                       // Now in Exit1-IR
+		}
+		if ( jtagClock(input) && i < 8 ) {
+			captured |= 1 << i;
+		}
+	}
+	while ( before ) {
+		before--;
+		jtagClock(before ? TDI : TDI|TMS);    // Now in Exit1-IR, after the last
+	}
+	jtagEndScan(TAPSTATE_UPDATE_IR);
+	return captured;
+}
 
-	uint32 thisID;
-	uint8 i;
-	uint8 count = 0;
-	
-	// Go to Test-Logic-Reset
+// Load a data register of up to 32 bits in one device, with all the others
+// in BYPASS; ends in Update-DR
+//
+void jtagWriteDataTo(uint8 device, uint32 value, uint8 numBits) {
+	uint8 padding = device;  // bypass bits between TDI and the device
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	while ( numBits ) {
+		numBits--;
+		jtagClock(((value & 0x01) ? TDI : 0) | ((numBits || padding) ? 0 : TMS));
+		value >>= 1;
+	}
+	while ( padding ) {
+		padding--;
+		jtagClock(padding ? 0 : TMS);
+	}
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+}
+
+// Reset the JTAG TAP state machine. Five clocks with TMS high reach
+// Test-Logic-Reset from anywhere, so this is also how the tracked state gets
+// in step with the chain.
+//
+void jtagReset(void) {
 	jtagClock(TMS);
 	jtagClock(TMS);
 	jtagClock(TMS);
 	jtagClock(TMS);
 	jtagClock(TMS);
+	m_tapState = TAPSTATE_TEST_LOGIC_RESET;
+	#ifdef EXTEST
+		m_extestDevice = NO_EXTEST;  // so the pins are no longer driven
+	#endif
+}
 
-	// Go to Run-Test/Idle
-	jtagClock(0);          // Now in Run-Test/Idle
-	jtagGotoShiftState();  // Now in Shift-DR
+// Reset the JTAG TAP state machine and return the IDENT register
+//
+uint8 jtagScanForDevices(uint32 *idCodes, uint8 bufferSpace) {
+
+	uint32 thisID;
+	uint8 i;
+	uint8 count = 0;
+	
+	jtagReset();           // Now in Test-Logic-Reset
+	jtagGotoState(TAPSTATE_SHIFT_DR);
 	do {
 		thisID = 0x00000000;
 		for ( i = 0; i < 31; i++ ) {
@@ -319,45 +619,95 @@ uint8 jtagScanForDevices(uint32 *idCodes, uint8 bufferSpace) {
 		bufferSpace--;
 	}
 	jtagClock(TMS);        // Now in Exit1-DR
-	jtagGotoIdleState();   // Now in Run-Test/Idle
+	jtagEndScan(TAPSTATE_UPDATE_DR);
 	return count;
 }
 
-// Reset the JTAG TAP state machine
+// Walk the chain's data registers from Test-Logic-Reset, with ones on TDI.
+// A device with an IDCODE shifts out 32 bits, the first of them a one; a
+// BYPASS-only device shifts out a single zero. Thirty-two ones in a row can
+// only be our own TDI coming back, so they mark the end of the chain. If
+// stream is set, each IDCODE (or zero) goes to the host on the IN endpoint.
+// Returns the device count, or MAX_SCAN_DEVICES+1 if the chain never ends.
 //
-void jtagReset(void) {
-	// Go to Test-Logic-Reset
-	jtagClock(TMS);
-	jtagClock(TMS);
-	jtagClock(TMS);
-	jtagClock(TMS);
-	jtagClock(TMS);
+uint16 jtagWalkChain(uint8 stream) {
+	uint32 thisID;
+	uint16 count = 0;
+	uint8 i;
+	jtagReset();             // Now in Test-Logic-Reset
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	for ( ; ; ) {
+		if ( jtagClock(TDI) ) {
+			thisID = 0x80000000;
+			for ( i = 0; i < 31; i++ ) {
+				thisID >>= 1;
+				if ( jtagClock(TDI) ) {
+					thisID |= 0x80000000;
+				}
+			}
+			if ( thisID == 0xFFFFFFFF ) {
+				break;
+			}
+		} else {
+			thisID = 0x00000000;  // BYPASS-only device
+		}
+		if ( count == MAX_SCAN_DEVICES ) {
+			count++;
+			break;
+		}
+		if ( stream ) {
+			Endpoint_Write_Stream_LE(&thisID, 4);
+		}
+		count++;
+	}
+	jtagClock(TDI|TMS);      // Now in Exit1-DR
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	return count;
+}
+
+// Measure the total IR length of the chain: flush the IRs with zeros, then
+// count the clocks until a one shifted in at TDI comes out at TDO. By then
+// every IR holds all ones, so Update-IR leaves the whole chain in BYPASS.
+// Returns zero if the length exceeds maxBits.
+//
+uint16 jtagMeasureIr(uint16 maxBits) {
+	uint16 i, length = 0;
+	jtagGotoState(TAPSTATE_SHIFT_IR);
+	for ( i = 0; i < maxBits; i++ ) {
+		jtagClock(0);
+	}
+	while ( length <= maxBits && !jtagClock(TDI) ) {
+		length++;
+	}
+	jtagClock(TDI|TMS);      // Now in Exit1-IR
+	jtagEndScan(TAPSTATE_UPDATE_IR);
+	return length <= maxBits ? length : 0;
 }
 
 // Set the RESET state of the device
 //
 void avrResetEnable(uint8 enable) {
 	jtagWriteInstruction(INS_AVR_RESET, 4);
-	jtagGotoShiftState();    // Now in Shift-DR
+	jtagGotoState(TAPSTATE_SHIFT_DR);
 	if ( enable ) {
 		jtagClock(TDI|TMS);  // Now in Exit1-DR
 	} else {
 		jtagClock(TMS);      // Now in Exit1-DR
 	}
-	jtagGotoIdleState();          // Now in Run-Test/Idle
+	jtagEndScan(TAPSTATE_UPDATE_DR);
 }
 
 // Enable/disable the programming mode by writing a magic value
 //
 void avrProgModeEnable(uint8 enable) {
 	jtagWriteInstruction(INS_PROG_ENABLE, 4);
-	jtagGotoShiftState();  // Now in Shift-DR
+	jtagGotoState(TAPSTATE_SHIFT_DR);
 	if ( enable ) {
 		jtagExchangeData16(0xA370, 16);  // Magic word! Now in Exit1-DR
 	} else {
 		jtagExchangeData16(0x0000, 16);  // Now in Exit1-DR
 	}
-	jtagGotoIdleState();        // Now in Run-Test/Idle
+	jtagEndScan(TAPSTATE_UPDATE_DR);
 }
 
 // Write the specified 15-bit AVR command
@@ -365,30 +715,116 @@ void avrProgModeEnable(uint8 enable) {
 uint16 avrWriteCommand(uint16 cmd) {
 	uint16 response;
 	uint8 numBits;
-	jtagWriteInstruction(INS_PROG_COMMANDS, 4);     // Now in Run-Test/Idle
-	jtagGotoShiftState();                           // Now in Shift-DR
-	response = jtagExchangeData16(cmd, 15);         // Now in Exit1-DR
-	jtagGotoIdleState();                            // Now in Run-Test/Idle
+	jtagWriteInstruction(INS_PROG_COMMANDS, 4);     // Now in Update-IR
+	jtagGotoState(TAPSTATE_SHIFT_DR);
 
+	// The AVR's response reaches TDO through one BYPASS bit per extra device,
+	// so clock those out first; the command is the last thing shifted in
 	numBits = m_numDevices - 1;
-	if ( numBits ) {
-		jtagWriteInstruction(INS_BYPASS, 4);          // Shift in BYPASS instruction. Now in Run-Test/Idle
-		jtagGotoShiftState();                         // Now in Shift-DR
+	while ( numBits ) {
+		jtagClock(0);
 		numBits--;
-		while ( numBits ) {
-			response >>= 1;                             // One extra device means clocking one extra bit whilst in BYPASS
-			if ( jtagClock(0) ) {                       // Now in Exit1-DR
-				response |= 0x8000;
+	}
+	response = jtagExchangeData16(cmd, 15);         // Now in Exit1-DR
+	#ifdef DUAL_CHAIN
+		m_responseB = m_tdoB >> 1;
+	#endif
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	return response;
+}
+
+// Send a polling command; returns nonzero once bit 9 of the response says the
+// AVR has finished. In dual-chain mode both AVRs must have finished.
+//
+uint8 avrReady(uint16 cmd) {
+	uint16 response = avrWriteCommand(cmd);
+	#ifdef DUAL_CHAIN
+		if ( m_dualChain ) {
+			response &= m_responseB;
+		}
+	#endif
+	return (response & 0x0200) ? 1 : 0;
+}
+
+// Scan one of the AVR's data registers during a memory dump, skipping the IR
+// scan when the AVR already holds the instruction; returns what it captured
+//
+static uint32 ocdScan(uint8 ins, uint32 data, uint8 numBits) {
+	uint32 result;
+	uint8 padding = m_numDevices - 1;
+	if ( ins != m_ocdIns ) {
+		jtagWriteInstruction(ins, 4);
+		m_ocdIns = ins;
+	}
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	while ( padding ) {                 // as in avrWriteCommand()
+		jtagClock(0);
+		padding--;
+	}
+	result = jtagExchangeData32(data, numBits);  // Now in Exit1-DR
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	return result;
+}
+
+// Have the stopped core execute one instruction
+//
+static void ocdExecute(uint16 instruction) {
+	ocdScan(INS_EX_INST, instruction, 16);
+}
+
+// Stop the core where it is, without resetting it, and select OCDR for the
+// first read
+//
+void ocdBegin(void) {
+	m_ocdIns = INS_BYPASS;
+	m_ocdClobbered = 0;
+	m_ocdNext = 0;
+	jtagWriteInstruction(INS_FORCE_BREAK, 4);
+	ocdScan(INS_OCD_ACCESS, (uint32)OCD_REG_OCDR << OCD_REG_SHIFT, 21);
+}
+
+// Read one byte of the data space. The registers come out through OCDR as
+// they are; everything above them is loaded into r16 through X, which the
+// dump walks upwards from 0x20. The read-sensitive I/O registers are not
+// read at all, and X is loaded afresh past each of them.
+//
+uint8 ocdReadByte(uint16 address) {
+	uint8 data, i;
+	if ( address < 32 ) {
+		ocdExecute(AVR_OUT(m_ocdr, address));
+	} else {
+		for ( i = 0; i < AVR_MAX_UNREADABLE; i++ ) {
+			if ( address == m_ocdUnreadable[i] ) {
+				return 0xFF;
 			}
-			numBits--;
 		}
-		response >>= 1;                               // One extra device means clocking one extra bit whilst in BYPASS
-		if ( jtagClock(TMS) ) {                       // Now in Exit1-DR
-			response |= 0x8000;
+		if ( address != m_ocdNext ) {
+			ocdExecute(AVR_LDI(26, (uint8)address));
+			ocdExecute(AVR_LDI(27, (uint8)(address >> 8)));
+			m_ocdClobbered = 1;
 		}
-		jtagGotoIdleState();                          // Now in Run-Test/Idle
+		ocdExecute(AVR_LD_R16_XPLUS);
+		m_ocdNext = address + 1;
+		ocdExecute(AVR_OUT(m_ocdr, 16));
 	}
-	return response;
+	data = (uint8)ocdScan(INS_OCD_ACCESS, (uint32)OCD_REG_OCDR << OCD_REG_SHIFT, 21);
+	if ( address == 16 ) {
+		m_ocdSaved[0] = data;
+	} else if ( address == 26 || address == 27 ) {
+		m_ocdSaved[address - 25] = data;
+	}
+	return data;
+}
+
+// Put back the registers the dump used, and let the core run on
+//
+void ocdEnd(void) {
+	if ( m_ocdClobbered ) {
+		ocdExecute(AVR_LDI(16, m_ocdSaved[0]));
+		ocdExecute(AVR_LDI(26, m_ocdSaved[1]));
+		ocdExecute(AVR_LDI(27, m_ocdSaved[2]));
+	}
+	jtagWriteInstruction(INS_RUN, 4);
 }
 
 // Returns a long-word:
@@ -427,21 +863,21 @@ void avrWriteFuses(uint32 fuses) {
 	avrWriteCommand(CMD_6C_WRITE_EXT_BYTE & 0xFDFF);
 	avrWriteCommand(CMD_6C_WRITE_EXT_BYTE);
 	avrWriteCommand(CMD_6C_WRITE_EXT_BYTE);
-	while ( !(avrWriteCommand(CMD_6D_POLL_EXT_BYTE) & 0x0200) );
+	while ( !avrReady(CMD_6D_POLL_EXT_BYTE) );
 
 	avrWriteCommand(CMD_LOAD_DATA_LOW_BYTE | ((fuses>>16)&0x9F));  // Disallow JTAG&SPI disabling
 	avrWriteCommand(CMD_6F_WRITE_HIGH_BYTE);
 	avrWriteCommand(CMD_6F_WRITE_HIGH_BYTE & 0xFDFF);
 	avrWriteCommand(CMD_6F_WRITE_HIGH_BYTE);
 	avrWriteCommand(CMD_6F_WRITE_HIGH_BYTE);
-	while ( !(avrWriteCommand(CMD_6G_POLL_HIGH_BYTE) & 0x0200) );
+	while ( !avrReady(CMD_6G_POLL_HIGH_BYTE) );
 
 	avrWriteCommand(CMD_LOAD_DATA_LOW_BYTE | ((fuses>>8)&0xFF));
 	avrWriteCommand(CMD_6I_WRITE_LOW_BYTE);
 	avrWriteCommand(CMD_6I_WRITE_LOW_BYTE & 0xFDFF);
 	avrWriteCommand(CMD_6I_WRITE_LOW_BYTE);
 	avrWriteCommand(CMD_6I_WRITE_LOW_BYTE);
-	while ( !(avrWriteCommand(CMD_6J_POLL_LOW_BYTE) & 0x0200) );
+	while ( !avrReady(CMD_6J_POLL_LOW_BYTE) );
 
 	avrWriteCommand(CMD_7A_ENTER_LOCK_WRITE);
 
@@ -450,18 +886,30 @@ void avrWriteFuses(uint32 fuses) {
 	avrWriteCommand(CMD_7C_WRITE_LOCK_BYTE & 0xFDFF);
 	avrWriteCommand(CMD_7C_WRITE_LOCK_BYTE);
 	avrWriteCommand(CMD_7C_WRITE_LOCK_BYTE);
-	while ( !(avrWriteCommand(CMD_7D_POLL_LOCK_BYTE) & 0x0200) );
+	while ( !avrReady(CMD_7D_POLL_LOCK_BYTE) );
+}
+
+// Load the word address of the start of the specified page
+//
+static void avrLoadPageAddress(uint16 page) {
+	const uint32 address = (uint32)page * (m_pageSize >> 1);
+	if ( m_extendedAddress ) {
+		avrWriteCommand(CMD_LOAD_ADDRESS_EXT_BYTE | (uint8)(address >> 16));
+	}
+	avrWriteCommand(CMD_LOAD_ADDRESS_HIGH_BYTE | (uint8)(address >> 8));
+	avrWriteCommand(CMD_LOAD_ADDRESS_LOW_BYTE | (uint8)address);
 }
 
-// Begin reading the specified 128-byte page
+// Begin reading at the specified page. The AVR's byte address increments
+// across page boundaries, so the rest of the flash can be shifted out in the
+// same scan.
 //
 void avrReadFlashBegin(uint16 page) {
 	uint8 numBits;
 	avrWriteCommand(CMD_3A_ENTER_FLASH_READ);
-	avrWriteCommand(CMD_LOAD_ADDRESS_HIGH_BYTE | ((page&0x7F)>>2));
-	avrWriteCommand(CMD_LOAD_ADDRESS_LOW_BYTE | ((page&0x03)<<6));
+	avrLoadPageAddress(page);
 	jtagWriteInstruction(INS_PROG_PAGEREAD, 4);
-	jtagGotoShiftState();  // Now in Shift-DR
+	jtagGotoState(TAPSTATE_SHIFT_DR);
 
 	// Each extra device in the chain introduces a one-bit delay, so 
 	// clock the output data forward to compensate:
@@ -475,36 +923,80 @@ void avrReadFlashBegin(uint16 page) {
 	jtagExchangeData(0x00);
 }
 
-// Begin writing the specified 128-byte page
+// Begin writing the specified page
 //
 void avrWriteFlashBegin(uint16 page) {
 	avrWriteCommand(CMD_2A_ENTER_FLASH_WRITE);
-	avrWriteCommand(CMD_LOAD_ADDRESS_HIGH_BYTE | ((page&0x7F)>>2));
-	avrWriteCommand(CMD_LOAD_ADDRESS_LOW_BYTE | ((page&0x03)<<6));
+	avrLoadPageAddress(page);
 	jtagWriteInstruction(INS_PROG_PAGELOAD, 4);
-	jtagGotoShiftState();  // Now in Shift-DR...ready to accept 128 bytes
+	jtagGotoState(TAPSTATE_SHIFT_DR);  // ...ready to accept a page
 }
 
 void avrWriteFlashEnd(void) {
-	jtagGotoIdleState();          // Now in Run-Test/Idle
+	jtagEndScan(TAPSTATE_UPDATE_DR);
 	avrWriteCommand(CMD_2G_WRITE_FLASH_PAGE);
 	avrWriteCommand(CMD_2G_WRITE_FLASH_PAGE & 0xFDFF);
 	avrWriteCommand(CMD_2G_WRITE_FLASH_PAGE);
 	avrWriteCommand(CMD_2G_WRITE_FLASH_PAGE);
-	while ( !(avrWriteCommand(CMD_2H_POLL_FLASH_PAGE) & 0x0200) );
+	while ( !avrReady(CMD_2H_POLL_FLASH_PAGE) );
+}
+
+// Begin reading EEPROM, at an address in the 256-byte block given
+//
+void avrReadEepromBegin(uint16 address) {
+	avrWriteCommand(CMD_5A_ENTER_EEPROM_READ);
+	avrWriteCommand(CMD_LOAD_ADDRESS_HIGH_BYTE | (uint8)(address >> 8));
+}
+
+// Read a byte of EEPROM; the high address byte must already be loaded
+//
+uint8 avrReadEepromByte(uint16 address) {
+	avrWriteCommand(CMD_5C_READ_EEPROM_1 | (uint8)address);
+	avrWriteCommand(CMD_5C_READ_EEPROM_2);
+	return (uint8)avrWriteCommand(CMD_5C_READ_EEPROM_1);
+}
+
+// The EEPROM has no PAGELOAD path, so each byte of a page is loaded into the
+// page buffer with PROG_COMMANDS; then the whole page is written at once
+//
+void avrWriteEepromBegin(uint16 address) {
+	avrWriteCommand(CMD_4A_ENTER_EEPROM_WRITE);
+	avrWriteCommand(CMD_LOAD_ADDRESS_HIGH_BYTE | (uint8)(address >> 8));
+}
+
+void avrWriteEepromByte(uint16 address, uint8 data) {
+	avrWriteCommand(CMD_LOAD_ADDRESS_LOW_BYTE | (uint8)address);
+	avrWriteCommand(CMD_LOAD_DATA_LOW_BYTE | data);
+	avrWriteCommand(CMD_4E_LATCH_DATA);
+	avrWriteCommand(CMD_4E_LATCH_DATA | 0x4000);
+	avrWriteCommand(CMD_4E_LATCH_DATA);
 }
 
-// Erase the device entirely
+void avrWriteEepromEnd(void) {
+	avrWriteCommand(CMD_4F_WRITE_EEPROM_PAGE);
+	avrWriteCommand(CMD_4F_WRITE_EEPROM_PAGE & 0xFDFF);
+	avrWriteCommand(CMD_4F_WRITE_EEPROM_PAGE);
+	avrWriteCommand(CMD_4F_WRITE_EEPROM_PAGE);
+	while ( !avrReady(CMD_4G_POLL_EEPROM_PAGE) );
+}
+
+// Start erasing the device entirely
 //
-void avrChipErase(void) {
+void avrChipEraseBegin(void) {
 	avrWriteCommand(CMD_1A_CHIP_ERASE_1);
 	avrWriteCommand(CMD_1A_CHIP_ERASE_2);
 	avrWriteCommand(CMD_1A_CHIP_ERASE_3);
 	avrWriteCommand(CMD_1A_CHIP_ERASE_3);
-	while ( !(avrWriteCommand(CMD_1A_POLL_ERASE) & 0x0200) );
+}
+
+// Poll the erase; returns nonzero once it has finished
+//
+uint8 avrChipEraseDone(void) {
+	return avrReady(CMD_1A_POLL_ERASE);
 }
 
 ParseStatus gotXCOMPLETE(void) {
+	jtagGotoState(TAPSTATE_RUN_TEST_IDLE);  // settle any scan left in Update-xR
 	return PARSE_SUCCESS;
 }
 
@@ -512,25 +1004,39 @@ ParseStatus gotXTDOMASK(uint16 length, const uint8 *mask) {
 	return PARSE_SUCCESS;
 }
 
+static void xsvfEndScan(uint8 update, uint8 endState);
+
+// Clock the bypass bits of the devices around a targeted XSVF's device; with
+// exit set, the last of them leaves Shift-xR for Exit1-xR
+//
+static void xsvfPad(uint16 bits, uint8 tdi, uint8 exit) {
+	while ( bits ) {
+		bits--;
+		jtagClock((exit && !bits) ? tdi|TMS : tdi);
+	}
+}
+
+// An XSIR starts each step of an XSVF program, so a resumed playback starts
+// at the last one begun: the host counts them to find its place in the file
+//
 ParseStatus gotXSIR(uint8 length, const uint8 *sir) {
-	#ifdef DEBUG
-		usartSendFlashString(PSTR("gotXSIR("));
-		usartSendByteHex(length);
-		usartSendFlashString(PSTR(", "));
-		usartSendByteHex(*sir);
-		usartSendFlashString(PSTR(")\r"));
-	#endif
+	debugEvent(DBG_XSIR, length | ((uint16)*sir << 8));
+	m_checkpoint++;
 	sir += bitsToBytes(length) - 1;
-	// Assume Run-Test/Idle on entry
-	jtagClock(TMS);                // Now in Select-DR Scan
-	jtagGotoShiftState();          // Now in Shift-IR
+	jtagGotoState(TAPSTATE_SHIFT_IR);
+	xsvfPad(m_xsvfIrAfter, TDI, 0);  // The devices nearest TDO go first
 	while ( length > 8 ) {
 		jtagExchangeData(*sir);      // Stay in Shift-IR
 		length -= 8;
 		sir--;
 	}
-	jtagExchangeData8(*sir, length); // Now in Exit1-DR
-	jtagGotoIdleState();           // Now in Run-Test/Idle
+	if ( m_xsvfIrBefore ) {
+		jtagShiftData8(*sir, length);
+		xsvfPad(m_xsvfIrBefore, TDI, 1);  // Now in Exit1-IR
+	} else {
+		jtagExchangeData8(*sir, length); // Now in Exit1-IR
+	}
+	xsvfEndScan(TAPSTATE_UPDATE_IR, m_endIR);
 	return PARSE_SUCCESS;
 }
 
@@ -551,25 +1057,80 @@ ParseStatus gotXSDRSIZE(uint16 value) {
 }
 
 inline void delay(uint32 us) {
-	while ( us-- ) {
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
-		__asm__("nop");
+	#ifdef SIM
+		simDelay(us);
+	#else
+		while ( us-- ) {
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+			__asm__("nop");
+		}
+	#endif
+}
+
+// Wait in Run-Test/Idle, where in-system programming operations do their work
+//
+static void jtagRunTest(uint32 us) {
+	jtagGotoState(TAPSTATE_RUN_TEST_IDLE);
+	delay(us);
+}
+
+// Finish an XSVF scan, which has just reached Exit1-xR, in its end state and
+// wait out the run-test time there. A scan ending in Run-Test/Idle with no
+// time to wait stops in Update-xR instead: the next scan starts a clock
+// sooner from there, and gotXCOMPLETE() goes on to Run-Test/Idle at the end.
+//
+static void xsvfEndScan(uint8 update, uint8 endState) {
+	if ( endState == TAPSTATE_RUN_TEST_IDLE ) {
+		jtagEndScan(update);
+		if ( m_idleCycles ) {
+			jtagRunTest(m_idleCycles);
+		}
+	} else {
+		jtagEndScan(endState);
+	}
+}
+
+// On a vector's last attempt, keep what comes back from the first byte which
+// fails to match, for the host to compare against the file
+//
+static void xsvfNoteByte(
+	XsvfFailure *note, uint16 index, uint8 actual, uint8 actualB, uint8 expected, uint8 mask)
+{
+	const uint8 n = note->numBytes;
+	if ( n == 0 ) {
+		if ( (actual & mask) != expected ) {
+			note->chain = 0;
+		}
+		#ifdef DUAL_CHAIN
+			else if ( m_dualChain && (actualB & mask) != expected ) {
+				note->chain = 1;
+			}
+		#endif
+		else {
+			return;
+		}
+		note->offset = index;
+	} else if ( n == XSVF_FAIL_BYTES ) {
+		return;
 	}
+	note->actual[n] = note->chain ? actualB : actual;
+	note->numBytes = n + 1;
 }
 
 ParseStatus gotXSDRTDO(const uint16 length, const uint8 *const data, const uint8 *const mask) {
 	const uint16 offset = bitsToBytes(length);
 	const uint8 *dataPtr;
 	const uint8 *maskPtr;
-	uint16 bitCount;
+	XsvfFailure *note;
+	uint16 bitCount, index;
 	uint8 errorOccurred;
 	uint8 retryCount = 
 	#ifdef RETRIES
@@ -578,100 +1139,98 @@ ParseStatus gotXSDRTDO(const uint16 length, const uint8 *const data, const uint8
 		m_repeats;
 	#endif
 	uint8 byte;
-	#ifdef DEBUG
-		uint16 i;
-		usartSendFlashString(PSTR("gotXSDRTDO("));
-		usartSendWordHex(length);
-		usartSendFlashString(PSTR(", "));
-		for ( i = 0; i < offset; i++ ) {
-			usartSendByteHex(data[i]);
-		}
-		usartSendFlashString(PSTR(", "));
-		for ( i = 0; i < offset; i++ ) {
-			usartSendByteHex(data[offset+i]);
-		}
-		usartSendFlashString(PSTR(", mask="));
-		for ( i = 0; i < offset; i++ ) {
-			usartSendByteHex(mask[i]);
-		}
-		usartSendFlashString(PSTR(")\r"));
-	#endif
+	debugEvent(DBG_XSDRTDO, length | ((uint32)data[0] << 16));
+	m_xsvfVectors++;
 	for ( ; ; ) {
 		#if defined(DEBUG) && DEBUG > 1
-			usartSendFlashString(PSTR("  attempt="));
 			#ifdef RETRIES
-				usartSendByteHex(RETRIES-retryCount);
+				debugEvent(DBG_ATTEMPT, RETRIES-retryCount);
 			#else
-				usartSendByteHex(m_repeats-retryCount);
+				debugEvent(DBG_ATTEMPT, m_repeats-retryCount);
 			#endif
-			usartSendByte('\r');
 		#endif
 		errorOccurred = 0;
 		dataPtr = data + offset - 1;
 		maskPtr = mask + offset - 1;
 		bitCount = length;
-		// Assume Run-Test/Idle on entry
-		delay(m_idleCycles);
-		jtagGotoShiftState();  // Now in Shift-DR
+		index = 0;
+		note = NULL;
+		if ( retryCount == 1 && m_xsvfFailures.count < XSVF_MAX_FAILURES ) {
+			note = &m_xsvfFailures.failures[m_xsvfFailures.count];
+			note->numBytes = 0;
+		}
+		jtagGotoState(TAPSTATE_SHIFT_DR);
+		xsvfPad(m_xsvfDrAfter, 0, 0);   // TDO of the bypass registers is not compared
 		while ( bitCount > 8 ) {
 			byte = jtagExchangeData(*dataPtr);      // Stay in Shift-DR
 			#if defined(DEBUG) && DEBUG > 1
-				usartSendFlashString(PSTR("    sent="));
-				usartSendByteHex(*dataPtr);
-				usartSendFlashString(PSTR(" (bitCount=08), received="));
-				usartSendByteHex(byte);
-				usartSendFlashString(PSTR(", expected="));
-				usartSendByteHex(dataPtr[offset]);
-				usartSendFlashString(PSTR(", mask="));
-				usartSendByteHex(*maskPtr);
-				usartSendFlashString(PSTR("\r"));
+				debugEvent(DBG_TDO_BYTE, byte | ((uint16)dataPtr[offset] << 8) | ((uint32)*maskPtr << 16));
 			#endif
 			if ( (byte & *maskPtr) != dataPtr[offset] ) {
-				errorOccurred = 1;
+				errorOccurred |= 0x01;
+			}
+			#ifdef DUAL_CHAIN
+				if ( m_dualChain && ((uint8)(m_tdoB >> 8) & *maskPtr) != dataPtr[offset] ) {
+					errorOccurred |= 0x02;
+				}
+			#endif
+			if ( note ) {
+				xsvfNoteByte(note, index++, byte, CHAIN_B_BYTE(8), dataPtr[offset], *maskPtr);
 			}
 			bitCount -= 8;
 			dataPtr--;
 			maskPtr--;
 		}
-		byte = jtagExchangeData8(*dataPtr, bitCount); // Now in Exit1-DR
+		byte = m_xsvfDrBefore ?
+			jtagShiftData8(*dataPtr, bitCount) :      // Stay in Shift-DR
+			jtagExchangeData8(*dataPtr, bitCount);    // Now in Exit1-DR
 		#if defined(DEBUG) && DEBUG > 1
-			usartSendFlashString(PSTR("    sent="));
-			usartSendByteHex(*dataPtr);
-			usartSendFlashString(PSTR(" (bitCount="));
-			usartSendByteHex(bitCount);
-			usartSendFlashString(PSTR("), received="));
-			usartSendByteHex(byte);
-			usartSendFlashString(PSTR(", expected="));
-			usartSendByteHex(dataPtr[offset]);
-			usartSendFlashString(PSTR(", mask="));
-			usartSendByteHex(*maskPtr);
-			usartSendFlashString(PSTR("\r"));
+			debugEvent(DBG_TDO_BYTE, byte | ((uint16)dataPtr[offset] << 8) | ((uint32)*maskPtr << 16));
 		#endif
 		if ( (byte & *maskPtr) != dataPtr[offset] ) {
-			errorOccurred = 1;
+			errorOccurred |= 0x01;
 		}
+		#ifdef DUAL_CHAIN
+			if ( m_dualChain && ((uint8)(m_tdoB >> (16 - bitCount)) & *maskPtr) != dataPtr[offset] ) {
+				errorOccurred |= 0x02;
+			}
+		#endif
+		if ( note ) {
+			xsvfNoteByte(note, index, byte, CHAIN_B_BYTE(16 - bitCount), dataPtr[offset], *maskPtr);
+		}
+		xsvfPad(m_xsvfDrBefore, 0, 1);  // Now in Exit1-DR, if not already
 		if ( errorOccurred ) {
 			if ( --retryCount ) {
-				jtagClock(0);    // Now in Pause-DR
-				jtagClock(TMS);  // Now in Exit2-DR
-				jtagClock(0);    // Now in Shift-DR
-				jtagClock(TMS);  // Now in Exit1-DR
-				jtagClock(TMS);  // Now in Update-DR
-				jtagClock(0);    // Now in Run-Test/Idle
+				// Pause, go back through Shift-DR to Update-DR, wait in
+				// Run-Test/Idle...
+				jtagEndScan(TAPSTATE_PAUSE_DR);
+				jtagGotoState(TAPSTATE_SHIFT_DR);
+				jtagRunTest(m_idleCycles);
 				// ...and try again
 			} else {
 				// reached maxRetries, give up
-				jtagGotoIdleState();  // Now in Run-Test/Idle
+				xsvfEndScan(TAPSTATE_UPDATE_DR, m_endDR);
+				if ( errorOccurred & 0x01 ) {
+					m_failures++;
+				}
+				#ifdef DUAL_CHAIN
+					if ( errorOccurred & 0x02 ) {
+						m_failuresB++;
+					}
+				#endif
+				if ( note && note->numBytes ) {
+					note->vector = m_xsvfVectors - 1;
+					m_xsvfFailures.count++;
+				}
 				#if defined(DEBUG) && DEBUG > 1
-					usartSendFlashString(PSTR("  failed!\r"));
+					debugEvent(DBG_VECTOR_FAILED, m_failures);
 				#endif
-				m_failures++;
 				return PARSE_SUCCESS;
 			}
 		} else {
-			jtagGotoIdleState();  // Now in Run-Test/Idle
+			xsvfEndScan(TAPSTATE_UPDATE_DR, m_endDR);
 			#if defined(DEBUG) && DEBUG > 1
-				usartSendFlashString(PSTR("  success!\r"));
+				debugEvent(DBG_VECTOR_OK, 0);
 			#endif
 			return PARSE_SUCCESS;
 		}
@@ -691,243 +1250,1475 @@ ParseStatus gotXSDRE(unsigned short tdoNumBits, const unsigned char *tdoBitmap)
 }
 
 ParseStatus gotXSTATE(TAPState value) {
-	/*jtagReset();
-	switch ( state ) {
-		case TAPSTATE_TEST_LOGIC_RESET:
-			break;
-		case TAPSTATE_RUN_TEST_IDLE:
-			jtagClock(0);        // Now in Run-Test/Idle
-			break;
-		case TAPSTATE_SELECT_IR:
-	*/
+	if ( value > TAPSTATE_UPDATE_IR ) {
+		return PARSE_ILLEGAL_STATE;
+	}
+	if ( value == TAPSTATE_TEST_LOGIC_RESET ) {
+		jtagReset();  // always the full five clocks, whatever state we think we're in
+	} else {
+		jtagGotoState(value);
+	}
 	return PARSE_SUCCESS;
 }
 
+// End states for scans: zero is Run-Test/Idle, one is Pause-xR
+//
 ParseStatus gotXENDIR(unsigned char endState) {
-	return PARSE_ILLEGAL_COMMAND;
+	if ( endState > 1 ) {
+		return PARSE_ILLEGAL_STATE;
+	}
+	m_endIR = endState ? TAPSTATE_PAUSE_IR : TAPSTATE_RUN_TEST_IDLE;
+	return PARSE_SUCCESS;
 }
 
 ParseStatus gotXENDDR(unsigned char endState) {
-	return PARSE_ILLEGAL_COMMAND;
+	if ( endState > 1 ) {
+		return PARSE_ILLEGAL_STATE;
+	}
+	m_endDR = endState ? TAPSTATE_PAUSE_DR : TAPSTATE_RUN_TEST_IDLE;
+	return PARSE_SUCCESS;
 }
 
-void EVENT_USB_Device_UnhandledControlRequest(void) {
-	switch ( USB_ControlRequest.bRequest ) {
-		case CMD_SCAN:
-			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
-				// Read IDCODE, status, failure count
-				uint32 response[16];
-				DDRB = TCK | TMS | TDI;
-				m_numDevices = jtagScanForDevices(response, 16);
-				PORTB = 0x00;
-				DDRB = 0x00;
-				Endpoint_ClearSETUP();
-				Endpoint_Write_Control_Stream_LE(response, 64);
-				Endpoint_ClearStatusStage();
-			}
-			break;
-		case CMD_RW_AVR_FUSES:
-			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
-				// Read AVR fuses
-				uint32 response;
-				DDRB = TCK | TMS | TDI;
-				jtagReset();
-				avrResetEnable(1);
-				avrProgModeEnable(1);
-				response = avrReadFuses();
-				avrProgModeEnable(0);
-				avrResetEnable(0);
-				PORTB = 0x00;
-				DDRB = 0x00;
-				Endpoint_ClearSETUP();
-				Endpoint_Write_Control_Stream_LE(&response, 4);
-				Endpoint_ClearStatusStage();
-			} else if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
-				// Write AVR fuses
-				DDRB = TCK | TMS | TDI;
-				jtagReset();           // Now in Test-Logic-Reset
-				jtagClock(0);          // Now in Run-Test/Idle
-				avrResetEnable(1);
-				avrProgModeEnable(1);
-				avrWriteFuses(((uint32)USB_ControlRequest.wValue << 16) + USB_ControlRequest.wIndex);
-				avrProgModeEnable(0);
-				avrResetEnable(0);
-				PORTB = 0x00;
-				DDRB = 0x00;
-				Endpoint_ClearSETUP();
-				Endpoint_ClearStatusStage();
-			}
-			break;
-		case CMD_RD_AVR_FLASH:
-			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
-				// Read AVR flash
-				uint8 response[CHUNK_SIZE];
-				uint8 i;
-				uint16 page;
-				uint32 count;
-				Endpoint_ClearSETUP();
-				Endpoint_ClearStatusStage();
-				DDRB = TCK | TMS | TDI;
-				jtagReset();           // Now in Test-Logic-Reset
-				jtagClock(0);          // Now in Run-Test/Idle
-				avrResetEnable(1);
-				avrProgModeEnable(1);
-
-				page = 0;
-				count = USB_ControlRequest.wValue;
-				count <<= 16;
-				count += USB_ControlRequest.wIndex;
-				count >>= 7;  // number of 128-byte pages
-				Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
-				while ( count-- ) {
-					avrReadFlashBegin(page++);
-					for ( i = 0; i < CHUNK_SIZE; i++ ) {
-						response[i] = jtagExchangeData(0x00);
-					}
-					Endpoint_Write_Stream_LE(response, CHUNK_SIZE);
-					for ( i = 0; i < 63; i++ ) {
-						response[i] = jtagExchangeData(0x00);
-					}
-					response[63] = jtagExchangeDataEnd(0x00);
-					jtagGotoIdleState();
-					Endpoint_Write_Stream_LE(response, CHUNK_SIZE);
+// The operations below are shared by the control-request protocol and the
+// framed bulk protocol. Each one drives the JTAG lines only for its duration.
+//
+
+// A scan may find a different chain, so the IR lengths set for the last one
+// no longer apply; the host sends them again with CMD_SET_IRLENS
+//
+static void forgetIrLens(void) {
+	memset(m_irLens, 0x00, sizeof(m_irLens));
+	m_irBits = 0;
+	m_irPadding = 0;
+}
+
+// Scan the chain, filling in all 16 IDCODE slots; returns the device count
+//
+uint8 doScan(uint32 *idCodes) {
+	uint8 numDevices;
+	forgetIrLens();
+	jtagDrive();
+	numDevices = jtagScanForDevices(idCodes, 16);
+	PORTB = 0x00;
+	DDRB = 0x00;
+	return numDevices;
+}
+
+// Count the devices in the chain and measure its total IR length; returns
+// the count, or MAX_SCAN_DEVICES+1 if the chain is broken
+//
+uint16 doCountChain(uint16 *irBits) {
+	uint16 numDevices;
+	forgetIrLens();
+	jtagDrive();
+	numDevices = jtagWalkChain(0);
+	*irBits = (numDevices <= MAX_SCAN_DEVICES) ? jtagMeasureIr(numDevices * IR_BITS_PER_DEVICE) : 0;
+	PORTB = 0x00;
+	DDRB = 0x00;
+	return numDevices;
+}
+
+// The AVR commands address the first device by its position in the chain,
+// and targeted XSVF playback pads around the device it is given, so they need
+// a scan to have found one. Untargeted playback drives the whole chain as the
+// XSVF describes it, and so does not.
+//
+static uint8 needsChain(uint8 opcode, uint8 flags) {
+	return
+		opcode == CMD_RW_AVR_FUSES || opcode == CMD_RD_AVR_FLASH || opcode == CMD_WR_AVR_FLASH ||
+		opcode == CMD_ERASE_AVR_FLASH || opcode == CMD_RD_AVR_EEPROM || opcode == CMD_WR_AVR_EEPROM ||
+		opcode == CMD_RD_AVR_SRAM || (opcode == CMD_PLAY_XSVF && (flags & FRAME_XSVF_TARGET));
+}
+
+// Walk the chain again, streaming the IDCODEs to the host
+//
+void doStreamChain(void) {
+	jtagDrive();
+	jtagWalkChain(1);
+	PORTB = 0x00;
+	DDRB = 0x00;
+}
+
+uint32 doReadFuses(void) {
+	uint32 fuses;
+	jtagDrive();
+	jtagReset();           // Now in Test-Logic-Reset
+	avrResetEnable(1);
+	avrProgModeEnable(1);
+	fuses = avrReadFuses();
+	avrProgModeEnable(0);
+	avrResetEnable(0);
+	PORTB = 0x00;
+	DDRB = 0x00;
+	return fuses;
+}
+
+void doWriteFuses(uint32 fuses) {
+	jtagDrive();
+	jtagReset();           // Now in Test-Logic-Reset
+	avrResetEnable(1);
+	avrProgModeEnable(1);
+	avrWriteFuses(fuses);
+	avrProgModeEnable(0);
+	avrResetEnable(0);
+	PORTB = 0x00;
+	DDRB = 0x00;
+}
+
+// Long operations run as jobs. The request handlers only start them, and the
+// main loop advances them a step (at most one USB packet of data) at a time,
+// so USB_USBTask() keeps servicing the control endpoint in between:
+// CMD_STATUS reports progress and CMD_CANCEL stops the JTAG work. A step never
+// waits for the host to send or fetch a packet, so a host which stops part
+// way through a transfer leaves the firmware waiting but still answering. A cancelled
+// job still consumes or produces the rest of its data stream, without
+// touching the chain, so the host and firmware stay in step.
+//
+typedef enum {
+	JOB_IDLE = 0,
+	JOB_READ_FLASH,
+	JOB_WRITE_FLASH,
+	JOB_ERASE_FLASH,
+	JOB_PLAY_XSVF,
+	JOB_READ_EEPROM,
+	JOB_WRITE_EEPROM,
+	JOB_READ_SRAM,
+	JOB_CFG_SPARTAN3,
+	JOB_PROG_XCF,
+	JOB_EXTEST,
+	JOB_SAMPLE_BSCAN
+} JobType;
+
+static struct {
+	uint8 type;             // a JobType
+	uint8 cancel;           // set by CMD_CANCEL
+	uint8 framed;           // respond to request in-band when done
+	uint8 parseStatus;      // XSVF playback, or the FRAME_* status of a configuration
+	FrameHeader request;
+	uint16 page;
+	uint32 done;            // bytes processed so far
+	uint32 total;
+} m_job;
+static uint8 m_lastSeq;     // the last framed request taken up
+
+static void frameRespond(const FrameHeader *request, uint8 status, uint32 length);
+
+// Drive the JTAG lines and put the AVR in programming mode
+//
+static void avrSessionBegin(void) {
+	jtagDrive();
+	jtagReset();           // Now in Test-Logic-Reset
+	avrResetEnable(1);
+	avrProgModeEnable(1);
+}
+
+static void avrSessionEnd(void) {
+	avrProgModeEnable(0);
+	avrResetEnable(0);
+	PORTB = 0x00;
+	DDRB = 0x00;
+}
+
+// Whether a flash transfer of count bytes from page zero is a whole number of
+// pages, and no more than the flash holds
+//
+static uint8 flashCountValid(uint32 count) {
+	return count && count % m_pageSize == 0 && count / m_pageSize <= m_numPages;
+}
+
+// Start a job; request is the framed request which asked for it, or NULL for
+// a control request
+//
+void jobStart(JobType type, uint32 total, const FrameHeader *request) {
+	m_job.type = type;
+	m_job.cancel = 0;
+	m_job.framed = request ? 1 : 0;
+	if ( request ) {
+		m_job.request = *request;
+	}
+	m_job.parseStatus = PARSE_SUCCESS;
+	m_job.page = 0;
+	m_job.done = 0;
+	m_checkpoint = 0;
+	m_job.total = total;
+	m_status = FRAME_BUSY;
+	switch ( type ) {
+		case JOB_PLAY_XSVF:
+			jtagDrive();
+			debugEvent(DBG_XSVF_BEGIN, total);
+			m_failures = 0;
+			#ifdef DUAL_CHAIN
+				m_failuresB = 0;
+			#endif
+			m_xsvfVectors = 0;
+			m_xsvfFailures.count = 0;
+			m_endIR = TAPSTATE_RUN_TEST_IDLE;
+			m_endDR = TAPSTATE_RUN_TEST_IDLE;
+			m_xsvfIrAfter = m_xsvfIrBefore = 0;
+			m_xsvfDrAfter = m_xsvfDrBefore = 0;
+			if ( request && (request->flags & FRAME_XSVF_TARGET) ) {
+				const uint8 device = (uint8)request->param;  // checked by frameTask()
+				uint8 i;
+				for ( i = device + 1; i < m_numDevices; i++ ) {
+					m_xsvfIrAfter += m_irLens[i];
 				}
-				Endpoint_ClearIN();
-				avrProgModeEnable(0);
-				avrResetEnable(0);
-				PORTB = 0x00;
-				DDRB = 0x00;
+				m_xsvfIrBefore = m_irBits - m_xsvfIrAfter - m_irLens[device];
+				m_xsvfDrAfter = m_numDevices - 1 - device;
+				m_xsvfDrBefore = device;
+			}
+			parseInit();
+			jtagReset();
+			jtagGotoState(TAPSTATE_RUN_TEST_IDLE);
+			break;
+		case JOB_READ_SRAM:
+			jtagDrive();
+			jtagReset();       // Test-Logic-Reset leaves the core running
+			ocdBegin();
+			break;
+		case JOB_CFG_SPARTAN3: {
+			const uint8 device = (uint8)request->param;  // checked by frameTask()
+			uint8 polls;
+			jtagDrive();
+			jtagReset();       // Now in Test-Logic-Reset
+			jtagWriteInstructionTo(device, INS_S3_JPROGRAM);
+			m_job.parseStatus = FRAME_CFG_NO_INIT;
+			for ( polls = 0; polls < S3_INIT_POLLS; polls++ ) {
+				jtagRunTest(100);
+				if ( jtagWriteInstructionTo(device, INS_S3_CFG_IN) & S3_IR_INIT ) {
+					m_job.parseStatus = FRAME_SUCCESS;
+					jtagGotoState(TAPSTATE_SHIFT_DR);  // left open for the whole bitstream
+					break;
+				}
+			}
+			break;
+		}
+		case JOB_PROG_XCF: {
+			const uint8 device = (uint8)request->param;  // checked by frameTask()
+			m_failures = 0;
+			jtagDrive();
+			jtagReset();       // Now in Test-Logic-Reset
+			jtagWriteInstructionTo(device, INS_XCF_ISC_ENABLE);
+			jtagWriteDataTo(device, XCF_ENABLE_KEY, 8);
+			jtagRunTest(XCF_TOGGLE_US);
+			jtagWriteInstructionTo(device, INS_XCF_ISC_ERASE);
+			jtagWriteDataTo(device, XCF_ERASE_ALL, 16);
+			jtagGotoState(TAPSTATE_RUN_TEST_IDLE);  // jobProgramXcfStep() waits the erase out
+			break;
+		}
+		#ifdef EXTEST
+			case JOB_EXTEST:
+				m_extest.pending = 0x00;  // the chain is set up by the first step
+				m_extest.cellBytes = 0;
+				break;
+		#endif
+		case JOB_SAMPLE_BSCAN:
+			jtagDrive();
+			jtagReset();       // Now in Test-Logic-Reset
+			jtagWriteInstructionTo(m_sample.device, m_sample.sample);
+			break;
+		default:
+			avrSessionBegin();
+			break;
+	}
+}
+
+void jobCancel(void) {
+	m_job.cancel = 1;
+}
+
+static void jobFinish(uint8 status) {
+	if ( m_job.type == JOB_PLAY_XSVF ) {
+		PORTB = 0x00;
+		DDRB = 0x00;
+	} else if ( m_job.type == JOB_READ_SRAM ) {
+		ocdEnd();
+		PORTB = 0x00;
+		DDRB = 0x00;
+	} else if ( m_job.type == JOB_CFG_SPARTAN3 || m_job.type == JOB_PROG_XCF || m_job.type == JOB_SAMPLE_BSCAN ) {
+		if ( m_job.type == JOB_PROG_XCF ) {
+			const uint8 device = (uint8)m_job.request.param;
+			jtagWriteInstructionTo(device, INS_XCF_ISC_DISABLE);
+			jtagRunTest(XCF_TOGGLE_US);
+			jtagWriteInstructionTo(device, INS_XCF_BYPASS);
+		}
+		jtagReset();           // Now in Test-Logic-Reset, so SAMPLE is released
+		PORTB = 0x00;
+		DDRB = 0x00;
+	} else if ( m_job.type != JOB_EXTEST ) {  // whose pins may stay driven for the next request
+		avrSessionEnd();
+	}
+	if ( m_job.type == JOB_WRITE_FLASH || m_job.type == JOB_PLAY_XSVF || m_job.type == JOB_WRITE_EEPROM ||
+	     m_job.type == JOB_CFG_SPARTAN3 || m_job.type == JOB_PROG_XCF || m_job.type == JOB_EXTEST )
+	{
+		Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+		Endpoint_ClearOUT();
+	}
+	if ( m_job.type == JOB_READ_FLASH || m_job.type == JOB_READ_EEPROM || m_job.type == JOB_READ_SRAM ||
+	     m_job.type == JOB_EXTEST || m_job.type == JOB_SAMPLE_BSCAN )
+	{
+		Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);  // the response header went first
+		Endpoint_ClearIN();
+	} else if ( m_job.framed ) {
+		frameRespond(&m_job.request, status, 0);
+		Endpoint_ClearIN();
+	}
+	m_status = status;
+	m_job.type = JOB_IDLE;
+}
+
+// Room for a job step in the endpoint banks. A step moves no more than the
+// current bank holds (or has room for), so it never waits on the host: with
+// nothing to move it returns, and the job picks up from m_job.done on a later
+// pass of the main loop, with the control endpoint serviced in between. A
+// bank the last step emptied (or filled) is handed back first; as with the
+// LUFA streams, the last bank of a transfer is left to jobFinish().
+//
+static uint8 endpointReadable(void) {
+	Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+	if ( Endpoint_IsOUTReceived() && !Endpoint_IsReadWriteAllowed() ) {
+		Endpoint_ClearOUT();
+	}
+	return Endpoint_IsOUTReceived() ? (uint8)Endpoint_BytesInEndpoint() : 0;
+}
+
+static uint8 endpointWritable(void) {
+	Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+	if ( Endpoint_IsINReady() && !Endpoint_IsReadWriteAllowed() ) {
+		Endpoint_ClearIN();
+	}
+	return Endpoint_IsINReady() ? (uint8)(ENDPOINT_SIZE - Endpoint_BytesInEndpoint()) : 0;
+}
+
+// The most a job step may move: what the bank allows, but no more than limit
+//
+static uint8 stepBytes(uint8 allowed, uint32 limit) {
+	return (limit < allowed) ? (uint8)limit : allowed;
+}
+
+// Shift numBytes bytes from the OUT endpoint bank straight into Shift-DR; if
+// last is set the last bit goes to Exit1-DR, else the TAP stays in Shift-DR
+//
+static void jtagShiftFromEndpoint(uint8 numBytes, uint8 last) {
+	if ( last ) {
+		numBytes--;
+	}
+	while ( numBytes-- ) {
+		jtagExchangeData(Endpoint_Read_Byte());       // Stay in Shift-DR
+	}
+	if ( last ) {
+		jtagExchangeDataEnd(Endpoint_Read_Byte());    // Now in Exit1-DR
+	}
+}
+
+// Shift numBytes bytes out of Shift-DR straight into the IN endpoint bank;
+// if last is set the last bit goes to Exit1-DR, else the TAP stays in Shift-DR
+//
+static void jtagShiftToEndpoint(uint8 numBytes, uint8 last) {
+	if ( last ) {
+		numBytes--;
+	}
+	while ( numBytes-- ) {
+		Endpoint_Write_Byte(jtagExchangeData(0x00));  // Stay in Shift-DR
+	}
+	if ( last ) {
+		Endpoint_Write_Byte(jtagExchangeDataEnd(0x00)); // Now in Exit1-DR
+	}
+}
+
+// Send the next stretch of flash to the host on the IN endpoint. The whole
+// read is one PROG_PAGEREAD scan, left open in Shift-DR between steps, so the
+// set-up is paid once rather than once per page.
+//
+static void jobReadFlashStep(void) {
+	const uint8 count = stepBytes(endpointWritable(), m_job.total - m_job.done);
+	uint8 i;
+	if ( !count ) {
+		return;
+	}
+	if ( m_job.cancel ) {
+		if ( m_tapState == TAPSTATE_SHIFT_DR ) {
+			jtagGotoState(TAPSTATE_UPDATE_DR);
+		}
+		for ( i = 0; i < count; i++ ) {
+			Endpoint_Write_Byte(0xFF);
+		}
+	} else {
+		const uint8 last = (m_job.done + count == m_job.total);
+		if ( m_job.done == 0 ) {
+			avrReadFlashBegin(0);
+		}
+		jtagShiftToEndpoint(count, last);
+		if ( last ) {
+			jtagEndScan(TAPSTATE_UPDATE_DR);
+		}
+	}
+	m_job.done += count;
+}
+
+// Load the next stretch of the page being written, read from the host on the
+// OUT endpoint, and write the page once it is all loaded. A page is one
+// PROG_PAGELOAD scan, left open in Shift-DR between steps; a cancel abandons
+// it part-loaded, so it is never written.
+//
+static void jobWriteFlashStep(void) {
+	const uint16 offset = (uint16)(m_job.done % m_pageSize);
+	const uint8 count = stepBytes(endpointReadable(), m_pageSize - offset);
+	const uint8 last = (offset + count == m_pageSize);
+	uint8 i;
+	if ( !count ) {
+		return;
+	}
+	if ( m_job.cancel ) {
+		if ( m_tapState == TAPSTATE_SHIFT_DR ) {
+			jtagGotoState(TAPSTATE_UPDATE_DR);
+		}
+		for ( i = 0; i < count; i++ ) {
+			Endpoint_Read_Byte();
+		}
+	} else {
+		if ( offset == 0 ) {
+			avrWriteFlashBegin(m_job.page);
+		}
+		jtagShiftFromEndpoint(count, last);
+		if ( last ) {
+			avrWriteFlashEnd();
+			m_checkpoint = (uint32)(m_job.page + 1) * m_pageSize;
+		}
+	}
+	if ( last ) {
+		m_job.page++;
+	}
+	m_job.done += count;
+}
+
+// Read the next stretch of EEPROM, up to the end of the page, and send it to
+// the host on the IN endpoint. EEPROM pages never straddle a 256-byte block,
+// so the high address byte is loaded once for each page.
+//
+static void jobReadEepromStep(void) {
+	const uint16 offset = (uint16)(m_job.done % m_eepromPageSize);
+	const uint16 address = m_job.page * m_eepromPageSize + offset;
+	const uint8 count = stepBytes(endpointWritable(), m_eepromPageSize - offset);
+	uint8 i;
+	if ( !count ) {
+		return;
+	}
+	if ( m_job.cancel ) {
+		for ( i = 0; i < count; i++ ) {
+			Endpoint_Write_Byte(0xFF);
+		}
+	} else {
+		if ( offset == 0 ) {
+			avrReadEepromBegin(address);
+		}
+		for ( i = 0; i < count; i++ ) {
+			Endpoint_Write_Byte(avrReadEepromByte(address + i));
+		}
+	}
+	if ( offset + count == m_eepromPageSize ) {
+		m_job.page++;
+	}
+	m_job.done += count;
+}
+
+// Load the next stretch of an EEPROM page, straight from the OUT endpoint,
+// and write the page once it is all loaded. A page may end part way through
+// a packet, and the rest of the packet waits for the next step.
+//
+static void jobWriteEepromStep(void) {
+	const uint16 offset = (uint16)(m_job.done % m_eepromPageSize);
+	const uint16 address = m_job.page * m_eepromPageSize + offset;
+	const uint8 count = stepBytes(endpointReadable(), m_eepromPageSize - offset);
+	uint8 i;
+	if ( !count ) {
+		return;
+	}
+	if ( m_job.cancel ) {
+		for ( i = 0; i < count; i++ ) {
+			Endpoint_Read_Byte();
+		}
+	} else {
+		if ( offset == 0 ) {
+			avrWriteEepromBegin(address);
+		}
+		for ( i = 0; i < count; i++ ) {
+			avrWriteEepromByte(address + i, Endpoint_Read_Byte());
+		}
+		if ( offset + count == m_eepromPageSize ) {
+			avrWriteEepromEnd();
+		}
+	}
+	if ( offset + count == m_eepromPageSize ) {
+		m_job.page++;
+	}
+	m_job.done += count;
+}
+
+// Dump the next stretch of the AVR's data space to the IN endpoint, through
+// the on-chip debug registers
+//
+static void jobReadSramStep(void) {
+	uint8 count = stepBytes(endpointWritable(), m_job.total - m_job.done);
+	uint16 address = (uint16)m_job.done;
+	m_job.done += count;
+	while ( count-- ) {
+		Endpoint_Write_Byte(m_job.cancel ? 0xFF : ocdReadByte(address++));
+	}
+}
+
+// Capture the boundary-scan register of the device in SAMPLE/PRELOAD, as fast
+// as it can be shifted, and send the snapshot to the host on the IN endpoint.
+// A snapshot is one scan, left open in Shift-DR if it needs another step.
+//
+static void jobSampleStep(void) {
+	const uint16 numBytes = (m_sample.bsrLen + 7) >> 3;
+	const uint16 offset = (uint16)(m_job.done % numBytes);
+	uint8 count = stepBytes(endpointWritable(), numBytes - offset);
+	uint8 last, skip;
+	if ( !count ) {
+		return;
+	}
+	m_job.done += count;
+	if ( m_job.cancel ) {
+		while ( count-- ) {
+			Endpoint_Write_Byte(0xFF);
+		}
+		return;
+	}
+	if ( offset == 0 ) {
+		jtagGotoState(TAPSTATE_SHIFT_DR);  // from Update-xR, skipping Run-Test/Idle
+
+		// Each device between the target and TDO is in BYPASS, and delays the
+		// boundary register by one bit
+		skip = m_numDevices - 1 - m_sample.device;
+		while ( skip ) {
+			jtagClock(0);
+			skip--;
+		}
+	}
+	last = (offset + count == numBytes);
+	if ( last ) {
+		count--;
+	}
+	while ( count-- ) {
+		Endpoint_Write_Byte(jtagExchangeData(0x00));                  // Stay in Shift-DR
+	}
+	if ( last ) {
+		Endpoint_Write_Byte(
+			jtagExchangeData8(0x00, (uint8)(m_sample.bsrLen - 8 * (numBytes - 1))));  // Now in Exit1-DR
+		jtagEndScan(TAPSTATE_UPDATE_DR);
+	}
+}
+
+// Feed what the OUT endpoint bank holds of the XSVF to the player. After a
+// parse error (or a cancel) the rest of the stream is read and thrown away.
+//
+static void jobPlayXsvfStep(void) {
+	uint8 buffer[ENDPOINT_SIZE];
+	const uint8 count = stepBytes(endpointReadable(), m_job.total - m_job.done);
+	if ( !count ) {
+		return;
+	}
+	Endpoint_Read_Stream_LE(buffer, count);
+	if ( m_job.parseStatus == PARSE_SUCCESS && !m_job.cancel ) {
+		m_job.parseStatus = parse(buffer, count);
+	}
+	m_job.done += count;
+}
+
+// Configure a Spartan-3 from the raw bitstream, read from the host on the OUT
+// endpoint: JPROGRAM, wait for INIT, then CFG_IN and the whole bitstream in
+// one Shift-DR, then JSTART and check DONE. jobStart() waits for INIT; each
+// step shifts what the bank holds, and the Shift-DR stays open in between.
+// Bytes go MSB first, as the configuration logic expects.
+//
+static void jobConfigSpartan3Step(void) {
+	const uint8 device = (uint8)m_job.request.param;
+	uint8 count = stepBytes(endpointReadable(), m_job.total - m_job.done);
+	uint8 padding, bit, byte, i;
+	if ( !count ) {
+		return;
+	}
+	m_job.done += count;
+	while ( count-- ) {
+		byte = Endpoint_Read_Byte();
+		if ( m_job.parseStatus != FRAME_SUCCESS || m_job.cancel ) {
+			continue;  // throw the bitstream away
+		}
+		for ( bit = 0; bit < 8; bit++ ) {
+			if ( !count && m_job.done == m_job.total && !device && bit == 7 ) {
+				jtagClock(byte & 0x80 ? TDI|TMS : TMS);  // Now in Exit1-DR
+			} else {
+				jtagClock(byte & 0x80 ? TDI : 0);        // Stay in Shift-DR
+			}
+			byte <<= 1;
+		}
+	}
+	if ( m_job.done < m_job.total || m_job.parseStatus != FRAME_SUCCESS || m_job.cancel ) {
+		return;
+	}
+
+	// Push the tail of the bitstream through the bypassed devices nearer TDI
+	for ( padding = device; padding; ) {
+		jtagClock(--padding ? 0 : TMS);
+	}
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	jtagWriteInstructionTo(device, INS_S3_JSTART);
+	jtagGotoState(TAPSTATE_RUN_TEST_IDLE);
+	for ( i = 0; i < S3_STARTUP_CLOCKS; i++ ) {
+		jtagClock(0);          // Stay in Run-Test/Idle
+	}
+	if ( !(jtagWriteInstructionTo(device, INS_S3_BYPASS) & S3_IR_DONE) ) {
+		m_job.parseStatus = FRAME_CFG_NOT_DONE;
+	}
+}
+
+// Program an XCF0xS PROM, erased by jobStart(). The first steps wait the
+// erase out in slices, so the control endpoint is serviced all the while;
+// after that the steps read each record from the host on the OUT endpoint,
+// and program and verify its row once the record is complete. The row is
+// streamed into the data register as it arrives, the scan left open in
+// Shift-DR between steps, so only its CRC is kept; after programming, the row
+// is read back and its CRC compared on-board. Rows which fail are counted in
+// m_failures.
+//
+static void jobProgramXcfStep(void) {
+	const uint8 device = (uint8)m_job.request.param;
+	uint16 offset, readCrc, i;
+	uint8 count, padding, byte;
+	if ( m_job.page < XCF_ERASE_US / XCF_ERASE_SLICE_US ) {
+		jtagRunTest(XCF_ERASE_SLICE_US);  // an erase cannot be cancelled once begun
+		m_job.page++;
+		return;
+	}
+	offset = (uint16)(m_job.done % sizeof(XcfRecord));
+	count = stepBytes(endpointReadable(), sizeof(XcfRecord) - offset);
+	if ( !count ) {
+		return;
+	}
+	m_job.done += count;
+	if ( m_job.cancel ) {
+		while ( count-- ) {
+			Endpoint_Read_Byte();
+		}
+		return;
+	}
+	for ( ; count; count--, offset++ ) {
+		byte = Endpoint_Read_Byte();
+		if ( offset == 0 ) {
+			m_xcfRow = byte;
+			continue;
+		}
+		if ( offset == 1 ) {
+			m_xcfRow |= (uint16)byte << 8;
+			jtagWriteInstructionTo(device, INS_XCF_ISC_DATA);
+			jtagGotoState(TAPSTATE_SHIFT_DR);
+			m_xcfCrc = 0xFFFF;
+			continue;
+		}
+		m_xcfCrc = _crc_ccitt_update(m_xcfCrc, byte);
+		if ( offset == sizeof(XcfRecord) - 1 && !device ) {
+			jtagExchangeDataEnd(byte);  // Now in Exit1-DR
+		} else {
+			jtagExchangeData(byte);     // Stay in Shift-DR
+		}
+	}
+	if ( offset < sizeof(XcfRecord) ) {
+		return;  // the rest of the row is still to come
+	}
+	for ( padding = device; padding; ) {
+		jtagClock(--padding ? 0 : TMS);  // bypass bits between TDI and the PROM
+	}
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	jtagWriteInstructionTo(device, INS_XCF_ISC_ADDRESS);
+	jtagWriteDataTo(device, m_xcfRow, 16);
+	jtagWriteInstructionTo(device, INS_XCF_ISC_PROGRAM);
+	jtagRunTest(XCF_PROGRAM_US);
+
+	// Read the row back and compare CRCs
+	jtagWriteInstructionTo(device, INS_XCF_ISC_ADDRESS);
+	jtagWriteDataTo(device, m_xcfRow, 16);
+	jtagWriteInstructionTo(device, INS_XCF_XSC_READ);
+	jtagRunTest(XCF_READ_US);
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	for ( padding = m_numDevices - 1 - device; padding; padding-- ) {
+		jtagClock(0);          // bypass bits between the PROM and TDO
+	}
+	readCrc = 0xFFFF;
+	for ( i = 0; i < XCF_ROW_BYTES - 1; i++ ) {
+		readCrc = _crc_ccitt_update(readCrc, jtagExchangeData(0x00));
+	}
+	byte = jtagExchangeDataEnd(0x00);  // Now in Exit1-DR
+	readCrc = _crc_ccitt_update(readCrc, byte);
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	if ( readCrc != m_xcfCrc ) {
+		m_failures++;
+	}
+}
+
+#ifdef EXTEST
+// Pick the read cells out of byte index of what the boundary register
+// captured, readCells[k] into bit k of *reads
+//
+static void extestPick(const ExtestRequest *extest, uint16 index, uint8 captured, uint16 *reads) {
+	uint16 cell;
+	uint8 k;
+	for ( k = 0; k < extest->numReads; k++ ) {
+		cell = extest->readCells[k];
+		if ( (cell >> 3) == index && (captured & (1 << (cell & 7))) ) {
+			*reads |= 1U << k;
+		}
+	}
+}
+
+// Scan m_extestVector into one device's boundary register, with the others
+// in BYPASS, and apply it at Update-DR. If reads is not NULL, the read cells
+// of what the register captured (the pins as the last scan left them) are
+// picked out into it as they go by.
+//
+static void extestScan(const ExtestRequest *extest, uint16 *reads) {
+	const uint16 fullBytes = (extest->bsrLen - 1) >> 3;  // before the last bit's byte
+	uint8 skip = m_numDevices - 1 - extest->device;       // bypass bits before TDO
+	uint8 padding = extest->device;                        // and after TDI
+	uint8 numBits = (uint8)(extest->bsrLen - 8 * fullBytes);
+	uint8 data = m_extestVector[fullBytes];
+	uint8 result = 0x00;
+	uint8 input, bit;
+	uint16 i;
+	if ( reads ) {
+		*reads = 0x0000;
+	}
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	while ( skip ) {
+		jtagClock(0);
+		skip--;
+	}
+	for ( i = 0; i < fullBytes; i++ ) {
+		input = jtagExchangeData(m_extestVector[i]);  // Stay in Shift-DR
+		if ( reads ) {
+			extestPick(extest, i, input, reads);
+		}
+	}
+	for ( bit = 0; bit < numBits; bit++ ) {
+		input = (data & 0x01) ? TDI : 0;
+		if ( !padding && bit == numBits - 1 ) {
+			input |= TMS;                     // Now in Exit1-DR
+		}
+		if ( jtagClock(input) ) {
+			result |= 1 << bit;
+		}
+		data >>= 1;
+	}
+	if ( reads ) {
+		extestPick(extest, fullBytes, result, reads);
+	}
+	while ( padding ) {
+		padding--;
+		jtagClock(padding ? 0 : TMS);       // Now in Exit1-DR, after the last
+	}
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+}
+
+// Check the ExtestRequest which starts the payload of a CMD_EXTEST request,
+// read into m_extest, with bytesRemaining of the payload after it
+//
+static uint8 extestCheck(const FrameHeader *request, uint32 bytesRemaining) {
+	const ExtestRequest *extest = &m_extest.request;
+	const uint32 captures = request->param;
+	uint16 bsrBytes;
+	uint8 i;
+	Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+	while ( !Endpoint_IsOUTReceived() );
+	Endpoint_Read_Stream_LE(&m_extest.request, sizeof(ExtestRequest));
+	bsrBytes = (extest->bsrLen + 7) >> 3;
+	if ( extest->device >= m_numDevices || extest->bsrLen == 0 ||
+	     bsrBytes > EXTEST_MAX_BYTES || extest->numReads > EXTEST_MAX_READS ||
+	     (extest->numReads && captures > 8 * EXTEST_MAX_RESULT / extest->numReads) )
+	{
+		return FRAME_BAD_PARAM;
+	}
+	for ( i = 0; i < extest->numReads; i++ ) {
+		if ( extest->readCells[i] >= extest->bsrLen ) {
+			return FRAME_BAD_PARAM;
+		}
+	}
+	return (bytesRemaining < bsrBytes) ? FRAME_BAD_LENGTH : FRAME_SUCCESS;
+}
+
+// Apply the record just read: scan the vector it left, and if it asks for a
+// capture, put the read cells into the IN endpoint bank. The response header
+// and at most EXTEST_MAX_RESULT bytes of result fit in one packet, so the bank
+// always has room.
+//
+static void extestApply(const ExtestRequest *extest) {
+	uint16 reads;
+	uint8 i;
+	if ( m_job.parseStatus != FRAME_SUCCESS || m_job.cancel ) {
+		// Throw the rest away
+	} else if ( !(m_extest.record & EXTEST_CAPTURE) ) {
+		extestScan(extest, NULL);
+	} else if ( !m_job.request.param ) {
+		m_job.parseStatus = FRAME_BAD_LENGTH;
+	} else {
+		extestScan(extest, &reads);
+		m_job.request.param--;
+		Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+		for ( i = 0; i < extest->numReads; i++ ) {
+			if ( reads & (1U << i) ) {
+				m_extest.pending |= 1 << (m_job.page & 7);
+			}
+			if ( (++m_job.page & 7) == 0 ) {
+				Endpoint_Write_Byte(m_extest.pending);
+				m_extest.pending = 0x00;
+			}
+		}
+	}
+}
+
+// Drive a device's pins with the vectors of a CMD_EXTEST request, read from
+// the host on the OUT endpoint as they are scanned: the first vector, then
+// one record per step, or less if the rest of it is still to come. The
+// response went as soon as the request was known to be sound, its length
+// fixed by the number of capturing scans in its param (counted down in
+// m_job.request.param); the read cells of each capturing scan go straight
+// into the IN endpoint, so the captured register is never held. If a record
+// is malformed, or the job is cancelled, the rest of the result is zero and
+// the pins are released.
+//
+static void jobExtestStep(void) {
+	const ExtestRequest *extest = &m_extest.request;
+	const uint16 bsrBytes = (extest->bsrLen + 7) >> 3;
+	uint8 count = stepBytes(endpointReadable(), m_job.total - m_job.done);
+	uint16 cells, i;
+	uint8 byte;
+	while ( count-- ) {
+		byte = Endpoint_Read_Byte();
+		m_job.done++;
+		if ( m_job.done <= bsrBytes ) {
+			m_extestVector[m_job.done - 1] = byte;
+			if ( m_job.done < bsrBytes || m_job.cancel ) {
+				// The rest of the vector is still to come, or the pins are left alone
+			} else if ( m_extestDevice != extest->device ) {
+				jtagDrive();
+				jtagReset();         // Now in Test-Logic-Reset
+				jtagWriteInstructionTo(extest->device, extest->sample);
+				extestScan(extest, NULL);
+				jtagWriteInstructionTo(extest->device, extest->extest);  // the pins are driven now
+				m_extestDevice = extest->device;
+				break;
+			} else {
+				extestScan(extest, NULL);
+				break;
+			}
+		} else if ( m_extest.cellBytes == 0 ) {
+			m_extest.record = byte;
+			cells = byte & ~EXTEST_CAPTURE;
+			if ( m_job.parseStatus == FRAME_SUCCESS && m_job.total - m_job.done < 2U * cells ) {
+				m_job.parseStatus = FRAME_BAD_LENGTH;
+			}
+			if ( cells > (m_job.total - m_job.done) / 2 ) {
+				cells = (uint16)((m_job.total - m_job.done) / 2);
+			}
+			m_extest.cellBytes = (uint8)(2 * cells);
+			if ( !m_extest.cellBytes ) {
+				extestApply(extest);
+				break;
+			}
+		} else if ( --m_extest.cellBytes & 1 ) {
+			m_extest.cell = byte;
+		} else {
+			m_extest.cell |= (uint16)byte << 8;
+			if ( m_extest.cell < extest->bsrLen ) {
+				m_extestVector[m_extest.cell >> 3] ^= 1 << (m_extest.cell & 7);
+			}
+			if ( !m_extest.cellBytes ) {
+				extestApply(extest);
+				break;
+			}
+		}
+	}
+	if ( m_job.done < m_job.total ) {
+		return;
+	}
+
+	// Send the last bits, and make up the length promised if there were fewer
+	// capturing scans
+	Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+	if ( m_job.page & 7 ) {
+		Endpoint_Write_Byte(m_extest.pending);
+	}
+	for ( i = (m_job.page + 7) >> 3; i < m_extest.resultBytes; i++ ) {
+		Endpoint_Write_Byte(0x00);
+	}
+	if ( m_job.parseStatus != FRAME_SUCCESS || m_job.cancel || (extest->flags & EXTEST_RELEASE) ) {
+		jtagReset();             // Now in Test-Logic-Reset, so EXTEST is released
+		PORTB = 0x00;
+		DDRB = 0x00;
+	}
+}
+#endif
+
+// Advance the current job by one step; returns zero if there is none
+//
+uint8 jobTask(void) {
+	switch ( m_job.type ) {
+		case JOB_IDLE:
+			return 0;
+		case JOB_READ_FLASH:
+			jobReadFlashStep();
+			break;
+		case JOB_WRITE_FLASH:
+			jobWriteFlashStep();
+			break;
+		case JOB_ERASE_FLASH:
+			if ( m_job.page == 0 ) {
+				avrChipEraseBegin();  // an erase cannot be cancelled once begun
+				m_job.page = 1;
+			} else if ( avrChipEraseDone() ) {
+				m_job.done = m_job.total;
+			}
+			break;
+		case JOB_PLAY_XSVF:
+			jobPlayXsvfStep();
+			break;
+		case JOB_READ_EEPROM:
+			jobReadEepromStep();
+			break;
+		case JOB_WRITE_EEPROM:
+			jobWriteEepromStep();
+			break;
+		case JOB_READ_SRAM:
+			jobReadSramStep();
+			break;
+		case JOB_CFG_SPARTAN3:
+			jobConfigSpartan3Step();
+			break;
+		case JOB_PROG_XCF:
+			jobProgramXcfStep();
+			break;
+		#ifdef EXTEST
+			case JOB_EXTEST:
+				jobExtestStep();
+				break;
+		#endif
+		case JOB_SAMPLE_BSCAN:
+			jobSampleStep();
+			break;
+	}
+	if ( m_job.done >= m_job.total ) {
+		if ( (m_job.type == JOB_PLAY_XSVF || m_job.type == JOB_CFG_SPARTAN3 || m_job.type == JOB_EXTEST) &&
+		     !m_job.cancel )
+		{
+			jobFinish(m_job.parseStatus);
+		} else {
+			jobFinish(m_job.cancel ? FRAME_CANCELLED : FRAME_SUCCESS);
+		}
+	}
+	return 1;
+}
+
+void jobGetStatus(JobStatus *status) {
+	status->status = m_status;
+	status->failures = m_failures;
+	status->done = m_job.done;
+	status->total = m_job.total;
+	status->seq = m_lastSeq;
+	status->reserved[0] = status->reserved[1] = status->reserved[2] = 0x00;
+	#ifdef DUAL_CHAIN
+		status->failuresB = m_failuresB;
+	#else
+		status->failuresB = 0;
+	#endif
+	status->checkpoint = m_checkpoint;
+}
+
+// Accept the IR lengths of the devices found by the last scan
+//
+uint8 doSetIrLens(const uint8 *irLens, uint8 numDevices) {
+	uint8 i;
+	if ( m_numDevices == 0 || m_numDevices > MAX_CHAIN_DEVICES || m_numDevices != numDevices ) {
+		return 0;
+	}
+	m_irBits = 0;
+	for ( i = 0; i < MAX_CHAIN_DEVICES; i++ ) {
+		m_irLens[i] = (i < numDevices) ? irLens[i] : 0x00;
+		m_irBits += m_irLens[i];
+	}
+	m_irPadding = m_irBits - m_irLens[0];
+	return 1;
+}
+
+// Set the AVR's flash geometry; returns zero if the page size is not a whole
+// number of chunks
+//
+uint8 doSetAvrGeometry(const AvrGeometry *geometry) {
+	if ( geometry->pageSize == 0 || geometry->pageSize % CHUNK_SIZE || geometry->numPages == 0 ||
+	     geometry->eepromPageSize == 0 || 0x100 % geometry->eepromPageSize || geometry->eepromPages == 0 ||
+	     geometry->ocdr >= 0x40 )
+	{
+		return 0;
+	}
+	m_pageSize = geometry->pageSize;
+	m_numPages = geometry->numPages;
+	m_eepromPageSize = geometry->eepromPageSize;
+	m_eepromPages = geometry->eepromPages;
+	m_ocdr = (uint8)geometry->ocdr;
+	memcpy(m_ocdUnreadable, geometry->unreadable, sizeof(m_ocdUnreadable));
+	m_extendedAddress = ((uint32)m_pageSize * m_numPages > 0x20000UL);  // more than 64K words
+	return 1;
+}
+
+#ifdef DUAL_CHAIN
+// Switch dual-chain mode on or off. Before switching it on, shift both chains'
+// IDCODE/BYPASS registers out from Test-Logic-Reset, with a device's worth of
+// our own ones after them, and check that the two chains match bit for bit.
+//
+uint8 doSetDualChain(uint8 enable) {
+	uint16 numBits = 32 * ((uint16)m_numDevices + 1);
+	uint8 status = FRAME_SUCCESS;
+	m_dualChain = 0;
+	if ( !enable ) {
+		return FRAME_SUCCESS;
+	}
+	if ( m_numDevices == 0 ) {
+		return FRAME_BAD_PARAM;  // scan the chain first
+	}
+	m_dualChain = 1;
+	jtagDrive();
+	jtagReset();             // Now in Test-Logic-Reset
+	jtagGotoState(TAPSTATE_SHIFT_DR);
+	while ( --numBits ) {
+		if ( (jtagClock(TDI) ? 1 : 0) != (m_tdoB >> 15) ) {
+			status = FRAME_CHAIN_MISMATCH;
+		}
+	}
+	if ( (jtagClock(TDI|TMS) ? 1 : 0) != (m_tdoB >> 15) ) {  // Now in Exit1-DR
+		status = FRAME_CHAIN_MISMATCH;
+	}
+	jtagEndScan(TAPSTATE_UPDATE_DR);
+	jtagReset();             // Now in Test-Logic-Reset
+	PORTB = 0x00;
+	DDRB = 0x00;
+	if ( status != FRAME_SUCCESS ) {
+		m_dualChain = 0;
+	}
+	return status;
+}
+#endif
+
+// Send a framed response header on the IN endpoint; the caller sends the
+// payload (if any) and then calls Endpoint_ClearIN(), or frameEndVariable().
+//
+static void frameRespond(const FrameHeader *request, uint8 status, uint32 length) {
+	FrameResponse response;
+	response.opcode = request->opcode;
+	response.seq = request->seq;
+	response.status = status;
+	response.reserved = 0x00;
+	response.failures = m_failures;
+	response.length = length;
+	Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+	Endpoint_Write_Stream_LE(&response, sizeof(response));
+}
+
+// Send the last packet of a response whose length the host cannot know in
+// advance. The host asks for the most it could get, and its transfer only
+// ends early at a short packet; so if the response fills its last packet, a
+// zero-length packet follows it.
+//
+static void frameEndVariable(uint32 length) {
+	Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+	Endpoint_ClearIN();
+	if ( (sizeof(FrameResponse) + length) % ENDPOINT_SIZE == 0 ) {
+		while ( !Endpoint_IsINReady() );
+		Endpoint_ClearIN();
+	}
+}
+
+// Throw away the payload of a request which is being rejected
+//
+static void frameDiscard(uint32 length) {
+	uint8 buffer[CHUNK_SIZE];
+	uint8 chunk;
+	Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+	while ( !Endpoint_IsOUTReceived() );
+	while ( length ) {
+		chunk = length > CHUNK_SIZE ? CHUNK_SIZE : (uint8)length;
+		Endpoint_Read_Stream_LE(buffer, chunk);
+		length -= chunk;
+	}
+	Endpoint_ClearOUT();
+}
+
+// Service one framed request, if the host has sent one. Each request header
+// arrives in a packet of its own; any payload follows in the next packets,
+// and the response goes back in-band on the IN endpoint.
+//
+void frameTask(void) {
+	FrameHeader request;
+	uint8 status = FRAME_SUCCESS;
+	Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+	if ( !Endpoint_IsOUTReceived() ) {
+		return;
+	}
+	if ( Endpoint_BytesInEndpoint() != sizeof(request) ) {
+		Endpoint_ClearOUT();  // not a header; drop it and wait for the next
+		return;
+	}
+	Endpoint_Read_Stream_LE(&request, sizeof(request));
+	Endpoint_ClearOUT();
+	m_lastSeq = request.seq;
+
+	if ( m_numDevices == 0 && needsChain(request.opcode, request.flags) ) {
+		if ( request.length ) {
+			frameDiscard(request.length);
+		}
+		frameRespond(&request, FRAME_BAD_PARAM, 0);  // scan the chain first
+		Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+		Endpoint_ClearIN();
+		return;
+	}
+	switch ( request.opcode ) {
+		case CMD_SCAN: {
+			uint32 idCodes[16];
+			m_numDevices = doScan(idCodes);
+			frameRespond(&request, status, sizeof(idCodes));
+			Endpoint_Write_Stream_LE(idCodes, sizeof(idCodes));
+			break;
+		}
+		case CMD_SCAN_CHAIN: {
+			uint16 numDevices, irBits;
+			uint32 irTotal;
+			numDevices = doCountChain(&irBits);
+			if ( numDevices > MAX_SCAN_DEVICES ) {
+				m_numDevices = 0;
+				frameRespond(&request, FRAME_CHAIN_BROKEN, 0);
+				break;
+			}
+			m_numDevices = (numDevices <= MAX_CHAIN_DEVICES) ? (uint8)numDevices : 0;
+			irTotal = irBits;
+			frameRespond(&request, status, sizeof(irTotal) + 4 * (uint32)numDevices);
+			Endpoint_Write_Stream_LE(&irTotal, sizeof(irTotal));
+			doStreamChain();
+			frameEndVariable(sizeof(irTotal) + 4 * (uint32)numDevices);
+			return;
+		}
+		case CMD_SET_IRLENS: {
+			uint8 irLens[MAX_CHAIN_DEVICES];
+			if ( request.length > MAX_CHAIN_DEVICES ) {
+				status = FRAME_BAD_LENGTH;
+				request.length = 0;
+			}
+			if ( request.length ) {
+				Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+				while ( !Endpoint_IsOUTReceived() );
+				Endpoint_Read_Stream_LE(irLens, request.length);
+				Endpoint_ClearOUT();
+			}
+			if ( status == FRAME_SUCCESS && !doSetIrLens(irLens, (uint8)request.length) ) {
+				status = FRAME_BAD_LENGTH;
+			}
+			frameRespond(&request, status, 0);
+			break;
+		}
+		case CMD_RW_AVR_FUSES:
+			if ( request.flags & FRAME_WRITE ) {
+				doWriteFuses(request.param);
+				frameRespond(&request, status, 0);
+			} else {
+				uint32 fuses = doReadFuses();
+				frameRespond(&request, status, 4);
+				Endpoint_Write_Stream_LE(&fuses, 4);
 			}
 			break;
+		case CMD_RD_AVR_FLASH:
+			if ( !flashCountValid(request.param) ) {
+				frameRespond(&request, FRAME_BAD_PARAM, 0);  // must be a whole number of pages
+				break;
+			}
+			frameRespond(&request, status, request.param);
+			jobStart(JOB_READ_FLASH, request.param, &request);
+			return;  // the job sends the data
 		case CMD_WR_AVR_FLASH:
+			if ( request.length == 0 || request.length % m_pageSize || request.param % m_pageSize ||
+			     (request.param + request.length) / m_pageSize > m_numPages )
+			{
+				status = FRAME_BAD_LENGTH;  // must be a whole number of pages
+				if ( request.length ) {
+					frameDiscard(request.length);
+				}
+			} else {
+				jobStart(JOB_WRITE_FLASH, request.length, &request);
+				m_job.page = (uint16)(request.param / m_pageSize);
+				m_checkpoint = request.param;
+				return;  // the job responds when it is done
+			}
+			frameRespond(&request, status, 0);
+			break;
+		case CMD_ERASE_AVR_FLASH:
+			jobStart(JOB_ERASE_FLASH, 1, &request);
+			return;
+		case CMD_RD_AVR_EEPROM:
+			if ( request.param == 0 || request.param % m_eepromPageSize ||
+			     request.param / m_eepromPageSize > m_eepromPages )
+			{
+				frameRespond(&request, FRAME_BAD_PARAM, 0);  // must be a whole number of pages
+				break;
+			}
+			frameRespond(&request, status, request.param);
+			jobStart(JOB_READ_EEPROM, request.param, &request);
+			return;  // the job sends the data
+		case CMD_WR_AVR_EEPROM:
+			if ( request.length == 0 || request.length % m_eepromPageSize || request.param % m_eepromPageSize ||
+			     (request.param + request.length) / m_eepromPageSize > m_eepromPages )
+			{
+				status = FRAME_BAD_LENGTH;  // must be a whole number of pages
+				if ( request.length ) {
+					frameDiscard(request.length);
+				}
+			} else {
+				jobStart(JOB_WRITE_EEPROM, request.length, &request);
+				m_job.page = (uint16)(request.param / m_eepromPageSize);
+				return;  // the job responds when it is done
+			}
+			frameRespond(&request, status, 0);
+			break;
+		case CMD_RD_AVR_SRAM:
+			if ( request.param == 0 || request.param > 0x10000UL ) {
+				frameRespond(&request, FRAME_BAD_PARAM, 0);
+				break;
+			}
+			frameRespond(&request, status, request.param);
+			jobStart(JOB_READ_SRAM, request.param, &request);
+			return;  // the job sends the data
+		case CMD_PLAY_XSVF:
+			if ( request.length == 0 ) {
+				frameRespond(&request, FRAME_BAD_LENGTH, 0);
+				break;
+			}
+			if ( (request.flags & FRAME_XSVF_TARGET) && request.param >= m_numDevices ) {
+				frameDiscard(request.length);
+				frameRespond(&request, FRAME_BAD_PARAM, 0);
+				break;
+			}
+			jobStart(JOB_PLAY_XSVF, request.length, &request);
+			return;
+		case CMD_STATUS:
+			frameRespond(&request, (uint8)m_status, 0);
+			break;
+		case CMD_SAMPLE_BSCAN:
+			if ( request.length != sizeof(SampleRequest) ) {
+				frameRespond(&request, FRAME_BAD_LENGTH, 0);
+				break;
+			}
+			Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+			while ( !Endpoint_IsOUTReceived() );
+			Endpoint_Read_Stream_LE(&m_sample, sizeof(SampleRequest));
+			Endpoint_ClearOUT();
+			if ( request.param == 0 || m_sample.device >= m_numDevices || m_sample.bsrLen == 0 ) {
+				frameRespond(&request, FRAME_BAD_PARAM, 0);
+				break;
+			}
+			frameRespond(&request, status, request.param * ((m_sample.bsrLen + 7) >> 3));
+			jobStart(JOB_SAMPLE_BSCAN, request.param * ((m_sample.bsrLen + 7) >> 3), &request);
+			return;  // the job sends the snapshots
+		case CMD_CFG_SPARTAN3:
+			if ( request.length == 0 ) {
+				status = FRAME_BAD_LENGTH;
+			} else if ( request.param >= m_numDevices ) {
+				status = FRAME_BAD_PARAM;
+				frameDiscard(request.length);
+			} else {
+				jobStart(JOB_CFG_SPARTAN3, request.length, &request);
+				return;  // the job responds when it is done
+			}
+			frameRespond(&request, status, 0);
+			break;
+		case CMD_PROG_XCF:
+			if ( request.length == 0 || request.length % sizeof(XcfRecord) ) {
+				status = FRAME_BAD_LENGTH;
+			} else if ( request.param >= m_numDevices ) {
+				status = FRAME_BAD_PARAM;
+				frameDiscard(request.length);
+			} else {
+				jobStart(JOB_PROG_XCF, request.length, &request);
+				return;  // the job responds when it is done
+			}
+			frameRespond(&request, status, 0);
+			break;
+		case CMD_SET_AVR_GEOMETRY: {
+			AvrGeometry geometry;
+			if ( request.length != sizeof(geometry) ) {
+				frameRespond(&request, FRAME_BAD_LENGTH, 0);
+				break;
+			}
+			Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
+			while ( !Endpoint_IsOUTReceived() );
+			Endpoint_Read_Stream_LE(&geometry, sizeof(geometry));
+			Endpoint_ClearOUT();
+			frameRespond(&request, doSetAvrGeometry(&geometry) ? FRAME_SUCCESS : FRAME_BAD_PARAM, 0);
+			break;
+		}
+		#ifdef DUAL_CHAIN
+			case CMD_SET_DUAL_CHAIN:
+				frameRespond(&request, doSetDualChain(request.param ? 1 : 0), 0);
+				break;
+		#endif
+		#ifdef EXTEST
+			case CMD_EXTEST:
+				if ( request.length < sizeof(ExtestRequest) ) {
+					if ( request.length ) {
+						frameDiscard(request.length);
+					}
+					frameRespond(&request, FRAME_BAD_LENGTH, 0);
+					break;
+				}
+				status = extestCheck(&request, request.length - sizeof(ExtestRequest));
+				if ( status != FRAME_SUCCESS ) {
+					frameDiscard(request.length - sizeof(ExtestRequest));
+					frameRespond(&request, status, 0);
+					break;
+				}
+				m_extest.resultBytes =
+					(uint16)((request.param * m_extest.request.numReads + 7) >> 3);
+				frameRespond(&request, status, m_extest.resultBytes);
+				jobStart(JOB_EXTEST, request.length - sizeof(ExtestRequest), &request);
+				return;  // the job sends the result
+		#endif
+		default:
+			frameRespond(&request, FRAME_UNKNOWN_OPCODE, 0);
+			break;
+	}
+	Endpoint_SelectEndpoint(IN_ENDPOINT_ADDR);
+	Endpoint_ClearIN();
+}
+
+void EVENT_USB_Device_UnhandledControlRequest(void) {
+	if ( m_job.type != JOB_IDLE && USB_ControlRequest.bRequest != CMD_STATUS &&
+	     USB_ControlRequest.bRequest != CMD_CANCEL && USB_ControlRequest.bRequest != CMD_CAPTURE )
+	{
+		return;  // stall anything else until the job is done
+	}
+	if ( m_numDevices == 0 && needsChain(USB_ControlRequest.bRequest, 0) ) {
+		return;  // stall it until a scan has found the chain
+	}
+	switch ( USB_ControlRequest.bRequest ) {
+		case CMD_SCAN:
+			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
+				// Read IDCODE, status, failure count
+				uint32 response[16];
+				m_numDevices = doScan(response);
+				Endpoint_ClearSETUP();
+				Endpoint_Write_Control_Stream_LE(response, 64);
+				Endpoint_ClearStatusStage();
+			}
+			break;
+		case CMD_RW_AVR_FUSES:
+			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
+				// Read AVR fuses
+				uint32 response = doReadFuses();
+				Endpoint_ClearSETUP();
+				Endpoint_Write_Control_Stream_LE(&response, 4);
+				Endpoint_ClearStatusStage();
+			} else if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
+				// Write AVR fuses
+				doWriteFuses(((uint32)USB_ControlRequest.wValue << 16) + USB_ControlRequest.wIndex);
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+			}
+			break;
+		case CMD_RD_AVR_FLASH:
 			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
-				// Write AVR flash
-				uint8 buffer[CHUNK_SIZE];
-				uint8 i;
-				uint16 page;
-				uint32 count;
+				// Read AVR flash
+				uint32 count = USB_ControlRequest.wValue;
+				count <<= 16;
+				count += USB_ControlRequest.wIndex;
+				if ( !flashCountValid(count) ) {
+					break;  // stalled: it must be a whole number of pages
+				}
 				Endpoint_ClearSETUP();
 				Endpoint_ClearStatusStage();
-				DDRB = TCK | TMS | TDI;
-				jtagReset();           // Now in Test-Logic-Reset
-				jtagClock(0);          // Now in Run-Test/Idle
-				avrResetEnable(1);
-				avrProgModeEnable(1);
-
-				page = 0;
-				count = USB_ControlRequest.wValue;
+				jobStart(JOB_READ_FLASH, count, NULL);
+			}
+			break;
+		case CMD_WR_AVR_FLASH:
+			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
+				// Write AVR flash
+				uint32 count = USB_ControlRequest.wValue;
 				count <<= 16;
 				count += USB_ControlRequest.wIndex;
-				count >>= 7;  // number of 128-byte pages
-				Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
-				while ( !Endpoint_IsOUTReceived() );
-				while ( count-- ) {
-					Endpoint_Read_Stream_LE(buffer, CHUNK_SIZE);
-					avrWriteFlashBegin(page++);
-					for ( i = 0; i < CHUNK_SIZE; i++ ) {
-						jtagExchangeData(buffer[i]);
-					}
-					Endpoint_Read_Stream_LE(buffer, CHUNK_SIZE);
-					for ( i = 0; i < 63; i++ ) {
-						jtagExchangeData(buffer[i]);
-					}
-					jtagExchangeDataEnd(buffer[63]);
-					avrWriteFlashEnd();
+				if ( !flashCountValid(count) ) {
+					break;  // stalled: it must be a whole number of pages
 				}
-				Endpoint_ClearOUT();
-				avrProgModeEnable(0);
-				avrResetEnable(0);
-				PORTB = 0x00;
-				DDRB = 0x00;
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+				jobStart(JOB_WRITE_FLASH, count, NULL);
 			}
 			break;
 		case CMD_ERASE_AVR_FLASH:
 			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
 				// Erase AVR flash
-				DDRB = TCK | TMS | TDI;
-				jtagReset();           // Now in Test-Logic-Reset
-				jtagClock(0);          // Now in Run-Test/Idle
-				avrResetEnable(1);
-				avrProgModeEnable(1);
-				avrChipErase();
-				avrProgModeEnable(0);
-				avrResetEnable(0);
-				PORTB = 0x00;
-				DDRB = 0x00;
+				jobStart(JOB_ERASE_FLASH, 1, NULL);
 				Endpoint_ClearSETUP();
 				Endpoint_ClearStatusStage();
 			}
 			break;
 		case CMD_PLAY_XSVF:
 			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
-				uint8 buffer[CHUNK_SIZE];
 				uint32 bytesRemaining;
-				ParseStatus parseStatus = PARSE_SUCCESS;
 				Endpoint_ClearSETUP();
 				Endpoint_ClearStatusStage();
-
-				DDRB = TCK | TMS | TDI;
 				bytesRemaining = USB_ControlRequest.wValue;
 				bytesRemaining <<= 16;
 				bytesRemaining |= USB_ControlRequest.wIndex;
-				#ifdef DEBUG
-					usartSendFlashString(PSTR("total = "));
-					usartSendLongHex(bytesRemaining);
-					usartSendByte('\r');
-				#endif
-				m_failures = 0;
-				parseInit();
-				jtagReset();
-				jtagClock(0);        // Now in Run-Test/Idle				
-				
-				Endpoint_SelectEndpoint(OUT_ENDPOINT_ADDR);
-				while ( !Endpoint_IsOUTReceived() );
-				while ( bytesRemaining >= CHUNK_SIZE && parseStatus == PARSE_SUCCESS ) {
-					Endpoint_Read_Stream_LE(buffer, CHUNK_SIZE);
-					parseStatus = parse(buffer, CHUNK_SIZE);
-					bytesRemaining -= CHUNK_SIZE;
-				}
-				if ( parseStatus == PARSE_SUCCESS ) {
-					// If all is well, read the last few bytes (if any)...
-					if ( bytesRemaining ) {
-						Endpoint_Read_Stream_LE(buffer, bytesRemaining);
-						parseStatus = parse(buffer, bytesRemaining);
-					}
-				} else {
-					// An error occurred, throw away the remaining bytes...
-					while ( bytesRemaining >= CHUNK_SIZE ) {
-						Endpoint_Read_Stream_LE(buffer, CHUNK_SIZE);
-						bytesRemaining -= CHUNK_SIZE;
-					}
-					if ( bytesRemaining ) {
-						Endpoint_Read_Stream_LE(buffer, bytesRemaining);
-					}
-				}
-				m_status = parseStatus;
-				Endpoint_ClearOUT();
-				PORTB = 0x00;
-				DDRB = 0x00;
+				jobStart(JOB_PLAY_XSVF, bytesRemaining, NULL);
 			}
 			break;
 		case CMD_STATUS:
-			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
-				uint32 response[2];
-				response[0] = m_status;
-				response[1] = m_failures;
+			if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) &&
+			     USB_ControlRequest.wValue == STATUS_XSVF_FAILURES )
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_Write_Control_Stream_LE(
+					&m_xsvfFailures, XSVF_FAILURES_HEADER + m_xsvfFailures.count * sizeof(XsvfFailure));
+				Endpoint_ClearStatusStage();
+			} else if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
+				JobStatus response;
+				jobGetStatus(&response);
+				Endpoint_ClearSETUP();
+				Endpoint_Write_Control_Stream_LE(&response, sizeof(response));
+				Endpoint_ClearStatusStage();
+			}
+			break;
+		case CMD_CANCEL:
+			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
+				jobCancel();
 				Endpoint_ClearSETUP();
-				Endpoint_Write_Control_Stream_LE(response, 8);
 				Endpoint_ClearStatusStage();
 			}
 			break;
+		#ifdef CAPTURE
+			case CMD_CAPTURE:
+				if ( USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR) ) {
+					Endpoint_ClearSETUP();
+					Endpoint_Write_Control_Stream_LE(&m_capture, CAPTURE_HEADER + (m_capture.cycles + 1) / 2);
+					Endpoint_ClearStatusStage();
+					captureRestart();
+				} else if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
+					Endpoint_ClearSETUP();
+					m_captureOn = USB_ControlRequest.wValue ? 1 : 0;
+					captureRestart();
+					Endpoint_ClearStatusStage();
+				}
+				break;
+		#endif
 		case CMD_SET_IRLENS:
 			if ( USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR) ) {
-				uint8 i;
+				uint8 irLens[16];
 				Endpoint_ClearSETUP();
 				if ( m_numDevices > 0 && m_numDevices <= 16 && m_numDevices == (uint8)USB_ControlRequest.wValue ) {
-					Endpoint_Read_Control_Stream_LE(m_irLens, m_numDevices);
-					for ( i = m_numDevices; i < 16; i++ ) {
-						m_irLens[i] = 0x00;
-					}
+					Endpoint_Read_Control_Stream_LE(irLens, m_numDevices);
+					doSetIrLens(irLens, m_numDevices);
 					Endpoint_ClearStatusStage();
 				}
 			}
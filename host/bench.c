@@ -0,0 +1,448 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "bench.h"
+#include "frame.h"
+#include "image.h"
+#include "timer.h"
+
+#define XSVF_VECTORS 64
+
+typedef enum {
+	BENCH_SCAN = 0,
+	BENCH_ROUNDTRIP,
+	BENCH_FLASH_READ,
+	BENCH_FLASH_WRITE,
+	BENCH_XSVF_BYTES,
+	BENCH_XSVF_VECTORS,
+	BENCH_NUM_METRICS
+} Metric;
+static const char *const metricNames[] = {
+	"scan_latency_us",
+	"roundtrip_latency_us",
+	"flash_read_bytes_per_s",
+	"flash_write_bytes_per_s",
+	"xsvf_bytes_per_s",
+	"xsvf_vectors_per_s"
+};
+
+static uint8 *putLong(uint8 *p, uint32 value) {
+	*p++ = (uint8)(value >> 24);
+	*p++ = (uint8)(value >> 16);
+	*p++ = (uint8)(value >> 8);
+	*p++ = (uint8)value;
+	return p;
+}
+
+// A synthetic XSVF job for the first device: each vector loads IDCODE and
+// checks it against the one found by the chain scan, so it verifies on any
+// recognised part without changing its state.
+//
+static uint8 *makeXsvf(const BenchTarget *target, uint32 *length) {
+	uint8 *xsvf = malloc(13 + XSVF_VECTORS * 12);
+	uint8 *p = xsvf;
+	uint16 i;
+	if ( !xsvf ) {
+		return NULL;
+	}
+	*p++ = 0x07; *p++ = 0x00;                      // XREPEAT 0
+	*p++ = 0x08; p = putLong(p, 32);               // XSDRSIZE 32
+	*p++ = 0x01; p = putLong(p, 0x0FFFFFFF);       // XTDOMASK (ignore the revision)
+	for ( i = 0; i < XSVF_VECTORS; i++ ) {
+		*p++ = 0x02; *p++ = target->irLen;         // XSIR IDCODE
+		*p++ = target->idcodeIns;
+		*p++ = 0x09; p = putLong(p, 0);            // XSDRTDO
+		p = putLong(p, target->idCode);
+	}
+	*p++ = 0x00;                                   // XCOMPLETE
+	*length = (uint32)(p - xsvf);
+	return xsvf;
+}
+
+static double rate(uint32 count, uint64 nanos) {
+	return (double)count * 1e9 / (double)(nanos ? nanos : 1);
+}
+
+static int compareDoubles(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted sample
+//
+static double percentile(const double *sorted, uint32 count, uint32 pct) {
+	uint32 rank = (pct * count + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void writeStats(FILE *file, const char *name, double *samples, uint32 count, bool last) {
+	fprintf(file, "    \"%s\": ", name);
+	if ( count ) {
+		qsort(samples, count, sizeof(double), compareDoubles);
+		fprintf(
+			file, "{\"median\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"min\": %.1f, \"max\": %.1f}",
+			count & 1 ? samples[count/2] : (samples[count/2 - 1] + samples[count/2]) / 2,
+			percentile(samples, count, 90), percentile(samples, count, 99),
+			samples[0], samples[count - 1]);
+	} else {
+		fprintf(file, "null");
+	}
+	fprintf(file, "%s\n", last ? "" : ",");
+}
+
+// The loader benchmark's image: sparse, like a large part's application, its
+// data tables and a bootloader at the top, so the gaps are most of the range
+//
+#define IMAGE_SEGMENTS 3
+#define IMAGE_END      0x400000UL
+static const uint32 imageSegments[IMAGE_SEGMENTS][2] = {
+	{0x000000UL, 0x180000UL},  // address, length
+	{0x200000UL, 0x180000UL},
+	{0x3F0000UL, 0x010000UL}
+};
+
+typedef enum {
+	LOAD_HEX = 0,
+	LOAD_HEX_LIBBUFFER,
+	LOAD_SREC,
+	LOAD_ELF,
+	LOAD_BINARY,
+	LOAD_NUM_METRICS
+} LoadMetric;
+static const char *const loadMetricNames[] = {
+	"hex_bytes_per_s",
+	"hex_libbuffer_bytes_per_s",
+	"srec_bytes_per_s",
+	"elf_bytes_per_s",
+	"bin_bytes_per_s"
+};
+static const char *const loadExtensions[] = {".hex", ".hex", ".srec", ".elf", ".bin"};
+
+static uint8 imageByte(uint32 address) {
+	return (uint8)(address * 7 + (address >> 8));
+}
+
+// Write the image in one format, as the usual tools would: HEX and S-records
+// of 16 and 32 bytes, and an ELF file with one PT_LOAD for each segment
+//
+static void writeImage(FILE *file, LoadMetric format) {
+	uint32 s, address, end, i, base = 0xFFFFFFFFUL;
+	uint8 sum, byte;
+	if ( format == LOAD_ELF ) {
+		uint8 header[52 + 32 * IMAGE_SEGMENTS];
+		uint32 offset = sizeof(header);
+		memset(header, 0, sizeof(header));
+		memcpy(header, "\177ELF\001\001\001", 7);  // 32-bit, little-endian
+		header[16] = 2;                             // ET_EXEC
+		header[18] = 40;                            // EM_ARM
+		header[20] = 1;
+		header[28] = 52;                            // program headers follow
+		header[40] = 52;
+		header[42] = 32;
+		header[44] = IMAGE_SEGMENTS;
+		header[46] = 40;
+		for ( s = 0; s < IMAGE_SEGMENTS; s++ ) {
+			uint8 *const ph = header + 52 + 32 * s;
+			const uint32 fields[8] = {
+				1, offset, imageSegments[s][0], imageSegments[s][0],
+				imageSegments[s][1], imageSegments[s][1], 5, 4};
+			for ( i = 0; i < 32; i++ ) {
+				ph[i] = (uint8)(fields[i / 4] >> (8 * (i % 4)));
+			}
+			offset += imageSegments[s][1];
+		}
+		fwrite(header, 1, sizeof(header), file);
+	}
+	if ( format == LOAD_BINARY ) {
+		for ( address = 0, s = 0; address < IMAGE_END; address++ ) {
+			if ( s < IMAGE_SEGMENTS && address >= imageSegments[s][0] + imageSegments[s][1] ) {
+				s++;
+			}
+			fputc(s < IMAGE_SEGMENTS && address >= imageSegments[s][0] ? imageByte(address) : 0xFF, file);
+		}
+		return;
+	}
+	for ( s = 0; s < IMAGE_SEGMENTS; s++ ) {
+		end = imageSegments[s][0] + imageSegments[s][1];
+		if ( format == LOAD_ELF ) {
+			for ( address = imageSegments[s][0]; address < end; address++ ) {
+				fputc(imageByte(address), file);
+			}
+		} else if ( format == LOAD_SREC ) {
+			for ( address = imageSegments[s][0]; address < end; address += 32 ) {
+				sum = (uint8)(37 + (address >> 24) + (address >> 16) + (address >> 8) + address);
+				fprintf(file, "S325%08lX", (unsigned long)address);
+				for ( i = 0; i < 32; i++ ) {
+					byte = imageByte(address + i);
+					fprintf(file, "%02X", byte);
+					sum += byte;
+				}
+				fprintf(file, "%02X\n", (uint8)~sum);
+			}
+		} else {
+			for ( address = imageSegments[s][0]; address < end; address += 16 ) {
+				if ( (address >> 16) != base ) {
+					base = address >> 16;
+					sum = (uint8)(2 + 4 + (base >> 8) + base);
+					fprintf(file, ":02000004%04lX%02X\n", (unsigned long)base, (uint8)-sum);
+				}
+				sum = (uint8)(16 + (address >> 8) + address);
+				fprintf(file, ":10%04lX00", (unsigned long)(address & 0xFFFF));
+				for ( i = 0; i < 16; i++ ) {
+					byte = imageByte(address + i);
+					fprintf(file, "%02X", byte);
+					sum += byte;
+				}
+				fprintf(file, "%02X\n", (uint8)-sum);
+			}
+		}
+	}
+	if ( format == LOAD_HEX || format == LOAD_HEX_LIBBUFFER ) {
+		fprintf(file, ":00000001FF\n");
+	} else if ( format == LOAD_SREC ) {
+		fprintf(file, "S70500000000FA\n");
+	}
+}
+
+// Time "iterations" loads of a multi-megabyte image in each format, and write
+// the rates (bytes of image data a second) to jsonFile. Each file is written
+// next to jsonFile and removed afterwards. The libbuffer HEX reader, which
+// fills in the gaps, is timed on the same file for comparison.
+//
+int benchImages(uint32 iterations, const char *jsonFile, Buffer *buf) {
+	double *samples[LOAD_NUM_METRICS] = {NULL};
+	uint32 counts[LOAD_NUM_METRICS] = {0};
+	uint32 imageBytes = 0, i, s;
+	char *fileName = malloc(strlen(jsonFile) + 6);
+	uint64 start, elapsed;
+	FILE *file = NULL;
+	Image image;
+	int returnCode = 0, m;
+
+	imageInit(&image);
+	for ( s = 0; s < IMAGE_SEGMENTS; s++ ) {
+		imageBytes += imageSegments[s][1];
+	}
+	for ( m = 0; m < LOAD_NUM_METRICS; m++ ) {
+		samples[m] = malloc(iterations * sizeof(double));
+		if ( !samples[m] ) {
+			fprintf(stderr, "Cannot allocate benchmark samples\n");
+			returnCode = 1;
+			goto cleanup;
+		}
+	}
+	if ( !fileName ) {
+		returnCode = 1;
+		goto cleanup;
+	}
+
+	printf("Loading a %lu-byte image %lu times in each format...\n", imageBytes, iterations);
+	for ( m = 0; m < LOAD_NUM_METRICS; m++ ) {
+		sprintf(fileName, "%s%s", jsonFile, loadExtensions[m]);
+		file = fopen(fileName, "wb");
+		if ( !file ) {
+			fprintf(stderr, "Cannot write %s\n", fileName);
+			returnCode = 2;
+			goto cleanup;
+		}
+		writeImage(file, (LoadMetric)m);
+		fclose(file);
+		file = NULL;
+		for ( i = 0; i < iterations; i++ ) {
+			start = timerNanos();
+			if ( m == LOAD_HEX_LIBBUFFER ) {
+				bufZeroLength(buf);
+				returnCode = bufReadFromIntelHexFile(buf, NULL, fileName) ? 3 : 0;
+			} else {
+				returnCode = imageLoad(&image, fileName) ? 3 : 0;
+			}
+			elapsed = timerNanos() - start;
+			if ( returnCode ) {
+				fprintf(stderr, "Cannot load %s: %s\n", fileName,
+					m == LOAD_HEX_LIBBUFFER ? bufStrError() : imageStrError());
+				remove(fileName);
+				goto cleanup;
+			}
+			if ( m != LOAD_HEX_LIBBUFFER && image.length != (m == LOAD_BINARY ? IMAGE_END : imageBytes) ) {
+				fprintf(stderr, "%s loaded as %lu bytes\n", fileName, image.length);
+				returnCode = 4;
+				remove(fileName);
+				goto cleanup;
+			}
+			samples[m][counts[m]++] = rate(m == LOAD_BINARY ? IMAGE_END : imageBytes, elapsed);
+		}
+		remove(fileName);
+	}
+
+	file = fopen(jsonFile, "w");
+	if ( !file ) {
+		fprintf(stderr, "Cannot write %s\n", jsonFile);
+		returnCode = 5;
+		goto cleanup;
+	}
+	fprintf(file, "{\n  \"iterations\": %lu,\n  \"image_bytes\": %lu,\n", iterations, imageBytes);
+	fprintf(file, "  \"results\": {\n");
+	for ( m = 0; m < LOAD_NUM_METRICS; m++ ) {
+		writeStats(file, loadMetricNames[m], samples[m], counts[m], m == LOAD_NUM_METRICS - 1);
+	}
+	fprintf(file, "  }\n}\n");
+	fclose(file);
+	printf("Wrote loader benchmark results to %s\n", jsonFile);
+
+cleanup:
+	imageDestroy(&image);
+	free(fileName);
+	for ( m = 0; m < LOAD_NUM_METRICS; m++ ) {
+		free(samples[m]);
+	}
+	return returnCode;
+}
+
+// Time "iterations" repetitions of each operation and write the medians and
+// percentiles to jsonFile. The flash benchmarks are skipped (reported as null)
+// if the first device is not an AVR. The write benchmark writes back the
+// image it read, so the part is left unchanged. Each iteration still costs an
+// erase/write cycle of the whole flash, so it runs only if writeFlash is set.
+// A scan clears the firmware's IR lengths, so each one is followed by an
+// untimed CMD_SET_IRLENS.
+//
+int benchRun(
+	UsbDeviceHandle *deviceHandle, const BenchTarget *target, uint32 iterations, bool writeFlash,
+	const char *backend, const char *jsonFile, Buffer *buf)
+{
+	double *samples[BENCH_NUM_METRICS] = {NULL};
+	uint32 counts[BENCH_NUM_METRICS] = {0};
+	uint8 *image = NULL, *xsvf = NULL;
+	uint32 xsvfLength = 0, i;
+	uint64 start, elapsed;
+	FrameResponse response;
+	FILE *file = NULL;
+	uint8 seq;
+	int returnCode = 0, m;
+
+	for ( m = 0; m < BENCH_NUM_METRICS; m++ ) {
+		samples[m] = malloc(iterations * sizeof(double));
+		if ( !samples[m] ) {
+			fprintf(stderr, "Cannot allocate benchmark samples\n");
+			returnCode = 1;
+			goto cleanup;
+		}
+	}
+	xsvf = makeXsvf(target, &xsvfLength);
+	writeFlash = writeFlash && target->flashSize;
+	if ( writeFlash ) {
+		image = malloc(target->flashSize);
+	}
+	if ( !xsvf || (writeFlash && !image) ) {
+		fprintf(stderr, "Cannot allocate benchmark data\n");
+		returnCode = 2;
+		goto cleanup;
+	}
+	if ( writeFlash ) {
+		if ( frameCommand(deviceHandle, CMD_RD_AVR_FLASH, 0, target->flashSize, NULL, 0, buf, target->flashSize) ) {
+			returnCode = 3;
+			goto cleanup;
+		}
+		memcpy(image, buf->data, target->flashSize);
+	}
+
+	printf("Running %lu iterations against the %s backend...\n", iterations, backend);
+	for ( i = 0; i < iterations; i++ ) {
+		start = timerNanos();
+		if ( frameCommandVar(deviceHandle, CMD_SCAN_CHAIN, 0, 0, NULL, 0, buf, 4 * (MAX_SCAN_DEVICES + 1)) ) {
+			returnCode = 4;
+			goto cleanup;
+		}
+		samples[BENCH_SCAN][counts[BENCH_SCAN]++] = (double)(timerNanos() - start) / 1000.0;
+		if ( frameCommand(deviceHandle, CMD_SET_IRLENS, 0, 0, target->irLens, target->numDevices, buf, 0) ) {
+			returnCode = 4;
+			goto cleanup;
+		}
+
+		start = timerNanos();
+		if ( frameWrite(deviceHandle, CMD_STATUS, 0, 0, NULL, 0, &seq) ||
+		     frameRead(deviceHandle, CMD_STATUS, seq, buf, 0, &response) )
+		{
+			returnCode = 5;
+			goto cleanup;
+		}
+		samples[BENCH_ROUNDTRIP][counts[BENCH_ROUNDTRIP]++] = (double)(timerNanos() - start) / 1000.0;
+
+		if ( target->flashSize ) {
+			start = timerNanos();
+			if ( frameCommand(deviceHandle, CMD_RD_AVR_FLASH, 0, target->flashSize,
+			                  NULL, 0, buf, target->flashSize) )
+			{
+				returnCode = 6;
+				goto cleanup;
+			}
+			elapsed = timerNanos() - start;
+			samples[BENCH_FLASH_READ][counts[BENCH_FLASH_READ]++] = rate(target->flashSize, elapsed);
+		}
+		if ( writeFlash ) {
+			start = timerNanos();
+			if ( frameCommand(deviceHandle, CMD_WR_AVR_FLASH, 0, 0, image, target->flashSize, buf, 0) ) {
+				returnCode = 7;
+				goto cleanup;
+			}
+			elapsed = timerNanos() - start;
+			samples[BENCH_FLASH_WRITE][counts[BENCH_FLASH_WRITE]++] = rate(target->flashSize, elapsed);
+		}
+
+		start = timerNanos();
+		if ( frameWrite(deviceHandle, CMD_PLAY_XSVF, 0, 0, xsvf, xsvfLength, &seq) ||
+		     frameRead(deviceHandle, CMD_PLAY_XSVF, seq, buf, 0, &response) )
+		{
+			returnCode = 8;
+			goto cleanup;
+		}
+		elapsed = timerNanos() - start;
+		if ( response.status || response.failures ) {
+			fprintf(stderr, "XSVF playback returned 0x%02X with %lu failures\n", response.status, response.failures);
+			returnCode = 9;
+			goto cleanup;
+		}
+		samples[BENCH_XSVF_BYTES][counts[BENCH_XSVF_BYTES]++] = rate(xsvfLength, elapsed);
+		samples[BENCH_XSVF_VECTORS][counts[BENCH_XSVF_VECTORS]++] = rate(XSVF_VECTORS, elapsed);
+	}
+
+	file = fopen(jsonFile, "w");
+	if ( !file ) {
+		fprintf(stderr, "Cannot write %s\n", jsonFile);
+		returnCode = 10;
+		goto cleanup;
+	}
+	fprintf(file, "{\n  \"backend\": \"%s\",\n  \"iterations\": %lu,\n", backend, iterations);
+	fprintf(file, "  \"flash_bytes\": %lu,\n  \"xsvf_bytes\": %lu,\n", target->flashSize, xsvfLength);
+	fprintf(file, "  \"results\": {\n");
+	for ( m = 0; m < BENCH_NUM_METRICS; m++ ) {
+		writeStats(file, metricNames[m], samples[m], counts[m], m == BENCH_NUM_METRICS - 1);
+	}
+	fprintf(file, "  }\n}\n");
+	fclose(file);
+	printf("Wrote benchmark results to %s\n", jsonFile);
+
+cleanup:
+	free(xsvf);
+	free(image);
+	for ( m = 0; m < BENCH_NUM_METRICS; m++ ) {
+		free(samples[m]);
+	}
+	return returnCode;
+}
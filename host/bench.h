@@ -0,0 +1,44 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "types.h"
+#include "usbwrap.h"
+#include "buffer.h"
+
+// What the benchmark needs to know about the first device in the chain
+//
+typedef struct {
+	uint32 idCode;     // as read by the chain scan
+	uint8 irLen;
+	uint8 idcodeIns;   // IDCODE instruction
+	uint32 flashSize;  // bytes of AVR flash, or zero if it is not an AVR
+	const uint8 *irLens;  // the whole chain's, sent again after each scan
+	uint8 numDevices;
+} BenchTarget;
+
+int benchRun(
+	UsbDeviceHandle *deviceHandle, const BenchTarget *target, uint32 iterations, bool writeFlash,
+	const char *backend, const char *jsonFile, Buffer *buf);
+
+// Time the image loader on multi-megabyte files in each format; needs no
+// device
+//
+int benchImages(uint32 iterations, const char *jsonFile, Buffer *buf);
+
+#endif
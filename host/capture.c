@@ -0,0 +1,119 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include "capture.h"
+#include "frame.h"
+
+enum {
+	SIG_TCK,
+	SIG_TMS,
+	SIG_TDI,
+	SIG_TDO,
+	SIG_STATE,
+	SIG_LOST,
+	NUM_SIGNALS
+};
+
+static const char *const m_names[NUM_SIGNALS] = {"tck", "tms", "tdi", "tdo", "state", "lost"};
+static const uint8 m_widths[NUM_SIGNALS] = {1, 1, 1, 1, 4, 1};
+
+// The state which follows each TAP state (numbered as in XSTATE): TMS high in
+// the top nibble, TMS low in the bottom one
+//
+static const uint8 m_nextState[16] = {
+	0x01, 0x21, 0x93, 0x54, 0x54, 0x86, 0x76, 0x84,
+	0x21, 0x0A, 0xCB, 0xCB, 0xFD, 0xED, 0xFB, 0x21
+};
+
+static void captureSink(const CaptureBlock *block, void *context) {
+	Capture *capture = (Capture *)context;
+	VcdWriter *vcd = &capture->vcd;
+	uint64 time = capture->time;
+	uint8 state = block->tapState & 0x0F;
+	uint16 cycles = block->cycles;
+	uint16 i;
+	uint8 pins;
+	if ( cycles > 2 * CAPTURE_BYTES ) {
+		cycles = 2 * CAPTURE_BYTES;
+	}
+	if ( cycles ) {
+		vcdChange(vcd, time, SIG_STATE, state);
+		if ( capture->lost ) {
+			vcdChange(vcd, time, SIG_LOST, 0);
+			capture->lost = false;
+		}
+	}
+	for ( i = 0; i < cycles; i++ ) {
+		pins = (i & 1) ? block->data[i >> 1] >> 4 : block->data[i >> 1] & 0x0F;
+		vcdChange(vcd, time, SIG_TCK, 0);
+		vcdChange(vcd, time, SIG_TMS, pins & CAPTURE_TMS);
+		vcdChange(vcd, time, SIG_TDI, pins & CAPTURE_TDI);
+		state = (pins & CAPTURE_TMS) ? m_nextState[state] >> 4 : m_nextState[state] & 0x0F;
+		vcdChange(vcd, time + 1, SIG_TCK, 1);
+		vcdChange(vcd, time + 1, SIG_STATE, state);
+		time += 2;
+		vcdChange(vcd, time, SIG_TDO, pins & CAPTURE_TDO);
+	}
+	if ( block->dropped ) {
+		vcdChange(vcd, time, SIG_LOST, 1);
+		vcdChange(vcd, time, SIG_STATE, VCD_X);
+		vcdChange(vcd, time, SIG_TMS, VCD_X);
+		vcdChange(vcd, time, SIG_TDI, VCD_X);
+		vcdChange(vcd, time, SIG_TDO, VCD_X);
+		time += 2 * (uint64)block->dropped;
+		capture->lost = true;
+	}
+	capture->cycles += cycles;
+	capture->dropped += block->dropped;
+	capture->time = time;
+}
+
+// Open the VCD file and switch capture on; from here on, blocks are drained
+// into the file whenever the host waits on the device
+//
+int captureStart(UsbDeviceHandle *deviceHandle, Capture *capture, const char *vcdFile) {
+	if ( vcdOpen(&capture->vcd, vcdFile, "1 ns", "jtag", m_names, m_widths, NUM_SIGNALS) ) {
+		fprintf(stderr, "Unable to write %s\n", vcdFile);
+		return 1;
+	}
+	capture->time = 0;
+	capture->cycles = 0;
+	capture->dropped = 0;
+	capture->lost = false;
+	vcdChange(&capture->vcd, 0, SIG_LOST, 0);
+	if ( frameCaptureControl(deviceHandle, true) ) {
+		vcdClose(&capture->vcd, 0);
+		return 2;
+	}
+	frameCaptureTo(captureSink, capture);
+	return 0;
+}
+
+// Drain the last block, switch capture off and finish the VCD file
+//
+int captureStop(UsbDeviceHandle *deviceHandle, Capture *capture) {
+	int returnCode = 0;
+	if ( frameCaptureDrain(deviceHandle) ) {
+		returnCode = 1;
+	}
+	frameCaptureTo(NULL, NULL);
+	if ( frameCaptureControl(deviceHandle, false) ) {
+		returnCode = 2;
+	}
+	vcdClose(&capture->vcd, capture->time);
+	return returnCode;
+}
@@ -0,0 +1,40 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "types.h"
+#include "usbwrap.h"
+#include "vcd.h"
+
+// Writes the TCK cycles captured by firmware built with CAPTURE to a VCD
+// file, one time unit to each half cycle. The TAP state is worked out from
+// TMS, starting from the state the firmware gives with each block; cycles the
+// firmware had to drop leave a gap, marked on the "lost" signal.
+//
+typedef struct {
+	VcdWriter vcd;
+	uint64 time;      // in half TCK cycles
+	uint64 cycles;    // captured so far
+	uint64 dropped;   // lost so far
+	bool lost;        // the last block ended in a gap
+} Capture;
+
+int captureStart(UsbDeviceHandle *deviceHandle, Capture *capture, const char *vcdFile);
+int captureStop(UsbDeviceHandle *deviceHandle, Capture *capture);
+
+#endif
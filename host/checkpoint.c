@@ -0,0 +1,178 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "checkpoint.h"
+#include "xsvf.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#endif
+
+// 32-bit FNV-1a
+//
+uint32 checkpointHash(const uint8 *data, uint32 length) {
+	uint32 hash = 2166136261UL;
+	while ( length-- ) {
+		hash ^= *data++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+int checkpointRead(const char *fileName, Checkpoint *checkpoint) {
+	unsigned int opcode;
+	unsigned long size, hash, offset;
+	int count;
+	FILE *file = fopen(fileName, "r");
+	if ( !file ) {
+		return 1;
+	}
+	count = fscanf(file, "nj-checkpoint %x %lu %lx %lu", &opcode, &size, &hash, &offset);
+	fclose(file);
+	if ( count != 4 || offset >= size ) {
+		return 2;
+	}
+	checkpoint->opcode = (uint8)opcode;
+	checkpoint->size = (uint32)size;
+	checkpoint->hash = (uint32)hash;
+	checkpoint->offset = (uint32)offset;
+	return 0;
+}
+
+int checkpointWrite(const char *fileName, const Checkpoint *checkpoint) {
+	FILE *file = fopen(fileName, "w");
+	if ( !file ) {
+		return 1;
+	}
+	fprintf(file, "nj-checkpoint %02X %lu %08lX %lu\n", checkpoint->opcode,
+		(unsigned long)checkpoint->size, (unsigned long)checkpoint->hash, (unsigned long)checkpoint->offset);
+	return fclose(file) ? 2 : 0;
+}
+
+// Walk the program as far as XCOMPLETE, noting (if xsirs is not NULL) the
+// offset of each XSIR record
+//
+static int walk(const uint8 *data, uint32 length, uint32 *xsirs, uint32 *numXsirs) {
+	XsvfReader reader;
+	XsvfReadStatus status;
+	uint32 count = 0;
+	xsvfReaderInit(&reader, data, length);
+	while ( (status = xsvfNext(&reader)) == XSVF_RECORD && data[reader.offset] != XCOMPLETE ) {
+		if ( data[reader.offset] == XSIR ) {
+			if ( xsirs ) {
+				xsirs[count] = reader.offset;
+			}
+			count++;
+		}
+	}
+	if ( status != XSVF_RECORD && status != XSVF_END ) {
+		return 1;
+	}
+	*numXsirs = count;
+	return 0;
+}
+
+// Find the offset of every XSIR record in the program; the caller frees
+// *xsirs. Fails if the program holds records the firmware would not play.
+//
+int xsvfIndex(const uint8 *data, uint32 length, uint32 **xsirs, uint32 *numXsirs) {
+	if ( walk(data, length, NULL, numXsirs) ) {
+		return 1;
+	}
+	*xsirs = malloc(*numXsirs ? *numXsirs * sizeof(uint32) : 1);
+	if ( !*xsirs ) {
+		return 2;
+	}
+	return walk(data, length, *xsirs, numXsirs);
+}
+
+int xsvfFindVector(const uint8 *data, uint32 length, uint32 start, uint32 vector, XsvfVector *found) {
+	XsvfReader reader;
+	uint32 maskBits = 0, count = 0;
+	const uint8 *mask = NULL;
+	found->record = 0;
+	xsvfReaderInit(&reader, data, length);
+	while ( xsvfNext(&reader) == XSVF_RECORD ) {
+		const uint8 *p = data + reader.offset;
+		if ( *p == XCOMPLETE ) {
+			return 2;
+		}
+		if ( *p == XSDRTDO && reader.offset >= start && count++ == vector ) {
+			found->offset = reader.offset;
+			found->bits = reader.sdrBits;
+			found->expected = p + 1 + ((reader.sdrBits + 7) >> 3);
+			found->mask = (mask && maskBits == reader.sdrBits) ? mask : NULL;
+			return 0;
+		} else if ( *p == XTDOMASK ) {
+			mask = p + 1;
+			maskBits = reader.sdrBits;
+		}
+		found->record++;
+	}
+	return (reader.offset < length) ? 1 : 2;
+}
+
+// The firmware starts each playback from Test-Logic-Reset, with its settings
+// at their defaults. To carry on from the XSIR at offset, replay the records
+// which set what was in force there (the TDO mask going in with the XSDRSIZE
+// it was given under), then the rest of the program.
+//
+int xsvfResume(const uint8 *data, uint32 length, uint32 offset, Buffer *program) {
+	static const uint8 settings[] = {XSDRSIZE, XRUNTEST, XREPEAT, XENDIR, XENDDR};
+	const uint8 *latest[XENDDR + 1] = {NULL};
+	const uint8 *maskSize = NULL;
+	uint32 maskBytes = 0, i;
+	XsvfReader reader;
+	XsvfReadStatus status;
+	xsvfReaderInit(&reader, data, offset);
+	while ( (status = xsvfNext(&reader)) == XSVF_RECORD ) {
+		switch ( data[reader.offset] ) {
+			case XSDRSIZE:
+			case XRUNTEST:
+			case XREPEAT:
+			case XENDIR:
+			case XENDDR:
+				latest[data[reader.offset]] = data + reader.offset;
+				break;
+			case XTDOMASK:
+				latest[XTDOMASK] = data + reader.offset;
+				maskSize = latest[XSDRSIZE];
+				maskBytes = (reader.sdrBits + 7) >> 3;
+				break;
+		}
+	}
+	if ( status != XSVF_END ) {
+		return 1;
+	}
+	bufZeroLength(program);
+	if ( latest[XTDOMASK] ) {
+		if ( maskSize && bufAppendBlock(program, maskSize, 5) ) {
+			return 2;
+		}
+		if ( bufAppendBlock(program, latest[XTDOMASK], 1 + maskBytes) ) {
+			return 2;
+		}
+	}
+	for ( i = 0; i < sizeof(settings); i++ ) {
+		const uint8 *record = latest[settings[i]];
+		if ( record && bufAppendBlock(program, record, xsvfRecordLength(record, 5, 0)) ) {
+			return 2;
+		}
+	}
+	return bufAppendBlock(program, data + offset, length - offset) ? 2 : 0;
+}
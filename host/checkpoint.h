@@ -0,0 +1,60 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "types.h"
+#include "buffer.h"
+
+// A checkpoint file records how far a flash write or XSVF playback got, so
+// that running the same command again carries on from there instead of
+// starting over. It holds the size and a hash of the data being loaded, so it
+// is never applied to a different file.
+//
+typedef struct {
+	uint8 opcode;     // CMD_WR_AVR_FLASH or CMD_PLAY_XSVF
+	uint32 size;      // of the flash image or XSVF program
+	uint32 hash;      // of its contents
+	uint32 offset;    // bytes of it which need not be sent again
+} Checkpoint;
+
+uint32 checkpointHash(const uint8 *data, uint32 length);
+int checkpointRead(const char *fileName, Checkpoint *checkpoint);
+int checkpointWrite(const char *fileName, const Checkpoint *checkpoint);
+
+// XSVF playback resumes at an XSIR record. xsvfIndex() finds them all;
+// xsvfResume() builds the program which carries on from the one at offset.
+//
+int xsvfIndex(const uint8 *data, uint32 length, uint32 **xsirs, uint32 *numXsirs);
+int xsvfResume(const uint8 *data, uint32 length, uint32 offset, Buffer *program);
+
+// The firmware numbers the XSDRTDO records it plays; xsvfFindVector() finds
+// the one it calls "vector", counting from the record at start, giving its
+// offset and its record number in the whole program, and what it was
+// compared against.
+//
+typedef struct {
+	uint32 offset;          // of the XSDRTDO record
+	uint32 record;          // its number in the whole program
+	uint32 bits;            // the XSDRSIZE it was played under
+	const uint8 *expected;  // its TDO value, MSB first
+	const uint8 *mask;      // the XTDOMASK in force, or NULL if none (or another size)
+} XsvfVector;
+
+int xsvfFindVector(const uint8 *data, uint32 length, uint32 start, uint32 vector, XsvfVector *found);
+
+#endif
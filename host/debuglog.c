@@ -0,0 +1,106 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "types.h"
+#include "debuglog.h"
+#include "../commands.h"
+
+static void printEvent(FILE *out, uint8 event, uint32 value) {
+	switch ( event ) {
+		case DBG_SYNC:
+			fprintf(out, "sync%s\n", value == DBG_SYNC_VALUE ? "" : " (bad value)");
+			break;
+		case DBG_OVERFLOW:
+			fprintf(out, "overflow: %lu events dropped\n", value);
+			break;
+		case DBG_XSVF_BEGIN:
+			fprintf(out, "XSVF: %lu bytes\n", value);
+			break;
+		case DBG_XSIR:
+			fprintf(out, "XSIR length=%lu ins=0x%02lX\n", value & 0xFF, (value >> 8) & 0xFF);
+			break;
+		case DBG_XSDRTDO:
+			fprintf(out, "XSDRTDO length=%lu tdi=0x%02lX...\n", value & 0xFFFF, value >> 16);
+			break;
+		case DBG_ATTEMPT:
+			fprintf(out, "  attempt %lu\n", value);
+			break;
+		case DBG_TDO_BYTE:
+			fprintf(out, "    received=0x%02lX expected=0x%02lX mask=0x%02lX%s\n",
+				value & 0xFF, (value >> 8) & 0xFF, value >> 16,
+				((value ^ (value >> 8)) & (value >> 16) & 0xFF) ? "  mismatch" : "");
+			break;
+		case DBG_VECTOR_FAILED:
+			fprintf(out, "  failed (%lu so far)\n", value);
+			break;
+		case DBG_VECTOR_OK:
+			fprintf(out, "  success\n");
+			break;
+	}
+}
+
+// Records are decoded from the first sync record onwards. A byte which is not
+// a known event means bytes were lost on the serial line, so skip forward to
+// the next byte that is.
+//
+int debugLogDecode(const char *fileName, FILE *out) {
+	FILE *file = fopen(fileName, "rb");
+	uint8 *data;
+	long size;
+	uint32 pos = 0, skipped = 0, value;
+	if ( !file ) {
+		fprintf(stderr, "Cannot open %s\n", fileName);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if ( !data || fread(data, 1, size, file) != (size_t)size ) {
+		fprintf(stderr, "Cannot read %s\n", fileName);
+		free(data);
+		fclose(file);
+		return 2;
+	}
+	fclose(file);
+	while ( pos + DBG_RECORD_SIZE <= (uint32)size &&
+	        !(data[pos] == DBG_SYNC && data[pos+1] == 0x5A && data[pos+2] == 0xA5 && data[pos+3] == 0x5A) )
+	{
+		pos++;
+	}
+	if ( pos + DBG_RECORD_SIZE > (uint32)size ) {
+		fprintf(stderr, "No sync record in %s\n", fileName);
+		free(data);
+		return 3;
+	}
+	while ( pos + DBG_RECORD_SIZE <= (uint32)size ) {
+		if ( data[pos] < DBG_SYNC || data[pos] > DBG_VECTOR_OK ) {
+			pos++;
+			skipped++;
+			continue;
+		}
+		if ( skipped ) {
+			fprintf(out, "(skipped %lu bytes)\n", skipped);
+			skipped = 0;
+		}
+		value = data[pos+1] | ((uint32)data[pos+2] << 8) | ((uint32)data[pos+3] << 16);
+		printEvent(out, data[pos], value);
+		pos += DBG_RECORD_SIZE;
+	}
+	free(data);
+	return 0;
+}
@@ -0,0 +1,27 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DEBUGLOG_H
+#define DEBUGLOG_H
+
+#include <stdio.h>
+
+// Decode a binary debug trace captured from the firmware's USART (built with
+// DEBUG; see DebugEvent in commands.h) and print one line per event
+//
+int debugLogDecode(const char *fileName, FILE *out);
+
+#endif
@@ -0,0 +1,530 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "estimate.h"
+#include "xsvf.h"
+#include "../commands.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#endif
+
+#define RETRIES          3      // attempts at each XSDRTDO, as in firmware/main.c
+#define PACKET_SIZE      64
+#define PACKET_US        53     // one full-speed bulk packet, as in sim/sim.h
+#define AVR_IR_BITS      4
+#define AVR_COMMAND_BITS 15
+#define AVR_WRITE_US     4500   // flash page write (tWD_FLASH)
+#define AVR_ERASE_US     9000   // chip erase (tWD_ERASE)
+#define SKIP_BLANK       0x80   // an estimateFlash() option: leave out pages of 0xFF
+
+static char m_error[128];
+
+const char *estimateStrError(void) {
+	return m_error;
+}
+
+static int fail(int code, const char *format, uint32 value) {
+	sprintf(m_error, format, (unsigned long)value);
+	return code;
+}
+
+// The TAP state as the firmware tracks it, and the clocks spent so far
+//
+typedef struct {
+	uint8 state;
+	uint64 cycles;
+	uint64 captureAt;  // cycle on which Capture-DR was last entered
+	uint64 updateAt;   // ...and Update-DR
+} Tap;
+
+// As jtagGotoState()
+//
+static void tapGoto(Tap *tap, uint8 state) {
+	uint8 next;
+	while ( tap->state != state ) {
+		next = xsvfTapNext[tap->state];
+		tap->state = (xsvfTapPath[tap->state] & ((uint16)1 << state)) ? next >> 4 : next & 0x0F;
+		tap->cycles++;
+		if ( tap->state == TAP_CAPTURE_DR ) {
+			tap->captureAt = tap->cycles;
+		} else if ( tap->state == TAP_UPDATE_DR ) {
+			tap->updateAt = tap->cycles;
+		}
+	}
+}
+
+// As jtagEndScan(): the last bit shifted has already taken the TAP on to
+// Exit1-xR
+//
+static void tapEndScan(Tap *tap, uint8 state) {
+	tap->state++;
+	tapGoto(tap, state);
+}
+
+static void tapReset(Tap *tap) {
+	tap->cycles += 5;
+	tap->state = TAP_RESET;
+}
+
+// Go to Shift-xR and shift numBits bits, the last of them leaving for Exit1-xR
+//
+static void tapShift(Tap *tap, uint8 shiftState, uint32 numBits) {
+	tapGoto(tap, shiftState);
+	tap->cycles += numBits;
+}
+
+// USB traffic for one framed request and its response
+//
+static void countRequest(Estimate *est, uint32 outBytes) {
+	est->outBytes += sizeof(FrameHeader) + outBytes;
+	est->inBytes += sizeof(FrameResponse);
+	est->packets += 1 + (outBytes + PACKET_SIZE - 1) / PACKET_SIZE;  // the header goes on its own
+	est->packets += 1;
+	est->roundTrips++;
+	est->requests++;
+}
+
+// As xsvfEndScan(): stop in Update-xR, going on to Run-Test/Idle only to wait
+// there, or go on to Pause-xR
+//
+static void xsvfEndScan(Tap *tap, uint8 update, uint8 endState, uint32 idleUs, Estimate *est) {
+	if ( endState == TAP_IDLE ) {
+		tapEndScan(tap, update);
+		if ( idleUs ) {
+			tapGoto(tap, TAP_IDLE);
+			est->waitUs += idleUs;
+		}
+	} else {
+		tapEndScan(tap, endState);
+	}
+}
+
+// Play the program as the firmware's handlers would, making "attempts" goes
+// at each XSDRTDO
+//
+static int xsvfWalk(const uint8 *data, uint32 length, uint8 attempts, Estimate *est) {
+	Tap tap = {TAP_RESET, 0, 0, 0};
+	uint8 endIR = TAP_IDLE, endDR = TAP_IDLE, state, attempt;
+	uint32 idleUs = 0, maskBits = 0, size, sdrBits, value;
+	const uint8 *mask = NULL;
+	const uint8 *p;
+	XsvfReader reader;
+	XsvfReadStatus status;
+
+	// jobStart()
+	tapReset(&tap);
+	tapGoto(&tap, TAP_IDLE);
+
+	xsvfReaderInit(&reader, data, length);
+	while ( (status = xsvfNext(&reader)) == XSVF_RECORD ) {
+		p = data + reader.offset;
+		size = reader.size;
+		sdrBits = reader.sdrBits;
+		switch ( *p ) {
+			case XCOMPLETE:
+				tapGoto(&tap, TAP_IDLE);
+				est->cycles += tap.cycles;
+				return 0;
+			case XTDOMASK:
+				if ( mask && maskBits == sdrBits && !memcmp(mask, p + 1, size - 1) ) {
+					est->redundantBytes += size;
+				}
+				mask = p + 1;
+				maskBits = sdrBits;
+				break;
+			case XSIR:
+				tapShift(&tap, TAP_SHIFT_IR, p[1]);
+				est->shiftCycles += p[1];
+				xsvfEndScan(&tap, TAP_UPDATE_IR, endIR, idleUs, est);
+				break;
+			case XRUNTEST:
+				value = xsvfGetLong(p + 1);
+				if ( value == idleUs ) {
+					est->redundantBytes += size;
+				}
+				idleUs = value;
+				break;
+			case XSDRSIZE:
+				if ( xsvfGetLong(p + 1) == sdrBits ) {
+					est->redundantBytes += size;
+				}
+				break;
+			case XREPEAT:
+				est->redundantBytes += size;  // the firmware always makes RETRIES attempts
+				break;
+			case XSDRTDO:
+				est->vectors++;
+				for ( attempt = 1; attempt < attempts; attempt++ ) {
+					// A failed attempt pauses, goes back through Shift-DR to
+					// Update-DR and waits in Run-Test/Idle
+					tapShift(&tap, TAP_SHIFT_DR, sdrBits);
+					tapEndScan(&tap, TAP_PAUSE_DR);
+					tapGoto(&tap, TAP_SHIFT_DR);
+					tapGoto(&tap, TAP_IDLE);
+					est->waitUs += idleUs;
+				}
+				tapShift(&tap, TAP_SHIFT_DR, sdrBits);
+				xsvfEndScan(&tap, TAP_UPDATE_DR, endDR, idleUs, est);
+				est->shiftCycles += (uint64)attempts * sdrBits;
+				break;
+			case XSTATE:
+				if ( p[1] > TAP_UPDATE_IR ) {
+					return fail(2, "The XSTATE at offset 0x%08lX names no TAP state", reader.offset);
+				}
+				if ( p[1] == TAP_RESET ) {
+					tapReset(&tap);  // always the full five clocks
+				} else {
+					tapGoto(&tap, p[1]);
+				}
+				break;
+			case XENDIR:
+			case XENDDR:
+				if ( p[1] > 1 ) {
+					return fail(2, "The end state at offset 0x%08lX is neither Run-Test/Idle nor Pause", reader.offset);
+				}
+				if ( *p == XENDIR ) {
+					state = p[1] ? TAP_PAUSE_IR : TAP_IDLE;
+					if ( state == endIR ) {
+						est->redundantBytes += size;
+					}
+					endIR = state;
+				} else {
+					state = p[1] ? TAP_PAUSE_DR : TAP_IDLE;
+					if ( state == endDR ) {
+						est->redundantBytes += size;
+					}
+					endDR = state;
+				}
+				break;
+		}
+	}
+	if ( status == XSVF_UNKNOWN ) {
+		return fail(1, "The record at offset 0x%08lX is not one the firmware plays", reader.offset);
+	} else if ( status == XSVF_CUT_SHORT ) {
+		return fail(1, "The record at offset 0x%08lX is cut short", reader.offset);
+	}
+	return fail(1, "The program ends at offset 0x%08lX without XCOMPLETE", reader.offset);
+}
+
+int estimateXsvf(const uint8 *data, uint32 length, Estimate *est) {
+	Estimate worst;
+	memset(est, 0, sizeof(Estimate));
+	memset(&worst, 0, sizeof(Estimate));
+	if ( xsvfWalk(data, length, 1, est) || xsvfWalk(data, length, RETRIES, &worst) ) {
+		return 1;
+	}
+	est->maxCycles = worst.cycles;
+	est->maxWaitUs = worst.waitUs;
+	countRequest(est, length);
+	return 0;
+}
+
+// As jtagWriteInstruction(), for a lone AVR
+//
+static void avrInstruction(Tap *tap) {
+	tapShift(tap, TAP_SHIFT_IR, AVR_IR_BITS);
+	tapEndScan(tap, TAP_UPDATE_IR);
+}
+
+// As avrResetEnable() (one bit), avrProgModeEnable() (16) and avrWriteCommand()
+//
+static void avrScan(Tap *tap, uint32 numBits) {
+	avrInstruction(tap);
+	tapShift(tap, TAP_SHIFT_DR, numBits);
+	tapEndScan(tap, TAP_UPDATE_DR);
+}
+
+// The four commands which start a page write or chip erase, then polls until
+// the AVR is ready. It is busy from the Update-DR of the second command, and
+// each poll sees whether it still is at its Capture-DR.
+//
+static void avrBusy(Tap *tap, uint32 busyUs, const EstimateLink *link, Estimate *est) {
+	uint64 start, before;
+	avrScan(tap, AVR_COMMAND_BITS);
+	avrScan(tap, AVR_COMMAND_BITS);
+	start = tap->updateAt;
+	avrScan(tap, AVR_COMMAND_BITS);
+	avrScan(tap, AVR_COMMAND_BITS);
+	do {
+		before = tap->cycles;
+		avrScan(tap, AVR_COMMAND_BITS);
+		est->pollCycles += tap->cycles - before;
+	} while ( (tap->captureAt - start) * 1000000 < (uint64)busyUs * link->tckHz );
+}
+
+// As avrSessionBegin() and avrSessionEnd(), which bracket every AVR job
+//
+static void avrSessionBegin(Tap *tap) {
+	tapReset(tap);
+	avrScan(tap, 1);
+	avrScan(tap, 16);
+}
+
+static void avrSessionEnd(Tap *tap) {
+	avrScan(tap, 16);
+	avrScan(tap, 1);
+}
+
+// Whether the page holds only 0xFF, where the image gives it at all
+//
+static bool pageBlank(const Image *image, uint32 address, uint32 pageSize) {
+	const Segment *seg;
+	uint32 i, from, to;
+	for ( i = 0; i < image->numSegments; i++ ) {
+		seg = image->segments + i;
+		from = seg->address > address ? seg->address : address;
+		to = seg->address + seg->length < address + pageSize ? seg->address + seg->length : address + pageSize;
+		for ( ; from < to; from++ ) {
+			if ( image->data[seg->offset + from - seg->address] != 0xFF ) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Whether nj writes the page: every page up to the end of a flat image, or
+// those the image gives any bytes of
+//
+static bool pageWritten(const Image *image, uint32 page, uint32 pageSize, uint32 endPage, uint8 options) {
+	if ( page >= endPage ) {
+		return false;
+	}
+	if ( !(options & ESTIMATE_FLAT) && !imageTouches(image, page * pageSize, pageSize) ) {
+		return false;
+	}
+	return !(options & SKIP_BLANK) || !pageBlank(image, page * pageSize, pageSize);
+}
+
+int estimateFlash(
+	const Image *image, uint16 pageSize, uint16 numPages, uint8 options,
+	const EstimateLink *link, Estimate *est)
+{
+	Tap tap = {TAP_RESET, 0, 0, 0};
+	const uint32 endPage = (imageEnd(image) + pageSize - 1) / pageSize;
+	const uint8 addressCommands = ((uint32)pageSize * numPages > 0x20000UL) ? 3 : 2;
+	uint32 page = 0, last, i;
+	memset(est, 0, sizeof(Estimate));
+	if ( endPage > numPages ) {
+		return fail(1, "The image ends at 0x%08lX, beyond the end of the flash", imageEnd(image));
+	}
+	if ( endPage == 0 ) {
+		strcpy(m_error, "The image holds no data");
+		return 2;
+	}
+	if ( options & ESTIMATE_ERASE ) {
+		countRequest(est, 0);
+		avrSessionBegin(&tap);
+		avrBusy(&tap, AVR_ERASE_US, link, est);
+		avrSessionEnd(&tap);
+	}
+
+	// One request for each run of pages written, as nj sends them
+	for ( ; ; ) {
+		while ( page < endPage && !pageWritten(image, page, pageSize, endPage, options) ) {
+			page++;
+		}
+		if ( page == endPage ) {
+			break;
+		}
+		for ( last = page; pageWritten(image, last, pageSize, endPage, options); last++ );
+		countRequest(est, (last - page) * pageSize);
+		avrSessionBegin(&tap);
+		for ( ; page < last; page++ ) {
+			// avrWriteFlashBegin(), the page itself, then avrWriteFlashEnd()
+			for ( i = 0; i <= addressCommands; i++ ) {
+				avrScan(&tap, AVR_COMMAND_BITS);
+			}
+			avrInstruction(&tap);
+			tapShift(&tap, TAP_SHIFT_DR, 8 * (uint32)pageSize);
+			est->shiftCycles += 8 * (uint32)pageSize;
+			tapEndScan(&tap, TAP_UPDATE_DR);
+			avrBusy(&tap, AVR_WRITE_US, link, est);
+			est->vectors++;
+			if ( pageBlank(image, page * pageSize, pageSize) ) {
+				est->blankPages++;
+			}
+		}
+		avrSessionEnd(&tap);
+	}
+	est->cycles = est->maxCycles = tap.cycles;
+	return 0;
+}
+
+uint64 estimateTime(const Estimate *est, const EstimateLink *link, bool worst) {
+	const uint64 cycles = worst ? est->maxCycles : est->cycles;
+	return
+		(cycles * 1000000 + link->tckHz / 2) / link->tckHz +
+		(worst ? est->maxWaitUs : est->waitUs) +
+		(uint64)est->packets * PACKET_US +
+		(uint64)est->roundTrips * link->latencyUs;
+}
+
+// Changes which would shorten the job, with what each would save
+//
+typedef struct {
+	char what[96];
+	uint64 savingUs;
+} Lever;
+
+#define MAX_LEVERS 3
+
+static void printMs(FILE *out, uint64 us) {
+	fprintf(out, "%llu.%02llu ms", (unsigned long long)(us / 1000), (unsigned long long)(us % 1000 / 10));
+}
+
+// The predicted time split into its parts
+//
+static void printTimes(FILE *out, const Estimate *est, const EstimateLink *link) {
+	fprintf(out, "  Lower bound:        ");
+	printMs(out, estimateTime(est, link, false));
+	fprintf(out, ", the predicted time with no retries\n    TCK               ");
+	printMs(out, (est->cycles * 1000000 + link->tckHz / 2) / link->tckHz);
+	if ( est->waitUs ) {
+		fprintf(out, "\n    XRUNTEST waits    ");
+		printMs(out, est->waitUs);
+	}
+	fprintf(out, "\n    USB packets       ");
+	printMs(out, (uint64)est->packets * PACKET_US);
+	fprintf(out, "\n    USB round trips   ");
+	printMs(out, (uint64)est->roundTrips * link->latencyUs);
+	fprintf(out, "\n");
+}
+
+// The levers, the one saving most first
+//
+static void printLevers(FILE *out, Lever *levers, int numLevers, uint64 total) {
+	Lever swap;
+	int i, j;
+	for ( i = 1; i < numLevers; i++ ) {
+		for ( j = i; j > 0 && levers[j].savingUs > levers[j - 1].savingUs; j-- ) {
+			swap = levers[j];
+			levers[j] = levers[j - 1];
+			levers[j - 1] = swap;
+		}
+	}
+	fprintf(out, "What would help most:\n");
+	for ( i = 0; i < numLevers && levers[i].savingUs; i++ ) {
+		fprintf(out, "  %d. %-52s saves ", i + 1, levers[i].what);
+		printMs(out, levers[i].savingUs);
+		fprintf(out, " (%lu%%)\n", (unsigned long)(levers[i].savingUs * 100 / (total ? total : 1)));
+	}
+	if ( i == 0 ) {
+		fprintf(out, "  Nothing this model can see\n");
+	}
+}
+
+static uint64 saving(uint64 before, uint64 after) {
+	return before > after ? before - after : 0;
+}
+
+static int commonLevers(const Estimate *est, const Estimate *fast, const EstimateLink *link, Lever *levers) {
+	const uint64 total = estimateTime(est, link, false);
+	EstimateLink faster = *link;
+	faster.tckHz *= 2;
+	sprintf(levers[0].what, "Double TCK to %lu kHz", (unsigned long)(faster.tckHz / 1000));
+	levers[0].savingUs = saving(total, estimateTime(fast, &faster, false));
+	faster = *link;
+	faster.latencyUs /= 2;
+	sprintf(levers[1].what, "Halve the USB round trip to %lu us", (unsigned long)faster.latencyUs);
+	levers[1].savingUs = saving(total, estimateTime(est, &faster, false));
+	return 2;
+}
+
+int estimateXsvfReport(FILE *out, const uint8 *data, uint32 length, const EstimateLink *link) {
+	Estimate est, trimmed;
+	Lever levers[MAX_LEVERS];
+	int numLevers;
+	if ( estimateXsvf(data, length, &est) ) {
+		return 1;
+	}
+	fprintf(out, "XSVF playback at %lu kHz TCK, %lu us USB round trip:\n",
+		(unsigned long)(link->tckHz / 1000), (unsigned long)link->latencyUs);
+	fprintf(out, "  XSDRTDO vectors:    %lu\n", (unsigned long)est.vectors);
+	fprintf(out, "  TCK cycles:         %llu (%llu shifting bits, %llu moving the TAP)\n",
+		(unsigned long long)est.cycles, (unsigned long long)est.shiftCycles,
+		(unsigned long long)(est.cycles - est.shiftCycles));
+	fprintf(out, "  In XRUNTEST:        %llu us, the time of %llu TCK cycles (TCK is held)\n",
+		(unsigned long long)est.waitUs, (unsigned long long)(est.waitUs * link->tckHz / 1000000));
+	fprintf(out, "  USB:                %lu bytes out, %lu in, %lu packets, %lu round trip(s)\n",
+		(unsigned long)est.outBytes, (unsigned long)est.inBytes,
+		(unsigned long)est.packets, (unsigned long)est.roundTrips);
+	printTimes(out, &est, link);
+	fprintf(out, "  Upper bound:        ");
+	printMs(out, estimateTime(&est, link, true));
+	fprintf(out, ", with every XSDRTDO failing all %d attempts\n", RETRIES);
+	fprintf(out, "                      (%llu TCK cycles, %llu us in XRUNTEST)\n",
+		(unsigned long long)est.maxCycles, (unsigned long long)est.maxWaitUs);
+	numLevers = commonLevers(&est, &est, link, levers);
+	if ( est.redundantBytes ) {
+		trimmed = est;
+		trimmed.packets -=
+			(length + PACKET_SIZE - 1) / PACKET_SIZE -
+			(length - est.redundantBytes + PACKET_SIZE - 1) / PACKET_SIZE;
+		sprintf(levers[numLevers].what, "Drop %lu bytes of records which change nothing",
+			(unsigned long)est.redundantBytes);
+		levers[numLevers++].savingUs = saving(estimateTime(&est, link, false), estimateTime(&trimmed, link, false));
+	}
+	printLevers(out, levers, numLevers, estimateTime(&est, link, false));
+	if ( est.waitUs > estimateTime(&est, link, false) / 2 ) {
+		fprintf(out, "  The XRUNTEST waits are most of the time; they come from the file, so only\n");
+		fprintf(out, "  a file written for shorter waits shortens them\n");
+	}
+	return 0;
+}
+
+int estimateFlashReport(
+	FILE *out, const Image *image, uint16 pageSize, uint16 numPages, uint8 options,
+	const EstimateLink *link)
+{
+	Estimate est, other;
+	EstimateLink faster = *link;
+	Lever levers[MAX_LEVERS];
+	int numLevers;
+	faster.tckHz *= 2;
+	if ( estimateFlash(image, pageSize, numPages, options, link, &est) ||
+	     estimateFlash(image, pageSize, numPages, options, &faster, &other) )
+	{
+		return 1;
+	}
+	fprintf(out, "AVR flash write at %lu kHz TCK, %lu us USB round trip:\n",
+		(unsigned long)(link->tckHz / 1000), (unsigned long)link->latencyUs);
+	fprintf(out, "  Pages written:      %lu of %u bytes, in %lu request(s)%s\n",
+		(unsigned long)est.vectors, pageSize, (unsigned long)est.requests,
+		(options & ESTIMATE_ERASE) ? ", one of them the erase" : "");
+	fprintf(out, "  TCK cycles:         %llu (%llu shifting page data, %llu polling the busy AVR,\n"
+	             "                      %llu on commands and TAP moves)\n",
+		(unsigned long long)est.cycles, (unsigned long long)est.shiftCycles,
+		(unsigned long long)est.pollCycles,
+		(unsigned long long)(est.cycles - est.shiftCycles - est.pollCycles));
+	fprintf(out, "  USB:                %lu bytes out, %lu in, %lu packets, %lu round trip(s)\n",
+		(unsigned long)est.outBytes, (unsigned long)est.inBytes,
+		(unsigned long)est.packets, (unsigned long)est.roundTrips);
+	printTimes(out, &est, link);
+	numLevers = commonLevers(&est, &other, link, levers);
+	if ( est.blankPages && !(options & SKIP_BLANK) &&
+	     !estimateFlash(image, pageSize, numPages, options | SKIP_BLANK, link, &other) )
+	{
+		sprintf(levers[numLevers].what, "Skip the %lu pages of 0xFF%s",
+			(unsigned long)est.blankPages, (options & ESTIMATE_ERASE) ? "" : " (after an erase, -e)");
+		levers[numLevers++].savingUs = saving(estimateTime(&est, link, false), estimateTime(&other, link, false));
+	}
+	printLevers(out, levers, numLevers, estimateTime(&est, link, false));
+	return 0;
+}
@@ -0,0 +1,74 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include <stdio.h>
+#include "types.h"
+#include "image.h"
+
+// What an XSVF playback or AVR flash write will cost, worked out offline by
+// walking the same TAP moves the firmware's handlers make, for a lone device
+// on the framed protocol. XRUNTEST waits are timed by the firmware in
+// Run-Test/Idle without clocking TCK, so they are counted in microseconds.
+//
+typedef struct {
+	uint32 tckHz;      // TCK rate
+	uint32 latencyUs;  // USB round trip, paid once per request
+} EstimateLink;
+
+typedef struct {
+	uint64 cycles;          // TCK cycles, with every XSDRTDO passing first time
+	uint64 maxCycles;       // ...and with every one failing all its attempts
+	uint64 shiftCycles;     // of cycles, those clocking data or instruction bits
+	uint64 pollCycles;      // of cycles, those polling a busy AVR
+	uint64 waitUs;          // XRUNTEST waits in Run-Test/Idle
+	uint64 maxWaitUs;       // ...with every XSDRTDO failing all its attempts
+	uint32 outBytes;        // USB, frame headers and responses included
+	uint32 inBytes;
+	uint32 packets;         // 64-byte full-speed packets
+	uint32 roundTrips;      // transfers the host waits on
+	uint32 requests;        // framed requests sent
+	uint32 vectors;         // XSDRTDO records, or flash pages written
+	uint32 redundantBytes;  // XSVF records which change nothing the firmware uses
+	uint32 blankPages;      // flash pages written which are all 0xFF
+} Estimate;
+
+// Options for estimateFlash(), as nj would write the image
+#define ESTIMATE_FLAT  0x01  // one write from address zero, as with --checkpoint
+#define ESTIMATE_ERASE 0x02  // a chip erase first (-e)
+
+int estimateXsvf(const uint8 *data, uint32 length, Estimate *est);
+int estimateFlash(
+	const Image *image, uint16 pageSize, uint16 numPages, uint8 options,
+	const EstimateLink *link, Estimate *est);
+const char *estimateStrError(void);
+
+// Predicted wall time in microseconds: TCK, waits, packets and round trips
+// one after another, as the firmware does them. With worst set, every
+// XSDRTDO fails all its attempts.
+//
+uint64 estimateTime(const Estimate *est, const EstimateLink *link, bool worst);
+
+// Print the estimate, and the changes which would shorten the job most
+//
+int estimateXsvfReport(FILE *out, const uint8 *data, uint32 length, const EstimateLink *link);
+int estimateFlashReport(
+	FILE *out, const Image *image, uint16 pageSize, uint16 numPages, uint8 options,
+	const EstimateLink *link);
+
+#endif
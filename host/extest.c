@@ -0,0 +1,239 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "extest.h"
+#include "buffer.h"
+#include "frame.h"
+#include "timer.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#endif
+
+// Send a CMD_EXTEST request to the firmware
+//
+typedef struct {
+	UsbDeviceHandle *deviceHandle;
+	Buffer response;
+} Link;
+
+static int extestSend(
+	void *context, const uint8 *payload, uint32 length, uint32 captures, uint8 *result, uint32 resultBytes)
+{
+	Link *link = (Link *)context;
+	if ( frameCommand(link->deviceHandle, CMD_EXTEST, 0, captures, payload, length,
+	                  &link->response, resultBytes) )
+	{
+		return 1;
+	}
+	memcpy(result, link->response.data, resultBytes);
+	return 0;
+}
+
+static bool isBlank(const uint8 *data, uint32 length) {
+	while ( length-- ) {
+		if ( *data++ != 0xFF ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Read a pin map: one "<signal> <cell> [<control cell>]" line for each of cs,
+// sck, mosi and miso, where cell is the signal's output cell (its input cell,
+// for miso). Blank lines and "#" comments are ignored.
+//
+int spiReadPinMap(const char *fileName, uint16 bsrLen, SpiPins *pins) {
+	FILE *file = fopen(fileName, "r");
+	char line[256], name[32];
+	unsigned int cell, control;
+	int lineNum = 0, fields;
+	uint16 *cellPtr, *controlPtr;
+	if ( !file ) {
+		fprintf(stderr, "Cannot open pin map %s\n", fileName);
+		return 1;
+	}
+	pins->cs = pins->sck = pins->mosi = pins->miso = EXTEST_NO_CELL;
+	pins->csCtl = pins->sckCtl = pins->mosiCtl = EXTEST_NO_CELL;
+	while ( fgets(line, sizeof(line), file) ) {
+		char *p = line;
+		lineNum++;
+		while ( *p == ' ' || *p == '\t' ) {
+			p++;
+		}
+		if ( *p == '#' || *p == '\r' || *p == '\n' || *p == '\0' ) {
+			continue;
+		}
+		fields = sscanf(p, "%31s %u %u", name, &cell, &control);
+		controlPtr = NULL;
+		if ( !strcmp(name, "cs") ) {
+			cellPtr = &pins->cs;
+			controlPtr = &pins->csCtl;
+		} else if ( !strcmp(name, "sck") ) {
+			cellPtr = &pins->sck;
+			controlPtr = &pins->sckCtl;
+		} else if ( !strcmp(name, "mosi") ) {
+			cellPtr = &pins->mosi;
+			controlPtr = &pins->mosiCtl;
+		} else if ( !strcmp(name, "miso") ) {
+			cellPtr = &pins->miso;
+		} else {
+			cellPtr = NULL;
+		}
+		if ( !cellPtr || fields < 2 || cell >= bsrLen ||
+		     (fields == 3 && (!controlPtr || control >= bsrLen)) )
+		{
+			fprintf(stderr, "%s:%d: expected \"<cs|sck|mosi|miso> <cell> [<control cell>]\" with cells below %u\n",
+				fileName, lineNum, bsrLen);
+			fclose(file);
+			return 2;
+		}
+		*cellPtr = (uint16)cell;
+		if ( fields == 3 ) {
+			*controlPtr = (uint16)control;
+		}
+	}
+	fclose(file);
+	if ( pins->cs == EXTEST_NO_CELL || pins->sck == EXTEST_NO_CELL ||
+	     pins->mosi == EXTEST_NO_CELL || pins->miso == EXTEST_NO_CELL )
+	{
+		fprintf(stderr, "%s: cs, sck, mosi and miso must all be given\n", fileName);
+		return 3;
+	}
+	return 0;
+}
+
+// Erase the 64 KiB sectors the image touches, program its pages (skipping
+// blank ones) and read the whole image back. The pins start with every cell
+// at one, which leaves the outputs of a Xilinx part undriven, then the SPI
+// signals are enabled, with the flash deselected.
+//
+int spiFlashProgram(
+	UsbDeviceHandle *deviceHandle, const ExtestTarget *target, const SpiPins *pins,
+	const uint8 *image, uint32 length)
+{
+	static const uint8 readId = SPI_READ_ID;
+	static const uint8 writeEnable = SPI_WRITE_ENABLE;
+	SpiBus bus;
+	Link link;
+	uint32 id, address, chunk, i;
+	uint64 startTime = timerMicros();
+	int returnCode = 0;
+
+	link.deviceHandle = deviceHandle;
+	if ( bufInitialise(&link.response, EXTEST_MAX_RESULT, 0x00) != BUF_SUCCESS ) {
+		fprintf(stderr, "Cannot allocate buffer: %s\n", bufStrError());
+		return 1;
+	}
+	if ( spiBusInit(&bus, target, pins, extestSend, &link) ) {
+		returnCode = 1;
+		goto cleanup;
+	}
+
+	if ( spiCommand(&bus, &readId, 1, 3) || spiBusFlush(&bus, 0) ) {
+		returnCode = 2;
+		goto release;
+	}
+	id = ((uint32)spiBusResult(&bus, 0) << 16) | ((uint32)spiBusResult(&bus, 1) << 8) | spiBusResult(&bus, 2);
+	if ( id == 0x000000 || id == 0xFFFFFF ) {
+		fprintf(stderr, "No SPI flash answers on those pins\n");
+		returnCode = 3;
+		goto release;
+	}
+	printf("SPI flash ID 0x%06lX\n", id);
+
+	for ( address = 0; address < length; address += SPI_SECTOR_SIZE ) {
+		chunk = (length - address > SPI_SECTOR_SIZE) ? SPI_SECTOR_SIZE : length - address;
+		if ( isBlank(image + address, chunk) ) {
+			continue;
+		}
+		printf("\rErasing: %3lu%%", (uint32)((uint64)address * 100 / length));
+		fflush(stdout);
+		if ( spiCommand(&bus, &writeEnable, 1, 0) ||
+		     spiAddressed(&bus, SPI_SECTOR_ERASE, address, NULL, 0) || spiFlushAndWait(&bus) )
+		{
+			returnCode = 4;
+			goto release;
+		}
+	}
+	printf("\rErasing: 100%%\n");
+
+	for ( address = 0; address < length; address += SPI_PAGE_SIZE ) {
+		uint8 page[SPI_PAGE_SIZE];
+		chunk = (length - address > SPI_PAGE_SIZE) ? SPI_PAGE_SIZE : length - address;
+		if ( isBlank(image + address, chunk) ) {
+			continue;
+		}
+		memset(page, 0xFF, SPI_PAGE_SIZE);
+		memcpy(page, image + address, chunk);
+		printf("\rProgramming: %3lu%%", (uint32)((uint64)address * 100 / length));
+		fflush(stdout);
+		if ( spiCommand(&bus, &writeEnable, 1, 0) ||
+		     spiAddressed(&bus, SPI_PAGE_PROGRAM, address, page, chunk) || spiFlushAndWait(&bus) )
+		{
+			returnCode = 4;
+			goto release;
+		}
+	}
+	printf("\rProgramming: 100%%\n");
+
+	// One READ command, left selected across requests
+	if ( spiSelect(&bus, 1) || spiByte(&bus, SPI_READ, 0) ||
+	     spiByte(&bus, 0x00, 0) || spiByte(&bus, 0x00, 0) || spiByte(&bus, 0x00, 0) )
+	{
+		returnCode = 5;
+		goto release;
+	}
+	for ( address = 0; address < length; address += chunk ) {
+		chunk = (length - address > SPI_READ_CHUNK) ? SPI_READ_CHUNK : length - address;
+		for ( i = 0; i < chunk; i++ ) {
+			if ( spiByte(&bus, 0x00, 1) ) {
+				returnCode = 5;
+				goto release;
+			}
+		}
+		if ( spiBusFlush(&bus, 0) ) {
+			returnCode = 5;
+			goto release;
+		}
+		for ( i = 0; i < chunk; i++ ) {
+			if ( spiBusResult(&bus, i) != image[address + i] ) {
+				fprintf(stderr, "\nVerify failed at 0x%06lX: read 0x%02X, expected 0x%02X\n",
+					address + i, spiBusResult(&bus, i), image[address + i]);
+				returnCode = 6;
+				goto release;
+			}
+		}
+		if ( !(address & 0xFFF) ) {
+			printf("\rVerifying: %3lu%%", (uint32)((uint64)address * 100 / length));
+			fflush(stdout);
+		}
+	}
+	printf("\rVerifying: 100%%\n");
+	printf("Programmed %lu bytes in %lu scans (%lu ms)\n",
+		length, bus.numScans, (uint32)((timerMicros() - startTime) / 1000));
+
+release:
+	if ( spiBusRelease(&bus) ) {
+		returnCode = returnCode ? returnCode : 7;
+	}
+	spiBusDestroy(&bus);
+cleanup:
+	bufDestroy(&link.response);
+	return returnCode;
+}
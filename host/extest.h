@@ -0,0 +1,33 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EXTEST_H
+#define EXTEST_H
+
+#include "types.h"
+#include "usbwrap.h"
+#include "spibus.h"
+
+// Programs a 25-series SPI flash wired to the pins of a device in the chain,
+// by driving them through the device's boundary register (EXTEST). A pin map
+// names the boundary-scan cells of the four SPI signals.
+//
+int spiReadPinMap(const char *fileName, uint16 bsrLen, SpiPins *pins);
+int spiFlashProgram(
+	UsbDeviceHandle *deviceHandle, const ExtestTarget *target, const SpiPins *pins,
+	const uint8 *image, uint32 length);
+
+#endif
@@ -0,0 +1,475 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "frame.h"
+#include "standin.h"
+#include "session.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef WIN32
+typedef char *WriteDataPtr;
+#pragma warning(disable : 4996)
+#else
+typedef const char *WriteDataPtr;
+#endif
+
+#define TIMEOUT 5000000
+#define POLL_MS 100
+#define WATCH_SLICE 4096
+
+typedef enum {
+	BACKEND_USB,
+	BACKEND_STAND_IN,
+	BACKEND_REPLAY
+} Backend;
+
+static Backend m_backend = BACKEND_USB;
+static volatile sig_atomic_t m_cancel = 0;
+static FrameWatcher m_watcher = NULL;
+static void *m_watchContext;
+static FrameCaptureSink m_captureSink = NULL;
+static void *m_captureContext;
+static const char *m_progress = NULL;  // what the job's progress is shown as
+static uint32 m_shown = 101;           // the percentage shown last
+
+void frameUseStandIn(void) {
+	m_backend = BACKEND_STAND_IN;
+}
+
+// Answer every transfer from the session file given to sessionReplayOpen()
+//
+void frameUseReplay(void) {
+	m_backend = BACKEND_REPLAY;
+}
+
+static const char *backendError(const char *standInError) {
+	switch ( m_backend ) {
+	case BACKEND_STAND_IN:
+		return standInError;
+	case BACKEND_REPLAY:
+		return "not as recorded";
+	default:
+		return usb_strerror();
+	}
+}
+
+// The bulk transfers are traced (if --trace was given) against the command
+// they belong to, whichever backend carries them; and every transfer goes
+// into the session file, if one is being recorded.
+//
+int bulkWrite(UsbDeviceHandle *deviceHandle, CommandByte command, const uint8 *data, uint32 length) {
+	const uint64 start = timerMicros();
+	int returnCode;
+	switch ( m_backend ) {
+	case BACKEND_STAND_IN:
+		returnCode = standInWrite(data, length);
+		break;
+	case BACKEND_REPLAY:
+		returnCode = sessionReplay(SESSION_BULK_OUT, (uint8)command, 0x0000, (uint8 *)data, length);
+		break;
+	default:
+		returnCode = usb_bulk_write(
+			deviceHandle,
+			USB_ENDPOINT_OUT | 2,    // write to endpoint 2
+			(WriteDataPtr)data,      // write from this buffer
+			length,                  // write entire buffer
+			TIMEOUT                  // timeout in milliseconds
+		);
+	}
+	traceTransfer((uint8)command, TRACE_OUT, length, start, timerMicros(), returnCode);
+	sessionRecord(SESSION_BULK_OUT, (uint8)command, 0x0000, data, length, returnCode);
+	if ( returnCode < 0 ) {
+		fprintf(stderr, "usb_bulk_write() failed returnCode %d: %s\n", returnCode,
+			backendError("rejected by stand-in"));
+		return 1;
+	}
+	return 0;
+}
+
+int bulkRead(UsbDeviceHandle *deviceHandle, CommandByte command, uint8 *data, uint32 length) {
+	const uint64 start = timerMicros();
+	int returnCode;
+	switch ( m_backend ) {
+	case BACKEND_STAND_IN:
+		returnCode = standInRead(data, length);
+		break;
+	case BACKEND_REPLAY:
+		returnCode = sessionReplay(SESSION_BULK_IN, (uint8)command, 0x0000, data, length);
+		break;
+	default:
+		returnCode = usb_bulk_read(
+			deviceHandle,
+			USB_ENDPOINT_IN | 1,  // read from endpoint 1
+			(char *)data,         // read into this buffer
+			length,               // read "length" bytes
+			TIMEOUT               // timeout in milliseconds
+		);
+	}
+	traceTransfer((uint8)command, TRACE_IN, length, start, timerMicros(), returnCode);
+	sessionRecord(SESSION_BULK_IN, (uint8)command, 0x0000, data, length, returnCode);
+	if ( returnCode < 0 ) {
+		fprintf(stderr, "usb_bulk_read() failed returnCode %d: %s\n", returnCode,
+			backendError("no response pending in stand-in"));
+		return -1;
+	}
+	if ( m_captureSink ) {
+		frameCaptureDrain(deviceHandle);
+	}
+	return returnCode;
+}
+
+// Have the status of a job passed to watcher each time it is polled. The
+// payloads frameWrite() sends are polled between slices, so the watcher also
+// sees the progress of a job which is still being fed.
+//
+void frameWatchJobs(FrameWatcher watcher, void *context) {
+	m_watcher = watcher;
+	m_watchContext = context;
+}
+
+// Show the progress of the jobs started from now on as "what: nn%", while
+// their payloads are sent and while frameWaitJob() waits for them, or stop
+// showing it if what is NULL. Either way, no cancel is pending.
+//
+void frameShowProgress(const char *what) {
+	m_progress = what;
+	m_shown = 101;
+	m_cancel = 0;
+}
+
+// Poll the firmware's job status. Once the job started by framed request seq
+// is running, a cancel requested with frameRequestCancel() is passed on to it,
+// and its status goes to the watcher and its progress to stdout. *busy is
+// cleared once that job is done.
+//
+static int pollJob(UsbDeviceHandle *deviceHandle, uint8 seq, bool *busy) {
+	JobStatus status;
+	uint32 percent;
+	*busy = true;
+	if ( m_captureSink && frameCaptureDrain(deviceHandle) ) {
+		return 1;
+	}
+	if ( frameJobStatus(deviceHandle, &status) ) {
+		return 1;
+	}
+	if ( status.seq != seq ) {
+		return 0;  // an earlier job is still running
+	}
+	if ( m_cancel == 1 && status.status == FRAME_BUSY ) {
+		m_cancel = 2;
+		printf("\nCancelling...\n");
+		if ( frameJobCancel(deviceHandle) ) {
+			return 1;
+		}
+	}
+	if ( m_watcher ) {
+		m_watcher(&status, m_watchContext);
+	}
+	if ( status.status != FRAME_BUSY ) {
+		*busy = false;
+		return 0;
+	}
+	percent = status.total ? (uint32)((uint64)status.done * 100 / status.total) : 0;
+	if ( m_progress && percent != m_shown ) {
+		printf("\r%s: %3lu%%", m_progress, percent);
+		fflush(stdout);
+		m_shown = percent;
+	}
+	return 0;
+}
+
+// The payload goes in slices, with the job polled between them, so a long
+// one can be watched and cancelled while it is still being sent
+//
+static int writePayload(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 seq,
+                        const uint8 *payload, uint32 length)
+{
+	uint32 slice = (length > WATCH_SLICE) ? WATCH_SLICE : length;
+	bool busy;
+	for ( ; ; ) {
+		if ( bulkWrite(deviceHandle, opcode, payload, slice) ) {
+			return 1;
+		}
+		payload += slice;
+		length -= slice;
+		if ( !length ) {
+			return 0;
+		}
+		if ( pollJob(deviceHandle, seq, &busy) ) {
+			return 1;
+		}
+		if ( slice > length ) {
+			slice = length;
+		}
+	}
+}
+
+// Send a framed request: the header goes in a packet of its own, followed by
+// the payload (if any). Returns the sequence ID to expect in the response, so
+// several requests can be sent before their responses are read back.
+//
+int frameWrite(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+               const uint8 *payload, uint32 length, uint8 *seq)
+{
+	static uint8 nextSeq = 0;
+	FrameHeader request;
+	request.opcode = (uint8)opcode;
+	request.seq = ++nextSeq;
+	request.flags = flags;
+	request.reserved = 0x00;
+	request.param = param;
+	request.length = length;
+	if ( bulkWrite(deviceHandle, opcode, (const uint8 *)&request, sizeof(request)) ) {
+		return 1;
+	}
+	if ( length && writePayload(deviceHandle, opcode, request.seq, payload, length) ) {
+		return 2;
+	}
+	*seq = request.seq;
+	return 0;
+}
+
+// Read the response to a framed request into buf, expecting "length" bytes
+// of payload if the command succeeded, or at most that many if exact is not
+// set. The response header is returned in *response, and the caller decides
+// what to make of its status.
+//
+static int readResponse(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 seq,
+                        Buffer *buf, uint32 length, bool exact, FrameResponse *response)
+{
+	int returnCode;
+	bufZeroLength(buf);
+	if ( bufAppendConst(buf, sizeof(FrameResponse) + length, 0xFF, NULL) ) {
+		fprintf(stderr, "%s\n", bufStrError());
+		return 1;
+	}
+	returnCode = bulkRead(deviceHandle, opcode, buf->data, buf->length);
+	if ( returnCode < 0 ) {
+		return 2;
+	}
+	if ( (uint32)returnCode < sizeof(FrameResponse) ) {
+		fprintf(stderr, "Short response to command 0x%02X\n", opcode);
+		return 3;
+	}
+	memcpy(response, buf->data, sizeof(FrameResponse));
+	if ( response->opcode != (uint8)opcode || response->seq != seq ) {
+		fprintf(stderr, "Expected response to command 0x%02X/%d, got 0x%02X/%d\n",
+			opcode, seq, response->opcode, response->seq);
+		return 4;
+	}
+	if ( response->status == FRAME_SUCCESS && !exact && response->length <= length ) {
+		length = response->length;
+	}
+	if ( response->status == FRAME_SUCCESS &&
+	     (response->length != length || (uint32)returnCode != sizeof(FrameResponse) + length) )
+	{
+		fprintf(stderr, "Command 0x%02X returned %lu bytes; expected %lu\n", opcode, response->length, length);
+		return 5;
+	}
+	memmove(buf->data, buf->data + sizeof(FrameResponse), length);
+	buf->length = length;
+	return 0;
+}
+
+int frameRead(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 seq,
+              Buffer *buf, uint32 length, FrameResponse *response)
+{
+	return readResponse(deviceHandle, opcode, seq, buf, length, true, response);
+}
+
+// Send a framed request and wait for its response
+//
+int frameCommand(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+                 const uint8 *payload, uint32 length, Buffer *buf, uint32 responseLength)
+{
+	FrameResponse response;
+	uint8 seq;
+	if ( frameWrite(deviceHandle, opcode, flags, param, payload, length, &seq) ) {
+		return 1;
+	}
+	if ( frameRead(deviceHandle, opcode, seq, buf, responseLength, &response) ) {
+		return 2;
+	}
+	if ( response.status != FRAME_SUCCESS ) {
+		fprintf(stderr, "Command 0x%02X failed with status 0x%02X\n", opcode, response.status);
+		return 3;
+	}
+	return 0;
+}
+
+// A vendor request on the control endpoint, which is serviced even while a job
+// runs. The stand-in knows only CMD_STATUS (its JobStatus form) and CMD_CANCEL.
+//
+static int controlTransfer(UsbDeviceHandle *deviceHandle, bool in, CommandByte request, uint16 value,
+                           uint8 *data, uint16 length)
+{
+	const SessionKind kind = in ? SESSION_CONTROL_IN : SESSION_CONTROL_OUT;
+	int returnCode;
+	switch ( m_backend ) {
+	case BACKEND_STAND_IN:
+		if ( request == CMD_STATUS && length == sizeof(JobStatus) ) {
+			standInStatus((JobStatus *)data);
+			returnCode = sizeof(JobStatus);
+		} else {
+			returnCode = (request == CMD_CANCEL) ? 0 : -1;
+		}
+		break;
+	case BACKEND_REPLAY:
+		returnCode = sessionReplay(kind, (uint8)request, value, data, length);
+		break;
+	default:
+		returnCode = usb_control_msg(
+			deviceHandle,
+			(in ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT) | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+			request,              // bRequest
+			value,                // wValue
+			0x0000,               // wIndex
+			(char *)data,         // data to send, or space for received data
+			length,               // wLength
+			TIMEOUT               // timeout in milliseconds
+		);
+	}
+	sessionRecord(kind, (uint8)request, value, data, length, returnCode);
+	if ( returnCode < 0 ) {
+		fprintf(stderr, "usb_control_msg() failed returnCode %d: %s\n", returnCode,
+			backendError("not supported by the stand-in"));
+	}
+	return returnCode;
+}
+
+// Read the firmware's job status
+//
+int frameJobStatus(UsbDeviceHandle *deviceHandle, JobStatus *status) {
+	const int returnCode = controlTransfer(
+		deviceHandle, true, CMD_STATUS, 0x0000, (uint8 *)status, sizeof(JobStatus));
+	if ( returnCode >= 0 && returnCode != sizeof(JobStatus) ) {
+		fprintf(stderr, "Job status is %d bytes; expected %d\n", returnCode, (int)sizeof(JobStatus));
+	}
+	return returnCode == sizeof(JobStatus) ? 0 : 1;
+}
+
+// Read what the firmware kept of the vectors which failed in the last XSVF
+// playback
+//
+int frameXsvfFailures(UsbDeviceHandle *deviceHandle, XsvfFailures *failures) {
+	const int returnCode = controlTransfer(
+		deviceHandle, true, CMD_STATUS, STATUS_XSVF_FAILURES, (uint8 *)failures, sizeof(XsvfFailures));
+	if ( returnCode < XSVF_FAILURES_HEADER || failures->count > XSVF_MAX_FAILURES ||
+	     returnCode != XSVF_FAILURES_HEADER + failures->count * (int)sizeof(XsvfFailure) )
+	{
+		return 1;
+	}
+	return 0;
+}
+
+int frameJobCancel(UsbDeviceHandle *deviceHandle) {
+	return controlTransfer(deviceHandle, false, CMD_CANCEL, 0x0000, NULL, 0) < 0 ? 1 : 0;
+}
+
+// Ask for the job being fed or waited for to be cancelled; safe to call from
+// a signal handler
+//
+void frameRequestCancel(void) {
+	m_cancel = 1;
+}
+
+// Wait for the firmware to finish the job started by framed request seq,
+// showing its progress, and passing on a cancel if one is requested. The
+// job's response must still be read with frameRead() afterwards.
+//
+int frameWaitJob(UsbDeviceHandle *deviceHandle, uint8 seq) {
+	bool busy;
+	for ( ; ; ) {
+		if ( pollJob(deviceHandle, seq, &busy) ) {
+			return 1;
+		}
+		if ( !busy ) {
+			break;
+		}
+		if ( m_backend != BACKEND_REPLAY ) {
+			timerSleep(POLL_MS);  // a replay is paced by the recording instead
+		}
+	}
+	if ( m_progress && m_shown <= 100 ) {
+		printf("\r%s: 100%%\n", m_progress);
+	}
+	m_shown = 101;
+	return 0;
+}
+
+// Switch the firmware's cycle capture on or off; either way it starts a new
+// block. This fails on firmware built without CAPTURE, and on the stand-in.
+//
+int frameCaptureControl(UsbDeviceHandle *deviceHandle, bool on) {
+	return controlTransfer(deviceHandle, false, CMD_CAPTURE, on ? 0x0001 : 0x0000, NULL, 0) < 0 ? 1 : 0;
+}
+
+// Have each block of captured cycles passed to sink as it is drained, or stop
+// draining them if sink is NULL
+//
+void frameCaptureTo(FrameCaptureSink sink, void *context) {
+	m_captureSink = sink;
+	m_captureContext = context;
+}
+
+// Read back the block captured so far (which starts a new one) and pass it to
+// the sink. This is done after every bulk read, and between the polls and
+// payload slices of a job, so blocks are drained about as fast as the host
+// can manage; the cycles which come while a block is full are counted instead.
+//
+int frameCaptureDrain(UsbDeviceHandle *deviceHandle) {
+	CaptureBlock block = {0};
+	int returnCode;
+	if ( !m_captureSink ) {
+		return 0;
+	}
+	returnCode = controlTransfer(
+		deviceHandle, true, CMD_CAPTURE, 0x0000, (uint8 *)&block, sizeof(CaptureBlock));
+	if ( returnCode < 0 ) {
+		return 1;
+	}
+	if ( returnCode < CAPTURE_HEADER || (uint32)returnCode < CAPTURE_HEADER + (block.cycles + 1U) / 2 ) {
+		fprintf(stderr, "Capture block is %d bytes; too short\n", returnCode);
+		return 1;
+	}
+	m_captureSink(&block, m_captureContext);
+	return 0;
+}
+
+// As frameCommand(), for commands whose response payload varies in length:
+// up to maxLength bytes are accepted, and buf->length says how many came back
+//
+int frameCommandVar(UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+                    const uint8 *payload, uint32 length, Buffer *buf, uint32 maxLength)
+{
+	FrameResponse response;
+	uint8 seq;
+	if ( frameWrite(deviceHandle, opcode, flags, param, payload, length, &seq) ) {
+		return 1;
+	}
+	if ( readResponse(deviceHandle, opcode, seq, buf, maxLength, false, &response) ) {
+		return 2;
+	}
+	if ( response.status != FRAME_SUCCESS ) {
+		fprintf(stderr, "Command 0x%02X failed with status 0x%02X\n", opcode, response.status);
+		return 3;
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "types.h"
+#include "usbwrap.h"
+#include "buffer.h"
+#include "../commands.h"
+
+// Framed command transport. Requests normally go to the device over USB; after
+// frameUseStandIn() they are answered in-process by the stand-in backend
+// instead, and after frameUseReplay() from a recorded session (see session.h).
+// Either way the device handle is ignored.
+//
+void frameUseStandIn(void);
+void frameUseReplay(void);
+int bulkWrite(UsbDeviceHandle *deviceHandle, CommandByte command, const uint8 *data, uint32 length);
+int bulkRead(UsbDeviceHandle *deviceHandle, CommandByte command, uint8 *data, uint32 length);
+int frameWrite(
+	UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+	const uint8 *payload, uint32 length, uint8 *seq);
+int frameRead(
+	UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 seq,
+	Buffer *buf, uint32 length, FrameResponse *response);
+int frameCommand(
+	UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+	const uint8 *payload, uint32 length, Buffer *buf, uint32 responseLength);
+int frameCommandVar(
+	UsbDeviceHandle *deviceHandle, CommandByte opcode, uint8 flags, uint32 param,
+	const uint8 *payload, uint32 length, Buffer *buf, uint32 maxLength);
+
+// Long operations run as jobs in the firmware; their progress can be polled,
+// and they can be cancelled, over the control endpoint while they run.
+//
+int frameJobStatus(UsbDeviceHandle *deviceHandle, JobStatus *status);
+int frameJobCancel(UsbDeviceHandle *deviceHandle);
+int frameXsvfFailures(UsbDeviceHandle *deviceHandle, XsvfFailures *failures);
+void frameRequestCancel(void);
+void frameShowProgress(const char *what);
+int frameWaitJob(UsbDeviceHandle *deviceHandle, uint8 seq);
+
+typedef void (*FrameWatcher)(const JobStatus *status, void *context);
+void frameWatchJobs(FrameWatcher watcher, void *context);
+
+// Firmware built with CAPTURE records each TCK cycle while capture is on; the
+// blocks it fills are drained to the sink whenever the host is waiting on the
+// device anyway.
+//
+typedef void (*FrameCaptureSink)(const CaptureBlock *block, void *context);
+int frameCaptureControl(UsbDeviceHandle *deviceHandle, bool on);
+void frameCaptureTo(FrameCaptureSink sink, void *context);
+int frameCaptureDrain(UsbDeviceHandle *deviceHandle);
+
+#endif
@@ -0,0 +1,460 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#endif
+
+#define MAX_RECORD      260         // bytes of one HEX or S-record, decoded
+#define PT_LOAD         1
+#define EM_AVR          83
+#define AVR_DATA_SPACE  0x800000UL  // avr-gcc puts SRAM, EEPROM & fuses above here
+
+static char m_error[128];
+static uint8 m_nibbles[256];        // value of each hex digit, 0xFF for the rest
+static bool m_haveNibbles = false;
+
+const char *imageStrError(void) {
+	return m_error;
+}
+
+static int fail(int code, const char *message) {
+	strcpy(m_error, message);
+	return code;
+}
+
+static int failAt(int code, const char *format, uint32 value) {
+	sprintf(m_error, format, (unsigned long)value);
+	return code;
+}
+
+void imageInit(Image *self) {
+	memset(self, 0, sizeof(Image));
+}
+
+void imageDestroy(Image *self) {
+	free(self->data);
+	free(self->segments);
+	imageInit(self);
+}
+
+// Add bytes at an address, extending the last segment if they carry straight
+// on from it; the segments are only sorted when the file is done
+//
+static int addBytes(Image *self, uint32 address, const uint8 *bytes, uint32 count) {
+	Segment *last = self->numSegments ? &self->segments[self->numSegments - 1] : NULL;
+	if ( !count ) {
+		return 0;
+	}
+	if ( address + count < address ) {
+		return failAt(10, "Data at 0x%08lX runs past the end of the address space", address);
+	}
+	if ( self->length + count > self->capacity ) {
+		uint32 capacity = self->capacity ? self->capacity : 0x10000;
+		uint8 *data;
+		while ( capacity < self->length + count ) {
+			capacity *= 2;
+		}
+		data = realloc(self->data, capacity);
+		if ( !data ) {
+			return failAt(11, "Cannot allocate 0x%08lX bytes for the image", capacity);
+		}
+		self->data = data;
+		self->capacity = capacity;
+	}
+	if ( !last || last->address + last->length != address ) {
+		if ( self->numSegments == self->maxSegments ) {
+			const uint32 maxSegments = self->maxSegments ? 2 * self->maxSegments : 16;
+			Segment *segments = realloc(self->segments, maxSegments * sizeof(Segment));
+			if ( !segments ) {
+				return failAt(11, "Cannot allocate %lu segments", maxSegments);
+			}
+			self->segments = segments;
+			self->maxSegments = maxSegments;
+		}
+		last = &self->segments[self->numSegments++];
+		last->address = address;
+		last->length = 0;
+		last->offset = self->length;
+	}
+	memcpy(self->data + self->length, bytes, count);
+	self->length += count;
+	last->length += count;
+	return 0;
+}
+
+static int compareSegments(const void *a, const void *b) {
+	const uint32 x = ((const Segment *)a)->address, y = ((const Segment *)b)->address;
+	return (x > y) - (x < y);
+}
+
+// Most files give their records in address order, so the segments are
+// already sorted and apart. Otherwise sort them, copy their bytes into
+// address order and merge the ones which meet; overlapping ones are an error.
+//
+static int imageFinish(Image *self) {
+	uint8 *data;
+	uint32 i, n, length = 0;
+	for ( i = 1; i < self->numSegments; i++ ) {
+		if ( self->segments[i].address <= self->segments[i - 1].address + self->segments[i - 1].length ) {
+			break;
+		}
+	}
+	if ( i >= self->numSegments ) {
+		return 0;
+	}
+	qsort(self->segments, self->numSegments, sizeof(Segment), compareSegments);
+	data = malloc(self->capacity);
+	if ( !data ) {
+		return failAt(11, "Cannot allocate 0x%08lX bytes for the image", self->capacity);
+	}
+	for ( i = 0, n = 0; i < self->numSegments; i++ ) {
+		const Segment *segment = &self->segments[i];
+		memcpy(data + length, self->data + segment->offset, segment->length);
+		if ( n && segment->address < self->segments[n - 1].address + self->segments[n - 1].length ) {
+			free(data);
+			return failAt(12, "The file gives the byte at 0x%08lX more than once", segment->address);
+		}
+		if ( n && segment->address == self->segments[n - 1].address + self->segments[n - 1].length ) {
+			self->segments[n - 1].length += segment->length;
+		} else {
+			self->segments[n].address = segment->address;
+			self->segments[n].length = segment->length;
+			self->segments[n].offset = length;
+			n++;
+		}
+		length += segment->length;
+	}
+	free(self->data);
+	self->data = data;
+	self->numSegments = n;
+	return 0;
+}
+
+// Decode count bytes from 2*count hex digits, adding them up as it goes.
+// Returns nonzero if any of them is not a hex digit.
+//
+static bool decodeHex(const uint8 *text, uint8 *bytes, uint32 count, uint8 *sum) {
+	uint8 hi, lo, check = 0x00;
+	if ( !m_haveNibbles ) {
+		uint32 c;
+		memset(m_nibbles, 0xFF, sizeof(m_nibbles));
+		for ( c = 0; c < 10; c++ ) {
+			m_nibbles['0' + c] = (uint8)c;
+		}
+		for ( c = 0; c < 6; c++ ) {
+			m_nibbles['A' + c] = m_nibbles['a' + c] = (uint8)(10 + c);
+		}
+		m_haveNibbles = true;
+	}
+	while ( count-- ) {
+		hi = m_nibbles[*text++];
+		lo = m_nibbles[*text++];
+		check |= hi | lo;
+		*bytes = (uint8)((hi << 4) | lo);
+		*sum += *bytes++;
+	}
+	return (check & 0xF0) != 0;
+}
+
+// Skip blank space, counting lines; returns the next character's position
+//
+static const uint8 *skipSpace(const uint8 *p, const uint8 *end, uint32 *line) {
+	while ( p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t') ) {
+		if ( *p++ == '\n' ) {
+			(*line)++;
+		}
+	}
+	return p;
+}
+
+// Intel HEX, in one pass: each record is decoded straight from the text and
+// its data appended to the image
+//
+static int parseHex(Image *self, const uint8 *p, uint32 length) {
+	const uint8 *const end = p + length;
+	uint8 record[MAX_RECORD];
+	uint32 base = 0, line = 1, count;
+	uint8 sum;
+	int returnCode;
+	for ( ; ; ) {
+		p = skipSpace(p, end, &line);
+		if ( p == end ) {
+			return 0;  // no end-of-file record, but nothing is missing either
+		}
+		if ( *p != ':' ) {
+			return failAt(2, "Line %lu does not start with ':'", line);
+		}
+		sum = 0x00;
+		if ( end - p < 11 || decodeHex(p + 1, record, 1, &sum) ) {
+			return failAt(3, "Line %lu is not a valid record", line);
+		}
+		count = record[0] + 5u;  // count, address, type, data & checksum
+		if ( (uint32)(end - p - 1) < 2 * count || decodeHex(p + 3, record + 1, count - 1, &sum) ) {
+			return failAt(3, "Line %lu is not a valid record", line);
+		}
+		if ( sum ) {
+			return failAt(4, "Line %lu has a bad checksum", line);
+		}
+		p += 1 + 2 * count;
+		switch ( record[3] ) {
+		case 0x00:
+			returnCode = addBytes(self, base + ((record[1] << 8) | record[2]), record + 4, record[0]);
+			if ( returnCode ) {
+				return returnCode;
+			}
+			break;
+		case 0x01:
+			return 0;
+		case 0x02:
+		case 0x04:
+			if ( record[0] != 2 ) {
+				return failAt(3, "Line %lu is not a valid record", line);
+			}
+			base = (uint32)((record[4] << 8) | record[5]) << (record[3] == 0x02 ? 4 : 16);
+			break;
+		case 0x03:
+		case 0x05:
+			break;  // start address
+		default:
+			return failAt(5, "Line %lu has an unknown record type", line);
+		}
+	}
+}
+
+// Motorola S-records: S1, S2 and S3 carry data with 16, 24 and 32-bit
+// addresses; S0 (header) and S5/S6 (record counts) are checked and skipped,
+// and S7, S8 or S9 ends the file
+//
+static int parseSrec(Image *self, const uint8 *p, uint32 length) {
+	static const uint8 addressBytes[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+	const uint8 *const end = p + length;
+	uint8 record[MAX_RECORD];
+	uint32 line = 1, count, address, i;
+	uint8 type, sum;
+	int returnCode;
+	for ( ; ; ) {
+		p = skipSpace(p, end, &line);
+		if ( p == end ) {
+			return 0;
+		}
+		if ( end - p < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9' || p[1] == '4' ) {
+			return failAt(3, "Line %lu is not a valid S-record", line);
+		}
+		type = p[1] - '0';
+		sum = 0x00;
+		if ( decodeHex(p + 2, record, 1, &sum) ) {
+			return failAt(3, "Line %lu is not a valid S-record", line);
+		}
+		count = record[0];
+		if ( count < addressBytes[type] + 1u || (uint32)(end - p - 4) < 2 * count ||
+		     decodeHex(p + 4, record + 1, count, &sum) )
+		{
+			return failAt(3, "Line %lu is not a valid S-record", line);
+		}
+		if ( sum != 0xFF ) {
+			return failAt(4, "Line %lu has a bad checksum", line);
+		}
+		p += 4 + 2 * count;
+		if ( type >= 7 ) {
+			return 0;
+		}
+		if ( type >= 1 && type <= 3 ) {
+			address = 0;
+			for ( i = 1; i <= addressBytes[type]; i++ ) {
+				address = (address << 8) | record[i];
+			}
+			returnCode = addBytes(self, address, record + i, count - addressBytes[type] - 1);
+			if ( returnCode ) {
+				return returnCode;
+			}
+		}
+	}
+}
+
+static uint32 elfHalf(const uint8 *p, bool big) {
+	return big ? (uint32)((p[0] << 8) | p[1]) : (uint32)((p[1] << 8) | p[0]);
+}
+
+static uint32 elfWord(const uint8 *p, bool big) {
+	return big ?
+		((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3] :
+		((uint32)p[3] << 24) | ((uint32)p[2] << 16) | ((uint32)p[1] << 8) | p[0];
+}
+
+// 32-bit ELF: the file bytes of each PT_LOAD segment, at its physical (load)
+// address. For the AVR, segments above avr-gcc's flash addresses are dropped.
+//
+static int parseElf(Image *self, const uint8 *data, uint32 length) {
+	uint32 machine, phoff, phentsize, phnum, i;
+	bool big;
+	int returnCode;
+	if ( length < 52 || memcmp(data, "\177ELF", 4) ) {
+		return fail(6, "Not an ELF file");
+	}
+	if ( data[4] != 1 ) {
+		return fail(6, "Only 32-bit ELF files are supported");
+	}
+	big = (data[5] == 2);
+	machine = elfHalf(data + 18, big);
+	phoff = elfWord(data + 28, big);
+	phentsize = elfHalf(data + 42, big);
+	phnum = elfHalf(data + 44, big);
+	if ( phentsize < 32 || phoff > length || phnum > (length - phoff) / phentsize ) {
+		return failAt(7, "The program headers run past the end of the file (%lu bytes)", length);
+	}
+	for ( i = 0; i < phnum; i++ ) {
+		const uint8 *const header = data + phoff + i * phentsize;
+		const uint32 offset = elfWord(header + 4, big);
+		const uint32 address = elfWord(header + 12, big);
+		const uint32 size = elfWord(header + 16, big);
+		if ( elfWord(header, big) != PT_LOAD || !size ||
+		     (machine == EM_AVR && address >= AVR_DATA_SPACE) )
+		{
+			continue;
+		}
+		if ( offset > length || size > length - offset ) {
+			return failAt(7, "Segment %lu runs past the end of the file", i);
+		}
+		returnCode = addBytes(self, address, data + offset, size);
+		if ( returnCode ) {
+			return returnCode;
+		}
+	}
+	return 0;
+}
+
+// A .bin file is raw; otherwise the contents say what it is
+//
+ImageFormat imageFormat(const char *fileName, const uint8 *data, uint32 length) {
+	const size_t nameLength = strlen(fileName);
+	if ( nameLength >= 4 && !strcmp(fileName + nameLength - 4, ".bin") ) {
+		return IMAGE_BINARY;
+	}
+	if ( length >= 4 && !memcmp(data, "\177ELF", 4) ) {
+		return IMAGE_ELF;
+	}
+	while ( length && (*data == '\n' || *data == '\r' || *data == ' ' || *data == '\t') ) {
+		data++;
+		length--;
+	}
+	if ( length >= 2 && data[0] == ':' ) {
+		return IMAGE_HEX;
+	}
+	if ( length >= 2 && data[0] == 'S' && data[1] >= '0' && data[1] <= '9' ) {
+		return IMAGE_SREC;
+	}
+	return IMAGE_BINARY;
+}
+
+int imageParse(Image *self, ImageFormat format, const uint8 *data, uint32 length) {
+	int returnCode;
+	self->length = 0;
+	self->numSegments = 0;
+	switch ( format ) {
+	case IMAGE_HEX:
+		returnCode = parseHex(self, data, length);
+		break;
+	case IMAGE_SREC:
+		returnCode = parseSrec(self, data, length);
+		break;
+	case IMAGE_ELF:
+		returnCode = parseElf(self, data, length);
+		break;
+	default:
+		returnCode = addBytes(self, 0, data, length);
+		break;
+	}
+	return returnCode ? returnCode : imageFinish(self);
+}
+
+int imageLoad(Image *self, const char *fileName) {
+	uint8 *data;
+	long length;
+	int returnCode;
+	FILE *file = fopen(fileName, "rb");
+	if ( !file ) {
+		sprintf(m_error, "Cannot open %.100s", fileName);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = (length >= 0) ? malloc(length ? (size_t)length : 1) : NULL;
+	if ( !data ) {
+		fclose(file);
+		sprintf(m_error, "Cannot read %.100s", fileName);
+		return 1;
+	}
+	if ( fread(data, 1, (size_t)length, file) != (size_t)length ) {
+		free(data);
+		fclose(file);
+		sprintf(m_error, "Cannot read %.100s", fileName);
+		return 1;
+	}
+	fclose(file);
+	returnCode = imageParse(self, imageFormat(fileName, data, (uint32)length), data, (uint32)length);
+	free(data);
+	return returnCode;
+}
+
+uint32 imageEnd(const Image *self) {
+	const Segment *last = self->numSegments ? &self->segments[self->numSegments - 1] : NULL;
+	return last ? last->address + last->length : 0;
+}
+
+// Binary search for the first segment ending after the address
+//
+bool imageTouches(const Image *self, uint32 address, uint32 length) {
+	uint32 lo = 0, hi = self->numSegments, mid;
+	while ( lo < hi ) {
+		mid = (lo + hi) / 2;
+		if ( self->segments[mid].address + self->segments[mid].length <= address ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < self->numSegments && self->segments[lo].address < address + length;
+}
+
+int imageFlatten(const Image *self, uint32 address, uint32 length, uint8 fill, Buffer *buf) {
+	uint8 *block;
+	uint32 i, from, to;
+	bufZeroLength(buf);
+	if ( bufAppendConst(buf, length, fill, &block) ) {
+		sprintf(m_error, "%.120s", bufStrError());
+		return 11;
+	}
+	for ( i = 0; i < self->numSegments; i++ ) {
+		const Segment *segment = &self->segments[i];
+		if ( segment->address >= address + length ) {
+			break;
+		}
+		if ( segment->address + segment->length <= address ) {
+			continue;
+		}
+		from = segment->address > address ? segment->address : address;
+		to = segment->address + segment->length < address + length ? segment->address + segment->length : address + length;
+		memcpy(block + (from - address), self->data + segment->offset + (from - segment->address), to - from);
+	}
+	return 0;
+}
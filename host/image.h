@@ -0,0 +1,64 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "types.h"
+#include "buffer.h"
+
+// A memory image loaded from an Intel HEX, Motorola S-record, ELF or raw
+// binary file. Only the bytes the file gives are kept: a list of segments,
+// sorted by address and merged where they meet, whose bytes lie back to back
+// in one block. Gaps are never filled in, so a bootloader at the top of a
+// large part costs no more than its own size.
+//
+typedef enum {
+	IMAGE_BINARY = 0,
+	IMAGE_HEX,
+	IMAGE_SREC,
+	IMAGE_ELF
+} ImageFormat;
+
+typedef struct {
+	uint32 address;
+	uint32 length;
+	uint32 offset;    // of its first byte in Image.data
+} Segment;
+
+typedef struct {
+	uint8 *data;
+	uint32 length, capacity;
+	Segment *segments;
+	uint32 numSegments, maxSegments;
+} Image;
+
+void imageInit(Image *self);
+void imageDestroy(Image *self);
+ImageFormat imageFormat(const char *fileName, const uint8 *data, uint32 length);
+int imageLoad(Image *self, const char *fileName);
+int imageParse(Image *self, ImageFormat format, const uint8 *data, uint32 length);
+const char *imageStrError(void);
+
+// Questions a programmer asks of an image: where it ends (zero if it is
+// empty), whether it gives any byte of a page, and a page's worth of it as a
+// flat block, with "fill" where it gives nothing.
+//
+uint32 imageEnd(const Image *self);
+bool imageTouches(const Image *self, uint32 address, uint32 length);
+int imageFlatten(const Image *self, uint32 address, uint32 length, uint8 fill, Buffer *buf);
+
+#endif
@@ -18,24 +18,32 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include "types.h"
 #include "usbwrap.h"
 #include "buffer.h"
 #include "argtable2.h"
 #include "arg_uint.h"
 #include "dump.h"
+#include "vcd.h"
+#include "timer.h"
+#include "trace.h"
+#include "frame.h"
+#include "standin.h"
+#include "bench.h"
+#include "debuglog.h"
+#include "checkpoint.h"
+#include "capture.h"
+#include "session.h"
+#include "extest.h"
+#include "image.h"
+#include "estimate.h"
 #include "../commands.h"
 
 #ifdef WIN32
-typedef char *WriteDataPtr;
 #pragma warning(disable : 4996)
-#else
-typedef const char *WriteDataPtr;
 #endif
 
-#define BLOCK_SIZE 128
-#define TIMEOUT 5000000
-
 typedef enum {
 	ATMEL = 0,
 	XILINX
@@ -49,26 +57,56 @@ typedef struct {
 	ManufacturerIndex Manufacturer;
 	const char *DeviceID;
 	uint8 IRLen;
-	uint16 NumBlocks;
+	uint16 PageSize;  // AVR flash page size in bytes, or zero if not an AVR
+	uint16 NumPages;
+	uint16 EepromPageSize;  // AVR EEPROM page size in bytes
+	uint16 EepromPages;
+	uint16 DataSize;  // AVR registers, I/O and SRAM, in bytes
+	uint8 Ocdr;       // I/O address of the AVR's on-chip debug register
+	uint16 Unreadable[AVR_MAX_UNREADABLE];  // its read-sensitive I/O registers, left out of a RAM dump
+	uint8 Idcode;     // IDCODE instruction
+	uint8 Sample;     // SAMPLE/PRELOAD instruction
+	uint8 Extest;     // EXTEST instruction
+	uint16 BSRLen;    // boundary-scan register length, or zero if unknown
 } Device;
 typedef enum {
 	ATMEGA162 = 0,
+	ATMEGA128,
+	ATMEGA1281,
+	ATMEGA2560,
 	XC9572,
 	XC3S200,
 	XCF02S
 } DeviceIndex;
 static Device devices[] = {
-	{ATMEL,  "ATMEGA162", 4, 16384/BLOCK_SIZE},
-	{XILINX, "XC9572",    8, 0},
-	{XILINX, "XC3S200",   6, 0},
-	{XILINX, "XCF02S",    8, 0}
+	{ATMEL,  "ATMEGA162",  4, 128, 128,  4, 128, 0x0500, 0x04, {0x23, 0x2C, 0x2F},                    0x01, 0x02, 0x00, 0},
+	{ATMEL,  "ATMEGA128",  4, 256, 512,  8, 512, 0x1100, 0x22, {0x2C, 0x2F, 0x73, 0x9C},              0x01, 0x02, 0x00, 0},
+	{ATMEL,  "ATMEGA1281", 4, 256, 512,  8, 512, 0x2200, 0x31, {0x4E, 0xBB, 0xC6, 0xCE},              0x01, 0x02, 0x00, 0},
+	{ATMEL,  "ATMEGA2560", 4, 256, 1024, 8, 512, 0x2200, 0x31, {0x4E, 0xBB, 0xC6, 0xCE, 0xD6, 0x136}, 0x01, 0x02, 0x00, 0},
+	{XILINX, "XC9572",     8, 0,   0,    0, 0,   0,      0,    {0},                                   0xFE, 0x01, 0x00, 216},
+	{XILINX, "XC3S200",    6, 0,   0,    0, 0,   0,      0,    {0},                                   0x09, 0x01, 0x00, 472},
+	{XILINX, "XCF02S",     8, 0,   0,    0, 0,   0,      0,    {0},                                   0xFE, 0x01, 0x00, 25}
 };
 
+uint32 flashSize(const Device *device) {
+	return (uint32)device->PageSize * device->NumPages;
+}
+
+uint32 eepromSize(const Device *device) {
+	return (uint32)device->EepromPageSize * device->EepromPages;
+}
+
 const Device *getDevice(uint16 manufacturerID, uint16 deviceID) {
 	if ( manufacturerID == 0x01F ) {
 		// Atmel
 		if ( deviceID == 0x9404 ) {
 			return &devices[ATMEGA162];
+		} else if ( deviceID == 0x9702 ) {
+			return &devices[ATMEGA128];
+		} else if ( deviceID == 0x9704 ) {
+			return &devices[ATMEGA1281];
+		} else if ( deviceID == 0x9801 ) {
+			return &devices[ATMEGA2560];
 		} else {
 			return NULL;
 		}
@@ -88,87 +126,370 @@ const Device *getDevice(uint16 manufacturerID, uint16 deviceID) {
 	}
 }
 
-int controlMsgRead(UsbDeviceHandle *deviceHandle, CommandByte bRequest,
-                   uint16 wValue, uint16 wIndex,
-                   uint8 *responseData, uint16 wLength)
-{
-	int returnCode = usb_control_msg(
-		deviceHandle,
-		USB_ENDPOINT_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-		(uint8)bRequest,      // bRequest
-		wValue,               // wValue
-		wIndex,               // wIndex
-		(char *)responseData, // space for received data
-		wLength,              // wLength
-		TIMEOUT               // timeout in milliseconds
-	);
-	if ( returnCode < 0 ) {
-		fprintf(stderr, "usb_control_msg() failed returnCode %d: %s\n", returnCode, usb_strerror());
-		return 1;
+bool isSpartan3(const Device *device) {
+	return device == &devices[XC3S200];
+}
+
+bool isXcf(const Device *device) {
+	return device == &devices[XCF02S];
+}
+
+// Ctrl-C during a long load cancels the firmware's job rather than leaving
+// it running with nobody to collect the result
+//
+static void onInterrupt(int sig) {
+	(void)sig;
+	frameRequestCancel();
+}
+
+// With --checkpoint, the checkpoint file follows the load as it goes
+//
+typedef struct {
+	const char *fileName;
+	Checkpoint checkpoint;
+	uint32 *xsirs;      // offsets of the XSIR records, for XSVF playback
+	uint32 numXsirs;
+	uint32 firstXsir;   // the one the playback started at
+} CheckpointWatch;
+
+static void onJobStatus(const JobStatus *status, void *context) {
+	CheckpointWatch *watch = (CheckpointWatch *)context;
+	uint32 offset = status->checkpoint;
+	if ( watch->xsirs ) {
+		// The firmware counts the XSIRs it has begun; carry on from the last
+		if ( offset == 0 || watch->firstXsir + offset > watch->numXsirs ) {
+			return;
+		}
+		offset = watch->xsirs[watch->firstXsir + offset - 1];
+	}
+	if ( offset > watch->checkpoint.offset && offset < watch->checkpoint.size ) {
+		watch->checkpoint.offset = offset;
+		if ( checkpointWrite(watch->fileName, &watch->checkpoint) ) {
+			fprintf(stderr, "\nCannot write %s\n", watch->fileName);
+		}
 	}
-	return 0;
 }
 
-int controlMsgWrite(UsbDeviceHandle *deviceHandle, CommandByte bRequest,
-                    uint16 wValue, uint16 wIndex,
-                    const uint8 *requestData, uint16 wLength)
-{
-	int returnCode = usb_control_msg(
-		deviceHandle,
-		USB_ENDPOINT_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-		(uint8)bRequest,     // bRequest
-		wValue,              // wValue
-		wIndex,              // wIndex
-		(char *)requestData, // space for received data
-		wLength,             // wLength
-		TIMEOUT              // timeout in milliseconds
-	);
-	if ( returnCode < 0 ) {
-		fprintf(stderr, "usb_control_msg() failed returnCode %d: %s\n", returnCode, usb_strerror());
-		return 1;
+// Split a PROM image into row records, leaving out the rows which are blank
+// (all 0xFF, the erased state) since they need no programming
+//
+int xcfMakeRecords(const Buffer *image, Buffer *records, uint32 *numRecords) {
+	uint8 rowData[XCF_ROW_BYTES];
+	uint32 row, offset, count;
+	*numRecords = 0;
+	bufZeroLength(records);
+	for ( row = 0; row * XCF_ROW_BYTES < image->length; row++ ) {
+		offset = row * XCF_ROW_BYTES;
+		count = image->length - offset;
+		if ( count > XCF_ROW_BYTES ) {
+			count = XCF_ROW_BYTES;
+		}
+		memset(rowData, 0xFF, XCF_ROW_BYTES);
+		memcpy(rowData, image->data + offset, count);
+		for ( offset = 0; offset < XCF_ROW_BYTES && rowData[offset] == 0xFF; offset++ );
+		if ( offset == XCF_ROW_BYTES ) {
+			continue;
+		}
+		if ( bufAppendByte(records, (uint8)row) || bufAppendByte(records, (uint8)(row >> 8)) ||
+		     bufAppendBlock(records, rowData, XCF_ROW_BYTES) )
+		{
+			return 1;
+		}
+		(*numRecords)++;
 	}
 	return 0;
 }
 
-int bulkWrite(UsbDeviceHandle *deviceHandle, CommandByte bRequest, const Buffer *buf) {
-	int returnCode;
-	if ( controlMsgWrite(deviceHandle, bRequest, buf->length >> 16, buf->length & 0xFFFF, NULL, 0x0000) ) {
+// Find the raw bitstream in a Xilinx .bit file. The header starts with a
+// length-prefixed magic field and a 16-bit 0x0001; then come keyed fields
+// 'a' (design name), 'b' (part), 'c' (date) and 'd' (time), each with a
+// 16-bit big-endian length, and finally 'e' with a 32-bit length, which is
+// followed by the bitstream itself.
+//
+int bitFindBitstream(const Buffer *buf, const char **partName, uint32 *offset, uint32 *length) {
+	const uint8 *const data = buf->data;
+	uint32 pos, fieldLength;
+	uint8 key;
+	*partName = NULL;
+	if ( buf->length < 2 ) {
 		return 1;
 	}
-	returnCode = usb_bulk_write(
-		deviceHandle,
-		USB_ENDPOINT_OUT | 2,    // write to endpoint 2
-		(WriteDataPtr)buf->data, // write from this buffer
-		buf->length,             // write entire buffer
-		TIMEOUT                  // timeout in milliseconds
-	);
-	if ( returnCode < 0 ) {
-		fprintf(stderr, "usb_bulk_write() failed returnCode %d: %s\n", returnCode, usb_strerror());
-		return 2;
+	pos = 2 + ((data[0] << 8) | data[1]) + 2;  // skip the magic and the 0x0001
+	while ( pos + 3 <= buf->length ) {
+		key = data[pos++];
+		if ( key == 'e' ) {
+			if ( pos + 4 > buf->length ) {
+				return 2;
+			}
+			*length =
+				((uint32)data[pos] << 24) | ((uint32)data[pos+1] << 16) |
+				((uint32)data[pos+2] << 8) | data[pos+3];
+			*offset = pos + 4;
+			return (*offset + *length > buf->length) ? 3 : 0;
+		}
+		fieldLength = (data[pos] << 8) | data[pos+1];
+		pos += 2;
+		if ( pos + fieldLength > buf->length || fieldLength == 0 || data[pos + fieldLength - 1] != '\0' ) {
+			return 4;
+		}
+		if ( key == 'b' ) {
+			*partName = (const char *)data + pos;
+		}
+		pos += fieldLength;
 	}
-	return 0;
+	return 5;
 }
 
-int bulkRead(UsbDeviceHandle *deviceHandle, CommandByte bRequest, Buffer *buf, uint32 length) {
-	int returnCode;
-	bufZeroLength(buf);
-	if ( bufAppendConst(buf, length, 0xFF, NULL) ) {
-		fprintf(stderr, "%s\n", bufStrError());
-		return 1;
+// Read a pin map: one "<cell> <name>" pair per line, where cell is the
+// boundary-scan register bit to watch. Blank lines and "#" comments are
+// ignored. Returns the number of pins, or -1 on error.
+//
+int readPinMap(const char *fileName, uint16 bsrLen, uint16 *cells, char (*names)[32], int maxPins) {
+	FILE *file = fopen(fileName, "r");
+	char line[256];
+	unsigned int cell;
+	int numPins = 0, lineNum = 0;
+	if ( !file ) {
+		fprintf(stderr, "Cannot open pin map %s\n", fileName);
+		return -1;
 	}
-	if ( controlMsgWrite(deviceHandle, bRequest, length >> 16, length & 0xFFFF, NULL, 0x0000) ) {
-		return 2;
+	while ( fgets(line, sizeof(line), file) ) {
+		char *p = line;
+		lineNum++;
+		while ( *p == ' ' || *p == '\t' ) {
+			p++;
+		}
+		if ( *p == '#' || *p == '\r' || *p == '\n' || *p == '\0' ) {
+			continue;
+		}
+		if ( numPins == maxPins || sscanf(p, "%u %31s", &cell, names[numPins]) != 2 || cell >= bsrLen ) {
+			fprintf(stderr, "%s:%d: expected \"<cell> <name>\" with cell below %u and at most %d pins\n",
+				fileName, lineNum, bsrLen, maxPins);
+			fclose(file);
+			return -1;
+		}
+		cells[numPins++] = (uint16)cell;
 	}
-	returnCode = usb_bulk_read(
-		deviceHandle,
-		USB_ENDPOINT_IN | 1,  // read from endpoint 1
-		(char *)buf->data,    // read into this buffer
-		length,               // read "length" bytes
-		TIMEOUT               // timeout in milliseconds
-	);
-	if ( returnCode < 0 ) {
-		fprintf(stderr, "usb_bulk_write() failed returnCode %d: %s\n", returnCode, usb_strerror());
-		return 3;
+	fclose(file);
+	return numPins;
+}
+
+// Capture count boundary-scan snapshots of one device and write the pins in
+// the pin map (or every cell, if there is no pin map) to a VCD file. The
+// firmware streams the snapshots back-to-back, so the sample period is
+// taken as the capture's elapsed time divided by the number of snapshots.
+//
+int sampleToVcd(
+	UsbDeviceHandle *deviceHandle, uint8 deviceIndex, const Device *device, uint32 count,
+	const char *pinFile, const char *vcdFile, Buffer *buf)
+{
+	SampleRequest request;
+	const uint32 bytesPerSample = (device->BSRLen + 7) / 8;
+	uint16 *cells = NULL;
+	char (*names)[32] = NULL;
+	const char **namePtrs = NULL;
+	int numPins, i, returnCode = 0;
+	uint64 startTime, elapsed;
+	uint32 sample;
+	const uint8 *snapshot;
+	VcdWriter vcd;
+
+	cells = malloc(device->BSRLen * sizeof(uint16));
+	names = malloc(device->BSRLen * sizeof(*names));
+	namePtrs = malloc(device->BSRLen * sizeof(const char *));
+	if ( !cells || !names || !namePtrs ) {
+		fprintf(stderr, "Cannot allocate pin map\n");
+		returnCode = 1;
+		goto cleanup;
+	}
+	if ( pinFile ) {
+		numPins = readPinMap(pinFile, device->BSRLen, cells, names, device->BSRLen);
+		if ( numPins < 0 ) {
+			returnCode = 2;
+			goto cleanup;
+		}
+	} else {
+		for ( numPins = 0; numPins < device->BSRLen; numPins++ ) {
+			cells[numPins] = (uint16)numPins;
+			sprintf(names[numPins], "cell%d", numPins);
+		}
+	}
+	for ( i = 0; i < numPins; i++ ) {
+		namePtrs[i] = names[i];
+	}
+
+	request.device = deviceIndex;
+	request.sample = device->Sample;
+	request.bsrLen = device->BSRLen;
+	startTime = timerMicros();
+	if ( frameCommand(deviceHandle, CMD_SAMPLE_BSCAN, 0, count, (const uint8 *)&request, sizeof(request),
+	                  buf, count * bytesPerSample) )
+	{
+		returnCode = 3;
+		goto cleanup;
+	}
+	elapsed = timerMicros() - startTime;
+	printf("Captured %lu snapshots of %u cells in %lu ms (%lu samples/s)\n",
+		count, device->BSRLen, (uint32)(elapsed / 1000),
+		elapsed ? (uint32)((uint64)count * 1000000 / elapsed) : 0);
+
+	if ( vcdOpen(&vcd, vcdFile, "1 ns", device->DeviceID, namePtrs, NULL, (uint32)numPins) ) {
+		fprintf(stderr, "Cannot write %s\n", vcdFile);
+		returnCode = 4;
+		goto cleanup;
+	}
+	for ( sample = 0; sample < count; sample++ ) {
+		snapshot = buf->data + sample * bytesPerSample;
+		for ( i = 0; i < numPins; i++ ) {
+			vcdChange(&vcd, sample * elapsed * 1000 / count, (uint32)i,
+				(snapshot[cells[i] >> 3] >> (cells[i] & 7)) & 0x01);
+		}
+	}
+	vcdClose(&vcd, elapsed * 1000);
+
+cleanup:
+	free(namePtrs);
+	free(names);
+	free(cells);
+	return returnCode;
+}
+
+// AVR flash images may be Intel HEX, Motorola S-records or ELF
+//
+bool isFlashImage(const char *fileName) {
+	static const char *const extensions[] = {".hex", ".srec", ".s19", ".s28", ".s37", ".elf"};
+	const size_t length = strlen(fileName);
+	size_t i, n;
+	for ( i = 0; i < sizeof(extensions)/sizeof(extensions[0]); i++ ) {
+		n = strlen(extensions[i]);
+		if ( length >= n && !strcmp(fileName + length - n, extensions[i]) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Show the vectors which failed an XSVF playback, as the firmware kept them:
+// what came back, and against the file what was expected under its mask and
+// which bits differ. The vectors are found in the file by counting XSDRTDO
+// records from start, where the playback began.
+//
+void printXsvfFailures(UsbDeviceHandle *deviceHandle, const char *fileName, uint32 start, uint32 numFailures) {
+	XsvfFailures failures;
+	const XsvfFailure *f;
+	XsvfVector v;
+	Buffer program;
+	bool haveProgram, found;
+	uint32 index;
+	uint8 i, j, expected[XSVF_FAIL_BYTES], mask[XSVF_FAIL_BYTES];
+	if ( frameXsvfFailures(deviceHandle, &failures) ) {
+		fprintf(stderr, "Cannot read back the vectors which failed\n");
+		return;
+	}
+	if ( bufInitialise(&program, 1024, 0x00) != BUF_SUCCESS ) {
+		fprintf(stderr, "Cannot allocate buffer: %s\n", bufStrError());
+		return;
+	}
+	haveProgram = !bufAppendFromBinaryFile(&program, fileName);
+	for ( i = 0; i < failures.count; i++ ) {
+		f = &failures.failures[i];
+		found = haveProgram && !xsvfFindVector(program.data, program.length, start, f->vector, &v) &&
+			f->offset + f->numBytes <= (v.bits + 7) >> 3;
+		printf("Vector %lu", f->vector);
+		if ( found ) {
+			printf(" (record %lu, at offset 0x%08lX) of %lu bits", v.record, v.offset, v.bits);
+			for ( j = 0; j < f->numBytes; j++ ) {
+				index = ((v.bits + 7) >> 3) - 1 - f->offset - j;  // the file holds the TDO end last
+				mask[j] = v.mask ? v.mask[index] : 0xFF;
+				expected[j] = v.expected[index];
+			}
+		}
+		printf(" failed%s; bits from %u, TDO end first:\n", f->chain ? " on chain B" : "", f->offset * 8);
+		if ( found ) {
+			printf("  expected");
+			for ( j = 0; j < f->numBytes; j++ ) {
+				printf(" %02X", expected[j]);
+			}
+			printf("\n  mask    ");
+			for ( j = 0; j < f->numBytes; j++ ) {
+				printf(" %02X", mask[j]);
+			}
+			printf("\n");
+		}
+		printf("  actual  ");
+		for ( j = 0; j < f->numBytes; j++ ) {
+			printf(" %02X", f->actual[j]);
+		}
+		if ( found ) {
+			printf("\n  differs ");
+			for ( j = 0; j < f->numBytes; j++ ) {
+				printf(" %02X", (f->actual[j] & mask[j]) ^ expected[j]);
+			}
+		}
+		printf("\n");
+	}
+	if ( numFailures > failures.count ) {
+		printf("(only the first %u failures are kept)\n", failures.count);
+	}
+	bufDestroy(&program);
+}
+
+// Find the next run of pages, from *page up to numPages, which the image gives
+// any bytes of; return its length in pages (zero if there is none) and leave
+// *page at its first page. The pages in between need not be written at all.
+//
+uint32 nextRun(const Image *image, uint32 pageSize, uint32 numPages, uint32 *page) {
+	uint32 last;
+	while ( *page < numPages && !imageTouches(image, *page * pageSize, pageSize) ) {
+		(*page)++;
+	}
+	for ( last = *page; last < numPages && imageTouches(image, last * pageSize, pageSize); last++ );
+	return last - *page;
+}
+
+// Work out offline what loading the file would cost: an XSVF program as
+// played to a lone device, or a flash image as nj would write it to the
+// named AVR. Returns the exit code.
+//
+int estimateLoad(
+	const char *fileName, const char *partName, const EstimateLink *link, uint8 options,
+	Buffer *buf, Image *image)
+{
+	const size_t length = strlen(fileName);
+	const Device *part = NULL;
+	size_t i;
+	if ( length >= 5 && !strcmp(fileName + length - 5, ".xsvf") ) {
+		if ( bufAppendFromBinaryFile(buf, fileName) ) {
+			fprintf(stderr, "Cannot load: %s\n", bufStrError());
+			return 91;
+		}
+		if ( estimateXsvfReport(stdout, buf->data, buf->length, link) ) {
+			fprintf(stderr, "Cannot estimate %s: %s\n", fileName, estimateStrError());
+			return 91;
+		}
+		return 0;
+	}
+	if ( !isFlashImage(fileName) ) {
+		fprintf(stderr, "Only XSVF files and AVR flash images can be estimated\n");
+		return 89;
+	}
+	for ( i = 0; i < sizeof(devices)/sizeof(devices[0]); i++ ) {
+		if ( devices[i].PageSize && !strcmp(devices[i].DeviceID, partName) ) {
+			part = &devices[i];
+		}
+	}
+	if ( !part ) {
+		fprintf(stderr, "--part must be one of ATMEGA162, ATMEGA128, ATMEGA1281 or ATMEGA2560\n");
+		return 90;
+	}
+	if ( imageLoad(image, fileName) ) {
+		fprintf(stderr, "Cannot load: %s\n", imageStrError());
+		return 91;
+	}
+	printf("Writing %s to the %s:\n", fileName, part->DeviceID);
+	if ( estimateFlashReport(stdout, image, part->PageSize, part->NumPages, options, link) ) {
+		fprintf(stderr, "Cannot estimate %s: %s\n", fileName, estimateStrError());
+		return 91;
 	}
 	return 0;
 }
@@ -177,11 +498,32 @@ int main(int argc, char **argv) {
 	struct arg_uint *devIndex = arg_uint0("d", "device", "<num>", "    target device");
 	struct arg_lit *erase = arg_lit0("e",   "erase",       "           erase the flash, lock bits & maybe EEPROM");
 	struct arg_uint *fuses = arg_uint0("f", "fuses",   "<fuses>",  "   set fuses (EX:HI:LO:LK)");
-	struct arg_file *load = arg_file0("i",  "load",    "<inFile>", "   load flash from file");
-	struct arg_file *save = arg_file0("o",  "save",    "<outFile>", "  save flash to file");
+	struct arg_file *load = arg_file0("i",  "load",    "<inFile>", "   load flash (.hex/.srec/.elf), EEPROM (.eep), PROM (.mcs/.bin), FPGA (.bit) or play .xsvf");
+	struct arg_file *save = arg_file0("o",  "save",    "<outFile>", "  save flash (.hex), EEPROM (.eep) or a RAM dump (.ram) to file");
+	struct arg_uint *sample = arg_uint0("s", "sample", "<count>",  "   capture boundary-scan snapshots");
+	struct arg_file *vcd  = arg_file0("v",  "vcd",     "<vcdFile>", "  write the snapshots to this VCD file");
+	struct arg_file *pins = arg_file0("p",  "pins",    "<pinFile>", "  name the cells to watch (\"<cell> <name>\" lines)");
+	struct arg_file *trace = arg_file0(NULL, "trace",  "<jsonFile>", " record USB transfers as Chrome trace events");
+	struct arg_file *bench = arg_file0(NULL, "bench",  "<jsonFile>", " benchmark the device and write the results here");
+	struct arg_lit *benchWrite = arg_lit0(NULL, "bench-write", "     include AVR flash writes in --bench (one flash cycle per iteration)");
+	struct arg_file *benchImage = arg_file0(NULL, "bench-images", "<jsonFile>", " time loading multi-MB images in each format");
+	struct arg_uint *iterations = arg_uint0(NULL, "iterations", "<count>", " benchmark iterations (default 10)");
+	struct arg_lit *estimate = arg_lit0(NULL, "estimate",  "        estimate the cost of loading the -i XSVF or flash image, offline");
+	struct arg_str *part = arg_str0(NULL, "part", "<device>", "    AVR to estimate a flash write for (default ATMEGA162)");
+	struct arg_uint *tck = arg_uint0(NULL, "tck", "<kHz>", "        TCK rate to estimate for (default 800)");
+	struct arg_uint *latency = arg_uint0(NULL, "latency", "<us>", "     USB round trip to estimate for (default 1000)");
+	struct arg_lit *standIn = arg_lit0(NULL, "stand-in",  "        talk to an in-process stand-in instead of the device");
+	struct arg_lit *dual  = arg_lit0(NULL,  "dual",        "            program a second, identical chain in lockstep");
+	struct arg_file *checkpoint = arg_file0(NULL, "checkpoint", "<file>", " resume an interrupted load from here, and record its progress");
+	struct arg_file *debugLog = arg_file0(NULL, "debug-log", "<capture>", " decode a debug trace captured from the firmware's USART");
+	struct arg_file *capture = arg_file0(NULL, "capture", "<vcdFile>", " record every TCK cycle to this VCD file (CAPTURE firmware)");
+	struct arg_file *record = arg_file0(NULL, "record", "<sessionFile>", " record every USB transfer to this file");
+	struct arg_file *replay = arg_file0(NULL, "replay", "<sessionFile>", " replay a recorded session instead of talking to the device");
+	struct arg_lit *fast  = arg_lit0(NULL,  "fast",        "            replay as fast as possible, not with the recorded timing");
+	struct arg_file *spiFlash = arg_file0(NULL, "spi-flash", "<pinFile>", " program the -i image into an SPI flash on the -d device's pins");
 	struct arg_lit *help  = arg_lit0("h",   "help",        "            print this help and exit");
 	struct arg_end *end   = arg_end(20);
-	void* argTable[] = {devIndex, erase, fuses, load, save, help, end};
+	void* argTable[] = {devIndex, erase, fuses, load, save, sample, vcd, pins, trace, bench, benchWrite, benchImage, iterations, estimate, part, tck, latency, standIn, dual, checkpoint, debugLog, capture, record, replay, fast, spiFlash, help, end};
 	const char *progName = "nj";
 	uint32 exitCode = 0;
 	int numErrors;
@@ -190,14 +532,28 @@ int main(int argc, char **argv) {
 		uint8 bytes[16*sizeof(uint32)];
 		uint32 ints[16];
 	} u;
-	uint32 ident;
+	uint32 ident, firstIdent = 0;
 	uint16 deviceID, manufacturerID;
 	uint8 revision;
-	const Device* devices[16];
+	const Device* devices[MAX_SCAN_DEVICES];
 	const Device *device = NULL;
-	uint8 numDevices, firstUnrecognised, i;
-	UsbDeviceHandle *deviceHandle;
+	const uint32 *idCodes;
+	uint8 irLens[MAX_CHAIN_DEVICES];
+	uint32 irTotal, irKnown;
+	uint16 numDevices, firstUnrecognised, numUnknown, unknown = 0, i;
+	UsbDeviceHandle *deviceHandle = NULL;
 	Buffer buf;
+	Image image;
+	uint32 runPage = 0, runPages, numPages = 0;
+	FrameResponse response;
+	CommandByte loadCommand = CMD_STATUS;
+	uint8 fuseSeq = 0, eraseSeq = 0, loadSeq = 0;
+	CheckpointWatch watch = {NULL, {0, 0, 0, 0}, NULL, 0, 0};
+	Checkpoint resume;
+	bool haveResume = false, skipErase = false;
+	Capture jtagCapture;
+	bool capturing = false;
+	void (*previousInterrupt)(int) = SIG_DFL;
 
 	printf("NanduinoJTAG Copyright (C) 2010 Chris McClelland\n");
 
@@ -225,31 +581,105 @@ int main(int argc, char **argv) {
 		goto cleanupArgtable;
 	}
 
+	imageInit(&image);
 	if ( bufInitialise(&buf, 1024, 0xFF) != BUF_SUCCESS ) {
 		fprintf(stderr, "Cannot allocate buffer: %s\n", bufStrError());
 		exitCode = 3;
 		goto cleanupArgtable;
 	}
 
-	usbInitialise();
-	returnCode = usbOpenDevice(0x03EB, 0x3002, 1, 0, 0, &deviceHandle);
-	if ( returnCode ) {
-		fprintf(stderr, "usbOpenDevice() failed returnCode %d: %s\n", returnCode, usbStrError());
-		exitCode = 4;
+	if ( debugLog->count ) {
+		exitCode = debugLogDecode(debugLog->filename[0], stdout) ? 58 : 0;
+		goto cleanupBuffer;
+	}
+
+	if ( benchImage->count ) {
+		exitCode = benchImages((iterations->count && iterations->ival[0]) ? iterations->ival[0] : 10,
+		                       benchImage->filename[0], &buf) ? 87 : 0;
+		goto cleanupBuffer;
+	}
+
+	if ( estimate->count ) {
+		EstimateLink link;
+		if ( !load->count ) {
+			fprintf(stderr, "--estimate needs a file to load (-i)\n");
+			exitCode = 89;
+			goto cleanupBuffer;
+		}
+		link.tckHz = 1000 * ((tck->count && tck->ival[0]) ? tck->ival[0] : 800);
+		link.latencyUs = latency->count ? latency->ival[0] : 1000;
+		exitCode = estimateLoad(
+			load->filename[0], part->count ? part->sval[0] : "ATMEGA162", &link,
+			(uint8)((checkpoint->count ? ESTIMATE_FLAT : 0) | (erase->count ? ESTIMATE_ERASE : 0)),
+			&buf, &image);
+		goto cleanupBuffer;
+	}
+
+	if ( trace->count && traceOpen(trace->filename[0]) ) {
+		fprintf(stderr, "Cannot write %s\n", trace->filename[0]);
+		exitCode = 53;
 		goto cleanupBuffer;
 	}
 
+	if ( record->count && sessionRecordOpen(record->filename[0]) ) {
+		fprintf(stderr, "Cannot write %s\n", record->filename[0]);
+		exitCode = 67;
+		goto cleanupBuffer;
+	}
+
+	if ( replay->count ) {
+		if ( standIn->count ) {
+			fprintf(stderr, "A session can be replayed or the stand-in used, not both\n");
+			exitCode = 68;
+			goto cleanupBuffer;
+		}
+		if ( sessionReplayOpen(replay->filename[0], fast->count == 0) ) {
+			fprintf(stderr, "Cannot replay %s: not a session file\n", replay->filename[0]);
+			exitCode = 69;
+			goto cleanupBuffer;
+		}
+		frameUseReplay();
+	} else if ( standIn->count ) {
+		if ( standInOpen() ) {
+			fprintf(stderr, "Cannot start the stand-in device\n");
+			exitCode = 56;
+			goto cleanupBuffer;
+		}
+		frameUseStandIn();
+	} else {
+		usbInitialise();
+		returnCode = usbOpenDevice(0x03EB, 0x3002, 1, 0, 0, &deviceHandle);
+		if ( returnCode ) {
+			fprintf(stderr, "usbOpenDevice() failed returnCode %d: %s\n", returnCode, usbStrError());
+			exitCode = 4;
+			goto cleanupBuffer;
+		}
+	}
+
 	//usb_clear_halt(deviceHandle, 2);
 
-	if ( controlMsgRead(deviceHandle, CMD_SCAN, 0, 0, u.bytes, 64) ) {
+	if ( capture->count ) {
+		returnCode = captureStart(deviceHandle, &jtagCapture, capture->filename[0]);
+		if ( returnCode == 1 ) {
+			exitCode = 65;
+			goto cleanupUsb;
+		} else if ( returnCode ) {
+			fprintf(stderr, "Cannot capture: is the firmware built with CAPTURE?\n");
+			exitCode = 66;
+			goto cleanupUsb;
+		}
+		capturing = true;
+	}
+
+	// The response is the chain's total IR length, then an IDCODE (or zero, for
+	// a BYPASS-only device) for each device, nearest TDO first
+	if ( frameCommandVar(deviceHandle, CMD_SCAN_CHAIN, 0, 0, NULL, 0, &buf, 4 * (MAX_SCAN_DEVICES + 1)) ) {
 		exitCode = 5;
 		goto cleanupUsb;
 	}
-	i = 0;
-	while ( i < 16 && u.ints[i] ) {
-		i++;
-	}
-	numDevices = i;
+	idCodes = (const uint32 *)buf.data;
+	irTotal = *idCodes++;
+	numDevices = (uint16)(buf.length / 4 - 1);
 	if ( numDevices == 0 ) {
 		fprintf(stderr, "No devices found in the JTAG chain!\n");
 		exitCode = 6;
@@ -259,38 +689,127 @@ int main(int argc, char **argv) {
 	} else {
 		printf("Found %d devices in the JTAG chain:\n", numDevices);
 	}
-	firstUnrecognised = numDevices;
+	numUnknown = 0;
+	irKnown = 0;
 	for ( i = 0; i < numDevices; i++ ) {
-		ident = u.ints[numDevices - 1 - i];
+		ident = idCodes[numDevices - 1 - i];
+		if ( i == 0 ) {
+			firstIdent = ident;
+		}
 		revision = (ident >> 28) + 'A';
 		deviceID = (ident >> 12) & 0xFFFF;
 		manufacturerID = (ident >> 1) & 0x07FF;
-		devices[i] = getDevice(manufacturerID, deviceID);
+		devices[i] = ident ? getDevice(manufacturerID, deviceID) : NULL;
 		if ( !devices[i] ) {
-			if ( firstUnrecognised == numDevices ) {
-				firstUnrecognised = i;
+			if ( !numUnknown++ ) {
+				unknown = i;
+			}
+			if ( ident ) {
+				printf("  Device %d (IDCODE=0x%08lX): Unrecognised device 0x%04X/0x%04X\n", i, ident, manufacturerID, deviceID);
+			} else {
+				printf("  Device %d: BYPASS only (no IDCODE)\n", i);
 			}
-			printf("  Device %d (IDCODE=0x%08lX): Unrecognised device 0x%04X/0x%04X\n", i, ident, manufacturerID, deviceID);
 		} else {
+			irKnown += devices[i]->IRLen;
 			printf("  Device %d (IDCODE=0x%08lX): %s %s (rev %c)\n", i, ident, manufacturers[devices[i]->Manufacturer], devices[i]->DeviceID, revision);
 		}
 	}
+
+	// Devices can be addressed up to the first one whose IR length is unknown.
+	// If only one device is unrecognised, the measured total gives its length.
+	firstUnrecognised = numDevices;
+	if ( numUnknown == 1 && irTotal > irKnown ) {
+		printf("  Device %d has an IR length of %lu\n", unknown, irTotal - irKnown);
+	} else if ( numUnknown ) {
+		firstUnrecognised = unknown;
+	} else if ( irTotal && irTotal != irKnown ) {
+		fprintf(stderr, "Warning: the chain's IR is %lu bits, but its devices' add up to %lu\n", irTotal, irKnown);
+	}
+
+	if ( numDevices > MAX_CHAIN_DEVICES ) {
+		if ( devIndex->count || fuses->count || erase->count || load->count || save->count || sample->count ||
+		     bench->count || spiFlash->count )
+		{
+			fprintf(stderr, "Cannot address devices in a chain of more than %d\n", MAX_CHAIN_DEVICES);
+			exitCode = 59;
+		}
+		goto cleanupUsb;
+	}
 	for ( i = 0; i < numDevices; i++ ) {
-		if ( !devices[i] ) {
-			u.bytes[i] = 0xFF;  // Assume very long irLen
+		if ( devices[i] ) {
+			irLens[i] = devices[i]->IRLen;
+		} else if ( i < firstUnrecognised ) {
+			irLens[i] = (uint8)(irTotal - irKnown);
 		} else {
-			u.bytes[i] = devices[i]->IRLen;
+			irLens[i] = 0xFF;  // Assume very long irLen
 		}
 	}
 
-	if ( controlMsgWrite(deviceHandle, CMD_SET_IRLENS, numDevices, 0, u.bytes, numDevices) ) {
+	if ( frameCommand(deviceHandle, CMD_SET_IRLENS, 0, 0, irLens, numDevices, &buf, 0) ) {
 		fprintf(stderr, "Call to CMD_SET_IRLENS failed; this should not happen!\n");
 		exitCode = 7;
 		goto cleanupUsb;
 	}
 
-	if ( devIndex->count && devIndex->ival[0] != 0 ) {
-		fprintf(stderr, "This version of %s can only directly address the first device in the JTAG chain\n", progName);
+	if ( devices[0] && devices[0]->Manufacturer == ATMEL ) {
+		AvrGeometry geometry;
+		geometry.pageSize = devices[0]->PageSize;
+		geometry.numPages = devices[0]->NumPages;
+		geometry.eepromPageSize = devices[0]->EepromPageSize;
+		geometry.eepromPages = devices[0]->EepromPages;
+		geometry.ocdr = devices[0]->Ocdr;
+		memcpy(geometry.unreadable, devices[0]->Unreadable, sizeof(geometry.unreadable));
+		if ( frameCommand(deviceHandle, CMD_SET_AVR_GEOMETRY, 0, 0,
+		                  (const uint8 *)&geometry, sizeof(geometry), &buf, 0) )
+		{
+			fprintf(stderr, "Cannot set the flash geometry of the %s\n", devices[0]->DeviceID);
+			exitCode = 57;
+			goto cleanupUsb;
+		}
+	}
+
+	if ( dual->count ) {
+		if ( save->count || sample->count || spiFlash->count ) {
+			fprintf(stderr, "Cannot save, sample or program an SPI flash in dual-chain mode; only the first chain is read\n");
+			exitCode = 62;
+			goto cleanupUsb;
+		}
+		if ( frameCommand(deviceHandle, CMD_SET_DUAL_CHAIN, 0, 1, NULL, 0, &buf, 0) ) {
+			fprintf(stderr, "Cannot drive a second chain: the firmware lacks DUAL_CHAIN or the chains differ\n");
+			exitCode = 61;
+			goto cleanupUsb;
+		}
+		printf("Driving a second, identical chain in lockstep\n");
+	}
+
+	if ( bench->count ) {
+		BenchTarget target;
+		if ( !devices[0] ) {
+			fprintf(stderr, "Cannot benchmark because device 0 is unrecognised\n");
+			exitCode = 54;
+			goto cleanupUsb;
+		}
+		target.idCode = firstIdent;
+		target.irLen = devices[0]->IRLen;
+		target.idcodeIns = devices[0]->Idcode;
+		target.flashSize = flashSize(devices[0]);
+		target.irLens = irLens;
+		target.numDevices = (uint8)numDevices;
+		if ( benchRun(deviceHandle, &target, (iterations->count && iterations->ival[0]) ? iterations->ival[0] : 10,
+		              benchWrite->count || standIn->count,
+		              standIn->count ? "stand-in" : replay->count ? "replay" : "usb", bench->filename[0], &buf) )
+		{
+			exitCode = 55;
+		}
+		goto cleanupUsb;
+	}
+
+	if ( devIndex->count && devIndex->ival[0] != 0 && !spiFlash->count &&
+	     (fuses->count || erase->count || save->count ||
+	      (load->count && (isFlashImage(load->filename[0]) ||
+	                       !strcmp(load->filename[0] + strlen(load->filename[0]) - 4, ".eep")))) )
+	{
+		fprintf(stderr, "This version of %s can only program an AVR if it is the first device in the JTAG chain\n", progName);
 		exitCode = 8;
 		goto cleanupUsb;
 	}
@@ -301,7 +820,7 @@ int main(int argc, char **argv) {
 			exitCode = 9;
 			goto cleanupUsb;
 		}
-		if ( devIndex->ival[0] >= firstUnrecognised ) {
+		if ( devIndex->ival[0] >= firstUnrecognised || !devices[devIndex->ival[0]] ) {
 			fprintf(stderr, "Device %d is either itself unrecognised or is preceded by an unrecognised device.\n", devIndex->ival[0]);
 			exitCode = 10;
 			goto cleanupUsb;
@@ -316,22 +835,54 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if ( device && device->Manufacturer == ATMEL ) {
-		if ( controlMsgRead(deviceHandle, CMD_RW_AVR_FUSES, 0, 0, u.bytes, 4) ) {
+	if ( spiFlash->count ) {
+		SpiPins spiPins;
+		ExtestTarget target;
+		if ( !device || !device->BSRLen || firstUnrecognised < numDevices ) {
+			fprintf(stderr, "You must select a recognised device with a boundary register, in a fully recognised chain\n");
+			exitCode = 70;
+			goto cleanupUsb;
+		}
+		if ( !load->count || fuses->count || erase->count || save->count || sample->count ) {
+			fprintf(stderr, "Give just the image to program (-i) with --spi-flash\n");
+			exitCode = 71;
+			goto cleanupUsb;
+		}
+		if ( spiReadPinMap(spiFlash->filename[0], device->BSRLen, &spiPins) ) {
+			exitCode = 72;
+			goto cleanupUsb;
+		}
+		bufZeroLength(&buf);
+		if ( bufAppendFromBinaryFile(&buf, load->filename[0]) ) {
+			fprintf(stderr, "Cannot load: %s\n", bufStrError());
+			exitCode = 73;
+			goto cleanupUsb;
+		}
+		target.device = (uint8)devIndex->ival[0];
+		target.sample = device->Sample;
+		target.extest = device->Extest;
+		target.bsrLen = device->BSRLen;
+		printf("Programming %s into the SPI flash on the %s's pins...\n", load->filename[0], device->DeviceID);
+		if ( spiFlashProgram(deviceHandle, &target, &spiPins, buf.data, buf.length) ) {
+			fprintf(stderr, "SPI flash programming failed (is the firmware built with EXTEST?)\n");
+			exitCode = 74;
+		}
+		goto cleanupUsb;
+	}
+
+	if ( device && device->Manufacturer == ATMEL && devIndex->ival[0] == 0 ) {
+		if ( frameCommand(deviceHandle, CMD_RW_AVR_FUSES, 0, 0, NULL, 0, &buf, 4) ) {
 			exitCode = 12;
 			goto cleanupUsb;
 		}
+		memcpy(u.bytes, buf.data, 4);
 		printf("Fuses = 0x%08lX (EX:HI:LO:LK)\n", u.ints[0]);
 	}
 
 	if ( fuses->count ) {
 		if ( device->Manufacturer == ATMEL ) {
 			printf("Setting fuses to 0x%08X\n", fuses->ival[0]);
-			if ( controlMsgWrite(deviceHandle, CMD_RW_AVR_FUSES,
-								 fuses->ival[0] >> 16,     // wValue: extByte<<8 | highByte
-								 fuses->ival[0] & 0xFFFF,  // wIndex: lowByte<<8 | lockBits
-								 NULL, 0) )
-			{
+			if ( frameWrite(deviceHandle, CMD_RW_AVR_FUSES, FRAME_WRITE, fuses->ival[0], NULL, 0, &fuseSeq) ) {
 				exitCode = 13;
 				goto cleanupUsb;
 			}
@@ -341,10 +892,20 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if ( erase->count ) {
+	// A flash write resumed from a checkpoint must not lose the pages it
+	// has already programmed
+	if ( checkpoint->count && !checkpointRead(checkpoint->filename[0], &resume) ) {
+		haveResume = true;
+		skipErase = erase->count && load->count && resume.opcode == CMD_WR_AVR_FLASH &&
+			isFlashImage(load->filename[0]);
+	}
+
+	if ( skipErase ) {
+		printf("Not erasing: resuming the flash write recorded in %s\n", checkpoint->filename[0]);
+	} else if ( erase->count ) {
 		if ( device->Manufacturer == ATMEL ) {
 			printf("Erasing chip...\n");
-			if ( controlMsgWrite(deviceHandle, CMD_ERASE_AVR_FLASH, 0, 0, NULL, 0) ) {
+			if ( frameWrite(deviceHandle, CMD_ERASE_AVR_FLASH, 0, 0, NULL, 0, &eraseSeq) ) {
 				exitCode = 14;
 				goto cleanupUsb;
 			}
@@ -357,54 +918,253 @@ int main(int argc, char **argv) {
 
 	if ( load->count ) {
 		const char *fileName = load->filename[0];
+
+		// From here on, Ctrl-C cancels the load's job, even while its data is
+		// still being sent
+		previousInterrupt = signal(SIGINT, onInterrupt);
+		frameShowProgress(
+			!strcmp(fileName + strlen(fileName) - 5, ".xsvf") ? "Playing" :
+			!strcmp(fileName + strlen(fileName) - 4, ".bit") ? "Configuring" : "Programming");
 		if ( !strcmp(fileName + strlen(fileName) - 5, ".xsvf") ) {
-			printf("Playing XSVF file %s...\n", fileName);
+			uint8 xsvfFlags = 0x00;
+			uint32 xsvfTarget = 0;
+			if ( devIndex->count ) {
+				// The file is for the device alone; the firmware pads it for the rest
+				if ( firstUnrecognised < numDevices ) {
+					fprintf(stderr, "Cannot play to device %d alone because device %d is unrecognised\n",
+						devIndex->ival[0], firstUnrecognised);
+					exitCode = 75;
+					goto cleanupUsb;
+				}
+				xsvfFlags = FRAME_XSVF_TARGET;
+				xsvfTarget = devIndex->ival[0];
+				printf("Playing XSVF file %s to device %d...\n", fileName, devIndex->ival[0]);
+			} else {
+				printf("Playing XSVF file %s...\n", fileName);
+			}
 			if ( bufAppendFromBinaryFile(&buf, fileName) ) {
 				fprintf(stderr, "Cannot load: %s\n", bufStrError());
 				exitCode = 16;
 				goto cleanupUsb;
 			}
-			if ( bulkWrite(deviceHandle, CMD_PLAY_XSVF, &buf) ) {
+			loadCommand = CMD_PLAY_XSVF;
+			if ( checkpoint->count ) {
+				watch.fileName = checkpoint->filename[0];
+				watch.checkpoint.opcode = CMD_PLAY_XSVF;
+				watch.checkpoint.size = buf.length;
+				watch.checkpoint.hash = checkpointHash(buf.data, buf.length);
+				if ( xsvfIndex(buf.data, buf.length, &watch.xsirs, &watch.numXsirs) ) {
+					fprintf(stderr, "Cannot checkpoint %s: it holds records the firmware does not play\n", fileName);
+					exitCode = 64;
+					goto cleanupUsb;
+				}
+				if ( haveResume && resume.opcode == CMD_PLAY_XSVF && resume.size == buf.length &&
+				     resume.hash == watch.checkpoint.hash )
+				{
+					while ( watch.firstXsir < watch.numXsirs && watch.xsirs[watch.firstXsir] != resume.offset ) {
+						watch.firstXsir++;
+					}
+				}
+				frameWatchJobs(onJobStatus, &watch);
+			}
+			if ( watch.firstXsir < watch.numXsirs && watch.firstXsir ) {
+				Buffer program;
+				watch.checkpoint.offset = resume.offset;
+				printf("Resuming at offset 0x%08lX (XSIR %lu of %lu)\n",
+					resume.offset, watch.firstXsir + 1, watch.numXsirs);
+				if ( bufInitialise(&program, 1024, 0x00) != BUF_SUCCESS ) {
+					fprintf(stderr, "Cannot allocate buffer: %s\n", bufStrError());
+					exitCode = 64;
+					goto cleanupUsb;
+				}
+				if ( xsvfResume(buf.data, buf.length, resume.offset, &program) ) {
+					fprintf(stderr, "Cannot resume %s\n", fileName);
+					bufDestroy(&program);
+					exitCode = 64;
+					goto cleanupUsb;
+				}
+				returnCode = frameWrite(deviceHandle, loadCommand, xsvfFlags, xsvfTarget,
+				                        program.data, program.length, &loadSeq);
+				bufDestroy(&program);
+			} else {
+				watch.firstXsir = 0;
+				returnCode = frameWrite(deviceHandle, loadCommand, xsvfFlags, xsvfTarget,
+				                        buf.data, buf.length, &loadSeq);
+			}
+			if ( returnCode ) {
 				exitCode = 17;
 				goto cleanupUsb;
 			}
-		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".hex") ) {
+		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".bit") ) {
+			const char *partName;
+			uint32 offset, length;
+			uint8 target = 0;
+			if ( devIndex->count ) {
+				target = (uint8)devIndex->ival[0];
+			} else {
+				while ( target < numDevices && !isSpartan3(devices[target]) ) {
+					target++;
+				}
+			}
+			if ( target >= numDevices || !isSpartan3(devices[target]) ) {
+				fprintf(stderr, "Configuring from .bit files is only supported on the XC3S200\n");
+				exitCode = 38;
+				goto cleanupUsb;
+			}
+			if ( firstUnrecognised < numDevices ) {
+				fprintf(stderr, "Cannot address device %d because device %d is unrecognised\n", target, firstUnrecognised);
+				exitCode = 39;
+				goto cleanupUsb;
+			}
+			if ( bufAppendFromBinaryFile(&buf, fileName) ) {
+				fprintf(stderr, "Cannot load: %s\n", bufStrError());
+				exitCode = 40;
+				goto cleanupUsb;
+			}
+			if ( bitFindBitstream(&buf, &partName, &offset, &length) ) {
+				fprintf(stderr, "%s is not a valid .bit file\n", fileName);
+				exitCode = 41;
+				goto cleanupUsb;
+			}
+			if ( partName && strncmp(partName, "3s200", 5) ) {
+				fprintf(stderr, "%s is for a %s, not an XC3S200\n", fileName, partName);
+				exitCode = 42;
+				goto cleanupUsb;
+			}
+			printf("Configuring device %d from %s (%lu bytes)...\n", target, fileName, length);
+			loadCommand = CMD_CFG_SPARTAN3;
+			if ( frameWrite(deviceHandle, loadCommand, 0, target, buf.data + offset, length, &loadSeq) ) {
+				exitCode = 43;
+				goto cleanupUsb;
+			}
+		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".mcs") ||
+		            !strcmp(fileName + strlen(fileName) - 4, ".bin") )
+		{
+			Buffer records;
+			uint32 numRecords;
+			uint8 target = 0;
+			if ( devIndex->count ) {
+				target = (uint8)devIndex->ival[0];
+			} else {
+				while ( target < numDevices && !isXcf(devices[target]) ) {
+					target++;
+				}
+			}
+			if ( target >= numDevices || !isXcf(devices[target]) ) {
+				fprintf(stderr, "Programming from .mcs or .bin files is only supported on the XCF02S\n");
+				exitCode = 45;
+				goto cleanupUsb;
+			}
+			if ( firstUnrecognised < numDevices ) {
+				fprintf(stderr, "Cannot address device %d because device %d is unrecognised\n", target, firstUnrecognised);
+				exitCode = 46;
+				goto cleanupUsb;
+			}
+			if ( imageLoad(&image, fileName) || imageFlatten(&image, 0, imageEnd(&image), 0xFF, &buf) ) {
+				fprintf(stderr, "Cannot load: %s\n", imageStrError());
+				exitCode = 47;
+				goto cleanupUsb;
+			}
+			if ( buf.length > XCF_NUM_ROWS * XCF_ROW_BYTES ) {
+				fprintf(stderr, "%s contains 0x%08lX bytes which is too big for the XCF02S\n", fileName, buf.length);
+				exitCode = 48;
+				goto cleanupUsb;
+			}
+			if ( bufInitialise(&records, 1024, 0xFF) != BUF_SUCCESS ) {
+				fprintf(stderr, "Cannot allocate buffer: %s\n", bufStrError());
+				exitCode = 49;
+				goto cleanupUsb;
+			}
+			if ( xcfMakeRecords(&buf, &records, &numRecords) ) {
+				fprintf(stderr, "%s\n", bufStrError());
+				bufDestroy(&records);
+				exitCode = 50;
+				goto cleanupUsb;
+			}
+			if ( numRecords == 0 ) {
+				fprintf(stderr, "%s is blank\n", fileName);
+				bufDestroy(&records);
+				exitCode = 51;
+				goto cleanupUsb;
+			}
+			printf("Programming device %d from %s (%lu of %d rows hold data)...\n",
+				target, fileName, numRecords, XCF_NUM_ROWS);
+			loadCommand = CMD_PROG_XCF;
+			returnCode = frameWrite(deviceHandle, loadCommand, 0, target, records.data, records.length, &loadSeq);
+			bufDestroy(&records);
+			if ( returnCode ) {
+				exitCode = 52;
+				goto cleanupUsb;
+			}
+		} else if ( isFlashImage(fileName) ) {
 			if ( device ) {
 				if ( device->Manufacturer == ATMEL ) {
-					uint32 extraBytes, numBlocks;
-					printf("Programming Atmel chip using HEX file %s...\n", fileName);
-					if ( bufReadFromIntelHexFile(&buf, NULL, fileName) ) {
-						fprintf(stderr, "Cannot load: %s\n", bufStrError());
+					printf("Programming Atmel chip using %s...\n", fileName);
+					if ( imageLoad(&image, fileName) ) {
+						fprintf(stderr, "Cannot load: %s\n", imageStrError());
 						exitCode = 18;
-						goto cleanupBuffer;
+						goto cleanupUsb;
 					}
-					numBlocks = (buf.length % BLOCK_SIZE) ?
-						(buf.length / BLOCK_SIZE) + 1 :
-						(buf.length / BLOCK_SIZE);
-					if ( numBlocks > device->NumBlocks ) {
+					numPages = (imageEnd(&image) + device->PageSize - 1) / device->PageSize;
+					if ( numPages > device->NumPages ) {
 						fprintf(
 							stderr,
-							"%s contains 0x%08lX bytes which is too big for the %s which only has 0x%08X bytes of flash",
+							"%s ends at 0x%08lX which is too big for the %s which only has 0x%08lX bytes of flash\n",
 							fileName,
-							buf.length,
+							imageEnd(&image),
 							device->DeviceID,
-							BLOCK_SIZE * device->NumBlocks
+							flashSize(device)
 						);
 						exitCode = 19;
 						goto cleanupUsb;
 					}
-					extraBytes = BLOCK_SIZE * numBlocks - buf.length;
-					if ( bufAppendConst(&buf, extraBytes, 0xFF, NULL) ) {
-						fprintf(stderr, "%s\n", bufStrError());
+					if ( numPages == 0 ) {
+						fprintf(stderr, "%s holds no data\n", fileName);
+						exitCode = 88;
+						goto cleanupUsb;
+					}
+					loadCommand = CMD_WR_AVR_FLASH;
+					if ( checkpoint->count ) {
+						// A checkpoint counts through one flat write from address zero, so
+						// the gaps are written with 0xFF too
+						runPages = numPages;
+					} else {
+						// Only the runs of pages the image touches are written, one request
+						// at a time; the rest of the flash is left as it is
+						runPages = nextRun(&image, device->PageSize, numPages, &runPage);
+					}
+					if ( imageFlatten(&image, runPage * device->PageSize, runPages * device->PageSize, 0xFF, &buf) ) {
+						fprintf(stderr, "%s\n", imageStrError());
 						exitCode = 20;
 						goto cleanupUsb;
 					}
-					if ( bulkWrite(deviceHandle, CMD_WR_AVR_FLASH, &buf) ) {
+					if ( checkpoint->count ) {
+						watch.fileName = checkpoint->filename[0];
+						watch.checkpoint.opcode = CMD_WR_AVR_FLASH;
+						watch.checkpoint.size = buf.length;
+						watch.checkpoint.hash = checkpointHash(buf.data, buf.length);
+						if ( haveResume && resume.opcode == CMD_WR_AVR_FLASH && resume.size == buf.length &&
+						     resume.hash == watch.checkpoint.hash && resume.offset % device->PageSize == 0 )
+						{
+							watch.checkpoint.offset = resume.offset;
+							printf("Resuming at offset 0x%08lX\n", resume.offset);
+						} else if ( skipErase ) {
+							fprintf(stderr, "%s was recorded for a different file; delete it to start again\n",
+								checkpoint->filename[0]);
+							exitCode = 63;
+							goto cleanupUsb;
+						}
+						frameWatchJobs(onJobStatus, &watch);
+					}
+					if ( frameWrite(deviceHandle, loadCommand, 0, runPage * device->PageSize + watch.checkpoint.offset,
+					                buf.data + watch.checkpoint.offset, buf.length - watch.checkpoint.offset, &loadSeq) )
+					{
 						exitCode = 21;
 						goto cleanupUsb;
 					}
+					runPage += runPages;
 				} else {
-					fprintf(stderr, "Loading HEX files is only supported on Atmel devices\n");
+					fprintf(stderr, "Loading flash images is only supported on Atmel devices\n");
 					exitCode = 22;
 					goto cleanupUsb;
 				}
@@ -413,16 +1173,116 @@ int main(int argc, char **argv) {
 				exitCode = 23;
 				goto cleanupUsb;
 			}
+		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".eep") ) {
+			// EEPROM images are HEX files too, written a page at a time
+			if ( !device || device->Manufacturer != ATMEL ) {
+				fprintf(stderr, "Loading EEPROM files is only supported on Atmel devices\n");
+				exitCode = 76;
+				goto cleanupUsb;
+			}
+			printf("Programming Atmel EEPROM using HEX file %s...\n", fileName);
+			if ( imageLoad(&image, fileName) ) {
+				fprintf(stderr, "Cannot load: %s\n", imageStrError());
+				exitCode = 77;
+				goto cleanupUsb;
+			}
+			numPages = (imageEnd(&image) + device->EepromPageSize - 1) / device->EepromPageSize;
+			if ( numPages > device->EepromPages ) {
+				fprintf(
+					stderr,
+					"%s ends at 0x%08lX which is too big for the %s which only has 0x%08lX bytes of EEPROM\n",
+					fileName,
+					imageEnd(&image),
+					device->DeviceID,
+					eepromSize(device)
+				);
+				exitCode = 78;
+				goto cleanupUsb;
+			}
+			if ( imageFlatten(&image, 0, device->EepromPageSize * numPages, 0xFF, &buf) ) {
+				fprintf(stderr, "%s\n", imageStrError());
+				exitCode = 79;
+				goto cleanupUsb;
+			}
+			loadCommand = CMD_WR_AVR_EEPROM;
+			if ( frameWrite(deviceHandle, loadCommand, 0, 0, buf.data, buf.length, &loadSeq) ) {
+				exitCode = 80;
+				goto cleanupUsb;
+			}
 		} else {
 			fprintf(stderr, "File %s has unrecognised extension\n", fileName);
 			exitCode = 24;
 			goto cleanupUsb;
 		}
-		if ( controlMsgRead(deviceHandle, CMD_STATUS, 0, 0, u.bytes, 8) ) {
-			exitCode = 25;
+	}
+
+	// The fuse, erase and load requests above were pipelined; collect their
+	// responses in the order they were sent.
+	if ( fuses->count ) {
+		if ( frameRead(deviceHandle, CMD_RW_AVR_FUSES, fuseSeq, &buf, 0, &response) || response.status ) {
+			fprintf(stderr, "Setting fuses failed\n");
+			exitCode = 32;
+			goto cleanupUsb;
+		}
+	}
+	if ( erase->count && !skipErase ) {
+		if ( frameRead(deviceHandle, CMD_ERASE_AVR_FLASH, eraseSeq, &buf, 0, &response) || response.status ) {
+			fprintf(stderr, "Erasing failed\n");
+			exitCode = 33;
 			goto cleanupUsb;
 		}
-		printf("Load operation completed with returncode 0x%08lX, numfails=%lu\n", u.ints[0], u.ints[1]);
+	}
+	if ( load->count ) {
+		for ( ; ; ) {
+			if ( frameWaitJob(deviceHandle, loadSeq) ) {
+				exitCode = 60;
+				goto cleanupUsb;
+			}
+			if ( frameRead(deviceHandle, loadCommand, loadSeq, &buf, 0, &response) ) {
+				exitCode = 25;
+				goto cleanupUsb;
+			}
+			if ( loadCommand != CMD_WR_AVR_FLASH || response.status ) {
+				break;
+			}
+
+			// Write the flash image's next run of pages, if it has one
+			runPages = nextRun(&image, device->PageSize, numPages, &runPage);
+			if ( !runPages ) {
+				break;
+			}
+			if ( imageFlatten(&image, runPage * device->PageSize, runPages * device->PageSize, 0xFF, &buf) ) {
+				fprintf(stderr, "%s\n", imageStrError());
+				exitCode = 20;
+				goto cleanupUsb;
+			}
+			if ( frameWrite(deviceHandle, loadCommand, 0, runPage * device->PageSize, buf.data, buf.length, &loadSeq) ) {
+				exitCode = 21;
+				goto cleanupUsb;
+			}
+			runPage += runPages;
+		}
+		frameShowProgress(NULL);
+		signal(SIGINT, previousInterrupt);
+		printf("Load operation completed with returncode 0x%02X, numfails=%lu\n", response.status, response.failures);
+		if ( watch.fileName && response.status != FRAME_CANCELLED ) {
+			remove(watch.fileName);  // finished, so there is nothing to resume
+		}
+		if ( loadCommand == CMD_PLAY_XSVF ) {
+			uint32 failuresB = 0;
+			if ( dual->count ) {
+				JobStatus status;
+				if ( frameJobStatus(deviceHandle, &status) == 0 ) {
+					failuresB = status.failuresB;
+					printf("Second chain numfails=%lu\n", failuresB);
+				}
+			}
+			if ( response.failures || failuresB ) {
+				printXsvfFailures(deviceHandle, load->filename[0],
+					watch.firstXsir ? watch.xsirs[watch.firstXsir] : 0,
+					response.failures > failuresB ? response.failures : failuresB);
+			}
+		}
 	}
 
 	if ( save->count ) {
@@ -430,7 +1290,9 @@ int main(int argc, char **argv) {
 		if ( !strcmp(fileName + strlen(fileName) - 4, ".hex") ) {
 			if ( device ) {
 				if ( device->Manufacturer == ATMEL ) {
-					if ( bulkRead(deviceHandle, CMD_RD_AVR_FLASH, &buf, BLOCK_SIZE * device->NumBlocks) ) {
+					if ( frameCommand(deviceHandle, CMD_RD_AVR_FLASH, 0, flashSize(device),
+					                  NULL, 0, &buf, flashSize(device)) )
+					{
 						exitCode = 26;
 						goto cleanupUsb;
 					}
@@ -449,23 +1311,97 @@ int main(int argc, char **argv) {
 				exitCode = 29;
 				goto cleanupUsb;
 			}
+		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".eep") ) {
+			if ( !device || device->Manufacturer != ATMEL ) {
+				fprintf(stderr, "Saving EEPROM files is only supported on Atmel devices\n");
+				exitCode = 81;
+				goto cleanupUsb;
+			}
+			if ( frameCommand(deviceHandle, CMD_RD_AVR_EEPROM, 0, eepromSize(device),
+			                  NULL, 0, &buf, eepromSize(device)) )
+			{
+				exitCode = 82;
+				goto cleanupUsb;
+			}
+			if ( bufWriteToIntelHexFile(&buf, NULL, fileName, 16, true) ) {
+				fprintf(stderr, "Cannot write hex records: %s\n", bufStrError());
+				exitCode = 83;
+				goto cleanupUsb;
+			}
+		} else if ( !strcmp(fileName + strlen(fileName) - 4, ".ram") ) {
+			// The registers, I/O registers and SRAM, read through on-chip debug
+			// without resetting the AVR, as a flat image of its data space
+			if ( !device || device->Manufacturer != ATMEL ) {
+				fprintf(stderr, "Dumping RAM is only supported on Atmel devices\n");
+				exitCode = 84;
+				goto cleanupUsb;
+			}
+			if ( frameCommand(deviceHandle, CMD_RD_AVR_SRAM, 0, device->DataSize,
+			                  NULL, 0, &buf, device->DataSize) )
+			{
+				exitCode = 85;
+				goto cleanupUsb;
+			}
+			if ( bufWriteBinaryFile(&buf, fileName, 0, buf.length) ) {
+				fprintf(stderr, "Cannot write RAM dump: %s\n", bufStrError());
+				exitCode = 86;
+				goto cleanupUsb;
+			}
 		} else {
 			fprintf(stderr, "File %s has unrecognised extension\n", fileName);
 			exitCode = 30;
 			goto cleanupUsb;
 		}
-		if ( controlMsgRead(deviceHandle, CMD_STATUS, 0, 0, u.bytes, 8) ) {
-			exitCode = 31;
+		printf("Save operation completed\n");
+	}
+
+	if ( sample->count ) {
+		if ( !device ) {
+			fprintf(stderr, "You must select the target device!\n");
+			exitCode = 34;
+			goto cleanupUsb;
+		}
+		if ( !device->BSRLen ) {
+			fprintf(stderr, "Sampling is not supported on the %s\n", device->DeviceID);
+			exitCode = 35;
+			goto cleanupUsb;
+		}
+		if ( firstUnrecognised < numDevices ) {
+			fprintf(stderr, "Cannot sample because device %d is unrecognised\n", firstUnrecognised);
+			exitCode = 44;
+			goto cleanupUsb;
+		}
+		if ( !vcd->count ) {
+			fprintf(stderr, "You must give a VCD file to write the snapshots to\n");
+			exitCode = 36;
+			goto cleanupUsb;
+		}
+		if ( sampleToVcd(deviceHandle, (uint8)devIndex->ival[0], device, sample->ival[0],
+		                 pins->count ? pins->filename[0] : NULL, vcd->filename[0], &buf) )
+		{
+			exitCode = 37;
 			goto cleanupUsb;
 		}
-		printf("Save operation completed with returncode 0x%08lX, numfails=%lu\n", u.ints[0], u.ints[1]);
 	}
 
 	cleanupUsb:
-		usb_release_interface(deviceHandle, 0);
-		usb_close(deviceHandle);
+		if ( capturing ) {
+			captureStop(deviceHandle, &jtagCapture);
+			printf("Captured %llu TCK cycles (%llu dropped) to %s\n",
+				(unsigned long long)jtagCapture.cycles, (unsigned long long)jtagCapture.dropped,
+				capture->filename[0]);
+		}
+		if ( deviceHandle ) {
+			usb_release_interface(deviceHandle, 0);
+			usb_close(deviceHandle);
+		}
 
 	cleanupBuffer:
+		free(watch.xsirs);
+		imageDestroy(&image);
+		standInClose();
+		sessionClose();
+		traceClose();
 		bufDestroy(&buf);
 
 	cleanupArgtable:
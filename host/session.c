@@ -0,0 +1,167 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "session.h"
+#include "timer.h"
+
+#ifdef WIN32
+#pragma warning(disable : 4996)
+#endif
+
+#define SESSION_MAGIC "nj-session 1\n"
+
+// Each transfer is a SessionRecord followed by its data: what was sent for an
+// OUT transfer, what came back for an IN one
+//
+typedef struct {
+	uint8 kind;       // SessionKind
+	uint8 request;    // the command the transfer belongs to
+	uint16 value;     // wValue, for control transfers
+	int32 result;     // what libusb returned
+	uint32 micros;    // when the transfer finished, from the start of the session
+	uint32 length;    // of the data which follows
+} SessionRecord;
+
+static FILE *m_record = NULL;
+static FILE *m_replay = NULL;
+static bool m_realTime;
+static uint64 m_origin;
+static uint32 m_count;    // transfers so far
+static uint8 *m_data = NULL;
+static uint32 m_capacity;
+
+int sessionRecordOpen(const char *fileName) {
+	m_record = fopen(fileName, "wb");
+	if ( !m_record ) {
+		return 1;
+	}
+	if ( fputs(SESSION_MAGIC, m_record) < 0 ) {
+		fclose(m_record);
+		m_record = NULL;
+		return 2;
+	}
+	m_origin = timerMicros();
+	m_count = 0;
+	return 0;
+}
+
+// Note a transfer made to the device; length is how much was asked for, and
+// result says how much of it was actually moved
+//
+void sessionRecord(
+	SessionKind kind, uint8 request, uint16 value, const uint8 *data, uint32 length, int result)
+{
+	SessionRecord record;
+	if ( !m_record ) {
+		return;
+	}
+	if ( kind == SESSION_BULK_IN || kind == SESSION_CONTROL_IN ) {
+		length = result > 0 ? (uint32)result : 0;
+	}
+	record.kind = (uint8)kind;
+	record.request = request;
+	record.value = value;
+	record.result = result;
+	record.micros = (uint32)(timerMicros() - m_origin);
+	record.length = length;
+	if ( fwrite(&record, sizeof(record), 1, m_record) != 1 ||
+	     (length && fwrite(data, 1, length, m_record) != length) )
+	{
+		fprintf(stderr, "Session recording failed after %lu transfers\n", m_count);
+		fclose(m_record);
+		m_record = NULL;
+		return;
+	}
+	m_count++;
+}
+
+int sessionReplayOpen(const char *fileName, bool realTime) {
+	char magic[sizeof(SESSION_MAGIC)];
+	m_replay = fopen(fileName, "rb");
+	if ( !m_replay ) {
+		return 1;
+	}
+	if ( !fgets(magic, sizeof(magic), m_replay) || strcmp(magic, SESSION_MAGIC) ) {
+		fclose(m_replay);
+		m_replay = NULL;
+		return 2;
+	}
+	m_realTime = realTime;
+	m_origin = timerMicros();
+	m_count = 0;
+	return 0;
+}
+
+// Answer a transfer from the recording. It must match the next transfer
+// recorded; if it doesn't, or the recording has run out, it fails.
+//
+int sessionReplay(SessionKind kind, uint8 request, uint16 value, uint8 *data, uint32 length) {
+	SessionRecord record;
+	uint64 elapsed;
+	if ( !m_replay ) {
+		return -1;
+	}
+	if ( fread(&record, sizeof(record), 1, m_replay) != 1 ) {
+		fprintf(stderr, "Session recording ends before transfer %lu\n", m_count);
+		return -1;
+	}
+	if ( record.length > m_capacity ) {
+		free(m_data);
+		m_data = (uint8 *)malloc(record.length);
+		m_capacity = m_data ? record.length : 0;
+	}
+	if ( record.length > m_capacity || fread(m_data, 1, record.length, m_replay) != record.length ) {
+		fprintf(stderr, "Session recording is truncated at transfer %lu\n", m_count);
+		return -1;
+	}
+	if ( record.kind != (uint8)kind || record.request != request || record.value != value ||
+	     ((kind == SESSION_BULK_OUT || kind == SESSION_CONTROL_OUT) &&
+	      (record.length != length || memcmp(m_data, data, length))) ||
+	     ((kind == SESSION_BULK_IN || kind == SESSION_CONTROL_IN) && record.length > length) )
+	{
+		fprintf(stderr, "Session diverges from the recording at transfer %lu (command 0x%02X)\n",
+			m_count, request);
+		return -1;
+	}
+	if ( kind == SESSION_BULK_IN || kind == SESSION_CONTROL_IN ) {
+		memcpy(data, m_data, record.length);
+	}
+	if ( m_realTime ) {
+		elapsed = timerMicros() - m_origin;
+		if ( elapsed < record.micros ) {
+			timerSleep((uint32)((record.micros - elapsed + 999) / 1000));
+		}
+	}
+	m_count++;
+	return record.result;
+}
+
+void sessionClose(void) {
+	if ( m_record ) {
+		fclose(m_record);
+		m_record = NULL;
+	}
+	if ( m_replay ) {
+		fclose(m_replay);
+		m_replay = NULL;
+	}
+	free(m_data);
+	m_data = NULL;
+	m_capacity = 0;
+}
@@ -0,0 +1,43 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "types.h"
+
+// Every USB transfer nj makes can be recorded to a session file, and the file
+// replayed later in place of the device: with the original timing, or as fast
+// as possible. A replay must make the same transfers as the recording did, in
+// the same order and with the same OUT data, so run it with the same options.
+//
+typedef enum {
+	SESSION_BULK_OUT = 1,
+	SESSION_BULK_IN,
+	SESSION_CONTROL_OUT,
+	SESSION_CONTROL_IN
+} SessionKind;
+
+int sessionRecordOpen(const char *fileName);
+void sessionRecord(
+	SessionKind kind, uint8 request, uint16 value, const uint8 *data, uint32 length, int result);
+
+int sessionReplayOpen(const char *fileName, bool realTime);
+int sessionReplay(SessionKind kind, uint8 request, uint16 value, uint8 *data, uint32 length);
+
+void sessionClose(void);
+
+#endif
@@ -0,0 +1,203 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spibus.h"
+
+#define SPI_MAX_POLLS     10000
+#define SPI_MAX_PAYLOAD   0x10000  // a flash page's worth of scans, with room to spare
+
+static void busBegin(SpiBus *bus) {
+	memcpy(bus->payload, &bus->request, sizeof(ExtestRequest));
+	memcpy(bus->payload + sizeof(ExtestRequest), bus->vector, bus->bsrBytes);
+	bus->length = sizeof(ExtestRequest) + bus->bsrBytes;
+	bus->numCaptures = 0;
+}
+
+static void busSet(SpiBus *bus, uint16 cell, uint8 value) {
+	if ( cell == EXTEST_NO_CELL || ((bus->vector[cell >> 3] >> (cell & 7)) & 0x01) == value ) {
+		return;
+	}
+	bus->vector[cell >> 3] ^= 1 << (cell & 7);
+	bus->toggled[bus->numToggled++] = cell;
+}
+
+static int busScan(SpiBus *bus, uint8 capture) {
+	uint8 i;
+	if ( bus->length + 1 + 2 * bus->numToggled > SPI_MAX_PAYLOAD ) {
+		fprintf(stderr, "Too many scans queued for one CMD_EXTEST request\n");
+		return 1;
+	}
+	bus->payload[bus->length++] = bus->numToggled | (capture ? EXTEST_CAPTURE : 0x00);
+	for ( i = 0; i < bus->numToggled; i++ ) {
+		bus->payload[bus->length++] = (uint8)bus->toggled[i];
+		bus->payload[bus->length++] = (uint8)(bus->toggled[i] >> 8);
+	}
+	bus->numToggled = 0;
+	if ( capture ) {
+		bus->numCaptures++;
+	}
+	bus->numScans++;
+	return 0;
+}
+
+// The pins start with every cell at one, which leaves the outputs of a Xilinx
+// part undriven, then the SPI signals are enabled, with the flash deselected
+//
+int spiBusInit(SpiBus *bus, const ExtestTarget *target, const SpiPins *pins, SpiSend send, void *context) {
+	memset(bus, 0, sizeof(SpiBus));
+	bus->send = send;
+	bus->context = context;
+	bus->pins = pins;
+	bus->request.device = target->device;
+	bus->request.sample = target->sample;
+	bus->request.extest = target->extest;
+	bus->request.bsrLen = target->bsrLen;
+	bus->request.numReads = 1;
+	bus->request.readCells[0] = pins->miso;
+	bus->bsrBytes = (target->bsrLen + 7) / 8;
+	if ( bus->bsrBytes > EXTEST_MAX_BYTES ) {
+		fprintf(stderr, "The boundary register is too long for the firmware\n");
+		return 1;
+	}
+	bus->payload = malloc(SPI_MAX_PAYLOAD);
+	if ( !bus->payload ) {
+		fprintf(stderr, "Cannot allocate the CMD_EXTEST request\n");
+		return 2;
+	}
+	memset(bus->vector, 0xFF, bus->bsrBytes);
+	busSet(bus, pins->csCtl, 0);
+	busSet(bus, pins->sckCtl, 0);
+	busSet(bus, pins->mosiCtl, 0);
+	busSet(bus, pins->sck, 0);
+	busSet(bus, pins->mosi, 0);
+	bus->numToggled = 0;  // the first vector goes whole
+	busBegin(bus);
+	return 0;
+}
+
+void spiBusDestroy(SpiBus *bus) {
+	free(bus->payload);
+	bus->payload = NULL;
+}
+
+// Send the request built so far, and start the next
+//
+int spiBusFlush(SpiBus *bus, uint8 release) {
+	const uint32 resultBytes = (bus->numCaptures * bus->request.numReads + 7) / 8;
+	((ExtestRequest *)bus->payload)->flags = release ? EXTEST_RELEASE : 0x00;
+	if ( bus->send(bus->context, bus->payload, bus->length, bus->numCaptures, bus->result, resultBytes) ) {
+		return 1;
+	}
+	busBegin(bus);
+	return 0;
+}
+
+// Deselect the flash and give the pins back, dropping anything left queued
+//
+int spiBusRelease(SpiBus *bus) {
+	busBegin(bus);
+	return spiSelect(bus, 0) || spiBusFlush(bus, 1);
+}
+
+// Byte n of what the last request read on MISO, MSB first
+//
+uint8 spiBusResult(const SpiBus *bus, uint32 n) {
+	uint8 value = 0x00;
+	uint32 bit;
+	for ( bit = 8 * n; bit < 8 * n + 8; bit++ ) {
+		value = (uint8)((value << 1) | ((bus->result[bit >> 3] >> (bit & 7)) & 0x01));
+	}
+	return value;
+}
+
+// SPI mode 0: MOSI is set up with SCK low and sampled on the rising edge; the
+// scan which raises SCK captures MISO as the flash drove it after the fall.
+//
+int spiSelect(SpiBus *bus, uint8 select) {
+	busSet(bus, bus->pins->sck, 0);
+	busSet(bus, bus->pins->cs, select ? 0 : 1);
+	return busScan(bus, 0);
+}
+
+int spiByte(SpiBus *bus, uint8 byte, uint8 read) {
+	uint8 mask;
+	for ( mask = 0x80; mask; mask >>= 1 ) {
+		busSet(bus, bus->pins->sck, 0);
+		busSet(bus, bus->pins->mosi, (byte & mask) ? 1 : 0);
+		if ( busScan(bus, 0) ) {
+			return 1;
+		}
+		busSet(bus, bus->pins->sck, 1);
+		if ( busScan(bus, read) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Queue a whole command: select, send numOut bytes, read numIn, deselect
+//
+int spiCommand(SpiBus *bus, const uint8 *out, uint32 numOut, uint32 numIn) {
+	if ( spiSelect(bus, 1) ) {
+		return 1;
+	}
+	while ( numOut-- ) {
+		if ( spiByte(bus, *out++, 0) ) {
+			return 1;
+		}
+	}
+	while ( numIn-- ) {
+		if ( spiByte(bus, 0x00, 1) ) {
+			return 1;
+		}
+	}
+	return spiSelect(bus, 0);
+}
+
+int spiAddressed(SpiBus *bus, uint8 command, uint32 address, const uint8 *data, uint32 length) {
+	if ( spiSelect(bus, 1) || spiByte(bus, command, 0) || spiByte(bus, (uint8)(address >> 16), 0) ||
+	     spiByte(bus, (uint8)(address >> 8), 0) || spiByte(bus, (uint8)address, 0) )
+	{
+		return 1;
+	}
+	while ( length-- ) {
+		if ( spiByte(bus, *data++, 0) ) {
+			return 1;
+		}
+	}
+	return spiSelect(bus, 0);
+}
+
+// Send what is queued, with a status read on the end, and keep polling the
+// status until the flash is no longer busy
+//
+int spiFlushAndWait(SpiBus *bus) {
+	const uint8 readStatus = SPI_READ_STATUS;
+	uint32 polls;
+	for ( polls = 0; polls < SPI_MAX_POLLS; polls++ ) {
+		if ( spiCommand(bus, &readStatus, 1, 1) || spiBusFlush(bus, 0) ) {
+			return 1;
+		}
+		if ( !(spiBusResult(bus, 0) & SPI_STATUS_BUSY) ) {
+			return 0;
+		}
+	}
+	fprintf(stderr, "The SPI flash stayed busy\n");
+	return 1;
+}
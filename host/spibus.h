@@ -0,0 +1,93 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SPIBUS_H
+#define SPIBUS_H
+
+#include "types.h"
+#include "../commands.h"
+
+// Drives a 25-series SPI flash wired to the pins of a device in the chain,
+// through the device's boundary register (EXTEST). Each scan is queued as a
+// CMD_EXTEST record of the cells it toggles, and the queue goes to the
+// firmware as one request when a result is needed (or it reaches a flash
+// page's worth), so the chain, not the USB round trips, sets the pace. nj
+// and the simulator's benchmark both build their requests here, each
+// sending them its own way.
+//
+#define EXTEST_NO_CELL 0xFFFF
+
+// 25-series SPI flash commands
+#define SPI_WRITE_ENABLE  0x06
+#define SPI_READ_STATUS   0x05
+#define SPI_READ          0x03
+#define SPI_PAGE_PROGRAM  0x02
+#define SPI_SECTOR_ERASE  0xD8
+#define SPI_READ_ID       0x9F
+#define SPI_STATUS_BUSY   0x01
+
+#define SPI_PAGE_SIZE     256
+#define SPI_SECTOR_SIZE   0x10000
+#define SPI_READ_CHUNK    (EXTEST_MAX_RESULT)  // bytes, with one read cell
+
+typedef struct {
+	uint16 cs, sck, mosi;            // output cells
+	uint16 csCtl, sckCtl, mosiCtl;   // their control cells (0 enables), or EXTEST_NO_CELL
+	uint16 miso;                     // input cell
+} SpiPins;
+
+typedef struct {
+	uint8 device;     // chain position, nearest TDI first
+	uint8 sample;     // its SAMPLE/PRELOAD instruction
+	uint8 extest;     // and its EXTEST instruction
+	uint16 bsrLen;
+} ExtestTarget;
+
+// Send a CMD_EXTEST request holding captures capturing scans, and put the
+// resultBytes of its response in result; nonzero if that fails
+//
+typedef int (*SpiSend)(
+	void *context, const uint8 *payload, uint32 length, uint32 captures, uint8 *result, uint32 resultBytes);
+
+typedef struct {
+	SpiSend send;
+	void *context;
+	const SpiPins *pins;
+	ExtestRequest request;
+	uint16 bsrBytes;
+	uint8 vector[EXTEST_MAX_BYTES];  // as the last scan queued leaves it
+	uint16 toggled[8];               // cells changed since then
+	uint8 numToggled;
+	uint8 *payload;                  // of the request being built
+	uint32 length;
+	uint32 numCaptures;              // queued in this request
+	uint32 numScans;                 // queued in all
+	uint8 result[EXTEST_MAX_RESULT]; // the bits captured by the last request
+} SpiBus;
+
+int spiBusInit(SpiBus *bus, const ExtestTarget *target, const SpiPins *pins, SpiSend send, void *context);
+void spiBusDestroy(SpiBus *bus);
+int spiBusFlush(SpiBus *bus, uint8 release);
+int spiBusRelease(SpiBus *bus);
+uint8 spiBusResult(const SpiBus *bus, uint32 n);
+
+int spiSelect(SpiBus *bus, uint8 select);
+int spiByte(SpiBus *bus, uint8 byte, uint8 read);
+int spiCommand(SpiBus *bus, const uint8 *out, uint32 numOut, uint32 numIn);
+int spiAddressed(SpiBus *bus, uint8 command, uint32 address, const uint8 *data, uint32 length);
+int spiFlushAndWait(SpiBus *bus);
+
+#endif
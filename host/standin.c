@@ -0,0 +1,229 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "standin.h"
+#include "buffer.h"
+#include "../commands.h"
+
+#define FLASH_SIZE 16384
+#define EEPROM_SIZE 512
+#define DATA_SIZE 0x500
+#define IDCODE 0x0940403FUL   // ATMEGA162 rev A
+#define FUSES 0xFF9962FFUL    // factory defaults (EX:HI:LO:LK)
+#define IR_LENGTH 4
+
+static uint8 m_flash[FLASH_SIZE];
+static uint32 m_fuses;
+static uint16 m_pageSize;
+static uint8 m_eeprom[EEPROM_SIZE];
+static uint16 m_eepromPageSize;
+static uint8 m_data[DATA_SIZE];  // registers, I/O and SRAM
+static FrameHeader m_request;
+static bool m_inRequest;      // header received, payload still arriving
+static uint32 m_received;     // payload bytes received so far
+static Buffer m_payload;
+static Buffer m_responses;    // queued responses, each a FrameResponse and its payload
+static bool m_open = false;
+
+int standInOpen(void) {
+	if ( bufInitialise(&m_payload, 1024, 0x00) != BUF_SUCCESS ) {
+		return 1;
+	}
+	if ( bufInitialise(&m_responses, 1024, 0x00) != BUF_SUCCESS ) {
+		bufDestroy(&m_payload);
+		return 2;
+	}
+	memset(m_flash, 0xFF, FLASH_SIZE);
+	m_fuses = FUSES;
+	m_pageSize = 128;
+	memset(m_eeprom, 0xFF, EEPROM_SIZE);
+	m_eepromPageSize = 4;
+	memset(m_data, 0x00, DATA_SIZE);
+	m_inRequest = false;
+	m_open = true;
+	return 0;
+}
+
+static int respond(uint8 status, const uint8 *payload, uint32 length) {
+	FrameResponse response;
+	response.opcode = m_request.opcode;
+	response.seq = m_request.seq;
+	response.status = status;
+	response.reserved = 0x00;
+	response.failures = 0;
+	response.length = length;
+	if ( bufAppendBlock(&m_responses, (const uint8 *)&response, sizeof(response)) ) {
+		return -1;
+	}
+	if ( length && bufAppendBlock(&m_responses, payload, length) ) {
+		return -1;
+	}
+	return 0;
+}
+
+// Act on a complete request, the way the firmware's frameTask() would
+//
+static int execute(void) {
+	const uint8 *const payload = m_payload.data;
+	const uint32 length = m_request.length;
+	switch ( m_request.opcode ) {
+		case CMD_SCAN: {
+			uint8 idCodes[16*sizeof(uint32)];
+			const uint32 idCode = IDCODE;
+			memset(idCodes, 0x00, sizeof(idCodes));
+			memcpy(idCodes, &idCode, sizeof(idCode));
+			return respond(FRAME_SUCCESS, idCodes, sizeof(idCodes));
+		}
+		case CMD_SCAN_CHAIN: {
+			const uint32 chain[2] = {IR_LENGTH, IDCODE};
+			return respond(FRAME_SUCCESS, (const uint8 *)chain, sizeof(chain));
+		}
+		case CMD_SET_IRLENS:
+			return respond(length <= MAX_CHAIN_DEVICES ? FRAME_SUCCESS : FRAME_BAD_LENGTH, NULL, 0);
+		case CMD_RW_AVR_FUSES:
+			if ( m_request.flags & FRAME_WRITE ) {
+				m_fuses = m_request.param;
+				return respond(FRAME_SUCCESS, NULL, 0);
+			}
+			return respond(FRAME_SUCCESS, (const uint8 *)&m_fuses, 4);
+		case CMD_RD_AVR_FLASH:
+			if ( m_request.param == 0 || m_request.param % m_pageSize || m_request.param > FLASH_SIZE ) {
+				return respond(FRAME_BAD_PARAM, NULL, 0);
+			}
+			return respond(FRAME_SUCCESS, m_flash, m_request.param);
+		case CMD_WR_AVR_FLASH:
+			if ( length == 0 || length % m_pageSize || m_request.param % m_pageSize ||
+			     m_request.param + length > FLASH_SIZE )
+			{
+				return respond(FRAME_BAD_LENGTH, NULL, 0);
+			}
+			memcpy(m_flash + m_request.param, payload, length);
+			return respond(FRAME_SUCCESS, NULL, 0);
+		case CMD_ERASE_AVR_FLASH:
+			memset(m_flash, 0xFF, FLASH_SIZE);
+			memset(m_eeprom, 0xFF, EEPROM_SIZE);
+			return respond(FRAME_SUCCESS, NULL, 0);
+		case CMD_RD_AVR_EEPROM:
+			if ( m_request.param == 0 || m_request.param % m_eepromPageSize || m_request.param > EEPROM_SIZE ) {
+				return respond(FRAME_BAD_PARAM, NULL, 0);
+			}
+			return respond(FRAME_SUCCESS, m_eeprom, m_request.param);
+		case CMD_WR_AVR_EEPROM:
+			if ( length == 0 || length % m_eepromPageSize || m_request.param % m_eepromPageSize ||
+			     m_request.param + length > EEPROM_SIZE )
+			{
+				return respond(FRAME_BAD_LENGTH, NULL, 0);
+			}
+			memcpy(m_eeprom + m_request.param, payload, length);
+			return respond(FRAME_SUCCESS, NULL, 0);
+		case CMD_RD_AVR_SRAM:
+			if ( m_request.param == 0 || m_request.param > DATA_SIZE ) {
+				return respond(FRAME_BAD_PARAM, NULL, 0);
+			}
+			return respond(FRAME_SUCCESS, m_data, m_request.param);
+		case CMD_PLAY_XSVF:
+			return respond(length ? FRAME_SUCCESS : FRAME_BAD_LENGTH, NULL, 0);
+		case CMD_SET_AVR_GEOMETRY: {
+			AvrGeometry geometry;
+			if ( length != sizeof(geometry) ) {
+				return respond(FRAME_BAD_LENGTH, NULL, 0);
+			}
+			memcpy(&geometry, payload, sizeof(geometry));
+			if ( geometry.pageSize == 0 || geometry.pageSize % 64 ||
+			     (uint32)geometry.pageSize * geometry.numPages != FLASH_SIZE ||
+			     geometry.eepromPageSize == 0 ||
+			     (uint32)geometry.eepromPageSize * geometry.eepromPages != EEPROM_SIZE )
+			{
+				return respond(FRAME_BAD_PARAM, NULL, 0);
+			}
+			m_pageSize = geometry.pageSize;
+			m_eepromPageSize = geometry.eepromPageSize;
+			return respond(FRAME_SUCCESS, NULL, 0);
+		}
+		case CMD_STATUS:
+			return respond(FRAME_SUCCESS, NULL, 0);
+		default:
+			return respond(FRAME_UNKNOWN_OPCODE, NULL, 0);
+	}
+}
+
+// Accept one OUT transfer: a request header, or (some of) its payload.
+// Returns the number of bytes accepted, or -1 if they make no sense.
+//
+int standInWrite(const uint8 *data, uint32 length) {
+	if ( !m_open ) {
+		return -1;
+	}
+	if ( !m_inRequest ) {
+		if ( length != sizeof(FrameHeader) ) {
+			return -1;
+		}
+		memcpy(&m_request, data, sizeof(FrameHeader));
+		bufZeroLength(&m_payload);
+		m_received = 0;
+		m_inRequest = true;
+	} else {
+		if ( m_received + length > m_request.length || bufAppendBlock(&m_payload, data, length) ) {
+			return -1;
+		}
+		m_received += length;
+	}
+	if ( m_received == m_request.length ) {
+		m_inRequest = false;
+		if ( execute() ) {
+			return -1;
+		}
+	}
+	return (int)length;
+}
+
+// Requests are answered as soon as they arrive, so there is never a job
+// running
+//
+void standInStatus(JobStatus *status) {
+	memset(status, 0x00, sizeof(*status));
+	status->seq = m_request.seq;
+}
+
+// Return the oldest queued response (or as much of it as fits), as a single
+// IN transfer would. Returns -1 if nothing is queued.
+//
+int standInRead(uint8 *data, uint32 length) {
+	FrameResponse response;
+	uint32 size;
+	if ( !m_open || m_responses.length == 0 ) {
+		return -1;
+	}
+	memcpy(&response, m_responses.data, sizeof(response));
+	size = sizeof(response) + response.length;
+	if ( length > size ) {
+		length = size;
+	}
+	memcpy(data, m_responses.data, length);
+	memmove(m_responses.data, m_responses.data + size, m_responses.length - size);
+	m_responses.length -= size;
+	return (int)length;
+}
+
+void standInClose(void) {
+	if ( m_open ) {
+		bufDestroy(&m_responses);
+		bufDestroy(&m_payload);
+		m_open = false;
+	}
+}
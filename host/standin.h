@@ -0,0 +1,33 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef STANDIN_H
+#define STANDIN_H
+
+#include "types.h"
+#include "../commands.h"
+
+// A stand-in for the device, answering framed requests in-process with the
+// responses an ATMEGA162 alone in the chain would give. There is no JTAG
+// behind it, so it measures (and exercises) only the host side.
+//
+int standInOpen(void);
+int standInWrite(const uint8 *data, uint32 length);
+int standInRead(uint8 *data, uint32 length);
+void standInStatus(JobStatus *status);
+void standInClose(void);
+
+#endif
@@ -0,0 +1,52 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#define _POSIX_C_SOURCE 200112L
+	#include <time.h>
+#endif
+#include "timer.h"
+
+uint64 timerNanos(void) {
+	#ifdef WIN32
+		LARGE_INTEGER count, frequency;
+		QueryPerformanceCounter(&count);
+		QueryPerformanceFrequency(&frequency);
+		return (uint64)(count.QuadPart / frequency.QuadPart) * 1000000000 +
+			(uint64)(count.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	#endif
+}
+
+uint64 timerMicros(void) {
+	return timerNanos() / 1000;
+}
+
+void timerSleep(uint32 ms) {
+	#ifdef WIN32
+		Sleep(ms);
+	#else
+		struct timespec ts;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (long)(ms % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+	#endif
+}
@@ -0,0 +1,81 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include "trace.h"
+#include "../commands.h"
+
+static FILE *m_file = NULL;
+static uint64 m_origin;
+static bool m_first;
+
+static const char *commandName(uint8 command) {
+	static const char *const names[] = {
+		"SCAN", "RW_AVR_FUSES", "RD_AVR_FLASH", "WR_AVR_FLASH", "ERASE_AVR_FLASH",
+		"RSVD1", "RSVD2", "RSVD3", "PLAY_XSVF", "STATUS", "SET_IRLENS",
+		"SAMPLE_BSCAN", "CFG_SPARTAN3", "PROG_XCF", "SET_AVR_GEOMETRY",
+		"SCAN_CHAIN", "CANCEL", "SET_DUAL_CHAIN", "CAPTURE", "EXTEST",
+		"RD_AVR_EEPROM", "WR_AVR_EEPROM", "RD_AVR_SRAM"
+	};
+	if ( command >= CMD_SCAN && command - CMD_SCAN < (int)(sizeof(names)/sizeof(names[0])) ) {
+		return names[command - CMD_SCAN];
+	}
+	return "UNKNOWN";
+}
+
+int traceOpen(const char *fileName) {
+	m_file = fopen(fileName, "w");
+	if ( !m_file ) {
+		return 1;
+	}
+	m_origin = 0;
+	m_first = true;
+	fprintf(m_file, "{\"traceEvents\":[\n");
+	fprintf(m_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"OUT\"}},\n", TRACE_OUT);
+	fprintf(m_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"IN\"}}", TRACE_IN);
+	return 0;
+}
+
+// Record one transfer; start and end are in microseconds, and result is what
+// libusb returned (a byte count, or a negative error code)
+//
+void traceTransfer(
+	uint8 command, TraceDirection direction, uint32 length, uint64 start, uint64 end, int result)
+{
+	if ( !m_file ) {
+		return;
+	}
+	if ( m_first ) {
+		m_origin = start;
+		m_first = false;
+	}
+	fprintf(
+		m_file,
+		",\n{\"name\":\"%s\",\"cat\":\"usb\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%llu,\"dur\":%llu,\"args\":{\"command\":\"0x%02X\",\"direction\":\"%s\","
+		"\"length\":%lu,\"result\":%d}}",
+		commandName(command), direction,
+		(unsigned long long)(start - m_origin), (unsigned long long)(end - start),
+		command, direction == TRACE_OUT ? "out" : "in", (unsigned long)length, result);
+}
+
+void traceClose(void) {
+	if ( m_file ) {
+		fprintf(m_file, "\n]}\n");
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
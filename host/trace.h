@@ -0,0 +1,36 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+// Record USB transfers as Chrome trace events (load the file in
+// chrome://tracing or Perfetto). OUT and IN transfers go on separate tracks,
+// so gaps in bus utilisation and the latency of each response stand out.
+//
+typedef enum {
+	TRACE_OUT = 1,
+	TRACE_IN
+} TraceDirection;
+
+int traceOpen(const char *fileName);
+void traceTransfer(
+	uint8 command, TraceDirection direction, uint32 length, uint64 start, uint64 end, int result);
+void traceClose(void);
+
+#endif
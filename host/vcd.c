@@ -0,0 +1,103 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include "vcd.h"
+
+
+// Signal identifiers are strings of the printable characters '!' to '~'
+//
+static void writeId(FILE *file, uint32 signal) {
+	do {
+		fputc('!' + (signal % 94), file);
+		signal /= 94;
+	} while ( signal );
+}
+
+// Signals are one bit wide unless widths says otherwise
+//
+int vcdOpen(
+	VcdWriter *vcd, const char *fileName, const char *timescale, const char *scope,
+	const char *const *names, const uint8 *widths, uint32 numSignals)
+{
+	uint32 i;
+	vcd->file = fopen(fileName, "w");
+	if ( !vcd->file ) {
+		return 1;
+	}
+	vcd->values = malloc(numSignals ? 2 * numSignals : 1);
+	if ( !vcd->values ) {
+		fclose(vcd->file);
+		return 2;
+	}
+	vcd->widths = vcd->values + numSignals;
+	vcd->numSignals = numSignals;
+	vcd->time = 0;
+	vcd->timeWritten = false;
+	fprintf(vcd->file, "$version nj $end\n$timescale %s $end\n$scope module %s $end\n", timescale, scope);
+	for ( i = 0; i < numSignals; i++ ) {
+		vcd->values[i] = VCD_X;
+		vcd->widths[i] = widths ? widths[i] : 1;
+		fprintf(vcd->file, "$var wire %d ", vcd->widths[i]);
+		writeId(vcd->file, i);
+		fprintf(vcd->file, " %s $end\n", names[i]);
+	}
+	fprintf(vcd->file, "$upscope $end\n$enddefinitions $end\n");
+	return 0;
+}
+
+// Record the value of a signal at the given time, which must not be earlier
+// than that of the previous change
+//
+void vcdChange(VcdWriter *vcd, uint64 time, uint32 signal, uint8 value) {
+	uint8 bit;
+	if ( signal >= vcd->numSignals ) {
+		return;
+	}
+	if ( value != VCD_X && vcd->widths[signal] == 1 ) {
+		value = value ? 1 : 0;
+	}
+	if ( vcd->values[signal] == value ) {
+		return;
+	}
+	if ( !vcd->timeWritten || time != vcd->time ) {
+		fprintf(vcd->file, "#%llu\n", (unsigned long long)time);
+		vcd->time = time;
+		vcd->timeWritten = true;
+	}
+	if ( vcd->widths[signal] == 1 ) {
+		fputc(value == VCD_X ? 'x' : '0' + value, vcd->file);
+	} else if ( value == VCD_X ) {
+		fputs("bx ", vcd->file);
+	} else {
+		fputc('b', vcd->file);
+		for ( bit = vcd->widths[signal]; bit--; ) {
+			fputc('0' + ((value >> bit) & 1), vcd->file);
+		}
+		fputc(' ', vcd->file);
+	}
+	writeId(vcd->file, signal);
+	fputc('\n', vcd->file);
+	vcd->values[signal] = value;
+}
+
+void vcdClose(VcdWriter *vcd, uint64 endTime) {
+	if ( !vcd->timeWritten || endTime != vcd->time ) {
+		fprintf(vcd->file, "#%llu\n", (unsigned long long)endTime);
+	}
+	fclose(vcd->file);
+	free(vcd->values);
+}
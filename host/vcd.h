@@ -0,0 +1,43 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef VCD_H
+#define VCD_H
+
+#include <stdio.h>
+#include "types.h"
+
+// A minimal Value Change Dump writer for signals of up to eight bits. Only
+// changes are written, so a signal which holds its value costs nothing.
+//
+typedef struct {
+	FILE *file;
+	uint32 numSignals;
+	uint8 *values;       // last value written for each signal
+	uint8 *widths;       // in bits
+	uint64 time;         // time of the last timestamp written
+	bool timeWritten;
+} VcdWriter;
+
+#define VCD_X 0xFF       // an unknown value
+
+int vcdOpen(
+	VcdWriter *vcd, const char *fileName, const char *timescale, const char *scope,
+	const char *const *names, const uint8 *widths, uint32 numSignals);
+void vcdChange(VcdWriter *vcd, uint64 time, uint32 signal, uint8 value);
+void vcdClose(VcdWriter *vcd, uint64 endTime);
+
+#endif
@@ -0,0 +1,91 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "xsvf.h"
+
+const uint8 xsvfTapNext[16] = {
+	0x01, 0x21, 0x93, 0x54, 0x54, 0x86, 0x76, 0x84,
+	0x21, 0x0A, 0xCB, 0xCB, 0xFD, 0xED, 0xFB, 0x21
+};
+const uint16 xsvfTapPath[16] = {
+	0x0000, 0xFFFD, 0xFE03, 0xFFE7, 0xFFEF, 0xFF0F, 0xFFBF, 0xFF0F,
+	0xFEFD, 0x01FF, 0xF3FF, 0xF7FF, 0x87FF, 0xDFFF, 0x87FF, 0x7FFD
+};
+
+// XSVF numbers are big-endian
+//
+uint32 xsvfGetLong(const uint8 *p) {
+	return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+uint32 xsvfRecordLength(const uint8 *p, uint32 remaining, uint32 sdrBits) {
+	const uint32 sdrBytes = (sdrBits + 7) >> 3;
+	switch ( *p ) {
+		case XCOMPLETE:
+			return 1;
+		case XTDOMASK:
+			return 1 + sdrBytes;
+		case XSIR:
+			return (remaining >= 2) ? 2 + ((p[1] + 7) >> 3) : 2;
+		case XRUNTEST:
+		case XSDRSIZE:
+			return 5;
+		case XSDRTDO:
+			return 1 + 2 * sdrBytes;
+		case XREPEAT:
+		case XSTATE:
+		case XENDIR:
+		case XENDDR:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+void xsvfReaderInit(XsvfReader *reader, const uint8 *data, uint32 length) {
+	reader->data = data;
+	reader->length = length;
+	reader->offset = 0;
+	reader->size = 0;
+	reader->sdrBits = 0;
+}
+
+// Move on from the current record (taking up its size, if it is an XSDRSIZE)
+// to the next
+//
+XsvfReadStatus xsvfNext(XsvfReader *reader) {
+	const uint8 *p;
+	if ( reader->size ) {
+		if ( reader->data[reader->offset] == XSDRSIZE ) {
+			reader->sdrBits = xsvfGetLong(reader->data + reader->offset + 1);
+		}
+		reader->offset += reader->size;
+		reader->size = 0;
+	}
+	if ( reader->offset >= reader->length ) {
+		return XSVF_END;
+	}
+	p = reader->data + reader->offset;
+	reader->size = xsvfRecordLength(p, reader->length - reader->offset, reader->sdrBits);
+	if ( !reader->size ) {
+		return XSVF_UNKNOWN;
+	}
+	if ( reader->size > reader->length - reader->offset ) {
+		reader->size = 0;
+		return XSVF_CUT_SHORT;
+	}
+	return XSVF_RECORD;
+}
@@ -0,0 +1,81 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XSVF_H
+#define XSVF_H
+
+#include "types.h"
+
+// The XSVF records the firmware plays
+#define XCOMPLETE 0x00
+#define XTDOMASK  0x01
+#define XSIR      0x02
+#define XRUNTEST  0x04
+#define XREPEAT   0x07
+#define XSDRSIZE  0x08
+#define XSDRTDO   0x09
+#define XSTATE    0x12
+#define XENDIR    0x13
+#define XENDDR    0x14
+
+// TAP states, numbered as in XSTATE
+#define TAP_RESET      0
+#define TAP_IDLE       1
+#define TAP_CAPTURE_DR 3
+#define TAP_SHIFT_DR   4
+#define TAP_PAUSE_DR   6
+#define TAP_UPDATE_DR  8
+#define TAP_SHIFT_IR   11
+#define TAP_PAUSE_IR   13
+#define TAP_UPDATE_IR  15
+
+// The firmware's TAP tables, as in firmware/main.c: the next state with TMS
+// high (high nibble) and low (low nibble), and the TMS value of the first step
+// of the shortest path from each state (row) to each other one (bit)
+//
+extern const uint8 xsvfTapNext[16];
+extern const uint16 xsvfTapPath[16];
+
+// The length of the XSVF record at p, given that "remaining" bytes are there
+// and the current XSDRSIZE is sdrBits; zero if it is not one the firmware
+// plays. The result may be more than remaining, if the record is cut short.
+//
+uint32 xsvfRecordLength(const uint8 *p, uint32 remaining, uint32 sdrBits);
+
+// Reads a program a record at a time, keeping track of the XSDRSIZE. While
+// an XSDRSIZE record is current, sdrBits is still the size it replaces.
+//
+typedef struct {
+	const uint8 *data;
+	uint32 length;
+	uint32 offset;    // of the current record
+	uint32 size;      // its length, or zero before the first
+	uint32 sdrBits;   // the XSDRSIZE in force for it
+} XsvfReader;
+
+typedef enum {
+	XSVF_RECORD = 0,  // the reader is on the next record
+	XSVF_END,         // there are no more bytes
+	XSVF_UNKNOWN,     // the next record is not one the firmware plays
+	XSVF_CUT_SHORT    // the next record runs past the end
+} XsvfReadStatus;
+
+void xsvfReaderInit(XsvfReader *reader, const uint8 *data, uint32 length);
+XsvfReadStatus xsvfNext(XsvfReader *reader);
+
+uint32 xsvfGetLong(const uint8 *p);
+
+#endif
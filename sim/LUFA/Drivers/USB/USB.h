@@ -0,0 +1,94 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIM_LUFA_USB_H
+#define SIM_LUFA_USB_H
+
+// Just enough of the LUFA 100807 device API for firmware/main.c to build on
+// the host. The endpoints are backed by in-process queues (see usb.c).
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+
+#define ATTR_WARN_UNUSED_RESULT
+#define ATTR_NON_NULL_PTR_ARG(...)
+
+#define REQDIR_HOSTTODEVICE (0 << 7)
+#define REQDIR_DEVICETOHOST (1 << 7)
+#define REQTYPE_STANDARD    (0 << 5)
+#define REQTYPE_CLASS       (1 << 5)
+#define REQTYPE_VENDOR      (2 << 5)
+
+#define EP_TYPE_CONTROL     0x00
+#define EP_TYPE_ISOCHRONOUS 0x01
+#define EP_TYPE_BULK        0x02
+#define EP_TYPE_INTERRUPT   0x03
+
+#define ENDPOINT_DIR_OUT     0
+#define ENDPOINT_DIR_IN      1
+#define ENDPOINT_BANK_SINGLE 0
+#define ENDPOINT_BANK_DOUBLE 1
+
+#define ENDPOINT_CONTROLEP 0
+
+enum Endpoint_Stream_RW_ErrorCodes_t {
+	ENDPOINT_RWSTREAM_NoError = 0,
+	ENDPOINT_RWSTREAM_EndpointStalled,
+	ENDPOINT_RWSTREAM_DeviceDisconnected,
+	ENDPOINT_RWSTREAM_Timeout
+};
+
+typedef struct {
+	uint8_t  bmRequestType;
+	uint8_t  bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} USB_Request_Header_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+
+// Descriptor types are only needed so desc.h compiles
+typedef struct { uint8_t Size; uint8_t Type; } USB_Descriptor_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Device_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_String_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Configuration_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Interface_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Endpoint_t;
+
+void USB_Init(void);
+void USB_USBTask(void);
+
+bool Endpoint_ConfigureEndpoint(uint8_t number, uint8_t type, uint8_t direction, uint16_t size, uint8_t banks);
+void Endpoint_SelectEndpoint(uint8_t address);
+void Endpoint_ClearSETUP(void);
+void Endpoint_ClearStatusStage(void);
+void Endpoint_ClearIN(void);
+void Endpoint_ClearOUT(void);
+bool Endpoint_IsINReady(void);
+bool Endpoint_IsOUTReceived(void);
+bool Endpoint_IsReadWriteAllowed(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t Endpoint_Read_Byte(void);
+void Endpoint_Write_Byte(uint8_t data);
+uint8_t Endpoint_Read_Stream_LE(void *buffer, uint16_t length);
+uint8_t Endpoint_Write_Stream_LE(const void *buffer, uint16_t length);
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length);
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length);
+
+#endif
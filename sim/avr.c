@@ -0,0 +1,405 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "../commands.h"
+
+// JTAG instructions
+#define INS_EXTEST        0x0
+#define INS_IDCODE        0x1
+#define INS_SAMPLE        0x2
+#define INS_PROG_ENABLE   0x4
+#define INS_PROG_COMMANDS 0x5
+#define INS_PROG_PAGELOAD 0x6
+#define INS_PROG_PAGEREAD 0x7
+#define INS_FORCE_BREAK   0x8
+#define INS_RUN           0x9
+#define INS_EX_INST       0xA
+#define INS_OCD_ACCESS    0xB
+#define INS_AVR_RESET     0xC
+#define INS_BYPASS        0xF
+
+// Programming modes selected by the 0x23xx "enter" commands
+#define MODE_CHIP_ERASE   0x80
+#define MODE_FLASH_READ   0x02
+#define MODE_FLASH_WRITE  0x10
+#define MODE_FUSE_READ    0x04
+#define MODE_FUSE_WRITE   0x40
+#define MODE_LOCK_WRITE   0x20
+#define MODE_EEPROM_READ  0x03
+#define MODE_EEPROM_WRITE 0x11
+
+// Self-timed programming delays, from the ATmega162 datasheet
+#define T_WD_FLASH_NS  4500000ULL
+#define T_WD_ERASE_NS  9000000ULL
+#define T_WD_FUSE_NS   4500000ULL
+#define T_WD_EEPROM_NS 9000000ULL
+
+#define MAX_PAGE_SIZE        256
+#define MAX_EEPROM_PAGE_SIZE 8
+#define OCD_REG_OCDR         0xC
+#define FUSE_OCDEN           0x80  // in the high fuse byte; programmed when zero
+
+// Memory geometry of each part, as the model's info
+typedef struct {
+	uint32 flashSize;
+	uint16 pageSize;
+	uint16 eepromSize;
+	uint16 eepromPageSize;
+	uint16 dataSize;         // registers, I/O and SRAM
+	uint8 ocdr;              // I/O address of the on-chip debug register
+	uint16 unreadable[AVR_MAX_UNREADABLE];  // data addresses of its UDRn, SPDR and TWDR
+} AvrInfo;
+
+static const AvrInfo m_atmega162 = {16384, 128, 512, 4, 0x0500, 0x04, {0x23, 0x2C, 0x2F}};
+static const AvrInfo m_atmega2560 = {262144, 256, 4096, 8, 0x2200, 0x31, {0x4E, 0xBB, 0xC6, 0xCE, 0xD6, 0x136}};
+
+typedef struct {
+	uint8 *flash;
+	uint32 flashSize;
+	uint16 pageSize;
+	uint8 *eeprom;
+	uint16 eepromSize;
+	uint16 eepromPageSize;
+	uint8 page[MAX_PAGE_SIZE];
+	uint8 eepromPage[MAX_EEPROM_PAGE_SIZE];
+	uint8 eepromLoaded;      // bitmap of the EEPROM page buffer bytes latched
+	uint8 *data;             // the data space, as the running program left it
+	uint16 dataSize;
+	uint8 ocdrAddress;
+	uint8 stopped;           // by FORCE_BREAK
+	uint8 ocdReg;            // OCD register selected by the last OCD_ACCESS scan
+	uint8 ocdr;
+	uint8 fuseExt, fuseHigh, fuseLow, lock;
+	uint8 reset;
+	uint16 progEnable;
+	uint8 mode;
+	uint8 lastOp;            // opcode of the previous programming command
+	uint32 address;          // word address loaded by the 0x03/0x07/0x0B commands
+	uint8 dataLow, dataHigh;
+	uint32 streamAddr;       // byte address for PAGELOAD/PAGEREAD
+	uint64 busyUntil;
+} Avr;
+
+static void avrInit(SimDevice *dev) {
+	const AvrInfo *info = dev->model->info;
+	Avr *avr = calloc(1, sizeof(Avr) + info->flashSize + info->eepromSize + info->dataSize);  // the memories follow the struct
+	uint16 i;
+	avr->flashSize = info->flashSize;
+	avr->pageSize = info->pageSize;
+	avr->eepromSize = info->eepromSize;
+	avr->eepromPageSize = info->eepromPageSize;
+	avr->flash = (uint8 *)(avr + 1);
+	avr->eeprom = avr->flash + avr->flashSize;
+	avr->dataSize = info->dataSize;
+	avr->ocdrAddress = info->ocdr;
+	avr->data = avr->eeprom + avr->eepromSize;
+	for ( i = 0; i < avr->dataSize; i++ ) {
+		avr->data[i] = (uint8)(i * 13 + 5);  // whatever the program was doing
+	}
+	memset(avr->flash, 0xFF, avr->flashSize);
+	memset(avr->eeprom, 0xFF, avr->eepromSize);
+	memset(avr->page, 0xFF, sizeof(avr->page));
+	avr->fuseExt = 0xFF;
+	avr->fuseHigh = 0x99;
+	avr->fuseLow = 0x62;
+	avr->lock = 0xFF;
+	dev->priv = avr;
+}
+
+static uint16 avrDrLength(SimDevice *dev) {
+	switch ( dev->ir ) {
+		case INS_IDCODE:        return 32;
+		case INS_PROG_ENABLE:   return 16;
+		case INS_PROG_COMMANDS: return 15;
+		case INS_PROG_PAGELOAD: return 8;
+		case INS_PROG_PAGEREAD: return 8;
+		case INS_EX_INST:       return 16;
+		case INS_OCD_ACCESS:    return 21;
+		case INS_EXTEST:
+		case INS_SAMPLE:        return dev->model->bsrLen;
+		default:                return 1;  // BYPASS, AVR_RESET & unimplemented
+	}
+}
+
+static uint8 isProgramming(const Avr *avr) {
+	return avr->reset && avr->progEnable == 0xA370;
+}
+
+// The value captured by PROG_COMMANDS is the result of the previous command
+//
+static uint16 commandResult(const Avr *avr) {
+	uint16 result = (simNow() >= avr->busyUntil) ? 0x0200 : 0x0000;
+	uint8 data = 0x00;
+	if ( avr->mode == MODE_FUSE_READ ) {
+		switch ( avr->lastOp ) {
+			case 0x3A: data = avr->fuseExt; break;
+			case 0x3E: data = avr->fuseHigh; break;
+			case 0x32: data = avr->fuseLow; break;
+			case 0x36: data = avr->lock; break;
+		}
+	} else if ( avr->mode == MODE_EEPROM_READ && avr->lastOp == 0x32 ) {
+		data = avr->eeprom[avr->address % avr->eepromSize];
+	}
+	return result | data;
+}
+
+static void avrCaptureDR(SimDevice *dev) {
+	Avr *avr = dev->priv;
+	switch ( dev->ir ) {
+		case INS_IDCODE:
+			simDrWrite(dev, 0, 32, dev->model->idCode);
+			break;
+		case INS_PROG_COMMANDS:
+			simDrWrite(dev, 0, 15, isProgramming(avr) ? commandResult(avr) : 0x0000);
+			break;
+		case INS_PROG_PAGEREAD:
+			simDrWrite(dev, 0, 8, 0x00);  // the first byte out is junk
+			break;
+		case INS_OCD_ACCESS:
+			simDrWrite(dev, 0, 21, avr->ocdReg == OCD_REG_OCDR ? avr->ocdr : 0x0000);
+			break;
+	}
+}
+
+// PAGELOAD and PAGEREAD are 8-bit virtual registers: every eighth clock moves
+// a byte between the shift register and the page, with auto-increment.
+//
+static void avrShiftDR(SimDevice *dev) {
+	Avr *avr = dev->priv;
+	if ( (dev->drShifted & 7) || !isProgramming(avr) ) {
+		return;
+	}
+	if ( dev->ir == INS_PROG_PAGELOAD ) {
+		avr->page[avr->streamAddr % avr->pageSize] = (uint8)simDrRead(dev, 0, 8);
+		avr->streamAddr++;
+	} else if ( dev->ir == INS_PROG_PAGEREAD ) {
+		simDrWrite(dev, 0, 8, avr->flash[avr->streamAddr % avr->flashSize]);
+		avr->streamAddr++;
+	}
+}
+
+static void execCommand(Avr *avr, uint16 cmd) {
+	const uint8 op = cmd >> 8;
+	const uint8 data = cmd & 0xFF;
+	const uint64 now = simNow();
+	uint32 base;
+	switch ( op ) {
+		case 0x23:
+			avr->mode = data;
+			break;
+		case 0x0B:
+			avr->address = (avr->address & 0x0000FFFF) | ((uint32)data << 16);
+			break;
+		case 0x07:
+			avr->address = (avr->address & 0x00FF00FF) | ((uint32)data << 8);
+			break;
+		case 0x03:
+			avr->address = (avr->address & 0x00FFFF00) | data;
+			break;
+		case 0x33:
+			if ( avr->mode == MODE_EEPROM_READ ) {
+				avr->address = (avr->address & 0x00FFFF00) | data;  // read address low byte
+			}
+			break;
+		case 0x13:
+			avr->dataLow = data;
+			break;
+		case 0x17:
+			avr->dataHigh = data;
+			break;
+		case 0x77:
+			// Latch data into the page buffer
+			if ( avr->mode == MODE_FLASH_WRITE ) {
+				avr->page[(avr->address*2) % avr->pageSize] = avr->dataLow;
+				avr->page[(avr->address*2 + 1) % avr->pageSize] = avr->dataHigh;
+			} else if ( avr->mode == MODE_EEPROM_WRITE ) {
+				avr->eepromPage[avr->address % avr->eepromPageSize] = avr->dataLow;
+				avr->eepromLoaded |= 1 << (avr->address % avr->eepromPageSize);
+			}
+			break;
+		case 0x31:
+			if ( avr->mode == MODE_CHIP_ERASE && avr->lastOp == 0x23 ) {
+				memset(avr->flash, 0xFF, avr->flashSize);
+				memset(avr->eeprom, 0xFF, avr->eepromSize);
+				avr->lock = 0xFF;
+				avr->busyUntil = now + T_WD_ERASE_NS;
+			} else if ( avr->mode == MODE_FUSE_WRITE && avr->lastOp == 0x33 ) {
+				avr->fuseLow = avr->dataLow;
+				avr->busyUntil = now + T_WD_FUSE_NS;
+			} else if ( avr->mode == MODE_LOCK_WRITE && avr->lastOp == 0x33 ) {
+				avr->lock = avr->dataLow;
+				avr->busyUntil = now + T_WD_FUSE_NS;
+			} else if ( avr->mode == MODE_EEPROM_WRITE && avr->lastOp == 0x33 ) {
+				// Only the bytes latched since the last page write are written
+				uint16 i;
+				base = avr->address % avr->eepromSize & ~(uint32)(avr->eepromPageSize - 1);
+				for ( i = 0; i < avr->eepromPageSize; i++ ) {
+					if ( avr->eepromLoaded & (1 << i) ) {
+						avr->eeprom[base + i] = avr->eepromPage[i];
+					}
+				}
+				avr->eepromLoaded = 0;
+				avr->busyUntil = now + T_WD_EEPROM_NS;
+			}
+			break;
+		case 0x35:
+			if ( avr->mode == MODE_FLASH_WRITE && avr->lastOp == 0x37 ) {
+				base = (avr->address*2) % avr->flashSize & ~(uint32)(avr->pageSize - 1);
+				memcpy(avr->flash + base, avr->page, avr->pageSize);
+				memset(avr->page, 0xFF, avr->pageSize);
+				avr->busyUntil = now + T_WD_FLASH_NS;
+			} else if ( avr->mode == MODE_FUSE_WRITE && avr->lastOp == 0x37 ) {
+				avr->fuseHigh = avr->dataLow;
+				avr->busyUntil = now + T_WD_FUSE_NS;
+			}
+			break;
+		case 0x39:
+			if ( avr->mode == MODE_FUSE_WRITE && avr->lastOp == 0x3B ) {
+				avr->fuseExt = avr->dataLow;
+				avr->busyUntil = now + T_WD_FUSE_NS;
+			}
+			break;
+	}
+	avr->lastOp = op;
+}
+
+// The stopped core runs the instructions the debugger feeds it: just those a
+// memory dump needs (LD Rd, X+; OUT A, Rr; LDI Rd, K)
+//
+static void execInstruction(Avr *avr, uint16 instruction) {
+	uint8 reg = (instruction >> 4) & 0x1F;
+	if ( (instruction & 0xFE0F) == 0x900D ) {
+		uint16 x = avr->data[26] | (avr->data[27] << 8);
+		avr->data[reg] = avr->data[x % avr->dataSize];
+		x++;
+		avr->data[26] = (uint8)x;
+		avr->data[27] = (uint8)(x >> 8);
+	} else if ( (instruction & 0xF800) == 0xB800 ) {
+		const uint8 io = ((instruction >> 5) & 0x30) | (instruction & 0x0F);
+		if ( io == avr->ocdrAddress ) {
+			avr->ocdr = avr->data[reg];
+		} else {
+			avr->data[0x20 + io] = avr->data[reg];
+		}
+	} else if ( (instruction & 0xF000) == 0xE000 ) {
+		avr->data[16 + (reg & 0x0F)] = ((instruction >> 4) & 0xF0) | (instruction & 0x0F);
+	}
+}
+
+static void avrUpdateDR(SimDevice *dev) {
+	Avr *avr = dev->priv;
+	switch ( dev->ir ) {
+		case INS_AVR_RESET:
+			avr->reset = (uint8)simDrRead(dev, 0, 1);
+			break;
+		case INS_PROG_ENABLE:
+			avr->progEnable = (uint16)simDrRead(dev, 0, 16);
+			break;
+		case INS_PROG_COMMANDS:
+			if ( isProgramming(avr) ) {
+				execCommand(avr, (uint16)simDrRead(dev, 0, 15));
+			}
+			break;
+		case INS_EX_INST:
+			if ( avr->stopped ) {
+				execInstruction(avr, (uint16)simDrRead(dev, 0, 16));
+			}
+			break;
+		case INS_OCD_ACCESS:
+			avr->ocdReg = (uint8)(simDrRead(dev, 0, 21) >> 16) & 0x0F;
+			break;
+	}
+}
+
+static void avrUpdateIR(SimDevice *dev) {
+	Avr *avr = dev->priv;
+	if ( dev->ir == INS_PROG_PAGELOAD || dev->ir == INS_PROG_PAGEREAD ) {
+		avr->streamAddr = avr->address * 2;
+	} else if ( dev->ir == INS_FORCE_BREAK && !(avr->fuseHigh & FUSE_OCDEN) ) {
+		avr->stopped = 1;
+	} else if ( dev->ir == INS_RUN ) {
+		avr->stopped = 0;
+	}
+}
+
+const SimModel simATmega162 = {
+	"ATMEGA162", 0x0940403F, 4, INS_IDCODE, 71,
+	avrInit, avrDrLength, avrCaptureDR, avrShiftDR, avrUpdateDR, avrUpdateIR, NULL, NULL, &m_atmega162
+};
+
+// 256-byte pages, and more than 64K words so the extended address byte is
+// needed
+const SimModel simATmega2560 = {
+	"ATMEGA2560", 0x0980103F, 4, INS_IDCODE, 0,
+	avrInit, avrDrLength, avrCaptureDR, avrShiftDR, avrUpdateDR, avrUpdateIR, NULL, NULL, &m_atmega2560
+};
+
+uint8 simIsAvr(const SimDevice *dev) {
+	return dev->model->init == avrInit;
+}
+
+uint8 *simAvrFlash(SimDevice *dev, uint32 *size) {
+	Avr *avr = dev->priv;
+	*size = avr->flashSize;
+	return avr->flash;
+}
+
+uint16 simAvrPageSize(SimDevice *dev) {
+	const Avr *avr = dev->priv;
+	return avr->pageSize;
+}
+
+uint8 *simAvrEeprom(SimDevice *dev, uint32 *size) {
+	Avr *avr = dev->priv;
+	*size = avr->eepromSize;
+	return avr->eeprom;
+}
+
+uint16 simAvrEepromPageSize(SimDevice *dev) {
+	const Avr *avr = dev->priv;
+	return avr->eepromPageSize;
+}
+
+uint8 *simAvrData(SimDevice *dev, uint32 *size) {
+	Avr *avr = dev->priv;
+	*size = avr->dataSize;
+	return avr->data;
+}
+
+uint8 simAvrOcdr(SimDevice *dev) {
+	const Avr *avr = dev->priv;
+	return avr->ocdrAddress;
+}
+
+const uint16 *simAvrUnreadable(SimDevice *dev) {
+	const AvrInfo *info = dev->model->info;
+	return info->unreadable;
+}
+
+uint8 simAvrStopped(SimDevice *dev) {
+	const Avr *avr = dev->priv;
+	return avr->stopped;
+}
+
+uint32 simAvrFuses(SimDevice *dev) {
+	const Avr *avr = dev->priv;
+	return
+		((uint32)avr->fuseExt << 24) | ((uint32)avr->fuseHigh << 16) |
+		((uint32)avr->fuseLow << 8) | avr->lock;
+}
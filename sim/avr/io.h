@@ -0,0 +1,39 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+// Every access to PORTB goes through simPortB() so the simulated JTAG chain
+// sees each write in order; PINB samples the chain's TDO line.
+//
+uint8_t *simPortB(void);
+uint8_t simPinB(void);
+extern uint8_t simDDRB;
+extern uint8_t simREGCR;
+extern uint8_t simMCUSR;
+
+#define PORTB (*simPortB())
+#define PINB  simPinB()
+#define DDRB  simDDRB
+#define REGCR simREGCR
+#define MCUSR simMCUSR
+#define REGDIS 0
+#define WDRF 3
+
+#endif
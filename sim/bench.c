@@ -0,0 +1,1366 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "../commands.h"
+#include "../host/spibus.h"
+
+// Runs the real firmware against the simulated chain and reports what each
+// host operation costs in TCK cycles, USB traffic and simulated time.
+//
+// By default the host side uses the framed bulk protocol; -l selects the
+// original control-request protocol. The firmware services each control
+// request synchronously, so in that case any bulk OUT data must be queued
+// before the control request that consumes it.
+
+#define MAX_SCENARIOS 16
+#define XSVF_VECTORS  256
+#define SAMPLES       64
+#define S3_BITSTREAM  130952   // bytes in an XC3S200 bitstream
+#define SKIPPED       (-1)
+
+typedef struct {
+	const char *name;
+	int (*run)(void);
+	SimStats stats;
+	int result;
+} Scenario;
+
+static const char *m_chainSpec = "ATMEGA162";
+static const char *m_xsvfFile = NULL;
+static uint8 m_legacy = 0;
+static uint8 m_dual = 0;
+static uint8 m_seq = 0;
+static uint8 *m_image;
+static uint32 m_imageSize;
+
+// Build the chain; in dual-chain mode, build an identical one on chain B
+//
+static int buildChain(void) {
+	const char *p;
+	const SimModel *model;
+	uint8 chain;
+	simChainReset();
+	for ( chain = 0; chain <= m_dual; chain++ ) {
+		simChainSelect(chain);
+		p = m_chainSpec;
+		while ( *p ) {
+			model = simFindModel(p);
+			if ( !model ) {
+				fprintf(stderr, "Unrecognised device in chain: %s\n", p);
+				return 1;
+			}
+			simChainAdd(model);
+			while ( *p && *p != ',' ) {
+				p++;
+			}
+			if ( *p ) {
+				p++;
+			}
+		}
+	}
+	simChainSelect(0);
+	simUsbConnect();
+	return 0;
+}
+
+// The host side of both protocols. In the framed protocol each request is a
+// header packet plus payload on the OUT endpoint, and the response header
+// and payload are fetched from the IN endpoint in a single transfer. Like nj,
+// frameCallVar asks for up to maxLength bytes of response payload and returns
+// the length the header announces; frameCall insists on exactly that many.
+//
+static int frameCallVar(
+	uint8 opcode, uint8 flags, uint32 param, const uint8 *payload, uint32 length,
+	uint8 *responseData, uint32 maxLength, uint32 *responseLength, uint32 *failures)
+{
+	FrameHeader request;
+	FrameResponse *response;
+	uint8 *buf = malloc(sizeof(FrameResponse) + maxLength);
+	uint32 got;
+	int result = 0;
+	request.opcode = opcode;
+	request.seq = ++m_seq;
+	request.flags = flags;
+	request.reserved = 0x00;
+	request.param = param;
+	request.length = length;
+	simBulkQueue((const uint8 *)&request, sizeof(request));
+	if ( length ) {
+		simBulkQueue(payload, length);
+	}
+	simRun();
+	response = (FrameResponse *)buf;
+	got = simBulkFetch(buf, sizeof(FrameResponse) + maxLength);
+	if ( got < sizeof(FrameResponse) ) {
+		fprintf(stderr, "frame 0x%02X: no response\n", opcode);
+		result = 1;
+	} else if ( response->opcode != opcode || response->seq != request.seq ) {
+		fprintf(stderr, "frame 0x%02X: response out of sequence\n", opcode);
+		result = 1;
+	} else if ( response->status != FRAME_SUCCESS || response->length != got - sizeof(FrameResponse) ) {
+		fprintf(stderr, "frame 0x%02X: status 0x%02X\n", opcode, response->status);
+		result = 1;
+	} else {
+		if ( response->length ) {
+			memcpy(responseData, buf + sizeof(FrameResponse), response->length);
+		}
+		*responseLength = response->length;
+		if ( failures ) {
+			*failures = response->failures;
+		}
+	}
+	free(buf);
+	return result;
+}
+
+static int frameCall(
+	uint8 opcode, uint8 flags, uint32 param, const uint8 *payload, uint32 length,
+	uint8 *responseData, uint32 responseLength, uint32 *failures)
+{
+	uint32 got;
+	if ( frameCallVar(opcode, flags, param, payload, length, responseData, responseLength, &got, failures) ) {
+		return 1;
+	}
+	if ( got != responseLength ) {
+		fprintf(stderr, "frame 0x%02X: %u bytes of response, expected %u\n", opcode, got, responseLength);
+		return 1;
+	}
+	return 0;
+}
+
+static int hostStatus(uint32 *failures) {
+	uint32 response[2];
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)response, 8) ) {
+		return 1;
+	}
+	*failures = response[1];
+	return response[0] ? 1 : 0;
+}
+
+// The control-request protocol returns 16 IDCODE slots; CMD_SCAN_CHAIN returns
+// the chain's total IR length followed by one IDCODE per device. As nj does,
+// the scan asks for room for the longest chain and counts the devices from
+// the length of the response.
+//
+static int hostScan(uint32 *response, uint8 *numDevices) {
+	uint32 length;
+	if ( m_legacy ) {
+		if ( simControlRead(CMD_SCAN, 0, 0, (uint8 *)response, 64) ) {
+			return 1;
+		}
+		*numDevices = 0;
+		while ( *numDevices < 16 && response[*numDevices] ) {
+			(*numDevices)++;
+		}
+		return 0;
+	}
+	if ( frameCallVar(CMD_SCAN_CHAIN, 0, 0, NULL, 0, (uint8 *)response,
+	                  4 * (SIM_MAX_DEVICES + 1), &length, NULL) )
+	{
+		return 1;
+	}
+	*numDevices = (uint8)((length - 4) / 4);
+	return 0;
+}
+
+static int hostSetIrLens(const uint8 *irLens, uint8 numDevices) {
+	if ( m_legacy ) {
+		return simControlWrite(CMD_SET_IRLENS, numDevices, 0, irLens, numDevices);
+	}
+	return frameCall(CMD_SET_IRLENS, 0, 0, irLens, numDevices, NULL, 0, NULL);
+}
+
+// The control-request protocol has no way to set the geometry; the firmware
+// then assumes an ATmega162
+//
+static int hostSetAvrGeometry(
+	uint16 pageSize, uint16 numPages, uint16 eepromPageSize, uint16 eepromPages, uint8 ocdr,
+	const uint16 *unreadable)
+{
+	AvrGeometry geometry;
+	if ( m_legacy ) {
+		return 0;
+	}
+	geometry.pageSize = pageSize;
+	geometry.numPages = numPages;
+	geometry.eepromPageSize = eepromPageSize;
+	geometry.eepromPages = eepromPages;
+	geometry.ocdr = ocdr;
+	memcpy(geometry.unreadable, unreadable, sizeof(geometry.unreadable));
+	return frameCall(CMD_SET_AVR_GEOMETRY, 0, 0, (const uint8 *)&geometry, sizeof(geometry), NULL, 0, NULL);
+}
+
+static int hostReadFuses(uint32 *fuses) {
+	if ( m_legacy ) {
+		return simControlRead(CMD_RW_AVR_FUSES, 0, 0, (uint8 *)fuses, 4);
+	}
+	return frameCall(CMD_RW_AVR_FUSES, 0, 0, NULL, 0, (uint8 *)fuses, 4, NULL);
+}
+
+static int hostWriteFuses(uint32 fuses) {
+	if ( m_legacy ) {
+		return simControlWrite(CMD_RW_AVR_FUSES, fuses >> 16, fuses & 0xFFFF, NULL, 0);
+	}
+	return frameCall(CMD_RW_AVR_FUSES, FRAME_WRITE, fuses, NULL, 0, NULL, 0, NULL);
+}
+
+static int hostErase(void) {
+	if ( m_legacy ) {
+		if ( simControlWrite(CMD_ERASE_AVR_FLASH, 0, 0, NULL, 0) ) {
+			return 1;
+		}
+		simRun();  // the erase runs as a job in the main loop
+		return 0;
+	}
+	return frameCall(CMD_ERASE_AVR_FLASH, 0, 0, NULL, 0, NULL, 0, NULL);
+}
+
+// Send a bulk payload to a command that consumes it, then fetch the status
+//
+static int hostLoad(CommandByte command, const uint8 *data, uint32 length, uint32 *failures) {
+	if ( m_legacy ) {
+		simBulkQueue(data, length);
+		if ( simControlWrite(command, length >> 16, length & 0xFFFF, NULL, 0) ) {
+			return 1;
+		}
+		simRun();
+		return hostStatus(failures);
+	}
+	return frameCall(command, 0, 0, data, length, NULL, 0, failures);
+}
+
+static int hostReadFlash(uint8 *buf, uint32 length) {
+	if ( m_legacy ) {
+		if ( simControlWrite(CMD_RD_AVR_FLASH, length >> 16, length & 0xFFFF, NULL, 0) ) {
+			return 1;
+		}
+		simRun();
+		return simBulkFetch(buf, length) == length ? 0 : 1;
+	}
+	return frameCall(CMD_RD_AVR_FLASH, 0, length, NULL, 0, buf, length, NULL);
+}
+
+static int benchScan(void) {
+	uint32 response[SIM_MAX_DEVICES + 1];
+	const uint32 *idCodes = m_legacy ? response : response + 1;
+	uint8 irLens[SIM_MAX_DEVICES];
+	uint32 irBits = 0;
+	uint8 i, numDevices;
+	if ( hostScan(response, &numDevices) ) {
+		return 1;
+	}
+	if ( numDevices != simChainLength() ) {
+		fprintf(stderr, "scan: found %d devices, expected %d\n", numDevices, simChainLength());
+		return 1;
+	}
+	for ( i = 0; i < numDevices; i++ ) {
+		if ( idCodes[numDevices - 1 - i] != simChainDevice(i)->model->idCode ) {
+			fprintf(stderr, "scan: device %d has IDCODE 0x%08X\n", i, idCodes[numDevices - 1 - i]);
+			return 1;
+		}
+		irLens[i] = simChainDevice(i)->model->irLen;
+		irBits += irLens[i];
+	}
+	if ( !m_legacy && response[0] != irBits ) {
+		fprintf(stderr, "scan: measured %d IR bits, expected %d\n", response[0], irBits);
+		return 1;
+	}
+	if ( hostSetIrLens(irLens, numDevices) ) {
+		return 1;
+	}
+	if ( simIsAvr(simChainDevice(0)) ) {
+		uint32 size, eepromSize;
+		const uint16 pageSize = simAvrPageSize(simChainDevice(0));
+		const uint16 eepromPageSize = simAvrEepromPageSize(simChainDevice(0));
+		simAvrFlash(simChainDevice(0), &size);
+		simAvrEeprom(simChainDevice(0), &eepromSize);
+		if ( hostSetAvrGeometry(pageSize, (uint16)(size / pageSize), eepromPageSize, (uint16)(eepromSize / eepromPageSize),
+		                        simAvrOcdr(simChainDevice(0)), simAvrUnreadable(simChainDevice(0))) )
+		{
+			return 1;
+		}
+	}
+	return m_dual ? frameCall(CMD_SET_DUAL_CHAIN, 0, 1, NULL, 0, NULL, 0, NULL) : 0;
+}
+
+static int requireAvr(const char *what) {
+	if ( !simIsAvr(simChainDevice(0)) ) {
+		fprintf(stderr, "%s: the first device in the chain must be an AVR\n", what);
+		return 1;
+	}
+	return 0;
+}
+
+static int benchFuseRead(void) {
+	uint32 fuses;
+	if ( requireAvr("fuse-read") || hostReadFuses(&fuses) ) {
+		return 1;
+	}
+	if ( fuses != simAvrFuses(simChainDevice(0)) ) {
+		fprintf(stderr, "fuse-read: got 0x%08X, expected 0x%08X\n", fuses, simAvrFuses(simChainDevice(0)));
+		return 1;
+	}
+	return 0;
+}
+
+// The write scenarios check the AVR on each chain the firmware drives
+//
+static SimDevice *targetAvr(uint8 chain) {
+	SimDevice *dev;
+	simChainSelect(chain);
+	dev = simChainDevice(0);
+	simChainSelect(0);
+	return dev;
+}
+
+// The fuses written program OCDEN, which sram-dump needs
+//
+static int benchFuseWrite(void) {
+	const uint32 fuses = 0xFB19E2FC;
+	uint8 chain;
+	if ( requireAvr("fuse-write") || hostWriteFuses(fuses) ) {
+		return 1;
+	}
+	for ( chain = 0; chain <= m_dual; chain++ ) {
+		if ( simAvrFuses(targetAvr(chain)) != fuses ) {
+			fprintf(stderr, "fuse-write: device on chain %d has 0x%08X\n", chain, simAvrFuses(targetAvr(chain)));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int benchErase(void) {
+	uint32 size, i;
+	const uint8 *flash;
+	uint8 chain;
+	if ( requireAvr("erase") || hostErase() ) {
+		return 1;
+	}
+	for ( chain = 0; chain <= m_dual; chain++ ) {
+		flash = simAvrFlash(targetAvr(chain), &size);
+		for ( i = 0; i < size; i++ ) {
+			if ( flash[i] != 0xFF ) {
+				fprintf(stderr, "erase: byte 0x%04X on chain %d is 0x%02X\n", i, chain, flash[i]);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int benchFlashWrite(void) {
+	uint32 size, i, failures;
+	const uint8 *flash;
+	uint8 chain;
+	if ( requireAvr("flash-write") || hostLoad(CMD_WR_AVR_FLASH, m_image, m_imageSize, &failures) ) {
+		return 1;
+	}
+	for ( chain = 0; chain <= m_dual; chain++ ) {
+		flash = simAvrFlash(targetAvr(chain), &size);
+		for ( i = 0; i < m_imageSize; i++ ) {
+			if ( flash[i] != m_image[i] ) {
+				fprintf(stderr, "flash-write: byte 0x%04X on chain %d is 0x%02X, expected 0x%02X\n",
+					i, chain, flash[i], m_image[i]);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int benchFlashRead(void) {
+	uint8 *buf;
+	int result = 0;
+	if ( requireAvr("flash-read") ) {
+		return 1;
+	}
+	buf = malloc(m_imageSize);
+	if ( hostReadFlash(buf, m_imageSize) ) {
+		fprintf(stderr, "flash-read: short read\n");
+		result = 1;
+	} else if ( memcmp(buf, m_image, m_imageSize) ) {
+		fprintf(stderr, "flash-read: data mismatch\n");
+		result = 1;
+	}
+	free(buf);
+	return result;
+}
+
+// Write the whole EEPROM, then rewrite one page in the middle of it with its
+// complement
+//
+static int benchEepromWrite(void) {
+	uint8 *data, *eeprom;
+	uint32 size, i, failures;
+	uint16 pageSize, page;
+	uint8 chain;
+	int result = 0;
+	if ( m_legacy ) {
+		return SKIPPED;  // there is no control request for the EEPROM
+	}
+	if ( requireAvr("eeprom-write") ) {
+		return 1;
+	}
+	simAvrEeprom(simChainDevice(0), &size);
+	pageSize = simAvrEepromPageSize(simChainDevice(0));
+	page = (uint16)(size / pageSize / 2);
+	data = malloc(size);
+	for ( i = 0; i < size; i++ ) {
+		data[i] = (uint8)(i * 7 + 3);
+	}
+	if ( frameCall(CMD_WR_AVR_EEPROM, 0, 0, data, size, NULL, 0, &failures) ) {
+		result = 1;
+		goto cleanup;
+	}
+	for ( i = page * pageSize; i < (uint32)(page + 1) * pageSize; i++ ) {
+		data[i] ^= 0xFF;
+	}
+	if ( frameCall(CMD_WR_AVR_EEPROM, 0, page * pageSize, data + page * pageSize, pageSize, NULL, 0, &failures) ) {
+		result = 1;
+		goto cleanup;
+	}
+	for ( chain = 0; chain <= m_dual; chain++ ) {
+		eeprom = simAvrEeprom(targetAvr(chain), &size);
+		for ( i = 0; i < size; i++ ) {
+			if ( eeprom[i] != data[i] ) {
+				fprintf(stderr, "eeprom-write: byte 0x%04X on chain %d is 0x%02X, expected 0x%02X\n",
+					i, chain, eeprom[i], data[i]);
+				result = 1;
+				goto cleanup;
+			}
+		}
+	}
+cleanup:
+	free(data);
+	return result;
+}
+
+static int benchEepromRead(void) {
+	uint8 *buf;
+	const uint8 *eeprom;
+	uint32 size;
+	int result = 0;
+	if ( m_legacy ) {
+		return SKIPPED;  // there is no control request for the EEPROM
+	}
+	if ( requireAvr("eeprom-read") ) {
+		return 1;
+	}
+	eeprom = simAvrEeprom(simChainDevice(0), &size);
+	buf = malloc(size);
+	if ( frameCall(CMD_RD_AVR_EEPROM, 0, size, NULL, 0, buf, size, NULL) ) {
+		fprintf(stderr, "eeprom-read: short read\n");
+		result = 1;
+	} else if ( memcmp(buf, eeprom, size) ) {
+		fprintf(stderr, "eeprom-read: data mismatch\n");
+		result = 1;
+	}
+	free(buf);
+	return result;
+}
+
+// Check that a dump left the read-sensitive I/O registers as 0xFF, and put
+// what they hold in its place, for the comparison with the rest
+//
+static int unreadSkipped(uint8 *buf, const uint8 *before, const uint16 *unreadable) {
+	uint8 i;
+	for ( i = 0; i < AVR_MAX_UNREADABLE && unreadable[i]; i++ ) {
+		if ( buf[unreadable[i]] != 0xFF ) {
+			fprintf(stderr, "sram-dump: read the I/O register at 0x%04X\n", unreadable[i]);
+			return 1;
+		}
+		buf[unreadable[i]] = before[unreadable[i]];
+	}
+	return 0;
+}
+
+// Dump the AVR's whole data space through the on-chip debug interface. The
+// read-sensitive I/O registers must come back as 0xFF, unread, and the core
+// must be running again afterwards, with the registers the dump used put back.
+//
+static int benchSramDump(void) {
+	const uint16 *unreadable = simAvrUnreadable(simChainDevice(0));
+	uint8 *buf, *before;
+	const uint8 *data;
+	uint32 size;
+	int result = 0;
+	if ( m_legacy ) {
+		return SKIPPED;  // there is no control request for the dump
+	}
+	if ( requireAvr("sram-dump") ) {
+		return 1;
+	}
+	data = simAvrData(simChainDevice(0), &size);
+	before = malloc(size);
+	buf = malloc(size);
+	memcpy(before, data, size);
+	if ( frameCall(CMD_RD_AVR_SRAM, 0, size, NULL, 0, buf, size, NULL) ) {
+		fprintf(stderr, "sram-dump: short read\n");
+		result = 1;
+	} else if ( unreadSkipped(buf, before, unreadable) ) {
+		result = 1;
+	} else if ( memcmp(buf, before, size) ) {
+		fprintf(stderr, "sram-dump: data mismatch\n");
+		result = 1;
+	} else if ( memcmp(data, before, size) ) {
+		fprintf(stderr, "sram-dump: the dump changed the data space\n");
+		result = 1;
+	} else if ( simAvrStopped(simChainDevice(0)) ) {
+		fprintf(stderr, "sram-dump: the core was left stopped\n");
+		result = 1;
+	}
+	free(buf);
+	free(before);
+	return result;
+}
+
+// Start writing an inverted image to flash, check the job's progress over the
+// control endpoint part-way through, then cancel it. The job must stop
+// programming, but still consume the rest of the image and then report
+// FRAME_CANCELLED.
+//
+static int benchCancel(void) {
+	FrameHeader request;
+	FrameResponse response;
+	JobStatus status;
+	uint8 *image;
+	const uint8 *flash;
+	uint32 size, pageSize, i;
+	int result = 1;
+	if ( requireAvr("cancel") ) {
+		return 1;
+	}
+	pageSize = simAvrPageSize(simChainDevice(0));
+	image = malloc(m_imageSize);
+	for ( i = 0; i < m_imageSize; i++ ) {
+		image[i] = (uint8)~m_image[i];
+	}
+	if ( m_legacy ) {
+		simBulkQueue(image, m_imageSize);
+		if ( simControlWrite(CMD_WR_AVR_FLASH, m_imageSize >> 16, m_imageSize & 0xFFFF, NULL, 0) ) {
+			goto cleanup;
+		}
+	} else {
+		request.opcode = CMD_WR_AVR_FLASH;
+		request.seq = ++m_seq;
+		request.flags = 0x00;
+		request.reserved = 0x00;
+		request.param = 0;
+		request.length = m_imageSize;
+		simBulkQueue((const uint8 *)&request, sizeof(request));
+		simBulkQueue(image, m_imageSize);
+	}
+	simRunSteps(4);  // the request, then a few packets
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) ||
+	     status.status != FRAME_BUSY || status.done == 0 || status.done >= status.total )
+	{
+		fprintf(stderr, "cancel: job status 0x%02X after %u of %u bytes\n", status.status, status.done, status.total);
+		goto cleanup;
+	}
+	if ( simControlWrite(CMD_CANCEL, 0, 0, NULL, 0) ) {
+		goto cleanup;
+	}
+	simRun();
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) ||
+	     status.status != FRAME_CANCELLED || status.done != m_imageSize )
+	{
+		fprintf(stderr, "cancel: job finished with status 0x%02X\n", status.status);
+		goto cleanup;
+	}
+	if ( !m_legacy &&
+	     (simBulkFetch((uint8 *)&response, sizeof(response)) != sizeof(response) ||
+	      response.seq != request.seq || response.status != FRAME_CANCELLED) )
+	{
+		fprintf(stderr, "cancel: no FRAME_CANCELLED response\n");
+		goto cleanup;
+	}
+	flash = simAvrFlash(simChainDevice(0), &size);
+	if ( memcmp(flash + m_imageSize - pageSize, m_image + m_imageSize - pageSize, pageSize) ) {
+		fprintf(stderr, "cancel: the last page was programmed anyway\n");
+		goto cleanup;
+	}
+	result = 0;
+	cleanup:
+	free(image);
+	return result;
+}
+
+// Start writing an image to flash but hold back the data after a page and a
+// half, as a host which died mid-page would. The firmware must go on
+// answering CMD_STATUS and CMD_CANCEL without the rest; once it comes, the
+// job finishes cancelled, with the first page written and the half-loaded
+// one abandoned.
+//
+static int benchCancelHeld(void) {
+	FrameHeader request;
+	FrameResponse response;
+	JobStatus status;
+	uint8 *image;
+	const uint8 *flash;
+	uint32 size, pageSize, sent, i;
+	int result = 1;
+	if ( m_legacy ) {
+		return SKIPPED;  // the control-endpoint write needs its data queued first
+	}
+	if ( requireAvr("cancel-held") ) {
+		return 1;
+	}
+	pageSize = simAvrPageSize(simChainDevice(0));
+	sent = pageSize + pageSize / 2;
+	image = malloc(m_imageSize);
+	for ( i = 0; i < m_imageSize; i++ ) {
+		image[i] = (uint8)(m_image[i] ^ 0xAA);
+	}
+	request.opcode = CMD_WR_AVR_FLASH;
+	request.seq = ++m_seq;
+	request.flags = 0x00;
+	request.reserved = 0x00;
+	request.param = 0;
+	request.length = m_imageSize;
+	simBulkQueue((const uint8 *)&request, sizeof(request));
+	simBulkQueue(image, sent);
+	simRunSteps(100);  // far more than the data queued needs
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) ||
+	     status.status != FRAME_BUSY || status.done != sent || status.checkpoint != pageSize )
+	{
+		fprintf(stderr, "cancel-held: job status 0x%02X after %u bytes, checkpoint 0x%04X\n",
+			status.status, status.done, status.checkpoint);
+		goto cleanup;
+	}
+	if ( simControlWrite(CMD_CANCEL, 0, 0, NULL, 0) ) {
+		goto cleanup;
+	}
+	simRunSteps(100);
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) ||
+	     status.status != FRAME_BUSY || status.done != sent )
+	{
+		fprintf(stderr, "cancel-held: job status 0x%02X before the rest of the data\n", status.status);
+		goto cleanup;
+	}
+	simBulkQueue(image + sent, m_imageSize - sent);
+	simRun();
+	if ( simBulkFetch((uint8 *)&response, sizeof(response)) != sizeof(response) ||
+	     response.seq != request.seq || response.status != FRAME_CANCELLED )
+	{
+		fprintf(stderr, "cancel-held: no FRAME_CANCELLED response\n");
+		goto cleanup;
+	}
+	flash = simAvrFlash(simChainDevice(0), &size);
+	if ( memcmp(flash, image, pageSize) ) {
+		fprintf(stderr, "cancel-held: the first page was not programmed\n");
+		goto cleanup;
+	}
+	if ( !memcmp(flash + pageSize, image + pageSize, pageSize / 2) ) {
+		fprintf(stderr, "cancel-held: the half-loaded page was programmed anyway\n");
+		goto cleanup;
+	}
+	result = 0;
+	cleanup:
+	free(image);
+	return result;
+}
+
+// Start writing another image to flash, cancel it part-way through as if the
+// host had gone away, then write the rest from the job's checkpoint. The
+// flash must end up holding the whole image.
+//
+static int benchResume(void) {
+	FrameHeader request;
+	FrameResponse response;
+	JobStatus status;
+	uint8 *image;
+	const uint8 *flash;
+	uint32 size, i;
+	int result = 1;
+	if ( m_legacy ) {
+		return SKIPPED;  // the control-endpoint write always starts at page 0
+	}
+	if ( requireAvr("resume") ) {
+		return 1;
+	}
+	image = malloc(m_imageSize);
+	for ( i = 0; i < m_imageSize; i++ ) {
+		image[i] = (uint8)(m_image[i] ^ 0x55);
+	}
+	request.opcode = CMD_WR_AVR_FLASH;
+	request.seq = ++m_seq;
+	request.flags = 0x00;
+	request.reserved = 0x00;
+	request.param = 0;
+	request.length = m_imageSize;
+	simBulkQueue((const uint8 *)&request, sizeof(request));
+	simBulkQueue(image, m_imageSize);
+	simRunSteps(4);
+	if ( simControlWrite(CMD_CANCEL, 0, 0, NULL, 0) ) {
+		goto cleanup;
+	}
+	simRun();
+	if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) ||
+	     simBulkFetch((uint8 *)&response, sizeof(response)) != sizeof(response) ||
+	     response.status != FRAME_CANCELLED )
+	{
+		fprintf(stderr, "resume: the first write was not cancelled\n");
+		goto cleanup;
+	}
+	if ( status.checkpoint == 0 || status.checkpoint >= m_imageSize ||
+	     status.checkpoint % simAvrPageSize(simChainDevice(0)) )
+	{
+		fprintf(stderr, "resume: bad checkpoint 0x%04X\n", status.checkpoint);
+		goto cleanup;
+	}
+	if ( frameCall(CMD_WR_AVR_FLASH, 0, status.checkpoint, image + status.checkpoint,
+	               m_imageSize - status.checkpoint, NULL, 0, NULL) )
+	{
+		goto cleanup;
+	}
+	flash = simAvrFlash(simChainDevice(0), &size);
+	if ( memcmp(flash, image, m_imageSize) ) {
+		fprintf(stderr, "resume: flash does not hold the image\n");
+		goto cleanup;
+	}
+	result = 0;
+	cleanup:
+	free(image);
+	return result;
+}
+
+// XSVF helpers
+//
+static uint8 *putLong(uint8 *p, uint32 value) {
+	*p++ = (uint8)(value >> 24);
+	*p++ = (uint8)(value >> 16);
+	*p++ = (uint8)(value >> 8);
+	*p++ = (uint8)value;
+	return p;
+}
+
+static uint8 *putXSIR(uint8 *p, uint8 irLen, uint32 ins) {
+	uint8 i = (irLen + 7) / 8;
+	*p++ = 0x02;
+	*p++ = irLen;
+	while ( i-- ) {
+		*p++ = (uint8)(ins >> (8*i));
+	}
+	return p;
+}
+
+// A synthetic programming job for one device, written as if it were alone in
+// the chain: each vector loads IDCODE and checks it, and is followed by a
+// long don't-care data load with a wait, in the style of a CPLD
+// program/verify pass.
+//
+static uint8 *makeXsvf(uint8 device, uint32 *length) {
+	const SimModel *model = simChainDevice(device)->model;
+	uint8 *xsvf = malloc(XSVF_VECTORS * 128 + 8);
+	uint8 *p = xsvf;
+	uint16 i, j;
+	*p++ = 0x12; *p++ = 0x00;                  // XSTATE Test-Logic-Reset
+	*p++ = 0x12; *p++ = 0x01;                  // XSTATE Run-Test/Idle
+	*p++ = 0x13; *p++ = 0x00;                  // XENDIR Run-Test/Idle
+	*p++ = 0x14; *p++ = 0x00;                  // XENDDR Run-Test/Idle
+	*p++ = 0x07; *p++ = 0x00;                  // XREPEAT 0
+	for ( i = 0; i < XSVF_VECTORS; i++ ) {
+		p = putXSIR(p, model->irLen, model->irIdcode);
+		*p++ = 0x08; p = putLong(p, 32);           // XSDRSIZE 32
+		*p++ = 0x01; p = putLong(p, 0x0FFFFFFF);   // XTDOMASK
+		*p++ = 0x04; p = putLong(p, 0);            // XRUNTEST 0
+		*p++ = 0x09; p = putLong(p, 0);            // XSDRTDO
+		p = putLong(p, model->idCode);
+		*p++ = 0x08; p = putLong(p, 128);          // XSDRSIZE 128
+		*p++ = 0x01;                               // XTDOMASK 0
+		for ( j = 0; j < 16; j++ ) *p++ = 0x00;
+		*p++ = 0x04; p = putLong(p, 20);           // XRUNTEST 20us
+		*p++ = 0x09;                               // XSDRTDO
+		for ( j = 0; j < 16; j++ ) *p++ = (uint8)(i + j);
+		for ( j = 0; j < 16; j++ ) *p++ = 0x00;
+	}
+	*p++ = 0x00;                                 // XCOMPLETE
+	*length = (uint32)(p - xsvf);
+	return xsvf;
+}
+
+static uint8 *loadFile(const char *fileName, uint32 *length) {
+	FILE *file = fopen(fileName, "rb");
+	uint8 *data;
+	long size;
+	if ( !file ) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if ( fread(data, 1, size, file) != (size_t)size ) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*length = (uint32)size;
+	return data;
+}
+
+static int benchXsvf(void) {
+	uint32 length, failures = 0;
+	uint8 *xsvf;
+	int result = 0;
+	if ( m_xsvfFile ) {
+		xsvf = loadFile(m_xsvfFile, &length);
+		if ( !xsvf ) {
+			fprintf(stderr, "xsvf: cannot load %s\n", m_xsvfFile);
+			return 1;
+		}
+	} else {
+		xsvf = makeXsvf(0, &length);
+	}
+	// A file given with -x is played to the chain as it stands
+	if ( m_legacy || m_xsvfFile ?
+	     hostLoad(CMD_PLAY_XSVF, xsvf, length, &failures) :
+	     frameCall(CMD_PLAY_XSVF, FRAME_XSVF_TARGET, 0, xsvf, length, NULL, 0, &failures) )
+	{
+		result = 1;
+	} else if ( failures ) {
+		fprintf(stderr, "xsvf: %u vectors failed\n", failures);
+		result = 1;
+	} else if ( m_dual ) {
+		JobStatus status;
+		if ( simControlRead(CMD_STATUS, 0, 0, (uint8 *)&status, sizeof(status)) || status.failuresB ) {
+			fprintf(stderr, "xsvf: %u vectors failed on chain B\n", status.failuresB);
+			result = 1;
+		}
+	}
+	free(xsvf);
+	return result;
+}
+
+// Play the synthetic job to a device in the middle of the chain (the last,
+// if there are only two), letting the firmware pad it for the others
+//
+static int benchXsvfTarget(void) {
+	const uint8 device = simChainLength() / 2;
+	uint32 length, failures = 0;
+	uint8 *xsvf;
+	int result = 0;
+	if ( simChainLength() < 2 ) {
+		return SKIPPED;
+	}
+	if ( m_legacy ) {
+		fprintf(stderr, "xsvf-target: only available in the framed protocol\n");
+		return 1;
+	}
+	xsvf = makeXsvf(device, &length);
+	if ( frameCall(CMD_PLAY_XSVF, FRAME_XSVF_TARGET, device, xsvf, length, NULL, 0, &failures) ) {
+		result = 1;
+	} else if ( failures ) {
+		fprintf(stderr, "xsvf-target: %u vectors failed on device %u\n", failures, device);
+		result = 1;
+	}
+	free(xsvf);
+	return result;
+}
+
+// Check IDCODE a few times, expecting the wrong one twice, and read back what
+// the firmware kept of those two vectors: the window must start at the byte
+// holding the corrupted bits, and show the device's real IDCODE there
+//
+#define XSVF_BAD_MASK 0x00500000UL
+static int benchXsvfFail(void) {
+	static const uint8 bad[] = {1, 4};  // of six vectors
+	const SimModel *model = simChainDevice(0)->model;
+	uint8 xsvf[6 * 30 + 16];
+	uint8 *p = xsvf;
+	uint32 failures = 0, i;
+	XsvfFailures record;
+	const XsvfFailure *f;
+	*p++ = 0x12; *p++ = 0x00;                  // XSTATE Test-Logic-Reset
+	*p++ = 0x12; *p++ = 0x01;                  // XSTATE Run-Test/Idle
+	*p++ = 0x07; *p++ = 0x00;                  // XREPEAT 0
+	for ( i = 0; i < 6; i++ ) {
+		p = putXSIR(p, model->irLen, model->irIdcode);
+		*p++ = 0x08; p = putLong(p, 32);           // XSDRSIZE 32
+		*p++ = 0x01; p = putLong(p, 0x0FFFFFFF);   // XTDOMASK
+		*p++ = 0x09; p = putLong(p, 0);            // XSDRTDO
+		p = putLong(p, (i == bad[0] || i == bad[1]) ? model->idCode ^ XSVF_BAD_MASK : model->idCode);
+	}
+	*p++ = 0x00;                                 // XCOMPLETE
+	if ( m_legacy ?
+	     hostLoad(CMD_PLAY_XSVF, xsvf, (uint32)(p - xsvf), &failures) :
+	     frameCall(CMD_PLAY_XSVF, FRAME_XSVF_TARGET, 0, xsvf, (uint32)(p - xsvf), NULL, 0, &failures) )
+	{
+		return 1;
+	}
+	memset(&record, 0x00, sizeof(record));
+	if ( simControlRead(CMD_STATUS, STATUS_XSVF_FAILURES, 0, (uint8 *)&record, sizeof(record)) ) {
+		return 1;
+	}
+	if ( failures != 2 || record.count != 2 ) {
+		fprintf(stderr, "xsvf-fail: %u vectors failed and %u were kept; expected 2\n", failures, record.count);
+		return 1;
+	}
+	for ( i = 0; i < 2; i++ ) {
+		f = &record.failures[i];
+		if ( f->vector != bad[i] || f->offset != 2 || f->chain != 0 || f->numBytes != 2 ||
+		     f->actual[0] != (uint8)(model->idCode >> 16) || f->actual[1] != (uint8)(model->idCode >> 24) )
+		{
+			fprintf(stderr, "xsvf-fail: vector %u kept as %u, %u bytes from byte %u, actual 0x%02X 0x%02X\n",
+				bad[i], f->vector, f->numBytes, f->offset, f->actual[0], f->actual[1]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Capture boundary-scan snapshots from the first Xilinx device in the chain.
+// The simulated board drives every pin from one counter, so each snapshot
+// must repeat with a period of 16 cells if the bits arrive in order.
+//
+static int benchSample(void) {
+	SampleRequest sample;
+	const SimModel *model = NULL;
+	uint8 *buf, *snapshot;
+	uint32 bytes, i;
+	uint16 j;
+	int result = 0;
+	for ( i = 0; i < simChainLength() && !model; i++ ) {
+		model = simChainDevice(i)->model;
+		if ( model != &simXC9572 && model != &simXC3S200 && model != &simXCF02S ) {
+			model = NULL;
+		}
+	}
+	if ( !model ) {
+		return SKIPPED;
+	}
+	sample.device = (uint8)(i - 1);
+	sample.sample = 0x01;
+	sample.bsrLen = model->bsrLen;
+	bytes = (model->bsrLen + 7) / 8;
+	buf = malloc(SAMPLES * bytes);
+	if ( m_legacy ) {
+		fprintf(stderr, "sample: only available in the framed protocol\n");
+		result = 1;
+	} else if ( frameCall(CMD_SAMPLE_BSCAN, 0, SAMPLES, (const uint8 *)&sample, sizeof(sample),
+	                      buf, SAMPLES * bytes, NULL) )
+	{
+		result = 1;
+	} else {
+		for ( i = 0; i < SAMPLES && !result; i++ ) {
+			snapshot = buf + i * bytes;
+			for ( j = 16; j < model->bsrLen; j++ ) {
+				if ( ((snapshot[j/8] >> (j%8)) ^ (snapshot[(j%16)/8] >> (j%8))) & 1 ) {
+					fprintf(stderr, "sample: snapshot %u cell %u does not match cell %u\n", i, j, j%16);
+					result = 1;
+					break;
+				}
+			}
+		}
+	}
+	free(buf);
+	return result;
+}
+
+// Configure the first XC3S200 in the chain with a synthetic bitstream: dummy
+// words, the sync word, then random configuration data
+//
+static int benchConfigure(void) {
+	static const uint8 header[] = {
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xAA, 0x99, 0x55, 0x66
+	};
+	uint8 *bitstream;
+	uint8 i;
+	uint32 j;
+	int result = 0;
+	for ( i = 0; i < simChainLength() && simChainDevice(i)->model != &simXC3S200; i++ );
+	if ( i == simChainLength() ) {
+		return SKIPPED;
+	}
+	if ( m_legacy ) {
+		fprintf(stderr, "configure: only available in the framed protocol\n");
+		return 1;
+	}
+	bitstream = malloc(S3_BITSTREAM);
+	memcpy(bitstream, header, sizeof(header));
+	for ( j = sizeof(header); j < S3_BITSTREAM; j++ ) {
+		bitstream[j] = (uint8)rand();
+	}
+	if ( frameCall(CMD_CFG_SPARTAN3, 0, i, bitstream, S3_BITSTREAM, NULL, 0, NULL) ) {
+		result = 1;
+	} else if ( !simSpartan3Done(simChainDevice(i)) ) {
+		fprintf(stderr, "configure: DONE is low\n");
+		result = 1;
+	}
+	free(bitstream);
+	return result;
+}
+
+// Program the first XCF02S in the chain with an XC3S200-sized image, with a
+// few blank rows in the middle, sending only the rows that hold data
+//
+static int benchProm(void) {
+	XcfRecord *records;
+	uint8 *image, *array;
+	uint32 size, numRecords = 0, failures = 1, j;
+	uint16 row;
+	uint8 i;
+	int result = 0;
+	for ( i = 0; i < simChainLength() && simChainDevice(i)->model != &simXCF02S; i++ );
+	if ( i == simChainLength() ) {
+		return SKIPPED;
+	}
+	if ( m_legacy ) {
+		fprintf(stderr, "prom: only available in the framed protocol\n");
+		return 1;
+	}
+	image = malloc(XCF_NUM_ROWS * XCF_ROW_BYTES);
+	memset(image, 0xFF, XCF_NUM_ROWS * XCF_ROW_BYTES);
+	for ( j = 0; j < S3_BITSTREAM; j++ ) {
+		image[j] = (uint8)rand();
+	}
+	memset(image + 64 * XCF_ROW_BYTES, 0xFF, 16 * XCF_ROW_BYTES);
+	records = malloc(XCF_NUM_ROWS * sizeof(XcfRecord));
+	for ( row = 0; row < XCF_NUM_ROWS; row++ ) {
+		for ( j = 0; j < XCF_ROW_BYTES && image[row * XCF_ROW_BYTES + j] == 0xFF; j++ );
+		if ( j < XCF_ROW_BYTES ) {
+			records[numRecords].row = row;
+			memcpy(records[numRecords].data, image + row * XCF_ROW_BYTES, XCF_ROW_BYTES);
+			numRecords++;
+		}
+	}
+	if ( frameCall(CMD_PROG_XCF, 0, i, (const uint8 *)records, numRecords * sizeof(XcfRecord),
+	               NULL, 0, &failures) )
+	{
+		result = 1;
+	} else if ( failures ) {
+		fprintf(stderr, "prom: %u rows failed to verify\n", failures);
+		result = 1;
+	} else {
+		array = simXcfArray(simChainDevice(i), &size);
+		if ( memcmp(array, image, size) ) {
+			fprintf(stderr, "prom: array does not match the image\n");
+			result = 1;
+		}
+	}
+	free(records);
+	free(image);
+	return result;
+}
+
+// Capture the cycles of a chain scan. Every cycle must be accounted for, as
+// data or as dropped, and the scan must begin with the five TMS-high cycles
+// of a TAP reset.
+//
+static int benchCapture(void) {
+	uint32 response[SIM_MAX_DEVICES + 1];
+	uint8 irLens[SIM_MAX_DEVICES];
+	CaptureBlock block;
+	SimStats before, after;
+	uint64 tck;
+	uint8 numDevices, i;
+	if ( simControlWrite(CMD_CAPTURE, 1, 0, NULL, 0) ) {
+		fprintf(stderr, "capture: cannot switch capture on\n");
+		return 1;
+	}
+	simGetStats(&before);
+	if ( hostScan(response, &numDevices) ) {
+		return 1;
+	}
+	simGetStats(&after);
+	tck = after.tckCycles - before.tckCycles;
+	if ( simControlRead(CMD_CAPTURE, 0, 0, (uint8 *)&block, sizeof(block)) ||
+	     simControlWrite(CMD_CAPTURE, 0, 0, NULL, 0) )
+	{
+		return 1;
+	}
+	if ( block.cycles + block.dropped != tck ||
+	     block.cycles != (tck < 2 * CAPTURE_BYTES ? tck : 2 * CAPTURE_BYTES) )
+	{
+		fprintf(stderr, "capture: %u cycles and %u dropped, for %llu TCKs\n",
+			block.cycles, block.dropped, (unsigned long long)tck);
+		return 1;
+	}
+	for ( i = 0; i < 5; i++ ) {
+		if ( !(block.data[i >> 1] >> ((i & 1) << 2) & CAPTURE_TMS) ) {
+			fprintf(stderr, "capture: cycle %d has TMS low\n", i);
+			return 1;
+		}
+	}
+	for ( i = 0; i < numDevices; i++ ) {
+		irLens[i] = simChainDevice(i)->model->irLen;
+	}
+	return hostSetIrLens(irLens, numDevices);  // the scan cleared them
+}
+
+// The SPI flash wired to the XC3S200's pins (cells as in xilinx.c), driven
+// through nj's own CMD_EXTEST request builder
+//
+#define SPI_READ_BYTES 32
+
+static int benchSpiSend(
+	void *context, const uint8 *payload, uint32 length, uint32 captures, uint8 *result, uint32 resultBytes)
+{
+	(void)context;
+	return frameCall(CMD_EXTEST, 0, captures, payload, length, result, resultBytes, NULL);
+}
+
+// Read the SPI flash's ID, erase its first sector, program a page of random
+// data and read the start of it back, all through the XC3S200's boundary scan
+//
+static int benchExtest(void) {
+	static const SpiPins pins = {91, 94, 97, 92, 95, 98, 99};
+	static const uint8 readId = SPI_READ_ID;
+	static const uint8 writeEnable = SPI_WRITE_ENABLE;
+	ExtestTarget target;
+	SpiBus bus;
+	uint8 page[SPI_PAGE_SIZE], *array;
+	uint32 size, id, j;
+	uint8 i;
+	int result = 1;
+	for ( i = 0; i < simChainLength() && simChainDevice(i)->model != &simXC3S200; i++ );
+	if ( i == simChainLength() ) {
+		return SKIPPED;
+	}
+	if ( m_legacy ) {
+		fprintf(stderr, "extest: only available in the framed protocol\n");
+		return 1;
+	}
+	target.device = i;
+	target.sample = 0x01;
+	target.extest = 0x00;
+	target.bsrLen = simXC3S200.bsrLen;
+	if ( spiBusInit(&bus, &target, &pins, benchSpiSend, NULL) ) {
+		return 1;
+	}
+	for ( j = 0; j < SPI_PAGE_SIZE; j++ ) {
+		page[j] = (uint8)rand();
+	}
+
+	if ( spiCommand(&bus, &readId, 1, 3) || spiBusFlush(&bus, 0) ) {
+		goto cleanup;
+	}
+	id = ((uint32)spiBusResult(&bus, 0) << 16) | ((uint32)spiBusResult(&bus, 1) << 8) | spiBusResult(&bus, 2);
+	if ( id != 0xEF3013 ) {
+		fprintf(stderr, "extest: read flash ID 0x%06X\n", id);
+		goto cleanup;
+	}
+	if ( spiCommand(&bus, &writeEnable, 1, 0) ||
+	     spiAddressed(&bus, SPI_SECTOR_ERASE, 0, NULL, 0) || spiFlushAndWait(&bus) ||
+	     spiCommand(&bus, &writeEnable, 1, 0) ||
+	     spiAddressed(&bus, SPI_PAGE_PROGRAM, 0, page, SPI_PAGE_SIZE) || spiFlushAndWait(&bus) )
+	{
+		goto cleanup;
+	}
+	if ( spiSelect(&bus, 1) || spiByte(&bus, SPI_READ, 0) ||
+	     spiByte(&bus, 0x00, 0) || spiByte(&bus, 0x00, 0) || spiByte(&bus, 0x00, 0) )
+	{
+		goto cleanup;
+	}
+	for ( j = 0; j < SPI_READ_BYTES; j++ ) {
+		if ( spiByte(&bus, 0x00, 1) ) {
+			goto cleanup;
+		}
+	}
+	if ( spiSelect(&bus, 0) || spiBusFlush(&bus, 1) ) {
+		goto cleanup;
+	}
+	for ( j = 0; j < SPI_READ_BYTES; j++ ) {
+		if ( spiBusResult(&bus, j) != page[j] ) {
+			fprintf(stderr, "extest: read 0x%02X at %u, expected 0x%02X\n", spiBusResult(&bus, j), j, page[j]);
+			goto cleanup;
+		}
+	}
+	array = simSpiFlashArray(simChainDevice(i), &size);
+	if ( memcmp(array, page, SPI_PAGE_SIZE) ) {
+		fprintf(stderr, "extest: flash does not match the page\n");
+		goto cleanup;
+	}
+	result = 0;
+cleanup:
+	spiBusDestroy(&bus);
+	return result;
+}
+
+static Scenario m_scenarios[] = {
+	{"scan",         benchScan,        {0}, 0},
+	{"fuse-read",    benchFuseRead,    {0}, 0},
+	{"fuse-write",   benchFuseWrite,   {0}, 0},
+	{"erase",        benchErase,       {0}, 0},
+	{"flash-write",  benchFlashWrite,  {0}, 0},
+	{"flash-read",   benchFlashRead,   {0}, 0},
+	{"cancel",       benchCancel,      {0}, 0},
+	{"cancel-held",  benchCancelHeld,  {0}, 0},
+	{"resume",       benchResume,      {0}, 0},
+	{"eeprom-write", benchEepromWrite, {0}, 0},
+	{"eeprom-read",  benchEepromRead,  {0}, 0},
+	{"sram-dump",    benchSramDump,    {0}, 0},
+	{"xsvf",         benchXsvf,        {0}, 0},
+	{"xsvf-target",  benchXsvfTarget,  {0}, 0},
+	{"xsvf-fail",    benchXsvfFail,    {0}, 0},
+	{"sample",       benchSample,      {0}, 0},
+	{"configure",    benchConfigure,   {0}, 0},
+	{"prom",         benchProm,        {0}, 0},
+	{"capture",      benchCapture,     {0}, 0},
+	{"extest",       benchExtest,      {0}, 0},
+	{NULL,           NULL,             {0}, 0}
+};
+
+static void printResults(void) {
+	const Scenario *s;
+	printf("%-12s %10s %9s %9s %6s %12s %12s\n",
+		"scenario", "tck", "usb-out", "usb-in", "trips", "idle(us)", "time(us)");
+	for ( s = m_scenarios; s->name; s++ ) {
+		if ( s->result == SKIPPED ) {
+			printf("%-12s %10s\n", s->name, "skipped");
+			continue;
+		}
+		printf("%-12s %10llu %9llu %9llu %6u %12llu %12llu%s\n",
+			s->name,
+			(unsigned long long)s->stats.tckCycles,
+			(unsigned long long)s->stats.usbOutBytes,
+			(unsigned long long)s->stats.usbInBytes,
+			s->stats.roundTrips,
+			(unsigned long long)(s->stats.idleNs / 1000),
+			(unsigned long long)(s->stats.timeNs / 1000),
+			s->result ? "  FAILED" : "");
+	}
+}
+
+static int writeBaseline(const char *fileName) {
+	FILE *file = fopen(fileName, "w");
+	const Scenario *s;
+	if ( !file ) {
+		fprintf(stderr, "Cannot write %s\n", fileName);
+		return 1;
+	}
+	for ( s = m_scenarios; s->name; s++ ) {
+		if ( s->result == SKIPPED ) {
+			continue;
+		}
+		fprintf(file, "%s %llu %llu %u\n",
+			s->name,
+			(unsigned long long)s->stats.tckCycles,
+			(unsigned long long)(s->stats.usbOutBytes + s->stats.usbInBytes),
+			s->stats.roundTrips);
+	}
+	fclose(file);
+	return 0;
+}
+
+// Fail if any scenario now needs more TCKs, USB bytes or round-trips than
+// the baseline recorded.
+//
+static int checkBaseline(const char *fileName) {
+	FILE *file = fopen(fileName, "r");
+	char name[32];
+	unsigned long long tck, bytes;
+	unsigned int roundTrips;
+	const Scenario *s;
+	int regressions = 0;
+	if ( !file ) {
+		fprintf(stderr, "Cannot read %s\n", fileName);
+		return 1;
+	}
+	while ( fscanf(file, "%31s %llu %llu %u", name, &tck, &bytes, &roundTrips) == 4 ) {
+		for ( s = m_scenarios; s->name && strcmp(s->name, name); s++ );
+		if ( !s->name ) {
+			continue;
+		}
+		if ( s->stats.tckCycles > tck ||
+		     s->stats.usbOutBytes + s->stats.usbInBytes > bytes ||
+		     s->stats.roundTrips > roundTrips )
+		{
+			fprintf(stderr, "%s: regressed against %s\n", name, fileName);
+			regressions++;
+		}
+	}
+	fclose(file);
+	return regressions ? 1 : 0;
+}
+
+static void usage(const char *progName) {
+	printf("Usage: %s [-l] [-2] [-c <chain>] [-x <file.xsvf>] [-b <baseline>] [-w <baseline>]\n\n", progName);
+	printf("  -l            use the control-request protocol instead of framed bulk\n");
+	printf("  -2            drive a second, identical chain in lockstep (framed only)\n");
+	printf("  -c <chain>    comma-separated devices, nearest TDI first (default %s)\n", m_chainSpec);
+	printf("  -x <file>     play this XSVF file instead of the synthetic one\n");
+	printf("  -b <file>     fail if any scenario is worse than this baseline\n");
+	printf("  -w <file>     write the results as a new baseline\n");
+}
+
+int main(int argc, char **argv) {
+	const char *checkFile = NULL;
+	const char *writeFile = NULL;
+	Scenario *s;
+	uint32 i;
+	int failed = 0;
+
+	for ( i = 1; i < (uint32)argc; i++ ) {
+		if ( !strcmp(argv[i], "-c") && i + 1 < (uint32)argc ) {
+			m_chainSpec = argv[++i];
+		} else if ( !strcmp(argv[i], "-x") && i + 1 < (uint32)argc ) {
+			m_xsvfFile = argv[++i];
+		} else if ( !strcmp(argv[i], "-b") && i + 1 < (uint32)argc ) {
+			checkFile = argv[++i];
+		} else if ( !strcmp(argv[i], "-w") && i + 1 < (uint32)argc ) {
+			writeFile = argv[++i];
+		} else if ( !strcmp(argv[i], "-l") ) {
+			m_legacy = 1;
+		} else if ( !strcmp(argv[i], "-2") ) {
+			m_dual = 1;
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if ( m_dual && m_legacy ) {
+		usage(argv[0]);
+		return 2;
+	}
+	if ( buildChain() ) {
+		return 2;
+	}
+	m_imageSize = 16384;
+	if ( simIsAvr(simChainDevice(0)) ) {
+		simAvrFlash(simChainDevice(0), &m_imageSize);
+	}
+	m_image = malloc(m_imageSize);
+	srand(1);
+	for ( i = 0; i < m_imageSize; i++ ) {
+		m_image[i] = (uint8)rand();
+	}
+
+	for ( s = m_scenarios; s->name; s++ ) {
+		simResetStats();
+		s->result = s->run();
+		simGetStats(&s->stats);
+		if ( s->result != SKIPPED ) {
+			failed |= s->result;
+		}
+	}
+	printResults();
+	free(m_image);
+
+	if ( writeFile && writeBaseline(writeFile) ) {
+		return 2;
+	}
+	if ( checkFile && checkBaseline(checkFile) ) {
+		return 1;
+	}
+	return failed;
+}
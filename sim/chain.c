@@ -0,0 +1,372 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/io.h>
+#include "sim.h"
+
+// Nanoseconds per TCK, given the firmware's estimated cycles per bit
+#define TCK_NS (SIM_CYCLES_PER_TCK * 1000000000ULL / SIM_F_CPU)
+
+uint8_t simDDRB;
+uint8_t simREGCR;
+uint8_t simMCUSR;
+
+static SimDevice m_chains[SIM_CHAINS][SIM_MAX_DEVICES];
+static uint8 m_lengths[SIM_CHAINS];
+static SimDevice *m_chain = m_chains[0];  // the chain simChainAdd() etc. refer to
+static uint8 *m_numDevices = &m_lengths[0];
+static uint8 m_portPending;    // value most recently written to PORTB
+static uint8 m_portCommitted;  // value the chain has already seen
+static uint8 m_pinSync;        // PINB, as seen through the input synchroniser
+static uint64 m_now;
+static SimStats m_stats;
+static SimStats m_base;
+
+// A device with no IDCODE register: Test-Logic-Reset selects BYPASS
+//
+static uint16 bypassDrLength(SimDevice *dev) {
+	(void)dev;
+	return 1;
+}
+
+const SimModel simBypass = {
+	"BYPASS", 0x00000000, 5, 0x1F, 0,
+	NULL, bypassDrLength, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static const SimModel *const m_models[] = {
+	&simATmega162,
+	&simATmega2560,
+	&simXC9572,
+	&simXC3S200,
+	&simXCF02S,
+	&simBypass,
+	NULL
+};
+
+static const SimTapState m_nextState[16][2] = {
+	/* TLR        */ {SIM_RTI,      SIM_TLR},
+	/* RTI        */ {SIM_RTI,      SIM_SELECT_DR},
+	/* SELECT_DR  */ {SIM_CAPTURE_DR, SIM_SELECT_IR},
+	/* CAPTURE_DR */ {SIM_SHIFT_DR, SIM_EXIT1_DR},
+	/* SHIFT_DR   */ {SIM_SHIFT_DR, SIM_EXIT1_DR},
+	/* EXIT1_DR   */ {SIM_PAUSE_DR, SIM_UPDATE_DR},
+	/* PAUSE_DR   */ {SIM_PAUSE_DR, SIM_EXIT2_DR},
+	/* EXIT2_DR   */ {SIM_SHIFT_DR, SIM_UPDATE_DR},
+	/* UPDATE_DR  */ {SIM_RTI,      SIM_SELECT_DR},
+	/* SELECT_IR  */ {SIM_CAPTURE_IR, SIM_TLR},
+	/* CAPTURE_IR */ {SIM_SHIFT_IR, SIM_EXIT1_IR},
+	/* SHIFT_IR   */ {SIM_SHIFT_IR, SIM_EXIT1_IR},
+	/* EXIT1_IR   */ {SIM_PAUSE_IR, SIM_UPDATE_IR},
+	/* PAUSE_IR   */ {SIM_PAUSE_IR, SIM_EXIT2_IR},
+	/* EXIT2_IR   */ {SIM_SHIFT_IR, SIM_UPDATE_IR},
+	/* UPDATE_IR  */ {SIM_RTI,      SIM_SELECT_DR}
+};
+
+void simChainReset(void) {
+	uint8 c, i;
+	for ( c = 0; c < SIM_CHAINS; c++ ) {
+		for ( i = 0; i < m_lengths[c]; i++ ) {
+			free(m_chains[c][i].priv);
+		}
+		m_lengths[c] = 0;
+	}
+	memset(m_chains, 0, sizeof(m_chains));
+	simChainSelect(0);
+	m_portPending = m_portCommitted = 0x00;
+	m_pinSync = SIM_TDO;
+	simDDRB = 0x00;
+}
+
+// Chain 0 is wired to the firmware's chain A pins, chain 1 to chain B's. The
+// functions below act on the selected chain.
+//
+void simChainSelect(uint8 chain) {
+	m_chain = m_chains[chain];
+	m_numDevices = &m_lengths[chain];
+}
+
+// Devices are added starting with the one nearest TDI, which matches the
+// numbering used by the host tool.
+//
+SimDevice *simChainAdd(const SimModel *model) {
+	SimDevice *dev;
+	if ( *m_numDevices == SIM_MAX_DEVICES ) {
+		return NULL;
+	}
+	dev = &m_chain[(*m_numDevices)++];
+	memset(dev, 0, sizeof(*dev));
+	dev->model = model;
+	dev->state = SIM_TLR;
+	dev->ir = model->irIdcode;
+	dev->tdo = dev->nextTdo = 1;
+	if ( model->init ) {
+		model->init(dev);
+	}
+	return dev;
+}
+
+SimDevice *simChainDevice(uint8 index) {
+	return index < *m_numDevices ? &m_chain[index] : NULL;
+}
+
+uint8 simChainLength(void) {
+	return *m_numDevices;
+}
+
+// Look up a model by name, ignoring case. The name ends at a NUL or comma.
+//
+const SimModel *simFindModel(const char *name) {
+	const SimModel *const *m;
+	const char *p, *q;
+	for ( m = m_models; *m; m++ ) {
+		p = (*m)->name;
+		q = name;
+		while ( *p && toupper((unsigned char)*q) == *p ) {
+			p++;
+			q++;
+		}
+		if ( !*p && (!*q || *q == ',') ) {
+			return *m;
+		}
+	}
+	return NULL;
+}
+
+uint64 simNow(void) {
+	return m_now;
+}
+
+// The firmware's busy-wait, which takes about a microsecond per iteration
+//
+void simDelay(uint32 us) {
+	m_now += us * 1000ULL;
+	m_stats.idleNs += us * 1000ULL;
+}
+
+void simGetStats(SimStats *stats) {
+	stats->tckCycles = m_stats.tckCycles - m_base.tckCycles;
+	stats->idleNs = m_stats.idleNs - m_base.idleNs;
+	stats->usbOutBytes = m_stats.usbOutBytes - m_base.usbOutBytes;
+	stats->usbInBytes = m_stats.usbInBytes - m_base.usbInBytes;
+	stats->usbPackets = m_stats.usbPackets - m_base.usbPackets;
+	stats->roundTrips = m_stats.roundTrips - m_base.roundTrips;
+	stats->timeNs = m_now - m_base.timeNs;
+}
+
+void simResetStats(void) {
+	m_base = m_stats;
+	m_base.timeNs = m_now;
+}
+
+// Account for USB traffic: one host transfer, carrying the given payload
+//
+void simCountUsb(uint32 outBytes, uint32 inBytes, uint8 roundTrip) {
+	const uint32 packets =
+		(outBytes + SIM_PACKET_SIZE - 1) / SIM_PACKET_SIZE +
+		(inBytes + SIM_PACKET_SIZE - 1) / SIM_PACKET_SIZE;
+	m_stats.usbOutBytes += outBytes;
+	m_stats.usbInBytes += inBytes;
+	m_stats.usbPackets += packets;
+	m_now += packets * SIM_PACKET_NS;
+	if ( roundTrip ) {
+		m_stats.roundTrips++;
+		m_now += SIM_TRANSFER_NS;
+	}
+}
+
+// Read numBits (at most 32) of a device's DR, starting at logical bit "first"
+//
+uint32 simDrRead(const SimDevice *dev, uint16 first, uint8 numBits) {
+	uint32 value = 0;
+	uint16 pos;
+	uint8 i;
+	for ( i = 0; i < numBits && first + i < dev->drLen; i++ ) {
+		pos = (dev->drHead + first + i) % dev->drLen;
+		if ( dev->dr[pos >> 3] & (1 << (pos & 7)) ) {
+			value |= 1UL << i;
+		}
+	}
+	return value;
+}
+
+void simDrWrite(SimDevice *dev, uint16 first, uint8 numBits, uint32 value) {
+	uint16 pos;
+	uint8 i;
+	for ( i = 0; i < numBits && first + i < dev->drLen; i++ ) {
+		pos = (dev->drHead + first + i) % dev->drLen;
+		if ( value & (1UL << i) ) {
+			dev->dr[pos >> 3] |= (1 << (pos & 7));
+		} else {
+			dev->dr[pos >> 3] &= ~(1 << (pos & 7));
+		}
+	}
+}
+
+// One rising edge of TCK on a single device
+//
+static void clockDevice(SimDevice *dev, uint8 tms, uint8 tdi) {
+	const SimModel *model = dev->model;
+	const SimTapState prev = dev->state;
+	uint16 pos;
+
+	if ( prev == SIM_SHIFT_DR ) {
+		pos = dev->drHead;
+		if ( tdi ) {
+			dev->dr[pos >> 3] |= (1 << (pos & 7));
+		} else {
+			dev->dr[pos >> 3] &= ~(1 << (pos & 7));
+		}
+		dev->drHead = (pos + 1) % dev->drLen;
+		dev->drShifted++;
+		if ( model->shiftDR ) {
+			model->shiftDR(dev);
+		}
+	} else if ( prev == SIM_SHIFT_IR ) {
+		dev->irShift >>= 1;
+		if ( tdi ) {
+			dev->irShift |= 1UL << (model->irLen - 1);
+		}
+	}
+
+	dev->state = m_nextState[prev][tms ? 1 : 0];
+	switch ( dev->state ) {
+		case SIM_TLR:
+			if ( prev != SIM_TLR ) {
+				dev->ir = model->irIdcode;
+				if ( model->updateIR ) {
+					model->updateIR(dev);
+				}
+			}
+			break;
+		case SIM_CAPTURE_DR:
+			dev->drLen = model->drLength(dev);
+			dev->drHead = 0;
+			dev->drShifted = 0;
+			memset(dev->dr, 0, sizeof(dev->dr));
+			if ( model->captureDR ) {
+				model->captureDR(dev);
+			}
+			break;
+		case SIM_UPDATE_DR:
+			if ( model->updateDR ) {
+				model->updateDR(dev);
+			}
+			break;
+		case SIM_CAPTURE_IR:
+			dev->irShift = model->captureIR ? model->captureIR(dev) : 0x01;
+			break;
+		case SIM_UPDATE_IR:
+			dev->ir = dev->irShift & ((1UL << model->irLen) - 1);
+			if ( model->updateIR ) {
+				model->updateIR(dev);
+			}
+			break;
+		default:
+			break;
+	}
+
+	if ( model->clock ) {
+		model->clock(dev);
+	}
+
+	if ( dev->state == SIM_SHIFT_DR ) {
+		pos = dev->drHead;
+		dev->nextTdo = (dev->dr[pos >> 3] >> (pos & 7)) & 1;
+	} else if ( dev->state == SIM_SHIFT_IR ) {
+		dev->nextTdo = dev->irShift & 1;
+	} else {
+		dev->nextTdo = 1;  // TDO is tristated; the line is pulled up
+	}
+}
+
+static void risingEdge(uint8 chain, uint8 tms, uint8 tdi) {
+	SimDevice *const devices = m_chains[chain];
+	uint8 in = tdi ? 1 : 0;
+	uint8 out, i;
+	for ( i = 0; i < m_lengths[chain]; i++ ) {
+		out = devices[i].tdo;
+		clockDevice(&devices[i], tms, in);
+		in = out;
+	}
+}
+
+static void fallingEdge(uint8 chain) {
+	SimDevice *const devices = m_chains[chain];
+	uint8 i;
+	for ( i = 0; i < m_lengths[chain]; i++ ) {
+		devices[i].tdo = devices[i].nextTdo;
+	}
+}
+
+static uint8 chainTdo(uint8 chain) {
+	return m_lengths[chain] == 0 || m_chains[chain][m_lengths[chain] - 1].tdo;
+}
+
+static uint8 pins(void) {
+	uint8 value = m_portCommitted & simDDRB;
+	if ( chainTdo(0) ) {
+		value |= SIM_TDO;
+	}
+	if ( chainTdo(1) ) {
+		value |= SIM_TDO >> SIM_CHAIN_B_SHIFT;
+	}
+	return value;
+}
+
+// Clock one chain, if the firmware is driving its TCK
+//
+static void clockChain(uint8 chain, uint8 prev, uint8 next) {
+	const uint8 shift = chain ? SIM_CHAIN_B_SHIFT : 0;
+	const uint8 tck = SIM_TCK >> shift;
+	if ( simDDRB & tck ) {
+		if ( !(prev & tck) && (next & tck) ) {
+			risingEdge(chain, next & (SIM_TMS >> shift), next & (SIM_TDI >> shift));
+		} else if ( (prev & tck) && !(next & tck) ) {
+			fallingEdge(chain);
+		}
+	}
+}
+
+// Apply the most recent PORTB write to the chain. PINB is sampled before the
+// write takes effect, modelling the one-cycle lag of the AT90USB162's input
+// synchroniser: jtagClock() therefore sees TDO as it was on the rising edge.
+//
+static void commit(void) {
+	const uint8 prev = m_portCommitted;
+	const uint8 next = m_portPending;
+	m_pinSync = pins();
+	m_portCommitted = next;
+	if ( (simDDRB & SIM_TCK) && !(prev & SIM_TCK) && (next & SIM_TCK) ) {
+		m_stats.tckCycles++;  // both chains share the one clock period
+		m_now += TCK_NS;
+	}
+	clockChain(0, prev, next);
+	clockChain(1, prev, next);
+}
+
+uint8_t *simPortB(void) {
+	commit();
+	return &m_portPending;
+}
+
+uint8_t simPinB(void) {
+	commit();
+	return m_pinSync;
+}
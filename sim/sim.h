@@ -0,0 +1,148 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include "types.h"
+
+// AT90USB162 clock, and an estimate of how many CPU cycles the firmware spends
+// per TCK in its shift loops. Together these give the simulated JTAG time.
+#define SIM_F_CPU          16000000UL
+#define SIM_CYCLES_PER_TCK 20
+
+// Full-speed USB costs: every transfer the host must wait on (control
+// transfers and bulk IN) pays a round-trip, and every 64-byte bulk packet
+// takes roughly 1/19 of a frame. Bulk OUT writes can be queued back to back.
+#define SIM_TRANSFER_NS   1000000ULL
+#define SIM_PACKET_NS     53000ULL
+#define SIM_PACKET_SIZE   64
+
+// Port B pins, as wired on the Nanduino (see firmware/main.c)
+#define SIM_TCK 0x80
+#define SIM_TMS 0x40
+#define SIM_TDO 0x20
+#define SIM_TDI 0x10
+
+// The DUAL_CHAIN firmware's second chain, four bits lower on PB3..PB0
+#define SIM_CHAIN_B_SHIFT 4
+#define SIM_CHAINS        2
+
+// TAP controller states, numbered as in the XSVF spec
+typedef enum {
+	SIM_TLR = 0, SIM_RTI,
+	SIM_SELECT_DR, SIM_CAPTURE_DR, SIM_SHIFT_DR, SIM_EXIT1_DR, SIM_PAUSE_DR, SIM_EXIT2_DR, SIM_UPDATE_DR,
+	SIM_SELECT_IR, SIM_CAPTURE_IR, SIM_SHIFT_IR, SIM_EXIT1_IR, SIM_PAUSE_IR, SIM_EXIT2_IR, SIM_UPDATE_IR
+} SimTapState;
+
+#define SIM_MAX_DR_BITS 2048
+#define SIM_MAX_DEVICES 64
+
+typedef struct SimDevice SimDevice;
+
+// A device model. The generic TAP logic in chain.c handles IR shifting and
+// plain DR shifting; the hooks give each model its own data registers.
+//
+typedef struct {
+	const char *name;
+	uint32 idCode;
+	uint8 irLen;
+	uint32 irIdcode;                       // instruction selected by Test-Logic-Reset
+	uint16 bsrLen;                         // boundary-scan register length
+	void (*init)(SimDevice *dev);
+	uint16 (*drLength)(SimDevice *dev);    // length of the DR selected by dev->ir
+	void (*captureDR)(SimDevice *dev);     // load dev->dr on Capture-DR
+	void (*shiftDR)(SimDevice *dev);       // optional: called after every Shift-DR clock
+	void (*updateDR)(SimDevice *dev);      // act on dev->dr on Update-DR
+	void (*updateIR)(SimDevice *dev);      // act on dev->ir on Update-IR
+	uint32 (*captureIR)(SimDevice *dev);   // optional: IR status on Capture-IR (default 0x01)
+	void (*clock)(SimDevice *dev);         // optional: called after every TCK, in the new state
+	const void *info;                      // model-specific constant data
+} SimModel;
+
+struct SimDevice {
+	const SimModel *model;
+	SimTapState state;
+	uint32 ir;            // current instruction
+	uint32 irShift;       // IR shift register
+	uint8 dr[SIM_MAX_DR_BITS/8];
+	uint16 drLen;
+	uint16 drHead;        // dr[] is circular; bit 0 of the logical register is at drHead
+	uint32 drShifted;     // bits shifted since Capture-DR
+	uint8 tdo;            // value driven on TDO since the last falling edge
+	uint8 nextTdo;        // value that will be driven after the next falling edge
+	void *priv;           // model-specific state
+};
+
+// Counters for one benchmark run
+typedef struct {
+	uint64 tckCycles;
+	uint64 idleNs;        // time spent in the firmware's delay()
+	uint64 usbOutBytes;
+	uint64 usbInBytes;
+	uint32 usbPackets;
+	uint32 roundTrips;    // transfers the host had to wait for
+	uint64 timeNs;        // total simulated time
+} SimStats;
+
+// chain.c
+extern const SimModel simBypass;
+void simChainReset(void);
+void simChainSelect(uint8 chain);
+SimDevice *simChainAdd(const SimModel *model);
+SimDevice *simChainDevice(uint8 index);
+uint8 simChainLength(void);
+const SimModel *simFindModel(const char *name);
+uint64 simNow(void);
+void simDelay(uint32 us);
+void simGetStats(SimStats *stats);
+void simResetStats(void);
+uint32 simDrRead(const SimDevice *dev, uint16 first, uint8 numBits);
+void simDrWrite(SimDevice *dev, uint16 first, uint8 numBits, uint32 value);
+
+// usb.c
+void simBulkQueue(const uint8 *data, uint32 length);
+uint32 simBulkFetch(uint8 *data, uint32 length);
+int simControlRead(uint8 bRequest, uint16 wValue, uint16 wIndex, uint8 *data, uint16 wLength);
+int simControlWrite(uint8 bRequest, uint16 wValue, uint16 wIndex, const uint8 *data, uint16 wLength);
+void simUsbConnect(void);
+void simCountUsb(uint32 outBytes, uint32 inBytes, uint8 roundTrip);
+void simRun(void);
+void simRunSteps(uint32 steps);
+
+// avr.c
+extern const SimModel simATmega162;
+extern const SimModel simATmega2560;
+uint8 simIsAvr(const SimDevice *dev);
+uint8 *simAvrFlash(SimDevice *dev, uint32 *size);
+uint16 simAvrPageSize(SimDevice *dev);
+uint8 *simAvrEeprom(SimDevice *dev, uint32 *size);
+uint16 simAvrEepromPageSize(SimDevice *dev);
+uint8 *simAvrData(SimDevice *dev, uint32 *size);
+uint8 simAvrOcdr(SimDevice *dev);
+const uint16 *simAvrUnreadable(SimDevice *dev);
+uint8 simAvrStopped(SimDevice *dev);
+uint32 simAvrFuses(SimDevice *dev);
+
+// xilinx.c
+extern const SimModel simXC9572;
+extern const SimModel simXC3S200;
+extern const SimModel simXCF02S;
+uint8 simSpartan3Done(SimDevice *dev);
+uint8 *simSpiFlashArray(SimDevice *dev, uint32 *size);
+uint8 *simXcfArray(SimDevice *dev, uint32 *size);
+
+#endif
@@ -0,0 +1,44 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include "usart.h"
+
+void usartInit(uint32_t baudRate) {
+	(void)baudRate;
+}
+
+void usartSendByte(uint8_t byte) {
+	fputc(byte == '\r' ? '\n' : byte, stderr);
+}
+
+void usartSendByteHex(uint8_t byte) {
+	fprintf(stderr, "%02X", byte);
+}
+
+void usartSendWordHex(uint16_t word) {
+	fprintf(stderr, "%04X", word);
+}
+
+void usartSendLongHex(uint32_t word) {
+	fprintf(stderr, "%08X", word);
+}
+
+void usartSendFlashString(const char *str) {
+	while ( *str ) {
+		usartSendByte((uint8_t)*str++);
+	}
+}
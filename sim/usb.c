@@ -0,0 +1,336 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <LUFA/Drivers/USB/USB.h>
+#include "desc.h"
+#include "sim.h"
+
+// How many times the firmware may poll an empty OUT endpoint before we decide
+// it is waiting for data the host will never send.
+#define MAX_IDLE_POLLS 1000000
+
+typedef struct {
+	uint8 data[ENDPOINT_SIZE];
+	uint8 length;
+} Packet;
+
+typedef struct {
+	Packet *packets;
+	uint32 count;
+	uint32 capacity;
+	uint32 current;  // packet being read
+	uint8 offset;    // read position within it
+	uint8 held;      // the firmware has the current packet in its bank
+} PacketQueue;
+
+USB_Request_Header_t USB_ControlRequest;
+
+void EVENT_USB_Device_ConfigurationChanged(void);
+void EVENT_USB_Device_UnhandledControlRequest(void);
+void frameTask(void);
+uint8 jobTask(void);
+
+static PacketQueue m_out;           // host -> device (OUT endpoint)
+static uint8 *m_in;                 // device -> host (IN endpoint)
+static uint32 m_inLength, m_inCapacity, m_inRead;
+static uint8 *m_inPackets;          // the length of each packet in m_in
+static uint32 m_inCount, m_inPacketCapacity, m_inNext;
+static uint8 m_inBank[ENDPOINT_SIZE];
+static uint8 m_inBankLength;
+static uint8 m_selected;
+static uint8 *m_ctrlData;           // control data stage
+static uint16 m_ctrlLength;
+static uint8 m_ctrlSetupCleared;
+static uint32 m_idlePolls;
+
+static void fatal(const char *msg) {
+	fprintf(stderr, "sim: %s\n", msg);
+	exit(1);
+}
+
+static void pushPacket(const uint8 *data, uint8 length) {
+	Packet *p;
+	if ( m_out.count == m_out.capacity ) {
+		m_out.capacity = m_out.capacity ? 2 * m_out.capacity : 64;
+		m_out.packets = realloc(m_out.packets, m_out.capacity * sizeof(Packet));
+		if ( !m_out.packets ) {
+			fatal("out of memory");
+		}
+	}
+	p = &m_out.packets[m_out.count++];
+	memcpy(p->data, data, length);
+	p->length = length;
+}
+
+// One IN packet, as the firmware hands back a bank; an empty one is a
+// zero-length packet
+//
+static void pushIn(const uint8 *data, uint8 length) {
+	if ( m_inLength + length > m_inCapacity ) {
+		m_inCapacity = 2 * (m_inLength + length);
+		m_in = realloc(m_in, m_inCapacity);
+		if ( !m_in ) {
+			fatal("out of memory");
+		}
+	}
+	if ( m_inCount == m_inPacketCapacity ) {
+		m_inPacketCapacity = m_inPacketCapacity ? 2 * m_inPacketCapacity : 64;
+		m_inPackets = realloc(m_inPackets, m_inPacketCapacity);
+		if ( !m_inPackets ) {
+			fatal("out of memory");
+		}
+	}
+	memcpy(m_in + m_inLength, data, length);
+	m_inLength += length;
+	m_inPackets[m_inCount++] = length;
+}
+
+// Host side: one bulk OUT transfer, split into full-speed packets
+//
+void simBulkQueue(const uint8 *data, uint32 length) {
+	uint32 chunk;
+	simCountUsb(length, 0, 0);
+	do {
+		chunk = length > ENDPOINT_SIZE ? ENDPOINT_SIZE : length;
+		pushPacket(data, (uint8)chunk);
+		data += chunk;
+		length -= chunk;
+	} while ( length );
+}
+
+// Host side: one bulk IN transfer of at most length bytes; returns the number
+// of bytes it got. As on the wire, the transfer ends when it is full or at a
+// short packet; one which runs out of packets before either would leave a
+// real host waiting out its timeout. Nothing at all pending counts as no
+// response.
+//
+uint32 simBulkFetch(uint8 *data, uint32 length) {
+	uint32 got = 0;
+	uint8 size;
+	while ( got < length && m_inNext < m_inCount ) {
+		size = m_inPackets[m_inNext++];
+		if ( got + size > length ) {
+			fatal("an IN packet overflows the host's buffer");
+		}
+		memcpy(data + got, m_in + m_inRead, size);
+		m_inRead += size;
+		got += size;
+		if ( size < ENDPOINT_SIZE ) {
+			break;
+		}
+	}
+	if ( got && got < length && m_inPackets[m_inNext - 1] == ENDPOINT_SIZE ) {
+		fatal("an IN transfer ended without a short packet; the host would wait out its timeout");
+	}
+	if ( m_inNext == m_inCount ) {
+		m_inRead = m_inLength = 0;
+		m_inNext = m_inCount = 0;
+	}
+	simCountUsb(0, got, 1);
+	return got;
+}
+
+static int control(uint8 bmRequestType, uint8 bRequest, uint16 wValue, uint16 wIndex, uint8 *data, uint16 wLength) {
+	USB_ControlRequest.bmRequestType = bmRequestType;
+	USB_ControlRequest.bRequest = bRequest;
+	USB_ControlRequest.wValue = wValue;
+	USB_ControlRequest.wIndex = wIndex;
+	USB_ControlRequest.wLength = wLength;
+	m_ctrlData = data;
+	m_ctrlLength = wLength;
+	m_ctrlSetupCleared = 0;
+	m_selected = ENDPOINT_CONTROLEP;
+	EVENT_USB_Device_UnhandledControlRequest();
+	return m_ctrlSetupCleared ? 0 : -1;  // unhandled requests are stalled
+}
+
+int simControlRead(uint8 bRequest, uint16 wValue, uint16 wIndex, uint8 *data, uint16 wLength) {
+	simCountUsb(0, wLength, 1);
+	return control(REQDIR_DEVICETOHOST | REQTYPE_VENDOR, bRequest, wValue, wIndex, data, wLength);
+}
+
+int simControlWrite(uint8 bRequest, uint16 wValue, uint16 wIndex, const uint8 *data, uint16 wLength) {
+	simCountUsb(wLength, 0, 1);
+	return control(REQDIR_HOSTTODEVICE | REQTYPE_VENDOR, bRequest, wValue, wIndex, (uint8 *)data, wLength);
+}
+
+// One pass of the firmware's main loop; returns nonzero if a job is running
+//
+static uint8 mainLoop(void) {
+	USB_USBTask();
+	if ( jobTask() ) {
+		return 1;
+	}
+	frameTask();
+	return 0;
+}
+
+// Run the firmware's main loop until it has no job and stops consuming OUT
+// packets
+//
+void simRun(void) {
+	uint32 current;
+	uint8 offset, busy;
+	do {
+		current = m_out.current;
+		offset = m_out.offset;
+		busy = mainLoop();
+	} while ( busy || m_out.current != current || m_out.offset != offset );
+}
+
+// Run the firmware's main loop a fixed number of times, so the host can
+// interrupt a job part-way through
+//
+void simRunSteps(uint32 steps) {
+	while ( steps-- ) {
+		mainLoop();
+	}
+}
+
+void simUsbConnect(void) {
+	free(m_out.packets);
+	memset(&m_out, 0, sizeof(m_out));
+	m_inLength = m_inRead = 0;
+	m_inNext = m_inCount = 0;
+	m_inBankLength = 0;
+	EVENT_USB_Device_ConfigurationChanged();
+}
+
+// The LUFA API, as seen by the firmware
+//
+void USB_Init(void) { }
+void USB_USBTask(void) { }
+
+bool Endpoint_ConfigureEndpoint(uint8_t number, uint8_t type, uint8_t direction, uint16_t size, uint8_t banks) {
+	(void)number; (void)type; (void)direction; (void)banks;
+	return size <= ENDPOINT_SIZE;
+}
+
+void Endpoint_SelectEndpoint(uint8_t address) {
+	m_selected = address;
+}
+
+void Endpoint_ClearSETUP(void) {
+	m_ctrlSetupCleared = 1;
+}
+
+void Endpoint_ClearStatusStage(void) { }
+
+void Endpoint_ClearIN(void) {
+	if ( m_selected == IN_ENDPOINT_ADDR ) {
+		pushIn(m_inBank, m_inBankLength);
+		m_inBankLength = 0;
+	}
+}
+
+void Endpoint_ClearOUT(void) {
+	if ( m_selected == OUT_ENDPOINT_ADDR && m_out.held ) {
+		m_out.current++;
+		m_out.offset = 0;
+		m_out.held = 0;
+	}
+}
+
+bool Endpoint_IsINReady(void) {
+	return true;
+}
+
+bool Endpoint_IsOUTReceived(void) {
+	if ( m_out.current < m_out.count ) {
+		m_idlePolls = 0;
+		m_out.held = 1;
+		return true;
+	}
+	if ( ++m_idlePolls == MAX_IDLE_POLLS ) {
+		fatal("firmware is waiting for OUT data the host never sent");
+	}
+	return false;
+}
+
+bool Endpoint_IsReadWriteAllowed(void) {
+	if ( m_selected == IN_ENDPOINT_ADDR ) {
+		return m_inBankLength < ENDPOINT_SIZE;
+	}
+	return m_out.current < m_out.count && m_out.offset < m_out.packets[m_out.current].length;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void) {
+	if ( m_selected == IN_ENDPOINT_ADDR ) {
+		return m_inBankLength;
+	}
+	return m_out.current < m_out.count ? m_out.packets[m_out.current].length - m_out.offset : 0;
+}
+
+uint8_t Endpoint_Read_Byte(void) {
+	if ( m_out.current == m_out.count || m_out.offset == m_out.packets[m_out.current].length ) {
+		fatal("firmware read past the end of an OUT packet");
+	}
+	m_out.held = 1;
+	return m_out.packets[m_out.current].data[m_out.offset++];
+}
+
+void Endpoint_Write_Byte(uint8_t data) {
+	if ( m_inBankLength == ENDPOINT_SIZE ) {
+		fatal("firmware wrote past the end of an IN packet");
+	}
+	m_inBank[m_inBankLength++] = data;
+}
+
+// As in LUFA, the streams hand a bank back only when they need to move on to
+// the next one, so a stream that ends exactly on a packet boundary still
+// leaves the caller to Endpoint_ClearOUT()/Endpoint_ClearIN().
+//
+uint8_t Endpoint_Read_Stream_LE(void *buffer, uint16_t length) {
+	uint8 *p = buffer;
+	while ( length-- ) {
+		if ( m_out.held && m_out.offset == m_out.packets[m_out.current].length ) {
+			m_out.current++;
+			m_out.offset = 0;
+			m_out.held = 0;
+		}
+		if ( m_out.current == m_out.count ) {
+			fatal("firmware is waiting for OUT data the host never sent");
+		}
+		*p++ = m_out.packets[m_out.current].data[m_out.offset++];
+		m_out.held = 1;
+	}
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void *buffer, uint16_t length) {
+	const uint8 *p = buffer;
+	while ( length-- ) {
+		if ( m_inBankLength == ENDPOINT_SIZE ) {
+			pushIn(m_inBank, ENDPOINT_SIZE);
+			m_inBankLength = 0;
+		}
+		m_inBank[m_inBankLength++] = *p++;
+	}
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Read_Control_Stream_LE(void *buffer, uint16_t length) {
+	memcpy(buffer, m_ctrlData, length < m_ctrlLength ? length : m_ctrlLength);
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE(const void *buffer, uint16_t length) {
+	memcpy(m_ctrlData, buffer, length < m_ctrlLength ? length : m_ctrlLength);
+	return ENDPOINT_RWSTREAM_NoError;
+}
@@ -0,0 +1,427 @@
+/* 
+ * Copyright (C) 2010 Chris McClelland
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *  
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+// The boundary-scan instructions common to the Xilinx parts in our chains.
+// Any other instruction selects a 1-bit bypass register.
+//
+typedef struct {
+	uint32 extest;
+	uint32 sample;
+	uint32 usercode;
+	uint32 idcode;
+} XilinxInfo;
+
+static uint16 xilinxDrLength(SimDevice *dev) {
+	const XilinxInfo *info = dev->model->info;
+	if ( dev->ir == info->idcode || dev->ir == info->usercode ) {
+		return 32;
+	} else if ( dev->ir == info->sample || dev->ir == info->extest ) {
+		return dev->model->bsrLen;
+	}
+	return 1;
+}
+
+// The board drives the pins with a free-running counter: pin i toggles
+// every 2^(i%16) microseconds.
+//
+static uint8 pinValue(uint16 pin) {
+	return (uint8)(((simNow() / 1000) >> (pin % 16)) & 1);
+}
+
+static void xilinxCaptureDR(SimDevice *dev) {
+	const XilinxInfo *info = dev->model->info;
+	uint16 i;
+	if ( dev->ir == info->idcode ) {
+		simDrWrite(dev, 0, 32, dev->model->idCode);
+	} else if ( dev->ir == info->usercode ) {
+		simDrWrite(dev, 0, 32, 0xFFFFFFFF);
+	} else if ( dev->ir == info->sample || dev->ir == info->extest ) {
+		for ( i = 0; i < dev->model->bsrLen; i++ ) {
+			simDrWrite(dev, i, 1, pinValue(i));
+		}
+	}
+}
+
+// Spartan-3 configuration over JTAG: JPROGRAM clears the configuration
+// memory (INIT goes high once that is done), CFG_IN feeds the configuration
+// logic one bit per Shift-DR clock, MSB of each byte first, and JSTART runs
+// the start-up sequence in Run-Test/Idle, raising DONE if a whole bitstream
+// containing the sync word arrived.
+//
+#define S3_JPROGRAM 0x0B
+#define S3_CFG_IN   0x05
+#define S3_JSTART   0x0C
+#define S3_IR_DONE  0x20
+#define S3_IR_INIT  0x10
+
+#define S3_CLEAR_NS        500000ULL  // time to clear the configuration memory
+#define S3_SYNC_WORD       0xAA995566
+#define S3_CONFIG_BITS     1047616    // XC3S200 bitstream length
+#define S3_STARTUP_CLOCKS  12
+
+// The board hangs a 512 KiB 25-series SPI flash (a W25X40) off four of the
+// XC3S200's pins, for the host to program through EXTEST. Pin p has input
+// cell 3p, output cell 3p+1 and control cell 3p+2, which enables the output
+// when zero; an undriven pin is pulled high. The flash answers READ ID, READ
+// STATUS, WRITE ENABLE, READ, PAGE PROGRAM and SECTOR ERASE, and ignores
+// everything but READ STATUS while busy.
+//
+#define S3_EXTEST         0x00
+#define S3_SAMPLE         0x01
+#define S3_SPI_CS_PIN     30
+#define S3_SPI_SCK_PIN    31
+#define S3_SPI_MOSI_PIN   32
+#define S3_SPI_MISO_PIN   33
+
+#define SPI_FLASH_SIZE    0x80000
+#define SPI_FLASH_ID      0xEF3013
+#define SPI_SECTOR_SIZE   0x10000
+#define SPI_ERASE_NS      20000000ULL
+#define SPI_PROGRAM_NS    700000ULL
+
+typedef struct {
+	uint8 array[SPI_FLASH_SIZE];
+	uint8 latch[3];       // input, output and control cells of CS, SCK and MOSI
+	uint8 cs, sck, mosi, miso;
+	uint8 command;
+	uint8 in;             // bits arriving on MOSI
+	uint32 bits;          // clocked in since CS fell
+	uint32 address;
+	uint8 writeEnabled;
+	uint64 busyUntil;
+} SpiFlash;
+
+static uint8 spiOutByte(const SpiFlash *flash, uint32 index) {
+	if ( flash->command == 0x05 && index >= 1 ) {
+		return (uint8)((simNow() < flash->busyUntil ? 0x01 : 0x00) | (flash->writeEnabled ? 0x02 : 0x00));
+	} else if ( simNow() < flash->busyUntil ) {
+		return 0xFF;
+	} else if ( flash->command == 0x9F && index >= 1 && index <= 3 ) {
+		return (uint8)(SPI_FLASH_ID >> (8 * (3 - index)));
+	} else if ( flash->command == 0x03 && index >= 4 ) {
+		return flash->array[(flash->address + index - 4) % SPI_FLASH_SIZE];
+	}
+	return 0xFF;
+}
+
+static void spiRisingEdge(SpiFlash *flash) {
+	uint32 index;
+	flash->in = (uint8)((flash->in << 1) | flash->mosi);
+	if ( ++flash->bits % 8 ) {
+		return;
+	}
+	index = flash->bits / 8 - 1;
+	if ( index == 0 ) {
+		flash->command = flash->in;
+		flash->address = 0;
+		if ( simNow() >= flash->busyUntil ) {
+			if ( flash->command == 0x06 ) {
+				flash->writeEnabled = 1;
+			} else if ( flash->command == 0x04 ) {
+				flash->writeEnabled = 0;
+			}
+		}
+	} else if ( index <= 3 ) {
+		flash->address = (flash->address << 8) | flash->in;
+	} else if ( flash->command == 0x02 && flash->writeEnabled && simNow() >= flash->busyUntil ) {
+		flash->array[((flash->address & ~0xFFUL) | ((flash->address + index - 4) & 0xFF)) % SPI_FLASH_SIZE]
+			&= flash->in;
+	}
+}
+
+// A program or erase starts when CS rises at the end of the command
+//
+static void spiDeselect(SpiFlash *flash) {
+	if ( !flash->writeEnabled || simNow() < flash->busyUntil ) {
+		return;
+	}
+	if ( flash->command == 0xD8 && flash->bits == 32 ) {
+		memset(flash->array + (flash->address % SPI_FLASH_SIZE & ~(SPI_SECTOR_SIZE - 1UL)), 0xFF,
+			SPI_SECTOR_SIZE);
+		flash->busyUntil = simNow() + SPI_ERASE_NS;
+		flash->writeEnabled = 0;
+	} else if ( flash->command == 0x02 && flash->bits >= 40 && flash->bits % 8 == 0 ) {
+		flash->busyUntil = simNow() + SPI_PROGRAM_NS;
+		flash->writeEnabled = 0;
+	}
+}
+
+// Work out the pin levels from the latched cells and act on their edges
+//
+static void spiDrive(SpiFlash *flash, uint8 driven) {
+	uint8 level[3], pin;
+	for ( pin = 0; pin < 3; pin++ ) {
+		level[pin] = (driven && !(flash->latch[pin] & 0x04)) ? (flash->latch[pin] >> 1) & 1 : 1;
+	}
+	flash->mosi = level[2];
+	if ( level[0] != flash->cs ) {
+		flash->cs = level[0];
+		if ( flash->cs ) {
+			spiDeselect(flash);
+		} else {
+			flash->bits = 0;
+			flash->command = 0x00;
+		}
+	}
+	if ( level[1] != flash->sck ) {
+		flash->sck = level[1];
+		if ( !flash->cs ) {
+			if ( flash->sck ) {
+				spiRisingEdge(flash);
+			} else {
+				flash->miso = (spiOutByte(flash, flash->bits / 8) >> (7 - flash->bits % 8)) & 1;
+			}
+		}
+	}
+}
+
+typedef struct {
+	uint64 clearUntil;
+	uint32 word;          // last 32 bits received
+	uint32 bits;          // bits received since configuration memory was cleared
+	uint8 synced;
+	uint8 done;
+	uint8 startup;        // JSTART clocks seen in Run-Test/Idle
+	SpiFlash *flash;      // on the board, not in the FPGA: JPROGRAM leaves it be
+} Spartan3;
+
+static void spartan3Init(SimDevice *dev) {
+	Spartan3 *s3 = calloc(1, sizeof(Spartan3));
+	s3->flash = calloc(1, sizeof(SpiFlash));
+	memset(s3->flash->array, 0xFF, SPI_FLASH_SIZE);
+	s3->flash->cs = s3->flash->sck = 1;
+	s3->flash->latch[0] = s3->flash->latch[1] = s3->flash->latch[2] = 0x07;
+	dev->priv = s3;
+}
+
+static uint16 spartan3DrLength(SimDevice *dev) {
+	return dev->ir == S3_CFG_IN ? 1 : xilinxDrLength(dev);
+}
+
+static void spartan3ShiftDR(SimDevice *dev) {
+	Spartan3 *s3 = dev->priv;
+	if ( dev->ir != S3_CFG_IN || simNow() < s3->clearUntil ) {
+		return;
+	}
+	s3->word = (s3->word << 1) | simDrRead(dev, 0, 1);
+	s3->bits++;
+	if ( s3->word == S3_SYNC_WORD ) {
+		s3->synced = 1;
+	}
+}
+
+static void spartan3UpdateIR(SimDevice *dev) {
+	Spartan3 *s3 = dev->priv;
+	SpiFlash *const flash = s3->flash;
+	if ( dev->ir == S3_JPROGRAM ) {
+		memset(s3, 0, sizeof(*s3));
+		s3->flash = flash;
+		s3->clearUntil = simNow() + S3_CLEAR_NS;
+	} else if ( dev->ir == S3_JSTART ) {
+		s3->startup = 0;
+	}
+	spiDrive(flash, dev->ir == S3_EXTEST);
+}
+
+// SAMPLE/PRELOAD and EXTEST both latch the SPI pins' cells at Update-DR;
+// only EXTEST drives them onto the pins
+//
+static void spartan3UpdateDR(SimDevice *dev) {
+	Spartan3 *s3 = dev->priv;
+	uint8 pin;
+	if ( dev->ir != S3_EXTEST && dev->ir != S3_SAMPLE ) {
+		return;
+	}
+	for ( pin = 0; pin < 3; pin++ ) {
+		s3->flash->latch[pin] = (uint8)simDrRead(dev, 3 * (S3_SPI_CS_PIN + pin), 3);
+	}
+	spiDrive(s3->flash, dev->ir == S3_EXTEST);
+}
+
+static void spartan3CaptureDR(SimDevice *dev) {
+	const Spartan3 *s3 = dev->priv;
+	xilinxCaptureDR(dev);
+	if ( dev->ir == S3_EXTEST ) {
+		simDrWrite(dev, 3 * S3_SPI_CS_PIN, 1, s3->flash->cs);
+		simDrWrite(dev, 3 * S3_SPI_SCK_PIN, 1, s3->flash->sck);
+		simDrWrite(dev, 3 * S3_SPI_MOSI_PIN, 1, s3->flash->mosi);
+		simDrWrite(dev, 3 * S3_SPI_MISO_PIN, 1, s3->flash->cs ? 1 : s3->flash->miso);
+	}
+}
+
+static uint32 spartan3CaptureIR(SimDevice *dev) {
+	const Spartan3 *s3 = dev->priv;
+	uint32 value = 0x01;
+	if ( simNow() >= s3->clearUntil ) {
+		value |= S3_IR_INIT;
+	}
+	if ( s3->done ) {
+		value |= S3_IR_DONE;
+	}
+	return value;
+}
+
+static void spartan3Clock(SimDevice *dev) {
+	Spartan3 *s3 = dev->priv;
+	if ( dev->ir == S3_JSTART && dev->state == SIM_RTI && s3->startup < S3_STARTUP_CLOCKS ) {
+		if ( ++s3->startup == S3_STARTUP_CLOCKS && s3->synced && s3->bits >= S3_CONFIG_BITS ) {
+			s3->done = 1;
+		}
+	}
+}
+
+uint8 simSpartan3Done(SimDevice *dev) {
+	return dev->model == &simXC3S200 ? ((Spartan3 *)dev->priv)->done : 0;
+}
+
+uint8 *simSpiFlashArray(SimDevice *dev, uint32 *size) {
+	*size = SPI_FLASH_SIZE;
+	return ((Spartan3 *)dev->priv)->flash->array;
+}
+
+// XCF0xS in-system programming: ISC_ENABLE with the right key opens the
+// array, ISC_ERASE blanks it, ISC_DATA_SHIFT and ISC_ADDRESS_SHIFT load a row
+// and its address, ISC_PROGRAM clears the bits that are zero in the row and
+// XSC_READ captures a row. Operations issued while the array is still busy
+// with the previous one are ignored.
+//
+#define XCF_ISC_ENABLE   0xE8
+#define XCF_ISC_PROGRAM  0xEA
+#define XCF_ISC_ADDRESS  0xEB
+#define XCF_ISC_ERASE    0xEC
+#define XCF_ISC_DATA     0xED
+#define XCF_XSC_READ     0xEF
+#define XCF_ISC_DISABLE  0xF0
+#define XCF_ENABLE_KEY   0x34
+#define XCF_ROW_BYTES    256
+#define XCF_NUM_ROWS     1024
+
+#define XCF_ERASE_NS     15000000000ULL
+#define XCF_PROGRAM_NS   14000000ULL
+
+typedef struct {
+	uint8 array[XCF_NUM_ROWS][XCF_ROW_BYTES];
+	uint8 data[XCF_ROW_BYTES];
+	uint16 address;
+	uint8 enabled;
+	uint64 busyUntil;
+} Xcf;
+
+static void xcfInit(SimDevice *dev) {
+	Xcf *xcf = calloc(1, sizeof(Xcf));
+	memset(xcf->array, 0xFF, sizeof(xcf->array));
+	dev->priv = xcf;
+}
+
+static uint16 xcfDrLength(SimDevice *dev) {
+	switch ( dev->ir ) {
+		case XCF_ISC_ENABLE:
+			return 8;
+		case XCF_ISC_ERASE:
+		case XCF_ISC_ADDRESS:
+			return 16;
+		case XCF_ISC_DATA:
+		case XCF_XSC_READ:
+			return XCF_ROW_BYTES * 8;
+		default:
+			return xilinxDrLength(dev);
+	}
+}
+
+static uint8 xcfReady(const Xcf *xcf) {
+	return xcf->enabled && simNow() >= xcf->busyUntil;
+}
+
+static void xcfCaptureDR(SimDevice *dev) {
+	const Xcf *xcf = dev->priv;
+	uint16 i;
+	if ( dev->ir == XCF_XSC_READ ) {
+		if ( xcfReady(xcf) && xcf->address < XCF_NUM_ROWS ) {
+			for ( i = 0; i < XCF_ROW_BYTES; i++ ) {
+				simDrWrite(dev, 8*i, 8, xcf->array[xcf->address][i]);
+			}
+		}
+	} else {
+		xilinxCaptureDR(dev);
+	}
+}
+
+static void xcfUpdateDR(SimDevice *dev) {
+	Xcf *xcf = dev->priv;
+	uint16 i;
+	switch ( dev->ir ) {
+		case XCF_ISC_ENABLE:
+			xcf->enabled = simDrRead(dev, 0, 8) == XCF_ENABLE_KEY;
+			break;
+		case XCF_ISC_ERASE:
+			if ( xcfReady(xcf) ) {
+				memset(xcf->array, 0xFF, sizeof(xcf->array));
+				xcf->busyUntil = simNow() + XCF_ERASE_NS;
+			}
+			break;
+		case XCF_ISC_ADDRESS:
+			xcf->address = (uint16)simDrRead(dev, 0, 16);
+			break;
+		case XCF_ISC_DATA:
+			for ( i = 0; i < XCF_ROW_BYTES; i++ ) {
+				xcf->data[i] = (uint8)simDrRead(dev, 8*i, 8);
+			}
+			break;
+	}
+}
+
+static void xcfUpdateIR(SimDevice *dev) {
+	Xcf *xcf = dev->priv;
+	uint16 i;
+	if ( dev->ir == XCF_ISC_PROGRAM && xcfReady(xcf) && xcf->address < XCF_NUM_ROWS ) {
+		for ( i = 0; i < XCF_ROW_BYTES; i++ ) {
+			xcf->array[xcf->address][i] &= xcf->data[i];
+		}
+		xcf->busyUntil = simNow() + XCF_PROGRAM_NS;
+	} else if ( dev->ir == XCF_ISC_DISABLE ) {
+		xcf->enabled = 0;
+	}
+}
+
+uint8 *simXcfArray(SimDevice *dev, uint32 *size) {
+	Xcf *xcf = dev->priv;
+	*size = sizeof(xcf->array);
+	return &xcf->array[0][0];
+}
+
+static const XilinxInfo xc9572Info = {0x00, 0x01, 0xFD, 0xFE};
+static const XilinxInfo xc3s200Info = {0x00, 0x01, 0x08, 0x09};
+static const XilinxInfo xcf02sInfo = {0x00, 0x01, 0xFD, 0xFE};
+
+const SimModel simXC9572 = {
+	"XC9572", 0x09504093, 8, 0xFE, 216,
+	NULL, xilinxDrLength, xilinxCaptureDR, NULL, NULL, NULL, NULL, NULL, &xc9572Info
+};
+
+const SimModel simXC3S200 = {
+	"XC3S200", 0x01414093, 6, 0x09, 472,
+	spartan3Init, spartan3DrLength, spartan3CaptureDR, spartan3ShiftDR, spartan3UpdateDR, spartan3UpdateIR,
+	spartan3CaptureIR, spartan3Clock, &xc3s200Info
+};
+
+const SimModel simXCF02S = {
+	"XCF02S", 0x05045093, 8, 0xFE, 25,
+	xcfInit, xcfDrLength, xcfCaptureDR, NULL, xcfUpdateDR, xcfUpdateIR, NULL, NULL, &xcf02sInfo
+};